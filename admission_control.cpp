@@ -0,0 +1,318 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "admission_control.hpp"
+#include "storage/meta_tile.hpp"
+#include "logging/logger.hpp"
+
+#include <boost/format.hpp>
+
+#include <algorithm>
+#include <limits>
+#include <cmath>
+
+using std::string;
+using std::make_pair;
+using std::numeric_limits;
+using boost::posix_time::ptime;
+using boost::posix_time::milliseconds;
+
+// weight given to each new latency measurement in the averages.
+#define LATENCY_SMOOTHING (0.25)
+
+namespace rendermq {
+
+admission_control::~admission_control()
+{
+}
+
+void
+admission_control::submitted(const tile_protocol &, size_t, const ptime &)
+{
+}
+
+void
+admission_control::completed(const tile_protocol &, const ptime &)
+{
+}
+
+queue_length_admission::queue_length_admission(size_t threshold_stale,
+                                               size_t threshold_satisfy,
+                                               size_t threshold_max)
+   : m_threshold_stale(threshold_stale),
+     m_threshold_satisfy(threshold_satisfy),
+     m_threshold_max(threshold_max)
+{
+}
+
+admission_control::load
+queue_length_admission::level(const tile_protocol &, size_t queue_length, const ptime &)
+{
+   if (queue_length >= m_threshold_max)
+   {
+      return load_shed;
+   }
+   else if (queue_length >= m_threshold_satisfy)
+   {
+      return load_satisfy;
+   }
+   else if (queue_length >= m_threshold_stale)
+   {
+      return load_stale;
+   }
+   return load_normal;
+}
+
+latency_admission::stats::stats()
+   : latency(0.0), queue_length(0.0),
+     window_min(0.0), window_start(), window_empty(true),
+     standing(false), num_samples(0)
+{
+}
+
+latency_admission::latency_admission(long target, long interval, long satisfy, long max)
+   : m_target(target), m_satisfy(satisfy), m_max(max),
+     m_interval(milliseconds(interval))
+{
+}
+
+admission_control::load
+latency_admission::level(const tile_protocol &tile, size_t queue_length, const ptime &now)
+{
+   // the queue returns the largest possible length while it's still
+   // finding out which brokers are up.
+   if (queue_length == numeric_limits<size_t>::max())
+   {
+      return load_shed;
+   }
+
+   expire_pending(now);
+
+   boost::unordered_map<class_key, stats>::iterator itr =
+      m_stats.find(make_pair(tile.style, tile.z));
+   if (itr != m_stats.end())
+   {
+      roll_window(itr->second, now);
+   }
+   roll_window(m_all, now);
+
+   const stats &s = stats_for(tile);
+   if (s.num_samples == 0)
+   {
+      // nothing rendered yet, so nothing to go on.
+      return load_normal;
+   }
+
+   const double predicted = predicted_latency(tile, queue_length);
+   if (predicted >= m_max)
+   {
+      return load_shed;
+   }
+   else if (predicted >= m_satisfy)
+   {
+      return load_satisfy;
+   }
+   else if (s.standing || (predicted >= m_target))
+   {
+      return load_stale;
+   }
+   return load_normal;
+}
+
+void
+latency_admission::submitted(const tile_protocol &tile, size_t queue_length, const ptime &now)
+{
+   // only renders which come back to the handler can be timed.
+   if ((tile.status != cmdRender) && (tile.status != cmdRenderPrio))
+   {
+      return;
+   }
+
+   // if the metatile is already being rendered then this tile will
+   // come back along with it, so keep the earlier submission time.
+   pending p;
+   p.submitted = now;
+   p.queue_length = queue_length;
+   m_pending.insert(make_pair(pending_key_for(tile), p));
+}
+
+void
+latency_admission::completed(const tile_protocol &tile, const ptime &now)
+{
+   boost::unordered_map<pending_key, pending>::iterator itr = m_pending.find(pending_key_for(tile));
+   if (itr == m_pending.end())
+   {
+      // other tiles of the same metatile have already been counted.
+      return;
+   }
+
+   const double latency = double((now - itr->second.submitted).total_milliseconds());
+   const size_t queue_length = itr->second.queue_length;
+   m_pending.erase(itr);
+
+   record(m_stats[make_pair(tile.style, tile.z)], latency, queue_length, now);
+   record(m_all, latency, queue_length, now);
+}
+
+double
+latency_admission::predicted_latency(const tile_protocol &tile, size_t queue_length) const
+{
+   const stats &s = stats_for(tile);
+   if (s.num_samples == 0)
+   {
+      return -1.0;
+   }
+
+   // the latency was measured for tiles submitted when the queue was a
+   // different length. assuming the time spent waiting in the queue is
+   // proportional to its length, scale it up or down to match now.
+   return s.latency * (double(queue_length) + 1.0) / (s.queue_length + 1.0);
+}
+
+latency_admission::pending_key
+latency_admission::pending_key_for(const tile_protocol &tile)
+{
+   pending_key k;
+   k.style = tile.style;
+   k.z = tile.z;
+   k.x = tile.x & ~(METATILE - 1);
+   k.y = tile.y & ~(METATILE - 1);
+   return k;
+}
+
+void
+latency_admission::record(stats &s, double latency, size_t queue_length, const ptime &now)
+{
+   roll_window(s, now);
+
+   if (s.num_samples == 0)
+   {
+      s.latency = latency;
+      s.queue_length = double(queue_length);
+   }
+   else
+   {
+      s.latency += LATENCY_SMOOTHING * (latency - s.latency);
+      s.queue_length += LATENCY_SMOOTHING * (double(queue_length) - s.queue_length);
+   }
+
+   if (s.window_empty || (latency < s.window_min))
+   {
+      s.window_min = latency;
+   }
+   s.window_empty = false;
+   ++s.num_samples;
+}
+
+void
+latency_admission::roll_window(stats &s, const ptime &now)
+{
+   if (s.window_start.is_not_a_date_time())
+   {
+      s.window_start = now;
+      return;
+   }
+
+   if (now - s.window_start < m_interval)
+   {
+      return;
+   }
+
+   // tiles predicted to be over the satisfy latency aren't rendered for
+   // clients, so aren't measured, and nothing would ever bring a high
+   // latency back down. so each interval without any measurements lets
+   // it decay towards the target, until renders are let through again
+   // and measured.
+   const long intervals = (now - s.window_start).total_milliseconds() /
+      std::max(m_interval.total_milliseconds(), 1L);
+   const long empty = intervals - (s.window_empty ? 0 : 1);
+   if ((s.num_samples > 0) && (empty > 0) && (s.latency > m_target))
+   {
+      s.latency = m_target + (s.latency - m_target) * std::pow(1.0 - LATENCY_SMOOTHING, double(empty));
+   }
+
+   // if the whole of the last interval had no renders in it then there
+   // is no evidence of a standing queue any more.
+   const bool was_standing = s.standing;
+   if (now - s.window_start >= m_interval + m_interval)
+   {
+      s.standing = false;
+   }
+   else
+   {
+      s.standing = !s.window_empty && (s.window_min > m_target);
+   }
+
+   if (s.standing != was_standing)
+   {
+      LOG_INFO(boost::format("Render latency %1% target: minimum over the last interval was %2%ms.")
+               % (s.standing ? "above" : "back below") % s.window_min);
+   }
+
+   s.window_start = now;
+   s.window_empty = true;
+}
+
+void
+latency_admission::expire_pending(const ptime &now)
+{
+   if (!m_next_expire.is_not_a_date_time() && (now < m_next_expire))
+   {
+      return;
+   }
+   m_next_expire = now + m_interval;
+
+   // renders which haven't come back by now were probably dropped, and
+   // that's a sign of overload too, so count them at the max latency.
+   const boost::posix_time::time_duration max_age = milliseconds(long(m_max));
+   boost::unordered_map<pending_key, pending>::iterator itr = m_pending.begin();
+   while (itr != m_pending.end())
+   {
+      if (now - itr->second.submitted > max_age)
+      {
+         record(m_stats[make_pair(itr->first.style, itr->first.z)], m_max, itr->second.queue_length, now);
+         record(m_all, m_max, itr->second.queue_length, now);
+         itr = m_pending.erase(itr);
+      }
+      else
+      {
+         ++itr;
+      }
+   }
+}
+
+const latency_admission::stats &
+latency_admission::stats_for(const tile_protocol &tile) const
+{
+   boost::unordered_map<class_key, stats>::const_iterator itr =
+      m_stats.find(make_pair(tile.style, tile.z));
+   if ((itr != m_stats.end()) && (itr->second.num_samples > 0))
+   {
+      return itr->second;
+   }
+   return m_all;
+}
+
+} // namespace rendermq
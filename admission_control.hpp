@@ -0,0 +1,225 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef ADMISSION_CONTROL_HPP
+#define ADMISSION_CONTROL_HPP
+
+#include "tile_protocol.hpp"
+
+#include <boost/noncopyable.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include <string>
+
+namespace rendermq {
+
+/* decides, for each tile which would need rendering, how much of the
+ * rendering system the handler should try to use for it.
+ *
+ * the handler asks for the load level whenever it has a choice
+ * between rendering a tile for a client, serving a stale copy,
+ * rendering in the background or refusing the request. the levels are
+ * ordered, so each one implies the decisions of the levels below it.
+ */
+class admission_control
+   : public boost::noncopyable
+{
+public:
+   enum load {
+      load_normal,  // render tiles for clients as needed.
+      load_stale,   // serve stale tiles rather than re-render them.
+      load_satisfy, // render missing tiles in the background, 202.
+      load_shed     // don't send anything more to the queue, 503.
+   };
+
+   virtual ~admission_control();
+
+   /* the load level for this tile, given the current average length of
+    * the broker queues.
+    */
+   virtual load level(const tile_protocol &tile, size_t queue_length,
+                      const boost::posix_time::ptime &now) = 0;
+
+   /* called when a tile which a client is waiting for has been sent to
+    * the queue, and when the rendered tile comes back from the broker.
+    */
+   virtual void submitted(const tile_protocol &tile, size_t queue_length,
+                          const boost::posix_time::ptime &now);
+   virtual void completed(const tile_protocol &tile,
+                          const boost::posix_time::ptime &now);
+};
+
+/* the original admission control, comparing the queue length against
+ * fixed thresholds for each level.
+ */
+class queue_length_admission
+   : public admission_control
+{
+public:
+   queue_length_admission(size_t threshold_stale,
+                          size_t threshold_satisfy,
+                          size_t threshold_max);
+
+   load level(const tile_protocol &tile, size_t queue_length,
+              const boost::posix_time::ptime &now);
+
+private:
+   const size_t m_threshold_stale, m_threshold_satisfy, m_threshold_max;
+};
+
+/* admission control based on the time it actually takes to get a tile
+ * rendered, rather than the length of the queue.
+ *
+ * the cost of a render varies a lot between styles and zoom levels, so
+ * the same queue length can mean a wait of a second or a minute. this
+ * measures the time from sending each tile to the queue to the result
+ * coming back, and keeps statistics for each style and zoom level.
+ *
+ * two signals are taken from these measurements:
+ *
+ * the first is the minimum latency seen over each interval, as in
+ * CoDel. if even the quickest render in a whole interval took longer
+ * than the target then there's a standing queue, and stale tiles are
+ * served rather than re-rendered until the latency drops again.
+ *
+ * the second is a prediction of how long a render sent now would take.
+ * latency measurements are only available after the render finishes,
+ * by which time the queue may be very different, so the smoothed
+ * latency is scaled by the ratio of the current queue length to the
+ * queue length when the measured tiles were submitted. the queue
+ * length is sent back by the brokers with every rendered tile, so it
+ * is much fresher than the latency. the predicted latency is compared
+ * against the satisfy and max latencies to decide whether to render in
+ * the background or refuse the request.
+ *
+ * styles and zoom levels without any measurements yet use the
+ * statistics for all tiles. ones which haven't been measured for a
+ * whole interval have their latency decay towards the target, so that
+ * a spike which stops renders being measured doesn't last forever.
+ */
+class latency_admission
+   : public admission_control
+{
+public:
+   /* @param target latency, in milliseconds, above which stale tiles
+    *          are served rather than re-rendered.
+    * @param interval time, in milliseconds, over which the minimum
+    *          latency is measured. this should be a few times longer
+    *          than a typical render.
+    * @param satisfy predicted latency, in milliseconds, above which
+    *          missing tiles are rendered in the background and the
+    *          client gets a 202.
+    * @param max predicted latency, in milliseconds, above which
+    *          requests are refused with a 503. renders which haven't
+    *          come back after this long are counted as having taken
+    *          this long, as they were probably dropped.
+    */
+   latency_admission(long target, long interval, long satisfy, long max);
+
+   load level(const tile_protocol &tile, size_t queue_length,
+              const boost::posix_time::ptime &now);
+   void submitted(const tile_protocol &tile, size_t queue_length,
+                  const boost::posix_time::ptime &now);
+   void completed(const tile_protocol &tile,
+                  const boost::posix_time::ptime &now);
+
+   // the predicted latency, in milliseconds, of a render of this tile
+   // at the given queue length. negative if there are no measurements.
+   double predicted_latency(const tile_protocol &tile, size_t queue_length) const;
+
+private:
+   // statistics for a style and zoom level.
+   struct stats
+   {
+      stats();
+      // exponentially weighted averages of the latency in milliseconds
+      // and of the queue length when those tiles were submitted.
+      double latency, queue_length;
+      // minimum latency in the current interval, and when it started.
+      double window_min;
+      boost::posix_time::ptime window_start;
+      bool window_empty;
+      // whether the minimum latency over the last interval was above
+      // the target, i.e: there's a standing queue.
+      bool standing;
+      size_t num_samples;
+   };
+
+   typedef std::pair<std::string, int> class_key;
+
+   // renders which a client is waiting for, keyed by metatile.
+   struct pending_key
+   {
+      std::string style;
+      int z, x, y;
+   };
+
+   friend bool operator==(const pending_key &a, const pending_key &b)
+   {
+      return a.z == b.z && a.x == b.x && a.y == b.y && a.style == b.style;
+   }
+
+   friend size_t hash_value(const pending_key &k)
+   {
+      size_t seed = 0;
+      boost::hash_combine(seed, k.style);
+      boost::hash_combine(seed, k.z);
+      boost::hash_combine(seed, k.x);
+      boost::hash_combine(seed, k.y);
+      return seed;
+   }
+
+   struct pending
+   {
+      boost::posix_time::ptime submitted;
+      size_t queue_length;
+   };
+
+   static pending_key pending_key_for(const tile_protocol &tile);
+
+   // add a latency measurement to the statistics.
+   void record(stats &s, double latency, size_t queue_length,
+               const boost::posix_time::ptime &now);
+   // start a new interval if the current one has finished.
+   void roll_window(stats &s, const boost::posix_time::ptime &now);
+   // count renders which haven't come back as having taken the max.
+   void expire_pending(const boost::posix_time::ptime &now);
+   // statistics for the tile's style and zoom, or for all tiles if
+   // there aren't any measurements for it yet.
+   const stats &stats_for(const tile_protocol &tile) const;
+
+   const double m_target, m_satisfy, m_max;
+   const boost::posix_time::time_duration m_interval;
+
+   boost::unordered_map<class_key, stats> m_stats;
+   stats m_all;
+   boost::unordered_map<pending_key, pending> m_pending;
+   boost::posix_time::ptime m_next_expire;
+};
+
+} // namespace rendermq
+
+#endif /* ADMISSION_CONTROL_HPP */
@@ -0,0 +1,226 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "storage/tile_storage.hpp"
+#include "storage/tile_archive.hpp"
+#include "storage/meta_tile.hpp"
+#include "tile_utils.hpp"
+#include "config.hpp"
+
+#include <boost/format.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/ini_parser.hpp>
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+
+using std::string;
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::ifstream;
+using std::ostringstream;
+using std::runtime_error;
+using boost::scoped_ptr;
+using rendermq::tile_archive_writer;
+using rendermq::tile_protocol;
+namespace pt = boost::property_tree;
+namespace po = boost::program_options;
+namespace fs = boost::filesystem;
+
+namespace {
+
+/* add all the metatiles in a disk storage directory, as written by
+ * disk_storage or mod_tile, to the archive. the location of each
+ * metatile is read from its header rather than from its path.
+ */
+void add_tile_dir(tile_archive_writer &writer, const string &dir,
+                  int min_z, int max_z, bool verbose)
+{
+   for (fs::recursive_directory_iterator itr(dir), end; itr != end; ++itr)
+   {
+      const fs::path &p = itr->path();
+      if (!fs::is_regular_file(p) || (p.extension() != ".meta"))
+      {
+         continue;
+      }
+
+      ifstream in(p.string().c_str(), std::ios::binary);
+      ostringstream buf;
+      buf << in.rdbuf();
+      const string data = buf.str();
+
+      if (data.size() < size_t(rendermq::metaTile::header_size))
+      {
+         cerr << "Skipping " << p.string() << ": too small to be a metatile." << endl;
+         continue;
+      }
+      rendermq::meta_layout m;
+      std::copy(data.begin(), data.begin() + sizeof m, (char *)&m);
+      if (!m.magic_ok())
+      {
+         cerr << "Skipping " << p.string() << ": not a metatile." << endl;
+         continue;
+      }
+      if ((m.z < min_z) || (m.z > max_z))
+      {
+         continue;
+      }
+
+      // expired metatiles have their modification time set to zero on
+      // disk, which is also how the archive marks them.
+      writer.add(m.z, m.x, m.y, fs::last_write_time(p), data);
+      if (verbose)
+      {
+         cout << p.string() << " -> " << m.z << "/" << m.x << "/" << m.y << endl;
+      }
+   }
+}
+
+/* add all the metatiles of a style in the zoom range which exist in
+ * the storage to the archive. this probes every metatile, so is only
+ * practical for the lower zoom levels, or for storage which doesn't
+ * have a directory to walk.
+ */
+void add_storage(tile_archive_writer &writer, const rendermq::tile_storage &storage,
+                 const string &style, rendermq::protoFmt fmt,
+                 int min_z, int max_z, bool verbose)
+{
+   for (int z = min_z; z <= max_z; ++z)
+   {
+      const int size = 1 << z;
+      for (int x = 0; x < size; x += METATILE)
+      {
+         for (int y = 0; y < size; y += METATILE)
+         {
+            const tile_protocol tile(rendermq::cmdStatus, x, y, z, 0, style, fmt);
+            boost::shared_ptr<rendermq::tile_storage::handle> handle = storage.probe(tile);
+            if (!handle->exists())
+            {
+               continue;
+            }
+
+            // some storage doesn't return expired metatiles from
+            // get_meta, so those are quietly left out. if it does
+            // return them, the expiry goes in the mtime.
+            string data;
+            if (!storage.get_meta(tile, data))
+            {
+               if (!handle->expired())
+               {
+                  cerr << "Unable to get metatile " << z << "/" << x << "/" << y << " from storage." << endl;
+               }
+               continue;
+            }
+            writer.add(z, x, y, handle->expired() ? 0 : handle->last_modified(), data);
+            if (verbose)
+            {
+               cout << z << "/" << x << "/" << y << endl;
+            }
+         }
+      }
+   }
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv)
+{
+   po::options_description desc("Archive Tiles\n"
+                                "Version: " VERSION "\n"
+                                "\n"
+                                "Builds a tile archive for the archive storage from a disk\n"
+                                "storage directory or any configured storage.\n"
+                                "\n"
+                                "Options:");
+   desc.add_options()
+      ("help", "This help message.")
+      ("verbose,v", "Output extra information.")
+      ("output,o", po::value<string>(), "Archive file to write.")
+      ("style,s", po::value<string>(), "Style of the metatiles to archive.")
+      ("tile-dir,d", po::value<string>(), "Disk storage directory to read metatiles from.")
+      ("config,c", po::value<string>(), "Config file with a [storage] section to read metatiles from.")
+      ("format,f", po::value<string>()->default_value("png"), "Format to ask the storage for, with --config.")
+      ("min-zoom,z", po::value<int>()->default_value(0), "Lowest zoom level to archive.")
+      ("max-zoom,Z", po::value<int>()->default_value(18), "Highest zoom level to archive.")
+      ;
+
+   po::variables_map vm;
+   po::store(po::parse_command_line(argc, argv, desc), vm);
+   po::notify(vm);
+
+   if (vm.count("help") || !vm.count("output") || !vm.count("style") ||
+       (vm.count("tile-dir") + vm.count("config") != 1))
+   {
+      cout << desc << endl;
+      cout << "Exactly one of --tile-dir and --config must be given." << endl;
+      return vm.count("help") ? EXIT_SUCCESS : EXIT_FAILURE;
+   }
+
+   const string style = vm["style"].as<string>();
+   const int min_z = vm["min-zoom"].as<int>();
+   const int max_z = vm["max-zoom"].as<int>();
+   const bool verbose = vm.count("verbose") > 0;
+
+   try
+   {
+      tile_archive_writer writer(vm["output"].as<string>(), style);
+
+      if (vm.count("tile-dir"))
+      {
+         add_tile_dir(writer, (fs::path(vm["tile-dir"].as<string>()) / style).string(), min_z, max_z, verbose);
+      }
+      else
+      {
+         pt::ptree config;
+         pt::read_ini(vm["config"].as<string>(), config);
+         scoped_ptr<rendermq::tile_storage> storage(rendermq::get_tile_storage(config.get_child("storage")));
+         if (!storage)
+         {
+            cerr << "Unable to create storage from " << vm["config"].as<string>() << "." << endl;
+            return EXIT_FAILURE;
+         }
+         add_storage(writer, *storage, style, rendermq::get_format_for(vm["format"].as<string>()),
+                     min_z, max_z, verbose);
+      }
+
+      writer.finish();
+      cout << "Wrote " << writer.count() << " metatiles to " << vm["output"].as<string>() << "." << endl;
+   }
+   catch (const std::exception &e)
+   {
+      cerr << "Unable to build archive: " << e.what() << endl;
+      return EXIT_FAILURE;
+   }
+
+   return EXIT_SUCCESS;
+}
@@ -101,6 +101,13 @@ struct supervisor_backend
     * confined to changes to the "status" field.
     */
    virtual void notify(const job_t &job) = 0;
+
+   /* Returns the jobs which have been leased from the queue ahead of
+    * time and will be returned by future calls to get_job(), in the 
+    * order they will be returned. Backends which don't prefetch jobs 
+    * never have any.
+    */
+   virtual std::list<job_t> prefetched_jobs() { return std::list<job_t>(); }
 };
 
 typedef supervisor_backend *(*supervisor_creator)(const boost::property_tree::ptree &);
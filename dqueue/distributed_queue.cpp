@@ -194,4 +194,9 @@ supervisor::notify(const job_t &job) {
    pimpl->notify(job);
 }
 
+std::list<job_t>
+supervisor::prefetched_jobs() {
+   return pimpl->prefetched_jobs();
+}
+
 }
@@ -109,6 +109,11 @@ public:
     
    job_t get_job();
    void notify(const job_t &job);
+
+   // jobs which have already been leased from the queue, and will be 
+   // returned by the next calls to get_job(). this is only non-empty
+   // when the backend is configured to prefetch jobs.
+   std::list<job_t> prefetched_jobs();
     
 private:
    boost::scoped_ptr<supervisor_backend> pimpl;
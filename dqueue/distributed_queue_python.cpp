@@ -44,12 +44,25 @@ std::string tile_protocol_to_string(const tile_protocol &t)
    ostr << t;
    return ostr.str();
 }
+
+boost::python::list supervisor_prefetched_jobs(supervisor &s)
+{
+   boost::python::list jobs;
+   std::list<tile_protocol> prefetched = s.prefetched_jobs();
+   for (std::list<tile_protocol>::const_iterator itr = prefetched.begin();
+        itr != prefetched.end(); ++itr)
+   {
+      jobs.append(*itr);
+   }
+   return jobs;
+}
 }
 
 BOOST_PYTHON_MODULE(dqueue) {
     class_<supervisor, boost::noncopyable>("Supervisor", init<std::string, optional<std::string> >())
         .def("get_job", &supervisor::get_job)
         .def("notify", &supervisor::notify)
+        .def("prefetched_jobs", &supervisor_prefetched_jobs)
         ;
 
     // we're not using all of these, i'm pretty sure, but seems a good idea
@@ -81,6 +94,7 @@ BOOST_PYTHON_MODULE(dqueue) {
         .def_readwrite("style", &tile_protocol::style)
         .def_readwrite("format", &tile_protocol::format)
         .def_readwrite("last_modified", &tile_protocol::last_modified)
+        .def_readwrite("deadline", &tile_protocol::deadline)
         .def("__str__", &tile_protocol_to_string)
         .add_property("data", make_function(&tile_protocol::data,return_value_policy<copy_const_reference>()),
                       &tile_protocol::set_data)
@@ -36,12 +36,15 @@
 #include <iostream>
 #include <list>
 #include <map>
+#include <set>
 #include <iterator>
 #include <limits>
+#include <algorithm>
 #include <boost/tokenizer.hpp>
 #include <boost/optional.hpp>
 #include <boost/format.hpp>
 #include <boost/foreach.hpp>
+#include <boost/utility.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 
 namespace pt = boost::property_tree;
@@ -71,6 +74,10 @@ namespace manip = zstream::manip;
 // the broker after requesting a job.
 #define DEFAULT_BROKER_TIMEOUT (30)
 
+// if not specified in the config file, the number of jobs a worker can
+// lease from the brokers at once, including the one it's processing.
+#define DEFAULT_PREFETCH (1)
+
 // number of seconds between the subscription sockets being torn down and
 // re-used. this can be set very long, as this appears to be a problem which
 // builds up over the course of several days.
@@ -175,66 +182,58 @@ void zmq_backend_common::resubscribe()
  */
 
 struct zmq_backend_worker::task_communicator {
-   /* use this to track the state of the communicator, as it can 
-    * get a little bit complicated as it receives messages and
-    * resends them and so forth.
+   /* the communicator keeps track of two mostly-separate things; what
+    * the worker code is doing and what request, if any, is outstanding
+    * to a broker.
+    *
+    * the worker code is either idle, waiting for a job (having called
+    * get_job) or processing a job. a job is handed over as soon as one
+    * is available in the list of prefetched jobs, and each job is 
+    * returned to the broker it was leased from when the worker code 
+    * notifies that it's finished.
+    *
+    * the worker can hold up to `prefetch' leased jobs, including the
+    * one it's processing, and the difference is the number of credits
+    * it has to ask a broker for more. while the worker code is active
+    * and there are credits, a GET_JOB request is sent to the best 
+    * broker which has announced available jobs:
     *
-    * the state transition diagram looks a bit like:
+    *     +--------+  credits, and a broker   +--------+
+    *     |  NONE  | ---- has announced ----> |  TRY   |
+    *     |        | <--- jobs (added to the  |        |
+    *     +--------+      prefetch list), no  +--------+
+    *         ^           jobs, or timeout.
+    *         |
+    *     broker announces jobs, or the worker code asks 
+    *     for or returns a job.
     *
-    *         +--------------------------------------------------+
-    *         v                                                  |
-    *     +--------+                                             |
-    *     |  IDLE  |---- get job request  --------+              |
-    *     +--------+     from worker code.        |              |
-    *                                             v              |
-    *                                        ==================  |
-    *                                        =  any brokers   =  |
-    *                                        = available with =  |
-    *                                        =     jobs?      =  |
-    *                                        ==================  |
-    *     +--------+                            N |    Y |  ^    |
-    *     |  WAIT  | <----------------------------+      |  |    |
-    *     +--------+ ----+                               |  |    |
-    *                    broker announces job.           |  |    |
-    *                    |                               |  |    |
-    *     +--------+ <---+                               |  |    |
-    *     |  TRY   | <-------------- send job request ---+  |    |
-    *     |        |                 to best broker.        |    |
-    *     +--------+ -- timeout                             |    |
-    *          |        or no job --------------------------+    |
-    *          |        available                                |
-    *     job response                                           |
-    *     from broker                                            |
-    *          |                                                 |
-    *          v                                                 |
-    *     +--------+                                             |
-    *     |  PROC  |---- job response from ----------------------+
-    *     +--------+     worker code.
+    * a broker which had no jobs when asked remembers that this worker
+    * is idle, and pushes the next jobs it gets straight here instead of
+    * announcing them to everyone. pushed jobs go into the prefetch list
+    * too, and any which there aren't credits for are handed back.
     *
-    * there's also an almost-separate event queue in that each of
-    * these states (except WAIT), when it gets a broker announcement,
-    * uses it to update the internal state of which brokers have
-    * available jobs and at which priority.
+    * with a prefetch of 1 (the default) this is the same as the old
+    * behaviour of asking for one job at a time, only when the worker
+    * code asks for it. leased jobs which are never returned, for 
+    * example because this worker died with jobs still prefetched, are
+    * reclaimed by the broker as zombies.
     */
-   enum communicator_state {
-      state_idle,              /* when the client worker code hasn't
-                                * asked for a job yet. */
-      state_waiting_for_job,   /* when the client worker code has 
-                                * asked for a job, but one hasn't been
-                                * found yet. */
-      state_trying_to_get_job, /* client code asked for a job and a 
-                                * request to a broker has been sent 
-                                * out */
-      state_job_processing,    /* client code has a job and is working 
-                                * on it. */
+
+   // a job which has been leased from a broker, and the broker that
+   // the result should be returned to.
+   struct leased_job {
+      leased_job(const rendermq::tile_protocol &t, const string &b)
+         : tile(t), broker(b) {}
+      rendermq::tile_protocol tile;
+      string broker;
    };
 
    task_communicator(zmq::context_t &ctx, 
-                     long p_timeout, long b_timeout,
+                     long p_timeout, long b_timeout, size_t pfetch,
                      bool &sh_req, const string &wrk_id) 
       : common(ctx), inproc_req(ctx), poll_timeout(p_timeout), 
-        broker_timeout(b_timeout), shutdown_requested(sh_req), 
-        state(state_idle), worker_id(wrk_id) {
+        broker_timeout(b_timeout), prefetch(std::max(pfetch, size_t(1))),
+        shutdown_requested(sh_req), job_wanted(false), worker_id(wrk_id) {
    }
 
    void operator()() {
@@ -258,20 +257,17 @@ struct zmq_backend_worker::task_communicator {
 
          // first check that the broker that we were trying to get a job
          // from hasn't died or otherwise timed out.
-         if ((state == state_trying_to_get_job) &&
+         if (current_broker &&
              (get_job_retry_time < microsec_clock::universal_time())) {
             
-            if (current_broker) {
-               LOG_WARNING(boost::format("Dropped job request to current broker "
-                                         "(\"%1%\"), assuming it has died.") 
-                           % current_broker.get());
+            LOG_WARNING(boost::format("Dropped job request to current broker "
+                                      "(\"%1%\"), assuming it has died.") 
+                        % current_broker.get());
                         
-               // try not to go back to the same broker again...
-               brokers_with_jobs.erase(current_broker.get());
-
-            } else {
-               LOG_ERROR("Dropped job request to unknown current broker.");
-            }
+            // try not to go back to the same broker again...
+            brokers_with_jobs.erase(current_broker.get());
+            idle_at.erase(current_broker.get());
+            current_broker = boost::none;
 
             try_to_get_job();
          }
@@ -286,33 +282,81 @@ struct zmq_backend_worker::task_communicator {
 
             // if we get a stray message just ignore it...
             if ((response.compare("JOB") == 0) && common.broker_req.has_more()) {
-               // get job and send to inproc.
-               rendermq::tile_protocol tile;
-               common.broker_req >> tile;
+               // the broker may have sent several jobs, up to the number
+               // of credits we asked for.
+               list<rendermq::tile_protocol> tiles;
+               while (common.broker_req.has_more()) {
+                  tiles.push_back(rendermq::tile_protocol());
+                  common.broker_req >> tiles.back();
+               }
           
-               // check that we're looking for a job and looking for one 
-               // from this particular broker...
-               if ((state == state_trying_to_get_job) &&
-                   (current_broker == headers.front())) {
-                  inproc_req << tile;
-                  current_broker = headers.front();
-            
-                  LOG_INFO(boost::format("Got job (%1%) from broker (\"%2%\").")
-                           % tile % current_broker.get());
+               // check that we're looking for jobs from this particular 
+               // broker...
+               if (current_broker == headers.front()) {
+                  {
+                     boost::mutex::scoped_lock lock(prefetched_mutex);
+                     BOOST_FOREACH(const rendermq::tile_protocol &tile, tiles) {
+                        LOG_INFO(boost::format("Got job (%1%) from broker (\"%2%\").")
+                                 % tile % current_broker.get());
+                        prefetched.push_back(leased_job(tile, current_broker.get()));
+                     }
+                  }
+                  current_broker = boost::none;
 
-                  // next state is processing
-                  state = state_job_processing;
+                  hand_over_job();
+                  try_to_get_job();
 
                } else {
-                  LOG_WARNING(boost::format("Unexpected job offer from broker %1%.") 
-                              % headers.front());
+                  LOG_WARNING(boost::format("Unexpected offer of %1% jobs from broker %2%.") 
+                              % tiles.size() % headers.front());
                }
             
+            } else if ((response.compare("PUSH") == 0) && common.broker_req.has_more()) {
+               // jobs pushed by a broker which we asked earlier, when it
+               // didn't have any. take as many as there are credits for
+               // and hand the rest back to be given to someone else.
+               const string &broker = headers.front();
+               idle_at.erase(broker);
+               size_t num_credits = credits();
+               list<rendermq::tile_protocol> returned;
+               while (common.broker_req.has_more()) {
+                  rendermq::tile_protocol tile;
+                  common.broker_req >> tile;
+                  if (num_credits > 0) {
+                     LOG_INFO(boost::format("Got pushed job (%1%) from broker (\"%2%\").")
+                              % tile % broker);
+                     boost::mutex::scoped_lock lock(prefetched_mutex);
+                     prefetched.push_back(leased_job(tile, broker));
+                     --num_credits;
+                  } else {
+                     returned.push_back(tile);
+                  }
+               }
+
+               if (!returned.empty()) {
+                  LOG_INFO(boost::format("Returning %1% pushed jobs to broker (\"%2%\").")
+                           % returned.size() % broker);
+                  zstream::socket::osocket &out = common.broker_req.to(broker);
+                  out << manip::more << "RETURN";
+                  for (list<rendermq::tile_protocol>::iterator itr = returned.begin();
+                       itr != returned.end(); ++itr) {
+                     if (boost::next(itr) != returned.end()) {
+                        out << manip::more;
+                     }
+                     out << *itr;
+                  }
+               }
+
+               hand_over_job();
+               try_to_get_job();
+
             } else {
-               // no jobs... remove from list and try again.
+               // no jobs... remove from list and try again. the broker 
+               // will now push jobs to us when it gets them.
                brokers_with_jobs.erase(headers.front());
-               // if worker wants job...
-               if (state == state_trying_to_get_job) {
+               idle_at.insert(headers.front());
+               if (current_broker == headers.front()) {
+                  current_broker = boost::none;
                   try_to_get_job();
                }
             }
@@ -324,13 +368,17 @@ struct zmq_backend_worker::task_communicator {
             uint64_t qsize;
 
             (*common.broker_sub) >> broker_id >> msg >> max_priority >> qsize;
-            brokers_with_jobs[broker_id] = broker_status(max_priority, qsize);
-
-            // if we are waiting for a job, then try and grab this one immediately
-            if (state == state_waiting_for_job) {
-               try_to_get_job();
+            known_brokers.insert(broker_id);
+            if (qsize > 0) {
+               brokers_with_jobs[broker_id] = broker_status(max_priority, qsize);
+            } else {
+               brokers_with_jobs.erase(broker_id);
             }
 
+            // if we have credits to spend, then try and grab this one 
+            // immediately
+            try_to_get_job();
+
             // worker thread replies to be routed back to broker
          } else if (items[2].revents & ZMQ_POLLIN) {
             string dummy;
@@ -339,43 +387,39 @@ struct zmq_backend_worker::task_communicator {
                // this means it's finished and it needs to notify
                rendermq::tile_protocol tile;
                inproc_req >> tile;
-               if (state == state_job_processing) {
-                  if (current_broker) {
-                     common.broker_req.to(current_broker.get()) 
-                        << manip::more << "RESULT"
-                        << tile;
-              
-                     current_broker = boost::none;
-                     state = state_idle;
+               if (processing_broker) {
+                  common.broker_req.to(processing_broker.get()) 
+                     << manip::more << "RESULT"
+                     << tile;
+                  
+                  processing_broker = boost::none;
+                  try_to_get_job();
 
-                  } else {
-                     // the state machine implies this can never happen, as
-                     // current_broker is set anywhere we accept a job and
-                     // no other processing should be done, but never say 
-                     // never...
-                     LOG_DEBUG("worker returned a job, but there's no-one to send it to.");
-                  }
                } else {
                   // the state machine implies this can never happen, as jobs
-                  // are only sent to the worker where we enter the job 
-                  // processing state.
-                  LOG_DEBUG("worker returned a job, but the state is not job_processing.");
+                  // are only sent to the worker along with the broker they
+                  // came from, but never say never...
+                  LOG_DEBUG("worker returned a job, but there's no-one to send it to.");
                }
             } else {
-               // this means a request for a job. if there's a broker which has 
-               // advertised that it has jobs, go talk to it.
-               if (state == state_idle) {
+               // this means a request for a job. hand one over if it's 
+               // already been prefetched, or go and get one.
+               if (!job_wanted && !processing_broker) {
+                  job_wanted = true;
+                  hand_over_job();
                   try_to_get_job();
 
                } else {
                   // the state machine implies this can never happen, as job 
-                  // requests can only come from the worker when the state is
-                  // idle.
-                  LOG_DEBUG("worker requested a job, but the state is not idle.");
+                  // requests can only come from the worker when it's idle.
+                  LOG_DEBUG("worker requested a job, but it's not idle.");
                }
             }
          }
       }
+
+      // don't leave brokers trying to push jobs to us after we've gone.
+      set_busy();
    }
 
    boost::optional<string> highest_priority_broker() const
@@ -396,29 +440,136 @@ struct zmq_backend_worker::task_communicator {
       return broker;
    }
 
-   /* examines the state of what's known about the brokers' queues to
-    * move to the appropriate state for getting a job. this might be
-    * immediately available, or it might mean waiting for a broker to
-    * announce that a new job is available.
+   /* if the worker code is waiting for a job and there's one in the
+    * prefetch list, then send it over.
+    *
+    * jobs whose clients have given up waiting while they sat in the 
+    * prefetch list are skipped, and handed back to their brokers in
+    * case anyone else has asked for them since.
+    */
+   void hand_over_job() {
+      if (job_wanted) {
+         const std::time_t now = std::time(0);
+         list<leased_job> expired;
+         boost::mutex::scoped_lock lock(prefetched_mutex);
+         while (!prefetched.empty() && prefetched.front().tile.expired(now)) {
+            expired.push_back(prefetched.front());
+            prefetched.pop_front();
+         }
+         if (!prefetched.empty()) {
+            inproc_req << prefetched.front().tile;
+            processing_broker = prefetched.front().broker;
+            prefetched.pop_front();
+            job_wanted = false;
+         }
+         lock.unlock();
+
+         BOOST_FOREACH(const leased_job &job, expired) {
+            LOG_INFO(boost::format("Skipping expired job (%1%) from broker (\"%2%\").")
+                     % job.tile % job.broker);
+            common.broker_req.to(job.broker) << manip::more << "RETURN" << job.tile;
+         }
+      }
+   }
+
+   /* the number of jobs we could lease from a broker without going
+    * over the prefetch limit.
+    */
+   size_t credits() {
+      boost::mutex::scoped_lock lock(prefetched_mutex);
+      size_t held = prefetched.size() + (processing_broker ? 1 : 0);
+      return (held < prefetch) ? prefetch - held : 0;
+   }
+
+   /* examines the state of what's known about the brokers' queues and
+    * sends a request for jobs to the best one, if the worker code is
+    * active, there are credits and there isn't a request outstanding 
+    * already. if no brokers have jobs then an announcement will call 
+    * this again.
     */
    void try_to_get_job() {
+      if (current_broker) {
+         return;
+      }
+
+      // don't go looking for jobs before the worker code has asked for
+      // any, or after it's gone away.
+      if (!job_wanted && !processing_broker) {
+         boost::mutex::scoped_lock lock(prefetched_mutex);
+         if (prefetched.empty()) {
+            lock.unlock();
+            set_busy();
+            return;
+         }
+      }
+
+      const size_t num_jobs = credits();
+      if (num_jobs == 0) {
+         set_busy();
+         return;
+      }
+
       current_broker = highest_priority_broker();
 
-      if (current_broker) {
+      if (!current_broker) {
+         // no-one has any jobs at the moment, so let all the brokers 
+         // know we're waiting for them.
+         set_idle(num_jobs);
+         return;
+      }
+      // the broker forgets we were idle when it gets a request.
+      idle_at.erase(current_broker.get());
+
+      // only ask for more than one job if we're configured to, so that
+      // brokers which don't know about prefetching still work.
+      if (prefetch > 1) {
+         common.broker_req.to(current_broker.get()) 
+            << manip::more << "GET_JOB" << uint32_t(num_jobs);
+      } else {
          common.broker_req.to(current_broker.get()) << "GET_JOB";
-         state = state_trying_to_get_job;
-         // set up a time after which this worker will give up trying to 
-         // get a job from the current broker, assuming it has died, and
-         // try a different one instead.
-         get_job_retry_time = microsec_clock::universal_time() + milliseconds(broker_timeout);
+      }
+      // set up a time after which this worker will give up trying to 
+      // get a job from the current broker, assuming it has died, and
+      // try a different one instead.
+      get_job_retry_time = microsec_clock::universal_time() + milliseconds(broker_timeout);
+   }
 
-      } else {
-         // otherwise switch state back to waiting so that
-         // an announce might trigger another attempt.
-         state = state_waiting_for_job;
+   /* tell each broker we know about, and haven't already told, that
+    * we're waiting for jobs, so that they'll push new jobs straight 
+    * here. there's no reply to this, so it doesn't hold up anything
+    * else.
+    */
+   void set_idle(size_t num_jobs) {
+      BOOST_FOREACH(const string &broker, known_brokers) {
+         if (idle_at.count(broker) == 0) {
+            common.broker_req.to(broker) << manip::more << "IDLE" << uint32_t(num_jobs);
+            idle_at.insert(broker);
+         }
       }
    }
 
+   /* tell the brokers which think we're idle that we aren't any more,
+    * so that they don't push jobs which we'd only have to return.
+    */
+   void set_busy() {
+      BOOST_FOREACH(const string &broker, idle_at) {
+         common.broker_req.to(broker) << "BUSY";
+      }
+      idle_at.clear();
+   }
+
+   /* copy of the jobs which have been leased but not yet handed over
+    * to the worker code. this is called from the worker code's thread.
+    */
+   list<job_t> prefetched_jobs() {
+      list<job_t> jobs;
+      boost::mutex::scoped_lock lock(prefetched_mutex);
+      BOOST_FOREACH(const leased_job &job, prefetched) {
+         jobs.push_back(job.tile);
+      }
+      return jobs;
+   }
+
    zmq_backend_common common;
    zstream::socket::pair inproc_req;
 
@@ -426,18 +577,32 @@ struct zmq_backend_worker::task_communicator {
    // the broker timeout in milliseconds.
    long poll_timeout, broker_timeout;
 
+   // the maximum number of jobs this worker will lease at once.
+   const size_t prefetch;
+
    // whether we've been asked to shutdown this thread.
    bool &shutdown_requested;
 
-   // what stage of processing is this communicator in?
-   communicator_state state;
+   // whether the worker code has asked for a job which it hasn't got 
+   // yet.
+   bool job_wanted;
 
    // this worker's ID
    const string &worker_id;
 
-   // whether we're currently polling a particular worker for a job
+   // the broker we're currently polling for a job, if any.
    boost::optional<string> current_broker;
 
+   // the broker which leased the job the worker code is processing, 
+   // if it's processing one.
+   boost::optional<string> processing_broker;
+
+   // jobs which have been leased, but not yet handed to the worker 
+   // code, in the order they were received. the mutex is needed as the
+   // worker code can look at these from its own thread.
+   std::list<leased_job> prefetched;
+   boost::mutex prefetched_mutex;
+
    /* workers keep track of the status of the brokers to fairly
     * attempt to get the highest priority job. jobs are ordered by
     * priority on the broker and, between jobs with the same 
@@ -476,6 +641,10 @@ struct zmq_backend_worker::task_communicator {
    // map the identities of the brokers into their respective statuses.
    unordered_map<string, broker_status> brokers_with_jobs;
 
+   // all the brokers which have announced themselves, with or without
+   // jobs, and those of them which we've told we're idle.
+   std::set<string> known_brokers, idle_at;
+
    // time at which to give up on a (presumably) dead broker and retry
    ptime get_job_retry_time;
 };
@@ -500,6 +669,7 @@ void
 zmq_backend_worker::setup(const pt::ptree &pt) {
    poll_timeout = long(pt.get<double>("worker.poll_timeout", DEFAULT_POLL_TIMEOUT) * 1000000);
    long broker_timeout = long(pt.get<double>("worker.broker_timeout", DEFAULT_BROKER_TIMEOUT) * 1000);
+   size_t prefetch = pt.get<size_t>("worker.prefetch", DEFAULT_PREFETCH);
 
    boost::optional<std::string> config_worker_id = pt.get_optional<std::string>("worker.id");
    if (config_worker_id) {
@@ -512,8 +682,8 @@ zmq_backend_worker::setup(const pt::ptree &pt) {
    inproc_rep.bind("inproc://communication-" + worker_id);
 
    communicator.reset(new task_communicator(*context, poll_timeout, 
-                                            broker_timeout, shutdown_requested,
-                                            worker_id));
+                                            broker_timeout, prefetch,
+                                            shutdown_requested, worker_id));
    comm_thread.reset(new boost::thread(boost::ref(*communicator)));
 
    // set the identity on the REQ socket to support identity routing. this
@@ -542,6 +712,11 @@ zmq_backend_worker::notify(const job_t &job) {
    inproc_rep << manip::more << "" << job;
 }
 
+list<job_t>
+zmq_backend_worker::prefetched_jobs() {
+   return communicator->prefetched_jobs();
+}
+
 /*************************************************************
  * handler functions
  */
@@ -674,6 +849,16 @@ zmq_backend_handler::update_heartbeat(const string &broker_id, uint64_t qsize) {
    hb.queue_size = qsize;
 }
 
+void
+zmq_backend_handler::update_queue_length(const string &broker_id, uint64_t qsize) {
+   unordered_map<string, heartbeat>::iterator itr = heartbeats.find(broker_id);
+   // only update brokers we've heard a heartbeat from, as the others
+   // aren't part of the queue length yet.
+   if (itr != heartbeats.end()) {
+      itr->second.queue_size = qsize;
+   }
+}
+
 bool
 zmq_backend_handler::handle_pollitems(zmq::pollitem_t *items, std::list<job_t> &jobs) {
    bool have_new_jobs = false;
@@ -691,8 +876,15 @@ zmq_backend_handler::handle_pollitems(zmq::pollitem_t *items, std::list<job_t> &
 
    if (items[0].revents & ZMQ_POLLIN) {
       job_t job;
-      common.broker_req >> manip::ignore_routing_headers
-                        >> job;
+      list<string> broker_addresses;
+      manip::routing_headers headers(broker_addresses);
+      common.broker_req >> headers >> job;
+
+      // brokers send their queue length along with every job, which
+      // is fresher than the last heartbeat.
+      if ((job.queue_length >= 0) && !broker_addresses.empty()) {
+         update_queue_length(broker_addresses.front(), job.queue_length);
+      }
 
       jobs.push_back(job);
 
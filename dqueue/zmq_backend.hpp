@@ -159,6 +159,9 @@ private:
    // update the heartbeat for a broker.
    void update_heartbeat(const std::string &broker_id, uint64_t qsize);
 
+   // update the queue length of a broker from the one sent with a job.
+   void update_queue_length(const std::string &broker_id, uint64_t qsize);
+
    // check if we are still settling. returns true if settling has not
    // yet finished, false if the queue is ready to be used.
    bool settle_check();
@@ -185,6 +188,7 @@ public:
 
    job_t get_job();
    void notify(const job_t &job);
+   std::list<job_t> prefetched_jobs();
 
 private:
    // whether the worker backend owns the zmq context.
@@ -283,7 +283,6 @@ public:
 
       try 
       {
-         http::curl_ptr connection = http::createPersistentConnection();
          const http::headers_t headers = m_lts_storage->expiry_headers(host.second);
 
          BOOST_FOREACH(const string &path, itr.second)
@@ -291,7 +290,7 @@ public:
             string url = host.first;
             url.append(path);
             // todo: timeout
-            http::get(url, connection, headers, false, 300L);
+            http::get(url, http::curl_ptr(), headers, false, 300L);
          }
       }
       catch (const std::runtime_error &e)
@@ -0,0 +1,320 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *  Author: kevin.kreiser@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "connection_pool.hpp"
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/once.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <stdexcept>
+#include <algorithm>
+#include <list>
+#include <map>
+#include <vector>
+
+using std::string;
+using std::list;
+using std::map;
+using std::vector;
+using std::runtime_error;
+using boost::shared_ptr;
+namespace bt = boost::posix_time;
+
+namespace http
+{
+
+struct connection_pool::impl
+{
+   // a handle sitting in the pool, and when it was put there.
+   struct idle_handle
+   {
+      CURL *curl;
+      bt::ptime since;
+   };
+
+   // idle handles for a host, most recently used first.
+   typedef list<idle_handle> handle_list;
+
+   impl(size_t max_idle_per_host, long idle_timeout)
+      : m_max_idle_per_host(max_idle_per_host),
+        m_idle_timeout(bt::milliseconds(idle_timeout)),
+        m_num_idle(0), m_share(NULL)
+   {
+      curl_global_init(CURL_GLOBAL_ALL);
+
+      m_share = curl_share_init();
+      if (m_share == NULL)
+      {
+         curl_global_cleanup();
+         throw runtime_error("Cannot set up the cURL::share system.");
+      }
+      curl_share_setopt(m_share, CURLSHOPT_LOCKFUNC, &impl::lock_callback);
+      curl_share_setopt(m_share, CURLSHOPT_UNLOCKFUNC, &impl::unlock_callback);
+      curl_share_setopt(m_share, CURLSHOPT_USERDATA, this);
+      curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+      curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+   }
+
+   ~impl()
+   {
+      // nothing else can be holding a reference by now, as every handle
+      // out of the pool keeps it alive.
+      for (map<string, handle_list>::iterator itr = m_idle.begin(); itr != m_idle.end(); ++itr)
+      {
+         for (handle_list::iterator jtr = itr->second.begin(); jtr != itr->second.end(); ++jtr)
+         {
+            curl_easy_cleanup(jtr->curl);
+         }
+      }
+      m_idle.clear();
+      curl_share_cleanup(m_share);
+      curl_global_cleanup();
+   }
+
+   // take an idle handle for the host out of the pool, or make a new
+   // one if there isn't one.
+   CURL *take(const string &key)
+   {
+      CURL *curl = NULL;
+      vector<CURL *> expired;
+      {
+         boost::mutex::scoped_lock lock(m_mutex);
+         const bt::ptime now = bt::microsec_clock::universal_time();
+         prune_locked(now, expired);
+
+         map<string, handle_list>::iterator itr = m_idle.find(key);
+         if (itr != m_idle.end())
+         {
+            curl = itr->second.front().curl;
+            itr->second.pop_front();
+            --m_num_idle;
+            if (itr->second.empty())
+            {
+               m_idle.erase(itr);
+            }
+         }
+      }
+      close(expired);
+
+      if (curl == NULL)
+      {
+         curl = curl_easy_init();
+         if (curl == NULL)
+         {
+            throw runtime_error("Cannot initialise CURL library.");
+         }
+      }
+
+      // these are cleared by curl_easy_reset, so have to be set each
+      // time the handle comes out of the pool.
+      curl_easy_setopt(curl, CURLOPT_SHARE, m_share);
+#if LIBCURL_VERSION_NUM >= 0x074100
+      // connections can also be cached inside a multi handle, where
+      // the pool can't get at them to time them out.
+      curl_easy_setopt(curl, CURLOPT_MAXAGE_CONN, std::max(1L, long(m_idle_timeout.total_seconds())));
+#endif
+      return curl;
+   }
+
+   // put a handle back into the pool once it's finished with.
+   void give(const string &key, CURL *curl)
+   {
+      curl_easy_reset(curl);
+
+      vector<CURL *> expired;
+      {
+         boost::mutex::scoped_lock lock(m_mutex);
+         const bt::ptime now = bt::microsec_clock::universal_time();
+         prune_locked(now, expired);
+
+         handle_list &handles = m_idle[key];
+         if (handles.size() < m_max_idle_per_host)
+         {
+            idle_handle h;
+            h.curl = curl;
+            h.since = now;
+            handles.push_front(h);
+            ++m_num_idle;
+            curl = NULL;
+         }
+         else if (handles.empty())
+         {
+            m_idle.erase(key);
+         }
+      }
+      close(expired);
+
+      // there are already enough idle handles for this host.
+      if (curl != NULL)
+      {
+         curl_easy_cleanup(curl);
+      }
+   }
+
+   // take out all the handles which have been idle too long. they're
+   // cleaned up outside the lock, as that closes their connections.
+   void prune_locked(const bt::ptime &now, vector<CURL *> &expired)
+   {
+      map<string, handle_list>::iterator itr = m_idle.begin();
+      while (itr != m_idle.end())
+      {
+         handle_list &handles = itr->second;
+         while (!handles.empty() && (now - handles.back().since > m_idle_timeout))
+         {
+            expired.push_back(handles.back().curl);
+            handles.pop_back();
+            --m_num_idle;
+         }
+
+         if (handles.empty())
+         {
+            m_idle.erase(itr++);
+         }
+         else
+         {
+            ++itr;
+         }
+      }
+   }
+
+   static void close(const vector<CURL *> &handles)
+   {
+      for (vector<CURL *>::const_iterator itr = handles.begin(); itr != handles.end(); ++itr)
+      {
+         curl_easy_cleanup(*itr);
+      }
+   }
+
+   static void lock_callback(CURL *, curl_lock_data data, curl_lock_access, void *userp)
+   {
+      impl *self = static_cast<impl *>(userp);
+      self->m_share_locks[data].lock();
+   }
+
+   static void unlock_callback(CURL *, curl_lock_data data, void *userp)
+   {
+      impl *self = static_cast<impl *>(userp);
+      self->m_share_locks[data].unlock();
+   }
+
+   /* deleter for handles given out by the pool, which puts them back
+    * in. it holds a reference to the pool's state, so it's fine for a
+    * handle to outlive the pool object.
+    */
+   struct return_to_pool
+   {
+      return_to_pool(shared_ptr<impl> pool, const string &key)
+         : m_pool(pool), m_key(key)
+      {}
+
+      void operator()(CURL *curl) const
+      {
+         m_pool->give(m_key, curl);
+      }
+
+      shared_ptr<impl> m_pool;
+      string m_key;
+   };
+
+   const size_t m_max_idle_per_host;
+   const bt::time_duration m_idle_timeout;
+
+   mutable boost::mutex m_mutex;
+   map<string, handle_list> m_idle;
+   size_t m_num_idle;
+
+   CURLSH *m_share;
+   // one lock for each kind of data which curl might share.
+   boost::mutex m_share_locks[CURL_LOCK_DATA_LAST];
+};
+
+namespace
+{
+   connection_pool *global_pool = NULL;
+   boost::once_flag global_pool_once = BOOST_ONCE_INIT;
+
+   void make_global_pool()
+   {
+      // never deleted, as the handles it gives out may well be released
+      // during static destruction.
+      global_pool = new connection_pool();
+   }
+}
+
+connection_pool::connection_pool(size_t max_idle_per_host, long idle_timeout)
+   : m_impl(new impl(max_idle_per_host, idle_timeout))
+{
+}
+
+connection_pool::~connection_pool()
+{
+}
+
+curl_ptr connection_pool::acquire(const string &url)
+{
+   const string key = host_key(url);
+   return curl_ptr(m_impl->take(key), impl::return_to_pool(m_impl, key));
+}
+
+void connection_pool::prune()
+{
+   vector<CURL *> expired;
+   {
+      boost::mutex::scoped_lock lock(m_impl->m_mutex);
+      m_impl->prune_locked(bt::microsec_clock::universal_time(), expired);
+   }
+   impl::close(expired);
+}
+
+size_t connection_pool::idle() const
+{
+   boost::mutex::scoped_lock lock(m_impl->m_mutex);
+   return m_impl->m_num_idle;
+}
+
+size_t connection_pool::idle(const string &url) const
+{
+   boost::mutex::scoped_lock lock(m_impl->m_mutex);
+   map<string, impl::handle_list>::const_iterator itr = m_impl->m_idle.find(host_key(url));
+   return (itr == m_impl->m_idle.end()) ? 0 : itr->second.size();
+}
+
+connection_pool &connection_pool::instance()
+{
+   boost::call_once(&make_global_pool, global_pool_once);
+   return *global_pool;
+}
+
+string connection_pool::host_key(const string &url)
+{
+   // the host part runs from after the scheme to the start of the path,
+   // query or fragment, if there is one.
+   string::size_type start = url.find("://");
+   start = (start == string::npos) ? 0 : start + 3;
+   const string::size_type end = url.find_first_of("/?#", start);
+   return url.substr(0, end);
+}
+
+} // namespace http
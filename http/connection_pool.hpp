@@ -0,0 +1,102 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *  Author: kevin.kreiser@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef HTTP_CONNECTION_POOL_HPP
+#define HTTP_CONNECTION_POOL_HPP
+
+#include "http.hpp"
+#include <string>
+#include <boost/shared_ptr.hpp>
+#include <boost/utility.hpp>
+
+// number of idle handles to keep open for each host.
+#define DEFAULT_MAX_IDLE_PER_HOST (16)
+
+// milliseconds after which an idle handle, and the connection it
+// holds, is closed.
+#define DEFAULT_IDLE_TIMEOUT (30000)
+
+namespace http
+{
+   /* a pool of curl easy handles, kept open between requests so that
+    * the connections they hold can be re-used rather than setting up a
+    * new TCP connection for every request.
+    *
+    * handles are kept separately for each host (scheme, name and port
+    * of the URL), so that a handle taken from the pool for a URL is one
+    * which was last used for the same host and still has a live
+    * connection to it. all the handles share a DNS and SSL session
+    * cache through a CURLSH object, so even a new handle doesn't need
+    * to look up the host again.
+    *
+    * handles are taken out with acquire() and go back into the pool
+    * when the last reference to them is dropped. they're reset on the
+    * way back in, so each one comes out of the pool with default
+    * options. at most max_idle_per_host handles are kept for each host
+    * and any which haven't been used for idle_timeout milliseconds are
+    * closed, so that the pool doesn't hold on to connections which the
+    * server has probably given up on anyway.
+    *
+    * the pool is thread safe, but each handle must only be used by one
+    * thread at a time, as with any curl easy handle.
+    */
+   class connection_pool : private boost::noncopyable
+   {
+   public:
+      connection_pool(size_t max_idle_per_host = DEFAULT_MAX_IDLE_PER_HOST,
+                      long idle_timeout = DEFAULT_IDLE_TIMEOUT);
+      ~connection_pool();
+
+      // get a handle to use for a request to the given URL. the handle
+      // is returned to the pool when the last copy of the pointer is
+      // destroyed, which may be after the pool itself has gone.
+      curl_ptr acquire(const std::string &url);
+
+      // close any handles which have been idle for longer than the
+      // timeout. this is done as handles go in and out of the pool
+      // anyway, so it only needs calling if the pool isn't being used.
+      void prune();
+
+      // the number of idle handles in the pool, for all hosts or just
+      // for the host of the given URL.
+      size_t idle() const;
+      size_t idle(const std::string &url) const;
+
+      // the process-wide pool used by the http functions whenever
+      // they're not given a connection of their own.
+      static connection_pool &instance();
+
+      // the part of the URL which identifies the connection, i.e: the
+      // scheme, host name and port.
+      static std::string host_key(const std::string &url);
+
+   private:
+      struct impl;
+      boost::shared_ptr<impl> m_impl;
+   };
+}
+
+#endif /* HTTP_CONNECTION_POOL_HPP */
@@ -25,22 +25,36 @@
  *-----------------------------------------------------------------------------*/
 
 #include "http.hpp"
+#include "connection_pool.hpp"
 #include "../logging/logger.hpp"
 #include <boost/function.hpp>
+#include <boost/bind.hpp>
 #include <boost/variant.hpp>
 #include <boost/foreach.hpp>
+#include <boost/format.hpp>
+#include <boost/thread/tss.hpp>
 #include <cstdlib>
 #include <cstring>
 #include <stdexcept>
 #include <sstream>
-#include <stack>
 #include <list>
+#include <map>
+#include <set>
+#include <cerrno>
+
+// for the multi engine's event loop
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <unistd.h>
 
 using std::string;
 using std::pair;
 using std::vector;
-using std::stack;
 using std::list;
+using std::map;
+using std::set;
+using std::make_pair;
 using std::runtime_error;
 using std::ostringstream;
 using boost::shared_ptr;
@@ -119,7 +133,7 @@ namespace
  *************************************************************/
 using http::response;
 using http::part;
-using http::createPersistentConnection;
+using http::connection_pool;
 
 /* response or error variant - in order to not throw exceptions
  * during multi-request sessions, this is used to preserve 
@@ -163,7 +177,8 @@ struct curl_oper : private boost::noncopyable
    {
       if (!m_curl) 
       {
-         m_curl = createPersistentConnection();
+         // handles from the pool are reset on the way back in.
+         m_curl = connection_pool::instance().acquire(url);
          m_reset_connection = false;
       }
       CURL *curl = m_curl.get();
@@ -247,8 +262,8 @@ private:
    shared_ptr<response> m_resp;
    
    // whether to reset the connection once the transfer is
-   // done. set to false for single connections which aren't
-   // shared, true otherwise.
+   // done. set to false for connections from the pool, which
+   // does that itself, true for connections from the caller.
    bool m_reset_connection;
 };
 
@@ -367,208 +382,530 @@ struct curl_get : public curl_oper
    }
 };
 
-/* template function to abstract the multi-curl stuff across both
- * the single and form types of upload. the second argument is a 
- * functor, used to turn the request type into a representative 
- * object.
+/* curl operation to perform an HTTP HEAD. unlike the blocking head()
+ * function, the response headers aren't put into the body.
  */
-template <typename T>
-vector<shared_ptr<response> > do_multi_requests(
-   const vector<T> &requests,
-   boost::function<shared_ptr<curl_oper> (const T &t, shared_ptr<CURL> conn, size_t idx)> mk_request,
-   size_t concurrency,
-   shared_ptr<CURL> connection)
+struct curl_head : public curl_oper
 {
-   shared_ptr<CURLM> curl_multi(curl_multi_init(), &curl_multi_cleanup);
+   curl_head(shared_ptr<CURL> curl_ptr,
+             const string &url,
+             const vector<string> &headers,
+             bool keepHeaders,
+             size_t index = 0,
+             long timeout = 0L)
+      : curl_oper(curl_ptr, url, headers, keepHeaders, index)
+   {
+      curl_easy_setopt(m_curl.get(), CURLOPT_CONNECTTIMEOUT_MS, timeout);
+      curl_easy_setopt(m_curl.get(), CURLOPT_NOBODY, 1L);
+   }
+
+   string oper_type() const
+   {
+      return "HEAD";
+   }
+};
 
-   // pre-allocate an array for the responses, which are going to be in
-   // the same order as the requests.
-   vector<response_or_error_t> responses(requests.size());
+/*************************************************************
+ * multi engine
+ *
+ * curl_multi's socket interface tells us, through callbacks,
+ * which sockets it's interested in and how long it's willing
+ * to wait before it needs to be called again. the sockets go
+ * into an epoll set, and the timeout goes into a timerfd which
+ * is also in the epoll set, so that the epoll descriptor alone
+ * tells the caller whether there's anything to do.
+ *
+ * only the sockets of transfers which are actually in progress
+ * are in the epoll set, so the cost of each wakeup depends on
+ * the number of sockets with activity, not the number of
+ * transfers, and there's no limit on the number of sockets as
+ * there is with select().
+ *
+ * the engine is used both by the async_client, as a long-lived
+ * event loop, and by the blocking multi* functions, which keep
+ * one for each thread and wait on it until the batch is done.
+ *
+ * the engine also keeps timers for its users, on a second
+ * timerfd in the same epoll set. each transfer and timer gets an
+ * id, so that it can be cancelled before it calls back.
+ *
+ *************************************************************/
 
-   // "free" as in available connections so that we can re-use open HTTP
-   // connections as much as possible to reduce TCP setup time.
-   stack<shared_ptr<CURL> > free_connections;
+// maximum number of epoll events to handle in one call to
+// perform(). anything left over is picked up next time, as the
+// epoll set is level-triggered.
+#define MULTI_MAX_EVENTS (256)
 
-   // POST objects which are in progress at the moment.
-   list<shared_ptr<curl_oper> > in_progress;
+// called with the result of a transfer once it has finished.
+typedef boost::function<void (const response_or_error_t &)> completion_t;
 
-   if (!curl_multi)
+// milliseconds on the monotonic clock, for the engine's timers.
+int64_t monotonic_ms()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return int64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+struct multi_engine : private boost::noncopyable
+{
+   // a transfer in progress and what to do when it's finished.
+   struct transfer
+   {
+      unsigned long id;
+      shared_ptr<curl_oper> oper;
+      completion_t completion;
+   };
+
+   // timers, ordered by when they're due and then by id.
+   typedef map<pair<int64_t, unsigned long>, boost::function<void ()> > timer_map;
+
+   multi_engine()
+      : m_multi(curl_multi_init()), m_epoll_fd(-1), m_timer_fd(-1), m_alarm_fd(-1), m_next_id(0)
    {
-      throw runtime_error("Cannot set up the cURL::multi system.");
+      if (m_multi == NULL)
+      {
+         throw runtime_error("Cannot set up the cURL::multi system.");
+      }
+
+      m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+      m_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+      m_alarm_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+      if ((m_epoll_fd < 0) || (m_timer_fd < 0) || (m_alarm_fd < 0))
+      {
+         cleanup();
+         throw runtime_error((boost::format("Cannot set up asynchronous HTTP event loop: %1%") 
+                              % strerror(errno)).str());
+      }
+
+      struct epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLIN;
+      ev.data.fd = m_timer_fd;
+      epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_timer_fd, &ev);
+      ev.data.fd = m_alarm_fd;
+      epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_alarm_fd, &ev);
+
+      curl_multi_setopt(m_multi, CURLMOPT_SOCKETFUNCTION, &multi_engine::socket_callback);
+      curl_multi_setopt(m_multi, CURLMOPT_SOCKETDATA, this);
+      curl_multi_setopt(m_multi, CURLMOPT_TIMERFUNCTION, &multi_engine::timer_callback);
+      curl_multi_setopt(m_multi, CURLMOPT_TIMERDATA, this);
    }
 
-   // don't start up more connections than are needed
-   concurrency = std::min(concurrency, requests.size());
+   ~multi_engine()
+   {
+      abandon();
+      cleanup();
+   }
 
-   // setup the required number of connections, re-using the one which was 
-   // passed in, if appropriate.
-   if (connection)
+   void cleanup()
    {
-      free_connections.push(connection);
+      if (m_multi != NULL) { curl_multi_cleanup(m_multi); m_multi = NULL; }
+      if (m_epoll_fd >= 0) { close(m_epoll_fd); m_epoll_fd = -1; }
+      if (m_timer_fd >= 0) { close(m_timer_fd); m_timer_fd = -1; }
+      if (m_alarm_fd >= 0) { close(m_alarm_fd); m_alarm_fd = -1; }
    }
-   while (free_connections.size() < concurrency)
+
+   // stop everything still in progress, without calling back.
+   void abandon()
    {
-      shared_ptr<CURL> curl = createPersistentConnection();
-      if (!curl) 
+      for (map<CURL *, transfer>::iterator itr = m_transfers.begin();
+           itr != m_transfers.end(); ++itr)
       {
-         throw runtime_error("Cannot set up a cURL connection.");
+         curl_multi_remove_handle(m_multi, itr->first);
       }
-      free_connections.push(curl);
+      m_transfers.clear();
+      m_transfer_ids.clear();
+      m_timers.clear();
+      m_timer_ids.clear();
+      m_dispatching.clear();
    }
 
-   // req_i runs over the indices of the request objects in the input
-   // vector (and correspondingly over the output responses).
-   size_t req_i = 0;
+   // start a transfer, returning its id.
+   unsigned long start(shared_ptr<curl_oper> oper, const completion_t &completion)
+   {
+      CURL *curl = oper->m_curl.get();
+      transfer &t = m_transfers[curl];
+      t.id = ++m_next_id;
+      t.oper = oper;
+      t.completion = completion;
+
+      CURLMcode status = curl_multi_add_handle(m_multi, curl);
+      if (status != CURLM_OK)
+      {
+         m_transfers.erase(curl);
+         throw runtime_error((boost::format("Error adding easy handle to curl_multi: %1%") 
+                              % curl_multi_strerror(status)).str());
+      }
+      m_transfer_ids[t.id] = curl;
+      return t.id;
+   }
 
-   // keep track of the number of running handles in the curl system
-   // so that we know when something has changed between runs.
-   size_t running_handles = 0;
+   // call the function from perform() after timeout milliseconds,
+   // returning the timer's id.
+   unsigned long after(long timeout, const boost::function<void ()> &callback)
+   {
+      const unsigned long id = ++m_next_id;
+      const pair<int64_t, unsigned long> key(monotonic_ms() + std::max(timeout, 0L), id);
+      m_timers[key] = callback;
+      m_timer_ids[id] = key.first;
+      arm_alarm();
+      return id;
+   }
 
-   while (true)
+   // stop a transfer or timer without calling it back. this works
+   // even if it has finished, as long as it hasn't been called back
+   // yet, so it's safe to cancel one callback from another.
+   void cancel(unsigned long id)
    {
-      // check if there's available jobs and free connections and add
-      // handles to the multi pool.
-      while ((running_handles < concurrency) &&
-             (req_i < requests.size()) &&
-             (!free_connections.empty()))
+      m_dispatching.erase(id);
+
+      map<unsigned long, CURL *>::iterator t_itr = m_transfer_ids.find(id);
+      if (t_itr != m_transfer_ids.end())
       {
-         shared_ptr<CURL> conn = free_connections.top();
-         const T &data = requests[req_i];
-         shared_ptr<curl_oper> post = mk_request(data, conn, req_i);
+         // destroying the oper puts the handle back in the pool, and
+         // curl closes the connection if it was still in use.
+         curl_multi_remove_handle(m_multi, t_itr->second);
+         m_transfers.erase(t_itr->second);
+         m_transfer_ids.erase(t_itr);
+         return;
+      }
 
-         free_connections.pop();
-         in_progress.push_back(post);
+      map<unsigned long, int64_t>::iterator a_itr = m_timer_ids.find(id);
+      if (a_itr != m_timer_ids.end())
+      {
+         m_timers.erase(make_pair(a_itr->second, id));
+         m_timer_ids.erase(a_itr);
+         arm_alarm();
+      }
+   }
 
-         CURLMcode status = curl_multi_add_handle(curl_multi.get(), post->m_curl.get());
-         if (status != 0)
-         {
-            responses.at(req_i) = response_or_error_t("Error adding easy handle to curl_multi.");
-         }
-         
-         req_i += 1;
+   // number of transfers and timers which haven't called back yet.
+   size_t in_flight() const
+   {
+      return m_transfers.size() + m_timers.size();
+   }
+
+   // set the alarm timerfd for the earliest timer, or disarm it.
+   void arm_alarm()
+   {
+      struct itimerspec its;
+      memset(&its, 0, sizeof(its));
+      if (!m_timers.empty())
+      {
+         // the clock is the same one, so an absolute time can be used,
+         // and a time which has already passed fires straight away.
+         const int64_t due = std::max(m_timers.begin()->first.first, int64_t(1));
+         its.it_value.tv_sec = due / 1000;
+         its.it_value.tv_nsec = (due % 1000) * 1000000;
       }
+      timerfd_settime(m_alarm_fd, TFD_TIMER_ABSTIME, &its, NULL);
+   }
+
+   void perform()
+   {
+      struct epoll_event events[MULTI_MAX_EVENTS];
+      int n = epoll_wait(m_epoll_fd, events, MULTI_MAX_EVENTS, 0);
+      int running = 0;
 
-      int new_running_handles = running_handles;
-      // perform CURL actions
-      CURLMcode status;
-      do {
-         status = curl_multi_perform(curl_multi.get(), &new_running_handles); 
-         // curl wants us to keep running this while it's returning this 
-         // error code - presumably to drain all the incoming input.
-      } while (status == CURLM_CALL_MULTI_PERFORM);
-
-      // wait for something to happen - curl tells us how long it expects
-      // to have to wait for something. note that this is *after* the curl
-      // event gathering loop above so that curl has had an opportunity to
-      // figure out exactly what it is that it is waiting for.
-      long timeout = 0;
-      curl_multi_timeout(curl_multi.get(), &timeout);
-      if (timeout != 0) 
-      {
-         // first, pull the interesting file descriptors out of curl
-         fd_set read_fd, write_fd, exc_fd;
-         int n_fd = 0;
-         FD_ZERO(&read_fd);
-         FD_ZERO(&write_fd);
-         FD_ZERO(&exc_fd);
-
-         curl_multi_fdset(curl_multi.get(), &read_fd, &write_fd, &exc_fd, &n_fd);
-
-         if (n_fd > 0)
+      for (int i = 0; i < n; ++i)
+      {
+         if (events[i].data.fd == m_timer_fd)
          {
-            // if there's timeout information then use that, otherwise
-            // block until something interesting happens...
-            if (timeout < 0)
-            {
-               timeout = 100;
-            }
-            else if (timeout > 1000)
-            {
-               timeout = 1000;
-            }
-             
-            struct timeval tv;
-            tv.tv_sec = timeout / 1000;
-            tv.tv_usec = (timeout % 1000) * 1000;
-            select(n_fd, &read_fd, &write_fd, &exc_fd, &tv);
+            uint64_t expirations = 0;
+            ssize_t rv = read(m_timer_fd, &expirations, sizeof(expirations));
+            (void)rv;
+            curl_multi_socket_action(m_multi, CURL_SOCKET_TIMEOUT, 0, &running);
+         }
+         else if (events[i].data.fd == m_alarm_fd)
+         {
+            uint64_t expirations = 0;
+            ssize_t rv = read(m_alarm_fd, &expirations, sizeof(expirations));
+            (void)rv;
          }
-      }               
+         else
+         {
+            int action = 0;
+            if (events[i].events & EPOLLIN) { action |= CURL_CSELECT_IN; }
+            if (events[i].events & EPOLLOUT) { action |= CURL_CSELECT_OUT; }
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) { action |= CURL_CSELECT_ERR; }
+            curl_multi_socket_action(m_multi, events[i].data.fd, action, &running);
+         }
+      }
+
+      finish_transfers();
+      finish_timers();
+   }
+
+   // wait for up to timeout milliseconds for activity, then perform().
+   // a negative timeout waits indefinitely.
+   void wait(long timeout)
+   {
+      struct pollfd pfd;
+      pfd.fd = m_epoll_fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      poll(&pfd, 1, timeout < 0 ? -1 : int(timeout));
+      perform();
+   }
 
-      // check if some actions completed
+   // collect all the finished transfers from curl and call their
+   // completions. these are called only after all the state has been
+   // updated, as they may well start new transfers.
+   void finish_transfers()
+   {
+      list<pair<unsigned long, pair<response_or_error_t, completion_t> > > finished;
       struct CURLMsg *msg = NULL;
       int msg_count = 0;
 
-      while ((msg = curl_multi_info_read(curl_multi.get(), &msg_count)) != NULL)
+      while ((msg = curl_multi_info_read(m_multi, &msg_count)) != NULL)
       {
-         // curl docs say this should always be the case - that the other
-         // values of CURLMSG enum are unused...
-         if (msg->msg == CURLMSG_DONE)
+         if (msg->msg != CURLMSG_DONE)
          {
-            CURLcode status = msg->data.result;
-            
-            // find connection & resp
-            list<shared_ptr<curl_oper> >::iterator itr = in_progress.begin();
-            while (itr != in_progress.end()) 
-            {
-               if (msg->easy_handle == (*itr)->m_curl.get())
-               {
-                  break;
-               }
-               ++itr;
-            }
-            
-            if (itr != in_progress.end())
-            {
-               // take it out of the multi and the in_progress
-               shared_ptr<curl_oper> oper = *itr;
-               in_progress.erase(itr);
-               
-               // remove the connection from the multi
-               curl_multi_remove_handle(curl_multi.get(), oper->m_curl.get());
-               
-               // assign response to output vector using index
-               responses.at(oper->m_index) = oper->finish(status);
-               
-               // add connection back into free pool
-               free_connections.push(oper->m_curl);
+            continue;
+         }
+
+         CURL *curl = msg->easy_handle;
+         CURLcode status = msg->data.result;
+         map<CURL *, transfer>::iterator itr = m_transfers.find(curl);
+         if (itr == m_transfers.end())
+         {
+            LOG_ERROR("Asynchronous request finished, but cannot find matching record.");
+            curl_multi_remove_handle(m_multi, curl);
+            continue;
+         }
+
+         curl_multi_remove_handle(m_multi, curl);
+         finished.push_back(make_pair(itr->second.id, make_pair(itr->second.oper->finish(status), itr->second.completion)));
+         m_dispatching.insert(itr->second.id);
+         m_transfer_ids.erase(itr->second.id);
 
 #ifdef HTTP_DEBUG
-               LOG_FINER(boost::format("%1% <%2% %3%> <pending>")
-                         % (oper->m_curl.get() != NULL ? "Persistent" : "")
-                         % oper->oper_type() % oper->m_url);
+         LOG_FINER(boost::format("<%1% %2%> <done>") % itr->second.oper->oper_type() % itr->second.oper->m_url);
 #endif
-            }
-            else
+
+         // destroying the oper puts the handle back in the pool.
+         m_transfers.erase(itr);
+      }
+
+      for (list<pair<unsigned long, pair<response_or_error_t, completion_t> > >::iterator itr = finished.begin();
+           itr != finished.end(); ++itr)
+      {
+         // skip anything cancelled by an earlier callback.
+         if (m_dispatching.erase(itr->first) > 0)
+         {
+            itr->second.second(itr->second.first);
+         }
+      }
+   }
+
+   // call all the timers which are due, in the same way.
+   void finish_timers()
+   {
+      if (m_timers.empty() || m_timers.begin()->first.first > monotonic_ms())
+      {
+         return;
+      }
+
+      const int64_t now = monotonic_ms();
+      list<pair<unsigned long, boost::function<void ()> > > due;
+      while (!m_timers.empty() && m_timers.begin()->first.first <= now)
+      {
+         const unsigned long id = m_timers.begin()->first.second;
+         due.push_back(make_pair(id, m_timers.begin()->second));
+         m_dispatching.insert(id);
+         m_timer_ids.erase(id);
+         m_timers.erase(m_timers.begin());
+      }
+      arm_alarm();
+
+      for (list<pair<unsigned long, boost::function<void ()> > >::iterator itr = due.begin();
+           itr != due.end(); ++itr)
+      {
+         if (m_dispatching.erase(itr->first) > 0)
+         {
+            itr->second();
+         }
+      }
+   }
+
+   static int socket_callback(CURL *, curl_socket_t s, int what, void *userp, void *socketp)
+   {
+      multi_engine *self = static_cast<multi_engine *>(userp);
+      struct epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      ev.data.fd = s;
+
+      if (what == CURL_POLL_REMOVE)
+      {
+         // the socket may already have been closed, which takes it out
+         // of the epoll set anyway, so errors here are not interesting.
+         epoll_ctl(self->m_epoll_fd, EPOLL_CTL_DEL, s, &ev);
+         curl_multi_assign(self->m_multi, s, NULL);
+      }
+      else
+      {
+         if (what & CURL_POLL_IN) { ev.events |= EPOLLIN; }
+         if (what & CURL_POLL_OUT) { ev.events |= EPOLLOUT; }
+
+         // curl lets us attach a pointer to each socket, which is used
+         // here just to remember whether it's already in the epoll set.
+         if (socketp == NULL)
+         {
+            if (epoll_ctl(self->m_epoll_fd, EPOLL_CTL_ADD, s, &ev) != 0 && errno == EEXIST)
             {
-               // this is a serious logic error, so keep the exception
-               // behaviour here.
-               throw runtime_error("Request finished, but cannot find matching record.");
+               epoll_ctl(self->m_epoll_fd, EPOLL_CTL_MOD, s, &ev);
             }
+            curl_multi_assign(self->m_multi, s, self);
          }
          else
          {
-            // this is supposed not to happen, according to the cURL 
-            // docs, so keep the exception behaviour here.
-            throw runtime_error("Expected CURLMSG_DONE as status, but it was something else.");
+            epoll_ctl(self->m_epoll_fd, EPOLL_CTL_MOD, s, &ev);
          }
       }
+      return 0;
+   }
 
-      // update number of running handles for the next pass.
-      running_handles = (size_t)new_running_handles;
+   static int timer_callback(CURLM *, long timeout_ms, void *userp)
+   {
+      multi_engine *self = static_cast<multi_engine *>(userp);
+      struct itimerspec its;
+      memset(&its, 0, sizeof(its));
 
-      // break from the loop if there's nothing left to do
-      if ((running_handles == 0) &&
-          (req_i == requests.size()))
+      if (timeout_ms > 0)
+      {
+         its.it_value.tv_sec = timeout_ms / 1000;
+         its.it_value.tv_nsec = (timeout_ms % 1000) * 1000000;
+      }
+      else if (timeout_ms == 0)
       {
-         break;
+         // curl wants to be called as soon as possible, but a zero
+         // value would disarm the timer, so use the smallest possible
+         // non-zero value instead.
+         its.it_value.tv_nsec = 1;
+      }
+      // otherwise negative, which means delete the timer, which is
+      // what the zeroed structure does.
+
+      timerfd_settime(self->m_timer_fd, 0, &its, NULL);
+      return 0;
+   }
+
+   CURLM *m_multi;
+   // the timer_fd is curl's and the alarm_fd is for the user timers.
+   int m_epoll_fd, m_timer_fd, m_alarm_fd;
+   unsigned long m_next_id;
+   map<CURL *, transfer> m_transfers;
+   map<unsigned long, CURL *> m_transfer_ids;
+   timer_map m_timers;
+   map<unsigned long, int64_t> m_timer_ids;
+   // ids of finished transfers and timers waiting to be called back.
+   set<unsigned long> m_dispatching;
+};
+
+/* each thread keeps an engine for the multi* functions. easy handles
+ * added to a multi handle use its connection cache rather than their
+ * own, so an engine made for each call would close all its
+ * connections at the end of the call. multi handles can only be used
+ * by one thread at a time, so they can't be shared.
+ */
+boost::thread_specific_ptr<multi_engine> engine_for_thread;
+
+/* state of a blocking batch of transfers in do_multi_requests. the
+ * completion of each transfer puts its result in the output and
+ * counts it off.
+ */
+struct multi_batch : private boost::noncopyable
+{
+   explicit multi_batch(size_t size)
+      : responses(size), in_flight(0)
+   {}
+
+   void completed(size_t index, const response_or_error_t &result)
+   {
+      responses.at(index) = result;
+      --in_flight;
+   }
+
+   vector<response_or_error_t> responses;
+   size_t in_flight;
+};
+
+/* abandons any transfers still in the engine when leaving
+ * do_multi_requests, so that nothing calls back into the batch after
+ * it's gone, even if there was an error.
+ */
+struct engine_abandoner : private boost::noncopyable
+{
+   explicit engine_abandoner(multi_engine &engine) : m_engine(engine) {}
+   ~engine_abandoner() { m_engine.abandon(); }
+   multi_engine &m_engine;
+};
+
+/* template function to abstract the multi-curl stuff across both
+ * the single and form types of upload. the second argument is a 
+ * functor, used to turn the request type into a representative 
+ * object.
+ */
+template <typename T>
+vector<shared_ptr<response> > do_multi_requests(
+   const vector<T> &requests,
+   boost::function<shared_ptr<curl_oper> (const T &t, shared_ptr<CURL> conn, size_t idx)> mk_request,
+   size_t concurrency,
+   shared_ptr<CURL> connection)
+{
+   if (engine_for_thread.get() == NULL)
+   {
+      engine_for_thread.reset(new multi_engine());
+   }
+   multi_engine &engine = *engine_for_thread;
+   engine_abandoner abandoner(engine);
+
+   // the responses are going to be in the same order as the requests.
+   multi_batch batch(requests.size());
+
+   // at least one transfer has to be running to get anywhere.
+   concurrency = std::max(concurrency, size_t(1));
+
+   // req_i runs over the indices of the request objects in the input
+   // vector (and correspondingly over the output responses).
+   size_t req_i = 0;
+
+   while ((req_i < requests.size()) || (batch.in_flight > 0))
+   {
+      // start as many requests as the concurrency allows. the first
+      // request can use the connection which was passed in, if there
+      // was one, and the rest get handles from the connection pool.
+      while ((batch.in_flight < concurrency) &&
+             (req_i < requests.size()))
+      {
+         shared_ptr<curl_oper> oper = mk_request(requests[req_i], connection, req_i);
+         connection.reset();
+
+         try
+         {
+            engine.start(oper, boost::bind(&multi_batch::completed, &batch, req_i, _1));
+            ++batch.in_flight;
+         }
+         catch (const std::exception &e)
+         {
+            batch.responses.at(req_i) = response_or_error_t(string(e.what()));
+         }
+
+         req_i += 1;
+      }
+
+      if (batch.in_flight > 0)
+      {
+         engine.wait(-1);
       }
    }
 
    // filter the responses for errors here.
-   vector<shared_ptr<response> > real_responses(responses.size());
-   for (size_t i = 0; i < responses.size(); ++i)
+   vector<shared_ptr<response> > real_responses(batch.responses.size());
+   for (size_t i = 0; i < batch.responses.size(); ++i)
    {
-      real_responses[i] = boost::apply_visitor(response_or_error_visitor(), responses[i]);
+      real_responses[i] = boost::apply_visitor(response_or_error_visitor(), batch.responses[i]);
    }
    
    return real_responses;
@@ -663,7 +1000,7 @@ shared_ptr<response> get(
    const bool& keepHeaders, 
    long timeout)
 {
-      curl_get cg(connection, url, headers, keepHeaders, timeout);
+      curl_get cg(connection, url, headers, keepHeaders, 0, timeout);
 
       //do the request
       CURLcode status = curl_easy_perform(cg.m_curl.get());
@@ -765,14 +1102,14 @@ vector<shared_ptr<response> > multiPostForm(
    // perform HTTP delete, returning the response
    shared_ptr<response> del(const string &url, shared_ptr<CURL> connection, const vector<string>& headers, const bool& keepHeaders)
    {
-      //try to reuse the previous connection
-      CURL *curl = connection.get();
-      //if we didnt have a persistent
-      if(curl == NULL)
-         curl = curl_easy_init();
+      //use the caller's connection, or one from the pool
+      curl_ptr conn = connection;
       //we need to reset the options used in the last call
+      if(conn)
+         curl_easy_reset(conn.get());
       else
-         curl_easy_reset(curl);
+         conn = connection_pool::instance().acquire(url);
+      CURL *curl = conn.get();
 
       if(curl != 0)
       {
@@ -810,9 +1147,6 @@ vector<shared_ptr<response> > multiPostForm(
          curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &resp->statusCode);
          if(headerList)
             curl_slist_free_all(headerList);
-         //this wasn't a persistent connection so get rid of it
-         if(connection.get() == NULL)
-            curl_easy_cleanup(curl);
 
 #ifdef HTTP_DEBUG
          LOG_FINER(boost::format("%1% <DELETE %2%> <STATUS %3%>")
@@ -830,14 +1164,14 @@ vector<shared_ptr<response> > multiPostForm(
    // perform HTTP head, returning the response
    shared_ptr<response> head(const string &url, shared_ptr<CURL> connection, const vector<string>& headers, const bool& keepHeaders)
    {
-      //try to reuse the previous connection
-      CURL *curl = connection.get();
-      //if we didnt have a persistent
-      if(curl == NULL)
-         curl = curl_easy_init();
+      //use the caller's connection, or one from the pool
+      curl_ptr conn = connection;
       //we need to reset the options used in the last call
+      if(conn)
+         curl_easy_reset(conn.get());
       else
-         curl_easy_reset(curl);
+         conn = connection_pool::instance().acquire(url);
+      CURL *curl = conn.get();
 
       if(curl != 0)
       {
@@ -878,9 +1212,6 @@ vector<shared_ptr<response> > multiPostForm(
          curl_easy_getinfo(curl, CURLINFO_FILETIME, &resp->timeStamp);
          if(headerList)
             curl_slist_free_all(headerList);
-         //this wasn't a persistent connection so get rid of it
-         if(connection.get() == NULL)
-            curl_easy_cleanup(curl);
 
 #ifdef HTTP_DEBUG
          LOG_FINER(boost::format("%1% <HEAD %2%> <STATUS %3%>")
@@ -948,4 +1279,108 @@ vector<shared_ptr<response> > multiPostForm(
       return unescaped;
    }
 
+/*************************************************************
+ * asynchronous client
+ *
+ * the client is just a multi engine which is driven by the
+ * caller, with callbacks which get the response or a null
+ * pointer.
+ *
+ *************************************************************/
+
+struct async_client::impl : public multi_engine
+{
+   // adapts the result of a transfer for the client's callback, which
+   // gets a null response if the transfer failed.
+   static void call_back(const async_client::callback_t &callback, const response_or_error_t &result)
+   {
+      shared_ptr<response> resp;
+      try
+      {
+         resp = boost::apply_visitor(response_or_error_visitor(), result);
+      }
+      catch (const std::exception &e)
+      {
+         LOG_WARNING(boost::format("Asynchronous request failed: %1%") % e.what());
+      }
+
+      try
+      {
+         callback(resp);
+      }
+      catch (const std::exception &e)
+      {
+         LOG_ERROR(boost::format("Error in asynchronous request callback: %1%") % e.what());
+      }
+   }
+};
+
+async_client::async_client()
+   : m_impl(new impl())
+{
+}
+
+async_client::~async_client()
+{
+}
+
+async_client::request_id async_client::get(const string &url,
+                                            const headers_t &headers,
+                                            const callback_t &callback,
+                                            long connect_timeout)
+{
+   shared_ptr<curl_oper> oper(new curl_get(shared_ptr<CURL>(), url, headers, false, 0, connect_timeout));
+   return m_impl->start(oper, boost::bind(&impl::call_back, callback, _1));
+}
+
+async_client::request_id async_client::head(const string &url,
+                                             const headers_t &headers,
+                                             const callback_t &callback,
+                                             long connect_timeout)
+{
+   shared_ptr<curl_oper> oper(new curl_head(shared_ptr<CURL>(), url, headers, false, 0, connect_timeout));
+   return m_impl->start(oper, boost::bind(&impl::call_back, callback, _1));
+}
+
+async_client::request_id async_client::post_form(const string &url,
+                                                  const vector<part> &parts,
+                                                  const headers_t &headers,
+                                                  const callback_t &callback,
+                                                  long connect_timeout)
+{
+   shared_ptr<curl_oper> oper(new curl_post_form(shared_ptr<CURL>(), url, parts, headers, false, false));
+   curl_easy_setopt(oper->m_curl.get(), CURLOPT_CONNECTTIMEOUT_MS, connect_timeout);
+   return m_impl->start(oper, boost::bind(&impl::call_back, callback, _1));
+}
+
+async_client::request_id async_client::after(long timeout, const boost::function<void ()> &callback)
+{
+   return m_impl->after(timeout, callback);
+}
+
+void async_client::cancel(request_id id)
+{
+   m_impl->cancel(id);
+}
+
+int async_client::fd() const
+{
+   return m_impl->m_epoll_fd;
+}
+
+void async_client::perform()
+{
+   m_impl->perform();
+}
+
+void async_client::wait(long timeout)
+{
+   m_impl->wait(timeout);
+}
+
+size_t async_client::in_flight() const
+{
+   return m_impl->in_flight();
+}
+
 } // namespace http
@@ -32,6 +32,9 @@
 #include <memory>
 #include <curl/curl.h>
 #include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/utility.hpp>
 
 namespace http
 {
@@ -62,7 +65,11 @@ typedef std::vector<std::string> headers_t;
 
    };
 
-   // create a curl handle to use as a persistent connection
+   // create a curl handle to use as a persistent connection. this is
+   // rarely needed, as the functions below all take a handle from the
+   // shared connection_pool (see connection_pool.hpp) for the URL's
+   // host when they aren't given a connection. the multi* functions
+   // use the connection they're given for the first request only.
    curl_ptr createPersistentConnection();
 
 // perform HTTP get, returning the response
@@ -90,6 +97,11 @@ boost::shared_ptr<response> postForm(
    const bool& keepHeaders = false, 
    const bool& submit = false);
 
+// the multi* functions below run up to `concurrency' transfers at once
+// and block until they're all finished. they use the same epoll-driven
+// engine as the async_client, with one engine kept for each thread so
+// that its connections stay open between calls.
+
 // perform HTTP multi-post, returning the responses in the same order as the requests.
 // each request is a pair<string, string> of the URL and the data to post.
 std::vector<boost::shared_ptr<response> > multiPost(
@@ -126,6 +138,91 @@ std::vector<boost::shared_ptr<response> > multiGet(
    boost::shared_ptr<response> head(const std::string &url,
       curl_ptr connection = curl_ptr(), const headers_t& headers = headers_t(), const bool& keepHeaders = false);
 
+   /* asynchronous HTTP client, which keeps many transfers in flight at
+    * once without blocking the caller.
+    *
+    * requests are started with get() and the callback is called when
+    * the transfer is finished. nothing happens unless perform() is
+    * called, which should be done whenever fd() becomes readable, so
+    * that the client can be driven from a zmq::poll or select loop
+    * alongside other sockets. internally this uses curl_multi's socket
+    * interface with an epoll set and a timerfd for curl's timeouts, so
+    * the cost of each call doesn't grow with the number of transfers.
+    *
+    * handles come from the shared connection_pool, and connections are
+    * cached in the multi handle and re-used between transfers to the
+    * same host.
+    *
+    * the client isn't thread safe - it's intended to be used from a
+    * single event loop.
+    */
+   class async_client : private boost::noncopyable
+   {
+   public:
+      // called with the response, or with a null pointer if the
+      // transfer failed, for example because the host couldn't be
+      // reached.
+      typedef boost::function<void (boost::shared_ptr<response>)> callback_t;
+
+      // identifies a request or timer, so that it can be cancelled.
+      typedef unsigned long request_id;
+
+      async_client();
+      ~async_client();
+
+      // start an HTTP GET. the callback may be called from within
+      // perform() or wait(), but never from within this function.
+      request_id get(const std::string &url,
+                     const headers_t &headers,
+                     const callback_t &callback,
+                     long connect_timeout = 0L);
+
+      // start an HTTP HEAD, in the same way as get(). the response
+      // has the status and timestamp, but no body.
+      request_id head(const std::string &url,
+                      const headers_t &headers,
+                      const callback_t &callback,
+                      long connect_timeout = 0L);
+
+      // start an HTTP POST of a multipart form, in the same way as
+      // get(). the data which the parts point to has to stay valid
+      // until the callback has been called.
+      request_id post_form(const std::string &url,
+                           const std::vector<part> &parts,
+                           const headers_t &headers,
+                           const callback_t &callback,
+                           long connect_timeout = 0L);
+
+      // call the function from within perform() or wait() once
+      // timeout milliseconds have passed.
+      request_id after(long timeout, const boost::function<void ()> &callback);
+
+      // stop a request or timer, so that its callback is never
+      // called. ids which have already called back are ignored, so
+      // it's safe for one callback to cancel another.
+      void cancel(request_id id);
+
+      // file descriptor which is readable when perform() has work to
+      // do.
+      int fd() const;
+
+      // process any socket activity and timeouts without blocking,
+      // calling callbacks for all transfers which have finished.
+      void perform();
+
+      // wait for up to timeout milliseconds for activity, then
+      // perform(). a negative timeout waits indefinitely.
+      void wait(long timeout);
+
+      // number of transfers and timers which have been started but
+      // haven't yet had their callbacks called.
+      size_t in_flight() const;
+
+   private:
+      struct impl;
+      boost::scoped_ptr<impl> m_impl;
+   };
+
    // escape a string into "URL-encoded" RFC2396 compliant string
    std::string escape_url(const std::string &url,
       curl_ptr connection = curl_ptr());
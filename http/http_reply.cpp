@@ -96,12 +96,21 @@ void send_tile(zmq::socket_t & socket, http_date_formatter const& frmt,
                std::string const& uuid, std::string const& id ,
                unsigned max_age , std::time_t last_modified, std::time_t expire_time,
                std::string const& data, const std::string &mime_type)
+{
+   send_tile(socket, frmt, uuid, id, max_age, last_modified, expire_time,
+             data.data(), data.size(), mime_type);
+}
+
+void send_tile(zmq::socket_t & socket, http_date_formatter const& frmt,
+               std::string const& uuid, std::string const& id ,
+               unsigned max_age , std::time_t last_modified, std::time_t expire_time,
+               const char *data, size_t size, const std::string &mime_type)
 {
    std::ostringstream http;
    http << uuid << " " << id.size() << ":" << id << ", ";
    http << "HTTP/1.1" << " " << 200 << " " << "OK" << "\r\n";
    http << "Content-Type: " << mime_type << "\r\n";
-   http << "Content-Length: " << data.length()  << "\r\n";
+   http << "Content-Length: " << size  << "\r\n";
    http << "Cache-Control: max-age=" << max_age << "\r\n";
    http << "Edge-Control: downstream-ttl=" << max_age << "\r\n";
    http << "Last-Modified: ";
@@ -112,10 +121,12 @@ void send_tile(zmq::socket_t & socket, http_date_formatter const& frmt,
    http << "\r\n";
    http << "Server: " SERVER "\r\n";
    http << "Access-Control-Allow-Origin: *\r\n\r\n";
-   http << data;
+   // mongrel wants the whole response in one message, so the data has
+   // to be copied in after the headers, but that's the only copy.
    std::string s = http.str();
-   zmq::message_t msg(s.length()); 
+   zmq::message_t msg(s.length() + size); 
    std::memcpy(msg.data(),s.c_str(),s.length());
+   std::memcpy(static_cast<char *>(msg.data()) + s.length(),data,size);
    socket.send(msg);    
 }
 
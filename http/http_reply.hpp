@@ -77,6 +77,19 @@ void send_tile(zmq::socket_t & socket,
                std::string const& data,
                const std::string &mime_type);
 
+// as above, but with the tile data given as a pointer and size, so that
+// it can be sent straight from wherever it's held.
+void send_tile(zmq::socket_t & socket, 
+               http_date_formatter const& frmt,
+               std::string const& uuid, 
+               std::string const& id ,
+               unsigned max_age , 
+               std::time_t last_modified, 
+               std::time_t expire_time,
+               const char *data,
+               size_t size,
+               const std::string &mime_type);
+
 // sends a tile, but omits the Last-Modified and cache-related 
 // headers.
 void send_tile(zmq::socket_t & socket, 
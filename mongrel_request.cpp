@@ -75,4 +75,18 @@ bool mongrel_request::if_modified_since(std::time_t modified) const
     return true;
 }
 
+std::time_t mongrel_request::if_modified_since() const
+{
+    cont_type::const_iterator itr = headers_.find("if-modified-since");
+    if (itr != headers_.end())
+    {
+        std::time_t time;
+        if (parse_http_date(time, itr->second))
+        {
+            return time;
+        }
+    }
+    return 0;
+}
+
 }
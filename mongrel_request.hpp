@@ -56,6 +56,9 @@ public:
     
     bool is_disconnect() const;
     bool if_modified_since(std::time_t modified) const;
+    // the time in the If-Modified-Since header, or zero if there
+    // isn't one or it can't be parsed.
+    std::time_t if_modified_since() const;
     
 private:
     std::string uuid_;
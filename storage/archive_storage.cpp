@@ -0,0 +1,193 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: artem@mapnik-consulting.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "archive_storage.hpp"
+#include "meta_tile.hpp"
+#include "null_handle.hpp"
+#include "probe_handle.hpp"
+#include "data_handle.hpp"
+#include "../logging/logger.hpp"
+
+#include <boost/algorithm/string.hpp>
+#include <boost/format.hpp>
+#include <boost/foreach.hpp>
+#include <stdexcept>
+#include <algorithm>
+
+using std::string;
+using std::vector;
+using std::map;
+using boost::shared_ptr;
+
+namespace rendermq {
+
+namespace {
+
+tile_storage * create_archive_storage(boost::property_tree::ptree const& pt,
+                                      boost::optional<zmq::context_t &> ctx) {
+  vector<string> files;
+  boost::split(files, pt.get<string>("files", ""), boost::is_any_of(", "), boost::token_compress_on);
+  files.erase(std::remove(files.begin(), files.end(), string()), files.end());
+  if (files.empty()) {
+    LOG_ERROR("Archive storage needs a list of archive files.");
+    return 0;
+  }
+
+  try {
+    return new archive_storage(files, pt.get<bool>("mmap", true));
+  } catch (const std::exception &e) {
+    LOG_ERROR(boost::format("Unable to set up archive storage: %1%") % e.what());
+  }
+  return 0;
+}
+
+const bool registered = register_tile_storage("archive", create_archive_storage);
+
+shared_ptr<tile_storage::handle> missing() {
+  return shared_ptr<tile_storage::handle>(new null_handle());
+}
+
+} // anonymous namespace
+
+archive_storage::archive_storage(const vector<string> &files, bool use_mmap) {
+  BOOST_FOREACH(const string &file, files) {
+    shared_ptr<tile_archive> archive(new tile_archive(file, use_mmap));
+    LOG_INFO(boost::format("Serving %1% metatiles of style %2%, zoom %3% to %4%, from %5%.")
+             % archive->size() % archive->style() % archive->min_zoom() % archive->max_zoom() % file);
+    archives_[archive->style()].push_back(archive);
+  }
+}
+
+archive_storage::~archive_storage() {
+}
+
+shared_ptr<tile_storage::handle>
+archive_storage::get(const tile_protocol &tile) const {
+  archive_entry entry;
+  shared_ptr<tile_archive> archive = find(tile, entry);
+  uint64_t offset = 0;
+  size_t size = 0;
+  if (!archive || !find_tile(*archive, entry, tile, offset, size)) {
+    return missing();
+  }
+
+  // a mapped archive hands out views of the tile, which keep the
+  // archive open for as long as they're in use.
+  const char *ptr = archive->mapped(offset, size);
+  if (ptr != NULL) {
+    return shared_ptr<tile_storage::handle>(
+      new data_handle(entry.mtime, entry.mtime == 0, tile_data(archive, ptr, size)));
+  }
+
+  string data(size, '\0');
+  if (!archive->read(offset, size, &data[0])) {
+    LOG_ERROR(boost::format("Unable to read %1% from %2%.") % tile % archive->file());
+    return missing();
+  }
+  return shared_ptr<tile_storage::handle>(new data_handle(entry.mtime, entry.mtime == 0, data));
+}
+
+shared_ptr<tile_storage::handle>
+archive_storage::probe(const tile_protocol &tile) const {
+  archive_entry entry;
+  shared_ptr<tile_archive> archive = find(tile, entry);
+  uint64_t offset = 0;
+  size_t size = 0;
+  if (!archive || !find_tile(*archive, entry, tile, offset, size)) {
+    return missing();
+  }
+  return shared_ptr<tile_storage::handle>(new probe_handle(true, entry.mtime, entry.mtime == 0));
+}
+
+bool
+archive_storage::get_meta(const tile_protocol &tile, string &data) const {
+  archive_entry entry;
+  shared_ptr<tile_archive> archive = find(tile, entry);
+  // as with disk storage, expired metatiles aren't returned.
+  if (!archive || entry.mtime == 0) {
+    return false;
+  }
+
+  data.resize(entry.size);
+  return (entry.size == 0) || archive->read(entry.offset, entry.size, &data[0]);
+}
+
+bool
+archive_storage::put_meta(const tile_protocol &tile, const string &) const {
+  LOG_ERROR(boost::format("Can't save %1%, archive storage is read-only.") % tile);
+  return false;
+}
+
+bool
+archive_storage::expire(const tile_protocol &) const {
+  return false;
+}
+
+shared_ptr<tile_archive>
+archive_storage::find(const tile_protocol &tile, archive_entry &entry) const {
+  map<string, archives_t>::const_iterator itr = archives_.find(tile.style);
+  if (itr == archives_.end()) {
+    return shared_ptr<tile_archive>();
+  }
+
+  // the first archive with the metatile wins.
+  for (archives_t::const_iterator jtr = itr->second.begin(); jtr != itr->second.end(); ++jtr) {
+    if ((*jtr)->find(tile.z, tile.x, tile.y, entry)) {
+      return *jtr;
+    }
+  }
+  return shared_ptr<tile_archive>();
+}
+
+bool
+archive_storage::find_tile(const tile_archive &archive, const archive_entry &entry,
+                           const tile_protocol &tile, uint64_t &offset, size_t &size) const {
+  // the headers are at the start of the metatile, and are read from the
+  // mapping in place when there is one.
+  uint64_t buf[512];
+  const size_t header_size = std::min(size_t(entry.size), sizeof(buf));
+  const char *header = archive.mapped(entry.offset, header_size);
+  if (header == NULL) {
+    if (!archive.read(entry.offset, header_size, (char *)buf)) {
+      return false;
+    }
+    header = (const char *)buf;
+  }
+
+  const meta_layout *m = find_meta_layout(header, header_size, tile.format, archive.file().c_str());
+  if (m == NULL) {
+    return false;
+  }
+
+  const struct entry &e = m->index[xyz_to_meta_offset(tile.x, tile.y, tile.z)];
+  if (e.size <= 0 || e.offset < 0 || uint64_t(e.offset) + e.size > entry.size) {
+    return false;
+  }
+  offset = entry.offset + e.offset;
+  size = e.size;
+  return true;
+}
+
+}
@@ -0,0 +1,77 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: artem@mapnik-consulting.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef RENDERMQ_ARCHIVE_STORAGE_HPP
+#define RENDERMQ_ARCHIVE_STORAGE_HPP
+
+#include "tile_storage.hpp"
+#include "tile_archive.hpp"
+#include <boost/shared_ptr.hpp>
+#include <string>
+#include <vector>
+#include <map>
+
+namespace rendermq {
+
+/* read-only storage serving metatiles from tile archives, see
+ * tile_archive.hpp, which are built with the archive_tiles tool.
+ *
+ * each archive holds one style, and a style can be split between
+ * several archives, for example by zoom level. finding a tile is a
+ * binary search of an index, and with the archives memory mapped there
+ * are no system calls at all on the way.
+ *
+ * archives never change, so putting or expiring metatiles fails. to
+ * serve updates on top of an archive, put it in a union with storage
+ * which can be written to.
+ */
+class archive_storage : public tile_storage {
+public:
+  // throws std::runtime_error if any of the archives can't be opened.
+  archive_storage(const std::vector<std::string> &files, bool use_mmap);
+  ~archive_storage();
+
+  boost::shared_ptr<tile_storage::handle> get(const tile_protocol &tile) const;
+  boost::shared_ptr<tile_storage::handle> probe(const tile_protocol &tile) const;
+  bool get_meta(const tile_protocol &tile, std::string &) const;
+  bool put_meta(const tile_protocol &tile, const std::string &buf) const;
+  bool expire(const tile_protocol &tile) const;
+
+private:
+  // find the archive and entry of the metatile which the tile is in.
+  boost::shared_ptr<tile_archive> find(const tile_protocol &tile, archive_entry &entry) const;
+
+  // find the tile's data in the metatile, returning false if it isn't
+  // there. the offset is from the start of the archive.
+  bool find_tile(const tile_archive &archive, const archive_entry &entry,
+                 const tile_protocol &tile, uint64_t &offset, size_t &size) const;
+
+  typedef std::vector<boost::shared_ptr<tile_archive> > archives_t;
+  std::map<std::string, archives_t> archives_;
+};
+
+}
+
+#endif // RENDERMQ_ARCHIVE_STORAGE_HPP
@@ -36,6 +36,7 @@
 
 #include <boost/foreach.hpp>
 #include <boost/format.hpp>
+#include <boost/bind.hpp>
 
 using boost::shared_ptr;
 using std::string;
@@ -161,6 +162,26 @@ make_subtree(const bt::ptree &pt, boost::optional<zmq::context_t &> ctx, const s
    }
 }
 
+// the under and over storage, in that order, for the fan-out.
+rendermq::fan_out::storages_t input_storages(shared_ptr<rendermq::tile_storage> under,
+                                             shared_ptr<rendermq::tile_storage> over)
+{
+   rendermq::fan_out::storages_t storages;
+   storages.push_back(under);
+   storages.push_back(over);
+   return storages;
+}
+
+// the timeouts for the under and over storage, in that order.
+vector<long> input_timeouts(const bt::ptree &config)
+{
+   const long timeout = config.get<long>("timeout", DEFAULT_FAN_OUT_TIMEOUT);
+   vector<long> timeouts;
+   timeouts.push_back(config.get<long>("under_timeout", timeout));
+   timeouts.push_back(config.get<long>("over_timeout", timeout));
+   return timeouts;
+}
+
 rendermq::tile_storage *create_compositing_storage(const bt::ptree &pt,
                                                    boost::optional<zmq::context_t &> ctx)
 {
@@ -188,7 +209,8 @@ compositing_storage::compositing_storage(boost::shared_ptr<tile_storage> under,
    : m_under_storage(under), m_over_storage(over), m_config(config), 
      m_under_style(m_config.get_optional<string>("under_style")),
      m_over_style(m_config.get_optional<string>("over_style")),
-     m_generate_format(fmtNone)
+     m_generate_format(fmtNone),
+     m_fan_out(input_storages(under, over), input_timeouts(config))
 {
    m_under_format = get_format_for(m_config.get<string>("under_format"));
    m_over_format  = get_format_for(m_config.get<string>("over_format"));
@@ -241,6 +263,135 @@ compositing_storage::get(const tile_protocol &tile) const
       return shared_ptr<tile_storage::handle>(new null_handle());
    }
 
+   // try and get both tiles at once
+   vector<shared_ptr<tile_storage::handle> > handles;
+   m_fan_out.get_each(input_tiles_for(tile), false, handles);
+   return combine_handles(tile, handles);
+}
+
+void
+compositing_storage::get_async(const tile_protocol &tile, const get_callback &callback) const
+{
+   if (!can_generate_formats(tile.format))
+   {
+      LOG_FINER(boost::format("Cannot generate format for tile %1% "
+                              "when configured formats are %2%.")
+                % tile % m_generate_format);
+      callback(shared_ptr<tile_storage::handle>(new null_handle()));
+      return;
+   }
+
+   m_fan_out.get_each_async(input_tiles_for(tile), false,
+                            boost::bind(&compositing_storage::handle_inputs, this, tile, callback, _1));
+}
+
+void
+compositing_storage::handle_inputs(const tile_protocol &tile, const get_callback &callback,
+                                   const vector<shared_ptr<tile_storage::handle> > &handles) const
+{
+   callback(combine_handles(tile, handles));
+}
+
+void
+compositing_storage::async_fds(std::vector<int> &fds) const
+{
+   m_fan_out.async_fds(fds);
+}
+
+void
+compositing_storage::async_perform() const
+{
+   m_fan_out.async_perform();
+}
+
+vector<tile_protocol>
+compositing_storage::input_tiles_for(const tile_protocol &tile) const
+{
+   vector<tile_protocol> tiles;
+   tiles.push_back(under_tile_for(tile));
+   tiles.push_back(over_tile_for(tile));
+   return tiles;
+}
+
+shared_ptr<tile_storage::handle>
+compositing_storage::combine_handles(const tile_protocol &tile,
+                                     const vector<shared_ptr<tile_storage::handle> > &handles) const
+{
+   shared_ptr<tile_storage::handle> under_handle = handles[0], over_handle = handles[1];
+   if (!under_handle->exists())
+   {
+      // under tile doesn't exist - return a null(ish) tile
+      LOG_FINER(boost::format("Under tile %1% does not exist.") % under_tile_for(tile));
+      return under_handle;
+   }
+   else if (!over_handle->exists())
+   {
+      // over tile doesn't exist - we need both to exist, so
+      // return the null-ish tile.
+      LOG_FINER(boost::format("Over tile %1% does not exist.") % over_tile_for(tile));
+      return over_handle;
+   }
+   return composite_handles(tile, under_handle, over_handle);
+}
+
+void
+compositing_storage::get_multi(const vector<tile_protocol> &tiles,
+                               vector<shared_ptr<tile_storage::handle> > &handles) const
+{
+   handles.assign(tiles.size(), shared_ptr<tile_storage::handle>(new null_handle()));
+
+   // get all the under tiles in one batch, for the tiles which can
+   // be generated at all.
+   vector<size_t> indexes;
+   vector<tile_protocol> batch;
+   for (size_t i = 0; i < tiles.size(); ++i)
+   {
+      if (can_generate_formats(tiles[i].format))
+      {
+         indexes.push_back(i);
+         batch.push_back(under_tile_for(tiles[i]));
+      }
+   }
+   vector<shared_ptr<tile_storage::handle> > under_handles;
+   m_under_storage->get_multi(batch, under_handles);
+
+   // then all the over tiles which have an under tile to go with
+   // them in another batch.
+   vector<size_t> over_indexes;
+   batch.clear();
+   for (size_t j = 0; j < indexes.size(); ++j)
+   {
+      if (under_handles[j]->exists())
+      {
+         over_indexes.push_back(j);
+         batch.push_back(over_tile_for(tiles[indexes[j]]));
+      }
+      else
+      {
+         handles[indexes[j]] = under_handles[j];
+      }
+   }
+   vector<shared_ptr<tile_storage::handle> > over_handles;
+   m_over_storage->get_multi(batch, over_handles);
+
+   for (size_t k = 0; k < over_indexes.size(); ++k)
+   {
+      const size_t j = over_indexes[k];
+      const size_t i = indexes[j];
+      if (over_handles[k]->exists())
+      {
+         handles[i] = composite_handles(tiles[i], under_handles[j], over_handles[k]);
+      }
+      else
+      {
+         handles[i] = over_handles[k];
+      }
+   }
+}
+
+tile_protocol
+compositing_storage::under_tile_for(const tile_protocol &tile) const
+{
    // modify the requests to set the format type that is 
    // configured - this may well be different from the
    // input type, as it's almost certainly the case that
@@ -249,73 +400,63 @@ compositing_storage::get(const tile_protocol &tile) const
    tile_protocol under_tile(tile); 
    under_tile.format = m_under_format;
    if (m_under_style) { under_tile.style = m_under_style.get(); }
+   return under_tile;
+}
 
+tile_protocol
+compositing_storage::over_tile_for(const tile_protocol &tile) const
+{
    tile_protocol over_tile(tile);  
    over_tile.format = m_over_format;
    if (m_over_style) { over_tile.style = m_over_style.get(); }
+   return over_tile;
+}
 
-   // try and get the tiles
-   shared_ptr<tile_storage::handle> under_handle = m_under_storage->get(under_tile);
-   if (under_handle->exists())
+shared_ptr<tile_storage::handle>
+compositing_storage::composite_handles(const tile_protocol &tile,
+                                       shared_ptr<tile_storage::handle> under_handle,
+                                       shared_ptr<tile_storage::handle> over_handle) const
+{
+   // get the maximum last-modified time - this is to be
+   // conservative about the time so that updates to either 
+   // input may be presented to the client. for example, if
+   // one layer is relatively static over some period and 
+   // gets updated, then the last-modified will reflect 
+   // that and clients will not get 304s. for this to work
+   // properly, the timestamps on updated layers must be
+   // the time at which they were available for compositing.
+   // if the time is back-dated (to when they were generated
+   // perhaps) then expiry won't work correctly.
+   std::time_t last_mod = std::max(under_handle->last_modified(),
+                                   over_handle->last_modified());
+
+   // tile is expired if *either* of the input tiles are 
+   // expired. this is also conservative - don't want to be
+   // assuming some stuff is fresh when it potentially isn't.
+   bool expired = under_handle->expired() || over_handle->expired();
+
+   // extract the data from the tiles
+   string under_data, over_data, result_data;
+   bool data_ok = (under_handle->data(under_data) && 
+                   over_handle->data(over_data));
+   if (data_ok) 
    {
-      shared_ptr<tile_storage::handle> over_handle = m_over_storage->get(over_tile);
-      if (over_handle->exists())
-      {
-         // get the maximum last-modified time - this is to be
-         // conservative about the time so that updates to either 
-         // input may be presented to the client. for example, if
-         // one layer is relatively static over some period and 
-         // gets updated, then the last-modified will reflect 
-         // that and clients will not get 304s. for this to work
-         // properly, the timestamps on updated layers must be
-         // the time at which they were available for compositing.
-         // if the time is back-dated (to when they were generated
-         // perhaps) then expiry won't work correctly.
-         std::time_t last_mod = std::max(under_handle->last_modified(),
-                                         over_handle->last_modified());
-
-         // tile is expired if *either* of the input tiles are 
-         // expired. this is also conservative - don't want to be
-         // assuming some stuff is fresh when it potentially isn't.
-         bool expired = under_handle->expired() || over_handle->expired();
-
-         // extract the data from the tiles
-         string under_data, over_data, result_data;
-         bool data_ok = (under_handle->data(under_data) && 
-                         over_handle->data(over_data));
-         if (data_ok) 
-         {
-            data_ok = composite(under_data, m_under_format,
-                                over_data, m_over_format,
-                                result_data, tile.format,
-                                m_config);
-         }
-
-         if (data_ok)
-         {
-            // return a composited tile.
-            return shared_ptr<tile_storage::handle>(new composite_handle(last_mod, expired, result_data));
-         }
-         else
-         {
-            // return a null tile 
-            LOG_ERROR(boost::format("Unable to composite image for tile %1%.") % tile);
-            return shared_ptr<tile_storage::handle>(new null_handle());
-         }
-      }
-      else
-      {
-         // over tile doesn't exist - we need both to exist, so
-         // return the null-ish tile.
-         LOG_FINER(boost::format("Over tile %1% does not exist.") % over_tile);
-         return over_handle;
-      }
+      data_ok = composite(under_data, m_under_format,
+                          over_data, m_over_format,
+                          result_data, tile.format,
+                          m_config);
+   }
+
+   if (data_ok)
+   {
+      // return a composited tile.
+      return shared_ptr<tile_storage::handle>(new composite_handle(last_mod, expired, result_data));
    }
    else
    {
-      // under tile doesn't exist - return a null(ish) tile
-      LOG_FINER(boost::format("Under tile %1% does not exist.") % under_tile);
-      return under_handle;
+      // return a null tile 
+      LOG_ERROR(boost::format("Unable to composite image for tile %1%.") % tile);
+      return shared_ptr<tile_storage::handle>(new null_handle());
    }
 }
 
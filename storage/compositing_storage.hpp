@@ -32,6 +32,7 @@
 #include <list>
 #include <boost/shared_ptr.hpp>
 #include "tile_storage.hpp"
+#include "fan_out.hpp"
 
 namespace rendermq 
 {
@@ -42,6 +43,10 @@ namespace rendermq
  * This means that this storage object is unable to write new results.
  * It can, however, deal with expiries via configurable behaviour to
  * expire one or other (or both) of the input tiles.
+ *
+ * The under and over tiles are fetched at the same time, each with
+ * its own timeout, set by under_timeout and over_timeout in the
+ * config, or timeout for both.
  */
 class compositing_storage 
    : public tile_storage 
@@ -61,6 +66,17 @@ public:
    boost::shared_ptr<tile_storage::handle> get(const tile_protocol &tile) const;
    bool get_meta(const tile_protocol &, std::string &) const;
 
+   // the same as get(), with the event sources of both storages
+   // passed through.
+   void get_async(const tile_protocol &tile, const get_callback &callback) const;
+   void async_fds(std::vector<int> &fds) const;
+   void async_perform() const;
+
+   // gets all the under tiles in one batch, then the over tiles
+   // in another, before compositing them.
+   void get_multi(const std::vector<tile_protocol> &tiles,
+                  std::vector<boost::shared_ptr<tile_storage::handle> > &handles) const;
+
    // always fails - there is no way to store to this "storage" type
    bool put_meta(const tile_protocol &tile, const std::string &buf) const;
 
@@ -84,9 +100,33 @@ private:
    // over storage.
    protoFmt m_generate_format, m_under_format, m_over_format;
 
+   // gets the under and over tiles at the same time.
+   fan_out m_fan_out;
+
    // checks if the formats requested are a strict subset
    // of those available.
    bool can_generate_formats(protoFmt formats) const;
+
+   // the tiles to ask the under and over storages for.
+   tile_protocol under_tile_for(const tile_protocol &tile) const;
+   tile_protocol over_tile_for(const tile_protocol &tile) const;
+
+   // the under and over tiles to get for a tile.
+   std::vector<tile_protocol> input_tiles_for(const tile_protocol &tile) const;
+
+   // the result for a tile given the under and over handles, which
+   // is whichever doesn't exist if either doesn't.
+   boost::shared_ptr<tile_storage::handle>
+   combine_handles(const tile_protocol &tile,
+                   const std::vector<boost::shared_ptr<tile_storage::handle> > &handles) const;
+   void handle_inputs(const tile_protocol &tile, const get_callback &callback,
+                      const std::vector<boost::shared_ptr<tile_storage::handle> > &handles) const;
+
+   // composite the data from two tiles which both exist.
+   boost::shared_ptr<tile_storage::handle>
+   composite_handles(const tile_protocol &tile,
+                     boost::shared_ptr<tile_storage::handle> under_handle,
+                     boost::shared_ptr<tile_storage::handle> over_handle) const;
 };
 
 }
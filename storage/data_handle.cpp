@@ -0,0 +1,75 @@
+/*------------------------------------------------------------------------------
+ *
+ * Data handle - a handle which owns a copy of the tile's data.
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2011 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "data_handle.hpp"
+
+namespace rendermq {
+
+using std::time_t;
+using std::string;
+
+data_handle::data_handle(time_t last_modified, bool expired, string &data)
+   : m_last_modified(last_modified), m_expired(expired),
+     m_data(tile_data::adopt(data))
+{
+}
+
+data_handle::data_handle(time_t last_modified, bool expired, const tile_data &data)
+   : m_last_modified(last_modified), m_expired(expired), m_data(data)
+{
+}
+
+data_handle::~data_handle()
+{
+}
+
+bool data_handle::exists() const
+{
+   return true;
+}
+
+time_t data_handle::last_modified() const
+{
+   return m_last_modified;
+}
+
+bool data_handle::data(string &output) const 
+{
+   output.assign(m_data.data(), m_data.size());
+   return true;
+}
+
+bool data_handle::payload(tile_data &output) const
+{
+   output = m_data;
+   return true;
+}
+
+bool data_handle::expired() const 
+{
+   return m_expired;
+}
+
+}
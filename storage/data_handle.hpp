@@ -0,0 +1,66 @@
+/*------------------------------------------------------------------------------
+ *
+ * Data handle - a handle which owns a copy of the tile's data.
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2011 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef RENDERMQ_DATA_HANDLE_HPP
+#define RENDERMQ_DATA_HANDLE_HPP
+
+#include <string>
+#include <ctime>
+#include "tile_storage.hpp"
+
+namespace rendermq {
+
+/* Data handle owns a copy of the tile's data, along with its
+ * metadata. This is what storage classes return when the data has
+ * been read before the handle is made, for example from a batch of
+ * reads, so that the handle doesn't depend on any state in the
+ * storage object. The data can also be a view of a buffer which the
+ * storage shares, such as a mapped metatile, which payload() hands
+ * on without copying.
+ */
+class data_handle : public tile_storage::handle 
+{
+public:
+   // the data is swapped out of the given string, rather than copied.
+   data_handle(std::time_t last_modified, bool expired, std::string &data);
+   // the data is shared with the view, rather than copied.
+   data_handle(std::time_t last_modified, bool expired, const tile_data &data);
+   ~data_handle();
+
+   virtual bool exists() const;
+   virtual std::time_t last_modified() const;
+   virtual bool data(std::string &) const;
+   virtual bool payload(tile_data &) const;
+   virtual bool expired() const;
+
+private:
+   std::time_t m_last_modified;
+   bool m_expired;
+   tile_data m_data;
+};
+
+}
+
+#endif // RENDERMQ_DATA_HANDLE_HPP
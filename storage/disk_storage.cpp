@@ -27,23 +27,49 @@
 #include "disk_storage.hpp"
 #include "../logging/logger.hpp"
 #include "null_handle.hpp"
-
+#include "probe_handle.hpp"
+#include "data_handle.hpp"
+
+// posix
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <climits>
+#include <cstring>
 // stl
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <map>
+#include <algorithm>
 // boost
 #define BOOST_FILESYSTEM_VERSION 3
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/operations.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/format.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/ref.hpp>
+
+// batches of at least this many tiles for each thread are split up
+// between several threads, up to the maximum.
+#define BATCH_THREAD_SIZE (64)
+#define MAX_BATCH_THREADS (4)
+
+// metatiles kept open between reads, and how often, in milliseconds,
+// to check that they haven't been replaced by another process.
+#define DEFAULT_MAX_OPEN_FILES (128)
+#define DEFAULT_REVALIDATE (0L)
 
 using std::string;
 using std::time_t;
 using std::runtime_error;
 using std::cerr;
 using std::pair;
+using std::vector;
+using std::map;
 using boost::shared_ptr;
 namespace fs = boost::filesystem;
 
@@ -57,76 +83,366 @@ tile_storage * create_disk_storage(boost::property_tree::ptree const& pt,
     boost::optional<string> tile_cache_dir = pt.get_optional<string>("tile_dir");
     if ( tile_cache_dir )
     {
-        return new disk_storage(*tile_cache_dir);
+        size_t max_open_files = pt.get<size_t>("max_open_files", DEFAULT_MAX_OPEN_FILES);
+        long revalidate = pt.get<long>("revalidate", DEFAULT_REVALIDATE);
+        string io_engine = pt.get<string>("io_engine", DEFAULT_IO_ENGINE);
+        size_t io_depth = pt.get<size_t>("io_depth", DEFAULT_IO_DEPTH);
+        size_t io_threads = pt.get<size_t>("io_threads", DEFAULT_IO_THREADS);
+        bool use_mmap = pt.get<bool>("mmap", true);
+
+        // the writer is shared with all the other storage using the
+        // directory, so that their writes are put in order.
+        shared_ptr<meta_writer> writer;
+        size_t write_threads = pt.get<size_t>("write_threads", 0);
+        if (write_threads > 0) {
+          try {
+            writer = meta_writer::shared(*tile_cache_dir, write_threads,
+                                         pt.get<size_t>("write_queue", DEFAULT_WRITE_QUEUE),
+                                         pt.get<string>("write_sync", DEFAULT_WRITE_SYNC),
+                                         pt.get<size_t>("write_batch", DEFAULT_WRITE_BATCH));
+          } catch (const std::exception &e) {
+            LOG_ERROR(boost::format("Unable to set up disk storage writer: %1%") % e.what());
+            return 0;
+          }
+        }
+
+        // a budget for the directory makes it a cache, shared with all
+        // the other storage using it.
+        shared_ptr<meta_cache_index> cache;
+        uint64_t cache_size = pt.get<uint64_t>("cache_size", 0);
+        if (cache_size > 0) {
+          cache = meta_cache_index::shared(*tile_cache_dir, cache_size,
+                                           pt.get<long>("cache_log_interval", DEFAULT_CACHE_LOG_INTERVAL));
+        }
+
+        return new disk_storage(*tile_cache_dir, max_open_files, revalidate,
+                                io_engine, io_depth, io_threads, use_mmap, writer, cache);
     }
     return 0;
 }
 
 const bool registered = register_tile_storage("disk",create_disk_storage);
 
-} // anonymous namespace
+// a tile in a batch, along with the metatile it's in.
+struct batch_entry {
+  string path;
+  int offset;
+  size_t index;
+};
 
-disk_storage::handle::handle(std::time_t t, size_t s, const disk_storage &p)
-  : timestamp(t), size(s), parent(p) {
-  parent.data_locked = true;
+bool operator<(const batch_entry &a, const batch_entry &b) {
+  return a.path < b.path;
 }
 
-disk_storage::handle::~handle() {
-  parent.data_locked = false;
-}
+typedef vector<batch_entry>::const_iterator batch_iterator;
 
-bool 
-disk_storage::handle::exists() const {
+// read the whole of a range of a file, even if it comes back in
+// pieces.
+bool pread_fully(int fd, char *buf, size_t size, off_t offset) {
+  while (size > 0) {
+    ssize_t got = pread(fd, buf, size, offset);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      return false;
+    }
+    buf += got;
+    size -= got;
+    offset += got;
+  }
   return true;
 }
 
-std::time_t 
-disk_storage::handle::last_modified() const {
-  return timestamp;
+// the mapping of the whole of the open metatile, mapping it if this
+// is the first time it's needed.
+shared_ptr<const meta_mapping> map_file(const meta_file_cache::file &f) {
+  if (!f.map) {
+    f.map = meta_mapping::create(f.fd, f.size);
+  }
+  return f.map;
 }
 
-bool
-disk_storage::handle::expired() const {
-  // on disk we consider something expired if it's timestamp is before
-  // the planet_timestamp. but since we don't have that, we'll just take
-  // the epoch.
-  return last_modified() == 0;
+// a handle for the tile at the entry of the open file. if the file is
+// mapped then the handle's data is a view of the mapping, otherwise
+// it's read. returns null if the tile can't be read.
+shared_ptr<tile_storage::handle> tile_handle(int fd, time_t t, const shared_ptr<const meta_mapping> &map,
+                                             const entry &e) {
+  if (map && e.offset >= 0 && size_t(e.offset) + e.size <= map->size()) {
+    return shared_ptr<tile_storage::handle>(
+      new data_handle(t, t == 0, tile_data(map, map->data() + e.offset, e.size)));
+  }
+
+  string data(e.size, '\0');
+  if (pread_fully(fd, &data[0], e.size, e.offset)) {
+    return shared_ptr<tile_storage::handle>(new data_handle(t, t == 0, data));
+  }
+  return shared_ptr<tile_storage::handle>();
 }
 
-bool
-disk_storage::handle::data(string &output) const {
-  output.assign((const char *)parent.data_cache.data(), size);
-  return true;
+// read all the tiles in [begin, end), which are all in the same
+// metatile, from the open file and the header read from the start of
+// it, or from the mapping of it if there is one. tiles which can't be
+// read keep the null handles they started with.
+void read_tiles(int fd, time_t t, const char *header, size_t header_size,
+                const shared_ptr<const meta_mapping> &map,
+                batch_iterator begin, batch_iterator end,
+                const vector<tile_protocol> &tiles, bool with_data,
+                vector<shared_ptr<tile_storage::handle> > &handles) {
+  for (batch_iterator itr = begin; itr != end; ++itr) {
+    const meta_layout *m = find_meta_layout(header, header_size, tiles[itr->index].format, itr->path.c_str());
+    if (m == NULL || m->index[itr->offset].size <= 0) {
+      continue;
+    }
+
+    if (!with_data) {
+      handles[itr->index].reset(new probe_handle(true, t, t == 0));
+      continue;
+    }
+
+    shared_ptr<tile_storage::handle> h = tile_handle(fd, t, map, m->index[itr->offset]);
+    if (h) {
+      handles[itr->index] = h;
+    }
+  }
+}
+
+// read all the tiles in [begin, end), which are all in the same
+// metatile, opening it only once.
+void read_metatile(batch_iterator begin, batch_iterator end,
+                   const vector<tile_protocol> &tiles, bool with_data,
+                   vector<shared_ptr<tile_storage::handle> > &handles) {
+  int fd = open(begin->path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+
+  struct stat st;
+  char header[META_HEADER_READ_SIZE];
+  ssize_t got = -1;
+  if (fstat(fd, &st) == 0) {
+    got = pread(fd, header, sizeof(header), 0);
+  }
+
+  if (got > 0) {
+    read_tiles(fd, st.st_mtime, header, got, shared_ptr<const meta_mapping>(),
+               begin, end, tiles, with_data, handles);
+  }
+
+  close(fd);
+}
+
+// read all the tiles in [begin, end), which is sorted by metatile.
+void read_metatiles(batch_iterator begin, batch_iterator end,
+                    const vector<tile_protocol> &tiles, bool with_data,
+                    vector<shared_ptr<tile_storage::handle> > &handles) {
+  while (begin != end) {
+    batch_iterator next = begin;
+    while (next != end && next->path == begin->path) {
+      ++next;
+    }
+    read_metatile(begin, next, tiles, with_data, handles);
+    begin = next;
+  }
+}
+
+shared_ptr<tile_storage::handle> missing() {
+  return shared_ptr<tile_storage::handle>(new null_handle());
+}
+
+// a handle for the tile in a metatile which is waiting to be written,
+// sharing its data.
+shared_ptr<tile_storage::handle> pending_tile(const meta_writer::metatile &m, int format, int offset,
+                                              const char *path, bool with_data) {
+  const string &data = *m.data;
+  const meta_layout *l = find_meta_layout(data.data(), data.size(), format, path);
+  if (l == NULL || l->index[offset].size <= 0) {
+    return missing();
+  }
+  const entry &e = l->index[offset];
+  if (e.offset < 0 || size_t(e.offset) + e.size > data.size()) {
+    return missing();
+  }
+  if (!with_data) {
+    return shared_ptr<tile_storage::handle>(new probe_handle(true, m.mtime, m.mtime == 0));
+  }
+  return shared_ptr<tile_storage::handle>(
+    new data_handle(m.mtime, m.mtime == 0, tile_data(m.data, data.data() + e.offset, e.size)));
+}
+
+// pass the handle for a single tile read through the engine on to the
+// caller's callback.
+void single_tile(const tile_storage::get_callback &callback, size_t, shared_ptr<tile_storage::handle> handle) {
+  callback(handle);
+}
+
+// tell the cache index about a tile read through the engine before
+// passing it on.
+void cached_tile(const shared_ptr<meta_cache_index> &cache, const tile_protocol &tile,
+                 const tile_storage::get_callback &callback, shared_ptr<tile_storage::handle> handle) {
+  cache->accessed(tile, handle->exists());
+  callback(handle);
+}
+
+void cached_meta(const shared_ptr<meta_cache_index> &cache, const tile_protocol &tile,
+                 const tile_storage::get_meta_callback &callback, bool ok, const string &data) {
+  cache->accessed(tile, ok);
+  callback(ok, data);
+}
+
+// put the handle for a tile in a batch in its place.
+void batch_tile(vector<shared_ptr<tile_storage::handle> > *handles, size_t *remaining,
+                size_t index, shared_ptr<tile_storage::handle> handle) {
+  (*handles)[index] = handle;
+  --(*remaining);
+}
+
+// called by the writer once a metatile has been written, or not.
+void written(const shared_ptr<meta_cache_index> &cache, const tile_protocol &tile,
+             size_t size, bool ok) {
+  if (ok) {
+    cache->added(tile, size);
+  } else {
+    cache->abandoned(tile);
+  }
 }
 
+} // anonymous namespace
+
+struct disk_storage::meta_read {
+  // a tile to read from the metatile.
+  struct part {
+    size_t index;
+    int format;
+    int offset;
+    string data;
+  };
+
+  meta_read() : with_data(true), whole(false), keep(false), reading(0) {
+    f.fd = -1;
+  }
+
+  ~meta_read() {
+    if (f.fd >= 0) {
+      close(f.fd);
+    }
+  }
+
+  string path;
+  meta_file_cache::file f;
+  // whether to read the tiles' data, or just find whether they exist.
+  bool with_data;
+  vector<part> parts;
+  // called once for each part, with the index of the part.
+  boost::function<void (size_t, shared_ptr<tile_storage::handle>)> done;
+  // if set, the whole metatile is read into data rather than the parts.
+  bool whole;
+  string data;
+  get_meta_callback meta_done;
+  // whether the metatile was opened for this read, and should be given
+  // to the cache of open files afterwards.
+  bool keep;
+  size_t reading;
+};
+
 disk_storage::disk_storage(string const& dir)
-  : dir_(dir), data_locked(false)  {}
+  : dir_(dir), files_(DEFAULT_MAX_OPEN_FILES, DEFAULT_REVALIDATE),
+    io_engine_type_(DEFAULT_IO_ENGINE), io_depth_(DEFAULT_IO_DEPTH),
+    io_threads_(DEFAULT_IO_THREADS), engine_failed_(false),
+    use_mmap_(true)  {}
+
+disk_storage::disk_storage(string const& dir, size_t max_open_files, long revalidate,
+                           const string &io_engine, size_t io_depth, size_t io_threads,
+                           bool use_mmap, const shared_ptr<meta_writer> &writer,
+                           const shared_ptr<meta_cache_index> &cache)
+  : dir_(dir), files_(max_open_files, revalidate),
+    io_engine_type_(io_engine), io_depth_(io_depth), io_threads_(io_threads),
+    engine_failed_(io_engine == "none"), use_mmap_(use_mmap), writer_(writer),
+    cache_(cache)  {}
 
 disk_storage::~disk_storage() {}
 
+const meta_file_cache::file *
+disk_storage::open_meta(const tile_protocol &tile, char *path, size_t size, int &offset,
+                        shared_ptr<const meta_writer::metatile> &pending_meta) const {
+  offset = xyz_to_meta_path(path, size, dir_, tile.x, tile.y, tile.z, tile.style);
+  if (offset < 0) {
+    LOG_ERROR(boost::format("Metatile path for %1% is too long.") % tile);
+    return NULL;
+  }
+  pending_meta = pending(path);
+  if (pending_meta) {
+    return NULL;
+  }
+  return files_.open(path);
+}
+
+shared_ptr<const meta_writer::metatile>
+disk_storage::pending(const char *path) const {
+  return writer_ ? writer_->find(path) : shared_ptr<const meta_writer::metatile>();
+}
+
+void
+disk_storage::invalidate(const tile_protocol &tile) const {
+  char path[PATH_MAX];
+  if (xyz_to_meta_path(path, sizeof(path), dir_, tile.x, tile.y, tile.z, tile.style) >= 0) {
+    files_.invalidate(path);
+  }
+}
+
 shared_ptr<tile_storage::handle> 
 disk_storage::get(const tile_protocol &tile) const {
-  if (data_locked) {
-    throw runtime_error("Multiple use of disk_storage::data_cache not allowed.");
+  shared_ptr<tile_storage::handle> h = read(tile);
+  if (cache_) {
+    cache_->accessed(tile, h->exists());
   }
+  return h;
+}
 
-  pair<string, int> foo = xyz_to_meta(dir_, tile.x, tile.y, tile.z, tile.style);
-  try {
-    fs::path p(foo.first);
-
-    if (fs::exists(p)) {
-      std::time_t t = fs::last_write_time(p);
-      int ret = read_from_meta(dir_, tile.x, tile.y, tile.z, tile.style, 
-                               data_cache.c_array(), data_cache.size(), 
-                               tile.format);
-      
-      if (ret > 0) {
-        return shared_ptr<tile_storage::handle>(new handle(t, ret, *this));
+shared_ptr<tile_storage::handle>
+disk_storage::read(const tile_protocol &tile) const {
+  char path[PATH_MAX];
+  int offset = 0;
+  shared_ptr<const meta_writer::metatile> p;
+  const meta_file_cache::file *f = open_meta(tile, path, sizeof(path), offset, p);
+  if (p) {
+    return pending_tile(*p, tile.format, offset, path, true);
+  }
+  if (f != NULL) {
+    const meta_layout *m = find_meta_layout(f->header, f->header_size, tile.format, path);
+    if (m != NULL && m->index[offset].size > 0) {
+      shared_ptr<const meta_mapping> map;
+      if (use_mmap_) {
+        map = map_file(*f);
+      }
+      shared_ptr<tile_storage::handle> h = tile_handle(f->fd, f->mtime, map, m->index[offset]);
+      if (h) {
+        return h;
       }
+      // the metatile is shorter than its header says, so don't keep it.
+      files_.invalidate(path);
     }
+  }
 
-  } catch (const fs::filesystem_error &e) {
-     LOG_ERROR(boost::format("Filesystem error: %1%") % e.what());
+  return shared_ptr<tile_storage::handle>(new null_handle());
+}
+
+shared_ptr<tile_storage::handle> 
+disk_storage::probe(const tile_protocol &tile) const {
+  // only the metatile header is needed, so this doesn't map it.
+  char path[PATH_MAX];
+  int offset = 0;
+  shared_ptr<const meta_writer::metatile> p;
+  const meta_file_cache::file *f = open_meta(tile, path, sizeof(path), offset, p);
+  if (p) {
+    return pending_tile(*p, tile.format, offset, path, false);
+  }
+  if (f != NULL) {
+    const meta_layout *m = find_meta_layout(f->header, f->header_size, tile.format, path);
+    if (m != NULL && m->index[offset].size > 0) {
+      const std::time_t t = f->mtime;
+      return shared_ptr<tile_storage::handle>(new probe_handle(true, t, t == 0));
+    }
   }
 
   return shared_ptr<tile_storage::handle>(new null_handle());
@@ -134,35 +450,68 @@ disk_storage::get(const tile_protocol &tile) const {
 
 bool 
 disk_storage::get_meta(const tile_protocol &tile, std::string &data) const {
-  pair<string, int> foo = xyz_to_meta(dir_, tile.x, tile.y, tile.z, tile.style);
-  try {
-    fs::path p(foo.first);
+  const bool ok = read_meta(tile, data);
+  if (cache_) {
+    cache_->accessed(tile, ok);
+  }
+  return ok;
+}
 
-    if (fs::exists(p) && fs::is_regular_file(p)) {
-      // if its expired we signal as such
-      std::time_t t = fs::last_write_time(p);
-      if(t == 0)
-         return false;
-      uintmax_t size = fs::file_size(p);
-      fs::ifstream in(p);
-      data.resize(size);
-      // ooh, evil. cast away the const...
-      in.read((char *)data.data(), size);
-      return bool(in);
+bool
+disk_storage::read_meta(const tile_protocol &tile, std::string &data) const {
+  char path[PATH_MAX];
+  int offset = 0;
+  shared_ptr<const meta_writer::metatile> p;
+  const meta_file_cache::file *f = open_meta(tile, path, sizeof(path), offset, p);
+  if (p) {
+    if (p->mtime == 0) {
+      return false;
     }
-  } catch (const fs::filesystem_error &e) {
-     LOG_ERROR(boost::format("Filesystem error: %1%") % e.what());
+    data = *p->data;
+    return true;
+  }
+  // if its expired we signal as such
+  if (f == NULL || f->mtime == 0) {
+    return false;
   }
 
-  return false;
+  // copy from the mapping if a tile has already been read through it,
+  // but a whole metatile is copied anyway, so isn't worth mapping.
+  if (f->map) {
+    data.assign(f->map->data(), f->map->size());
+    return true;
+  }
+
+  data.resize(f->size);
+  if (f->size > 0 && !pread_fully(f->fd, &data[0], f->size, 0)) {
+    files_.invalidate(path);
+    return false;
+  }
+  return true;
 }
 
 bool 
 disk_storage::put_meta(const tile_protocol &tile, const std::string &buf) const {
   pair<string, int> foo = xyz_to_meta(dir_, tile.x, tile.y, tile.z, tile.style);
 
-  if (foo.second == 0) {
+  if (foo.second == 0 && writer_) {
+    // written in the background, and read from the writer's queue
+    // until then.
+    if (cache_) {
+      // it's only in the cache once it's on disk.
+      cache_->adding(tile);
+      writer_->put(foo.first, buf, boost::bind(&written, cache_, tile, buf.size(), _1));
+    } else {
+      writer_->put(foo.first, buf);
+    }
+    invalidate(tile);
+    return true;
+
+  } else if (foo.second == 0) {
     fs::path tmp = fs::path(dir_) / fs::unique_path();
+    if (cache_) {
+      cache_->adding(tile);
+    }
 
     try {
       fs::path p(foo.first);
@@ -177,12 +526,19 @@ disk_storage::put_meta(const tile_protocol &tile, const std::string &buf) const
 
       // now copy that file atomically into position
       fs::rename(tmp, p);
+      invalidate(tile);
+      if (cache_) {
+        cache_->added(tile, buf.size());
+      }
 
       return true;
 
     } catch (const fs::filesystem_error &e) {
        LOG_ERROR(boost::format("Filesystem error: %1%") % e.what());
     }
+    if (cache_) {
+      cache_->abandoned(tile);
+    }
 
   } else {
 #ifdef RENDERMQ_DEBUG
@@ -195,6 +551,11 @@ disk_storage::put_meta(const tile_protocol &tile, const std::string &buf) const
 bool 
 disk_storage::expire(const tile_protocol &tile) const {
   pair<string, int> foo = xyz_to_meta(dir_, tile.x, tile.y, tile.z, tile.style);
+  if (writer_ && writer_->expire(foo.first)) {
+    invalidate(tile);
+    return true;
+  }
+
   try {
     fs::path p(foo.first);
     
@@ -202,6 +563,7 @@ disk_storage::expire(const tile_protocol &tile) const {
       // indicate that a tile has expired by setting its time to the 
       // unix epoch. it's not perfect, but things very rarely are.
       fs::last_write_time(p, std::time_t(0));
+      invalidate(tile);
 
       return true;
     }
@@ -213,5 +575,399 @@ disk_storage::expire(const tile_protocol &tile) const {
   return false;
 }
 
+void
+disk_storage::get_multi(const vector<tile_protocol> &tiles,
+                        vector<shared_ptr<tile_storage::handle> > &handles) const {
+  read_multi(tiles, true, handles);
+  if (cache_) {
+    for (size_t i = 0; i < tiles.size(); ++i) {
+      cache_->accessed(tiles[i], handles[i]->exists());
+    }
+  }
+}
+
+void
+disk_storage::probe_multi(const vector<tile_protocol> &tiles,
+                          vector<shared_ptr<tile_storage::handle> > &handles) const {
+  read_multi(tiles, false, handles);
+}
+
+void
+disk_storage::read_multi(const vector<tile_protocol> &tiles, bool with_data,
+                         vector<shared_ptr<tile_storage::handle> > &handles) const {
+  // the handles start off as not existing, and are filled in as the
+  // tiles are found. they're all null, so they can share a handle.
+  handles.assign(tiles.size(), shared_ptr<tile_storage::handle>(new null_handle()));
+
+  // sort the tiles by metatile, which puts tiles in the same metatile
+  // together and reads the metatiles in directory order.
+  vector<batch_entry> entries(tiles.size());
+  for (size_t i = 0; i < tiles.size(); ++i) {
+    const tile_protocol &tile = tiles[i];
+    pair<string, int> meta = xyz_to_meta(dir_, tile.x, tile.y, tile.z, tile.style);
+    entries[i].path.swap(meta.first);
+    entries[i].offset = meta.second;
+    entries[i].index = i;
+  }
+
+  // metatiles waiting to be written are read from the writer's queue.
+  if (writer_) {
+    vector<batch_entry>::iterator out = entries.begin();
+    for (vector<batch_entry>::iterator itr = entries.begin(); itr != entries.end(); ++itr) {
+      shared_ptr<const meta_writer::metatile> p = pending(itr->path.c_str());
+      if (p) {
+        handles[itr->index] = pending_tile(*p, tiles[itr->index].format, itr->offset,
+                                           itr->path.c_str(), with_data);
+      } else {
+        *out++ = *itr;
+      }
+    }
+    entries.erase(out, entries.end());
+  }
+  std::sort(entries.begin(), entries.end());
+
+  // with an engine, all the metatiles are read at once, and this just
+  // waits for them.
+  io_engine *e = engine();
+  if (e != NULL) {
+    size_t remaining = entries.size();
+    batch_iterator begin = entries.begin();
+    while (begin != entries.end()) {
+      meta_read_ptr r(new meta_read);
+      r->path = begin->path;
+      r->with_data = with_data;
+      r->done = boost::bind(&batch_tile, &handles, &remaining, _1, _2);
+      for (; begin != entries.end() && begin->path == r->path; ++begin) {
+        meta_read::part p;
+        p.index = begin->index;
+        p.format = tiles[begin->index].format;
+        p.offset = begin->offset;
+        r->parts.push_back(p);
+      }
+      start_read(r);
+    }
+    while (remaining > 0) {
+      e->wait();
+    }
+    return;
+  }
+
+  const size_t num_threads = std::min(size_t(MAX_BATCH_THREADS), entries.size() / BATCH_THREAD_SIZE);
+  if (num_threads < 2) {
+    // small batches are read in this thread, so can use the open
+    // metatiles.
+    batch_iterator begin = entries.begin();
+    while (begin != entries.end()) {
+      batch_iterator next = begin;
+      while (next != entries.end() && next->path == begin->path) {
+        ++next;
+      }
+      const meta_file_cache::file *f = files_.open(begin->path.c_str());
+      if (f != NULL) {
+        shared_ptr<const meta_mapping> map;
+        if (use_mmap_ && with_data) {
+          map = map_file(*f);
+        }
+        read_tiles(f->fd, f->mtime, f->header, f->header_size, map, begin, next, tiles, with_data, handles);
+      }
+      begin = next;
+    }
+    return;
+  }
+
+  // give each thread a similar number of tiles, but don't split a
+  // metatile between threads. each thread writes to different handles,
+  // so they don't need any locking.
+  boost::thread_group threads;
+  batch_iterator begin = entries.begin();
+  for (size_t n = 1; n <= num_threads; ++n) {
+    batch_iterator end = entries.begin() + (entries.size() * n / num_threads);
+    if (end < begin) {
+      end = begin;
+    }
+    while (end != entries.end() && end != entries.begin() && end->path == (end - 1)->path) {
+      ++end;
+    }
+    if (begin != end) {
+      threads.create_thread(boost::bind(&read_metatiles, begin, end, boost::cref(tiles),
+                                        with_data, boost::ref(handles)));
+    }
+    begin = end;
+  }
+  threads.join_all();
+}
+
+void
+disk_storage::expire_multi(const vector<tile_protocol> &tiles,
+                           vector<bool> &results) const {
+  // tiles in the same metatile only need it expiring once.
+  map<string, bool> expired;
+  results.clear();
+  results.reserve(tiles.size());
+  for (vector<tile_protocol>::const_iterator itr = tiles.begin(); itr != tiles.end(); ++itr) {
+    string path = xyz_to_meta(dir_, itr->x, itr->y, itr->z, itr->style).first;
+    map<string, bool>::iterator jtr = expired.find(path);
+    if (jtr == expired.end()) {
+      jtr = expired.insert(make_pair(path, expire(*itr))).first;
+    }
+    results.push_back(jtr->second);
+  }
+}
+
+io_engine *
+disk_storage::engine() const {
+  if (!engine_ && !engine_failed_) {
+    engine_.reset(io_engine::create(io_engine_type_, io_depth_, io_threads_));
+    if (engine_) {
+      LOG_DEBUG(boost::format("Disk storage for %1% reading with %2%.") % dir_ % engine_->name());
+    } else {
+      LOG_ERROR(boost::format("Disk storage for %1% can't make an I/O engine, reading without one.") % dir_);
+      engine_failed_ = true;
+    }
+  }
+  return engine_.get();
+}
+
+void
+disk_storage::get_async(const tile_protocol &tile, const get_callback &callback) const {
+  io_engine *e = engine();
+  meta_read_ptr r = e ? make_read(tile) : meta_read_ptr();
+  if (!r || pending(r->path.c_str())) {
+    tile_storage::get_async(tile, callback);
+    return;
+  }
+  if (cache_) {
+    r->done = boost::bind(&single_tile, get_callback(boost::bind(&cached_tile, cache_, tile, callback, _1)), _1, _2);
+  } else {
+    r->done = boost::bind(&single_tile, callback, _1, _2);
+  }
+  start_read(r);
+  e->submit();
+}
+
+void
+disk_storage::probe_async(const tile_protocol &tile, const get_callback &callback) const {
+  io_engine *e = engine();
+  meta_read_ptr r = e ? make_read(tile) : meta_read_ptr();
+  if (!r || pending(r->path.c_str())) {
+    tile_storage::probe_async(tile, callback);
+    return;
+  }
+  r->with_data = false;
+  r->done = boost::bind(&single_tile, callback, _1, _2);
+  start_read(r);
+  e->submit();
+}
+
+void
+disk_storage::get_meta_async(const tile_protocol &tile, const get_meta_callback &callback) const {
+  io_engine *e = engine();
+  meta_read_ptr r = e ? make_read(tile) : meta_read_ptr();
+  if (!r || pending(r->path.c_str())) {
+    tile_storage::get_meta_async(tile, callback);
+    return;
+  }
+  r->whole = true;
+  r->parts.clear();
+  if (cache_) {
+    r->meta_done = boost::bind(&cached_meta, cache_, tile, callback, _1, _2);
+  } else {
+    r->meta_done = callback;
+  }
+  start_read(r);
+  e->submit();
+}
+
+void
+disk_storage::async_fds(vector<int> &fds) const {
+  io_engine *e = engine();
+  if (e != NULL) {
+    fds.push_back(e->fd());
+  }
+}
+
+void
+disk_storage::async_perform() const {
+  if (engine_) {
+    engine_->perform();
+  }
+}
+
+meta_cache_index::stats
+disk_storage::get_cache_stats() const {
+  return cache_ ? cache_->get_stats() : meta_cache_index::stats();
+}
+
+disk_storage::meta_read_ptr
+disk_storage::make_read(const tile_protocol &tile) const {
+  char path[PATH_MAX];
+  meta_read::part p;
+  p.offset = xyz_to_meta_path(path, sizeof(path), dir_, tile.x, tile.y, tile.z, tile.style);
+  if (p.offset < 0) {
+    return meta_read_ptr();
+  }
+  p.index = 0;
+  p.format = tile.format;
+
+  meta_read_ptr r(new meta_read);
+  r->path.assign(path);
+  r->parts.push_back(p);
+  return r;
+}
+
+void
+disk_storage::start_read(meta_read_ptr r) const {
+  // a metatile which is already open still has its header, so only the
+  // tiles need reading. the cache may close its file before the reads
+  // finish, so they use a copy of it.
+  const meta_file_cache::file *cached = files_.lookup(r->path.c_str());
+  if (cached != NULL) {
+    r->f = *cached;
+    r->f.fd = dup(cached->fd);
+    if (r->f.fd >= 0) {
+      read_parts(r);
+      return;
+    }
+  }
+
+  engine_->open(r->path.c_str(), boost::bind(&disk_storage::read_opened, this, r, _1));
 }
 
+void
+disk_storage::read_opened(meta_read_ptr r, int result) const {
+  if (result < 0) {
+    read_failed(r);
+    return;
+  }
+  r->f.fd = result;
+
+  // the inode is in memory once the file is open, so this doesn't wait
+  // for the disk.
+  struct stat st;
+  if (fstat(r->f.fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    read_failed(r);
+    return;
+  }
+  r->f.mtime = st.st_mtime;
+  r->f.size = st.st_size;
+  r->f.dev = st.st_dev;
+  r->f.ino = st.st_ino;
+  r->keep = true;
+
+  if (r->whole) {
+    read_parts(r);
+    return;
+  }
+  engine_->read(r->f.fd, r->f.header, sizeof(r->f.header), 0,
+                boost::bind(&disk_storage::read_header, this, r, _1));
+}
+
+void
+disk_storage::read_header(meta_read_ptr r, int result) const {
+  if (result < 0) {
+    read_failed(r);
+    return;
+  }
+  r->f.header_size = result;
+  read_parts(r);
+}
+
+void
+disk_storage::read_parts(meta_read_ptr r) const {
+  if (r->whole) {
+    // as get_meta(), expired metatiles aren't returned.
+    if (r->f.mtime == 0) {
+      read_failed(r);
+      return;
+    }
+    r->data.resize(r->f.size);
+    if (r->f.size == 0) {
+      read_whole(r, 0);
+      return;
+    }
+    engine_->read(r->f.fd, &r->data[0], r->f.size, 0,
+                  boost::bind(&disk_storage::read_whole, this, r, _1));
+    return;
+  }
+
+  const time_t t = r->f.mtime;
+  // hold off finishing until all the reads have been started.
+  r->reading = 1;
+  for (size_t i = 0; i < r->parts.size(); ++i) {
+    meta_read::part &p = r->parts[i];
+    const meta_layout *m = find_meta_layout(r->f.header, r->f.header_size, p.format, r->path.c_str());
+    if (m == NULL || m->index[p.offset].size <= 0) {
+      r->done(p.index, missing());
+      continue;
+    }
+
+    if (!r->with_data) {
+      r->done(p.index, shared_ptr<tile_storage::handle>(new probe_handle(true, t, t == 0)));
+      continue;
+    }
+
+    const entry &e = m->index[p.offset];
+    p.data.resize(e.size);
+    ++r->reading;
+    engine_->read(r->f.fd, &p.data[0], e.size, e.offset,
+                  boost::bind(&disk_storage::read_tile, this, r, i, _1));
+  }
+
+  if (--r->reading == 0) {
+    read_finished(r);
+  }
+}
+
+void
+disk_storage::read_tile(meta_read_ptr r, size_t i, int result) const {
+  meta_read::part &p = r->parts[i];
+  if (result >= 0 && size_t(result) == p.data.size()) {
+    const time_t t = r->f.mtime;
+    r->done(p.index, shared_ptr<tile_storage::handle>(new data_handle(t, t == 0, p.data)));
+  } else {
+    // the metatile is shorter than its header says, so don't keep it.
+    r->keep = false;
+    r->done(p.index, missing());
+  }
+
+  if (--r->reading == 0) {
+    read_finished(r);
+  }
+}
+
+void
+disk_storage::read_whole(meta_read_ptr r, int result) const {
+  if (result < 0 || off_t(result) != r->f.size) {
+    read_failed(r);
+    return;
+  }
+
+  // the start of the metatile is its header, so it can be kept open
+  // for reading tiles from later.
+  r->f.header_size = std::min(r->data.size(), sizeof(r->f.header));
+  memcpy(r->f.header, r->data.data(), r->f.header_size);
+  r->meta_done(true, r->data);
+  read_finished(r);
+}
+
+void
+disk_storage::read_failed(meta_read_ptr r) const {
+  r->keep = false;
+  if (r->whole) {
+    r->meta_done(false, string());
+  } else {
+    for (size_t i = 0; i < r->parts.size(); ++i) {
+      r->done(r->parts[i].index, missing());
+    }
+  }
+}
+
+void
+disk_storage::read_finished(meta_read_ptr r) const {
+  if (r->keep && r->f.fd >= 0) {
+    files_.insert(r->path.c_str(), r->f);
+    r->f.fd = -1;
+  }
+}
+
+}
@@ -26,45 +26,132 @@
 #ifndef RENDERMQ_DISK_STORAGE_HPP
 #define RENDERMQ_DISK_STORAGE_HPP
 
-#include <boost/array.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <string>
 #include <ctime>
 #include "tile_storage.hpp"
+#include "meta_file_cache.hpp"
+#include "io_engine.hpp"
+#include "meta_writer.hpp"
+#include "meta_cache_index.hpp"
 
 namespace rendermq {
 
 class disk_storage : public tile_storage {
 public:
-  typedef boost::array<unsigned char,1024*1024> tile_data;
-
-  class handle : public tile_storage::handle {
-  public:
-    handle(std::time_t, size_t, const disk_storage &);
-    virtual ~handle();
-    virtual bool exists() const;
-    virtual std::time_t last_modified() const;
-    virtual bool data(std::string &) const;
-    virtual bool expired() const;
-  private:
-    std::time_t timestamp;
-    size_t size;
-    const disk_storage &parent;
-  };
-  friend class handle;
-
   disk_storage(std::string const& dir);
+  // @param max_open_files the most metatiles to keep open between reads.
+  // @param revalidate milliseconds after which an open metatile is
+  //          checked for having been replaced, see meta_file_cache.
+  // @param io_engine the type of engine used for batches and the
+  //          asynchronous calls, see io_engine::create(), or "none" to
+  //          use blocking reads for them.
+  // @param io_depth most reads the engine has outstanding at once.
+  // @param io_threads threads in the engine's pool, if it uses one.
+  // @param use_mmap whether get() returns tiles as views of a mapping
+  //          of the open metatile, rather than reading them.
+  // @param writer if not null, metatiles are put through this in the
+  //          background rather than written straight away. anything
+  //          else writing to the directory must use the same writer,
+  //          see meta_writer::shared().
+  // @param cache if not null, the directory is used as a cache, and
+  //          every read and put is reported to this index so that it
+  //          can keep the directory within its budget.
+  disk_storage(std::string const& dir, size_t max_open_files, long revalidate,
+               const std::string &io_engine = DEFAULT_IO_ENGINE,
+               size_t io_depth = DEFAULT_IO_DEPTH, size_t io_threads = DEFAULT_IO_THREADS,
+               bool use_mmap = true,
+               const boost::shared_ptr<meta_writer> &writer = boost::shared_ptr<meta_writer>(),
+               const boost::shared_ptr<meta_cache_index> &cache = boost::shared_ptr<meta_cache_index>());
   ~disk_storage();
   boost::shared_ptr<tile_storage::handle> get(const tile_protocol &tile) const;
+  boost::shared_ptr<tile_storage::handle> probe(const tile_protocol &tile) const;
   bool get_meta(const tile_protocol &, std::string &) const;
   bool put_meta(const tile_protocol &tile, const std::string &buf) const;
   bool expire(const tile_protocol &tile) const;
 
+  // batches are sorted by metatile, so that each metatile is only
+  // opened once, and large batches are read by several threads.
+  void get_multi(const std::vector<tile_protocol> &tiles,
+                 std::vector<boost::shared_ptr<tile_storage::handle> > &handles) const;
+  void probe_multi(const std::vector<tile_protocol> &tiles,
+                   std::vector<boost::shared_ptr<tile_storage::handle> > &handles) const;
+  void expire_multi(const std::vector<tile_protocol> &tiles,
+                    std::vector<bool> &results) const;
+
+  // reads through the I/O engine, so many can be outstanding at once.
+  void get_async(const tile_protocol &tile, const get_callback &callback) const;
+  void probe_async(const tile_protocol &tile, const get_callback &callback) const;
+  void get_meta_async(const tile_protocol &tile, const get_meta_callback &callback) const;
+  void async_fds(std::vector<int> &fds) const;
+  void async_perform() const;
+
+  // hits, misses and sizes for each zoom level, if the directory is
+  // used as a cache, otherwise all zero. reads by probe() aren't
+  // counted.
+  meta_cache_index::stats get_cache_stats() const;
+
 private:
+  // get() and get_meta(), without telling the cache index about them.
+  boost::shared_ptr<tile_storage::handle> read(const tile_protocol &tile) const;
+  bool read_meta(const tile_protocol &tile, std::string &data) const;
+
+  // a read of one metatile through the I/O engine.
+  struct meta_read;
+  typedef boost::shared_ptr<meta_read> meta_read_ptr;
+
+  // the engine, made the first time it's needed, or null if it can't
+  // be made.
+  io_engine *engine() const;
+
+  // a read of the metatile which the tile is in, or null if the path
+  // can't be made.
+  meta_read_ptr make_read(const tile_protocol &tile) const;
+
+  // the steps of a read through the engine: find or open the metatile,
+  // read its header, then read the tiles or the whole metatile.
+  void start_read(meta_read_ptr r) const;
+  void read_opened(meta_read_ptr r, int result) const;
+  void read_header(meta_read_ptr r, int result) const;
+  void read_parts(meta_read_ptr r) const;
+  void read_tile(meta_read_ptr r, size_t i, int result) const;
+  void read_whole(meta_read_ptr r, int result) const;
+  void read_failed(meta_read_ptr r) const;
+  void read_finished(meta_read_ptr r) const;
+
+
+  // read, or just probe, a batch of tiles.
+  void read_multi(const std::vector<tile_protocol> &tiles, bool with_data,
+                  std::vector<boost::shared_ptr<tile_storage::handle> > &handles) const;
+
+  // the open metatile which the tile is in, or null if there isn't
+  // one. the metatile's path is written into the path buffer and the
+  // offset of the tile within the metatile is put in offset. if the
+  // metatile is waiting to be written, it's put in pending instead.
+  const meta_file_cache::file *open_meta(const tile_protocol &tile, char *path, size_t size,
+                                         int &offset,
+                                         boost::shared_ptr<const meta_writer::metatile> &pending) const;
+
+  // the metatile waiting to be written to the path, if any.
+  boost::shared_ptr<const meta_writer::metatile> pending(const char *path) const;
+
+  // close the metatile which the tile is in after changing it.
+  void invalidate(const tile_protocol &tile) const;
 
   std::string dir_;
 
-  mutable bool data_locked;
-  mutable tile_data data_cache;
+  mutable meta_file_cache files_;
+
+  const std::string io_engine_type_;
+  const size_t io_depth_, io_threads_;
+  mutable boost::scoped_ptr<io_engine> engine_;
+  mutable bool engine_failed_;
+
+  const bool use_mmap_;
+
+  boost::shared_ptr<meta_writer> writer_;
+
+  boost::shared_ptr<meta_cache_index> cache_;
 };
 
 }
@@ -28,9 +28,11 @@
 #include "expiry_overlay.hpp"
 #include "tile_storage.hpp"
 #include <boost/foreach.hpp>
+#include <boost/bind.hpp>
 
 using boost::shared_ptr;
 using std::string;
+using std::vector;
 namespace pt = boost::property_tree;
 
 namespace 
@@ -57,6 +59,35 @@ private:
    bool m_expired;
 };
 
+/* an overlaid handle for an asynchronous get, whose parts can
+ * turn up in either order.
+ */
+struct pending_overlay
+{
+   pending_overlay(const rendermq::tile_storage::get_callback &cb)
+      : callback(cb), expired(false), have_handle(false), have_expired(false) {}
+
+   void finish()
+   {
+      if (have_handle && have_expired)
+      {
+         callback(shared_ptr<rendermq::tile_storage::handle>(new overlay_handle(handle, expired)));
+      }
+   }
+
+   rendermq::tile_storage::get_callback callback;
+   shared_ptr<rendermq::tile_storage::handle> handle;
+   bool expired, have_handle, have_expired;
+};
+
+void handle_overlay_get(shared_ptr<pending_overlay> pending, 
+                        shared_ptr<rendermq::tile_storage::handle> handle)
+{
+   pending->handle = handle;
+   pending->have_handle = true;
+   pending->finish();
+}
+
 rendermq::tile_storage *create_expiry_overlay(const pt::ptree &conf, 
                                               boost::optional<zmq::context_t &> ctx)
 {
@@ -126,8 +157,96 @@ expiry_overlay::~expiry_overlay()
 shared_ptr<tile_storage::handle> 
 expiry_overlay::get(const tile_protocol &tile) const
 {
-   bool expired = m_expiry->is_expired(tile);
-   return shared_ptr<tile_storage::handle>(new overlay_handle(m_storage->get(tile), expired));
+   return fetch(tile, false);
+}
+
+shared_ptr<tile_storage::handle> 
+expiry_overlay::probe(const tile_protocol &tile) const
+{
+   return fetch(tile, true);
+}
+
+shared_ptr<tile_storage::handle> 
+expiry_overlay::fetch(const tile_protocol &tile, bool probe) const
+{
+   shared_ptr<tile_storage::handle> handle;
+   m_expiry->start_is_expired(tile);
+   try
+   {
+      handle = probe ? m_storage->probe(tile) : m_storage->get(tile);
+   }
+   catch (...)
+   {
+      // the reply still has to be read before the service can be
+      // used again.
+      m_expiry->finish_is_expired(tile);
+      throw;
+   }
+   bool expired = m_expiry->finish_is_expired(tile);
+   return shared_ptr<tile_storage::handle>(new overlay_handle(handle, expired));
+}
+
+void
+expiry_overlay::get_async(const tile_protocol &tile, const get_callback &callback) const
+{
+   fetch_async(tile, false, callback);
+}
+
+void
+expiry_overlay::probe_async(const tile_protocol &tile, const get_callback &callback) const
+{
+   fetch_async(tile, true, callback);
+}
+
+void
+expiry_overlay::fetch_async(const tile_protocol &tile, bool probe, const get_callback &callback) const
+{
+   shared_ptr<pending_overlay> pending(new pending_overlay(callback));
+   m_expiry->start_is_expired(tile);
+   try
+   {
+      if (probe)
+      {
+         m_storage->probe_async(tile, boost::bind(&handle_overlay_get, pending, _1));
+      }
+      else
+      {
+         m_storage->get_async(tile, boost::bind(&handle_overlay_get, pending, _1));
+      }
+   }
+   catch (...)
+   {
+      m_expiry->finish_is_expired(tile);
+      throw;
+   }
+   pending->expired = m_expiry->finish_is_expired(tile);
+   pending->have_expired = true;
+   pending->finish();
+}
+
+void
+expiry_overlay::get_meta_async(const tile_protocol &tile, const get_meta_callback &callback) const
+{
+   m_storage->get_meta_async(tile, callback);
+}
+
+void
+expiry_overlay::put_meta_async(const tile_protocol &tile, const string &buf, const put_meta_callback &callback) const
+{
+   m_expiry->set_expired(tile, false);
+   m_storage->put_meta_async(tile, buf, callback);
+}
+
+void
+expiry_overlay::async_fds(std::vector<int> &fds) const
+{
+   m_storage->async_fds(fds);
+}
+
+void
+expiry_overlay::async_perform() const
+{
+   m_storage->async_perform();
 }
 
 bool 
@@ -149,4 +268,40 @@ expiry_overlay::expire(const tile_protocol &tile) const
    return m_expiry->set_expired(tile, true);
 }
 
+void
+expiry_overlay::get_multi(const vector<tile_protocol> &tiles,
+                          vector<shared_ptr<tile_storage::handle> > &handles) const
+{
+   m_storage->get_multi(tiles, handles);
+   overlay_multi(tiles, handles);
+}
+
+void
+expiry_overlay::probe_multi(const vector<tile_protocol> &tiles,
+                            vector<shared_ptr<tile_storage::handle> > &handles) const
+{
+   m_storage->probe_multi(tiles, handles);
+   overlay_multi(tiles, handles);
+}
+
+void
+expiry_overlay::overlay_multi(const vector<tile_protocol> &tiles,
+                              vector<shared_ptr<tile_storage::handle> > &handles) const
+{
+   vector<bool> expired;
+   m_expiry->is_expired(tiles, expired);
+
+   for (size_t i = 0; i < handles.size(); ++i)
+   {
+      handles[i].reset(new overlay_handle(handles[i], expired[i]));
+   }
+}
+
+void
+expiry_overlay::expire_multi(const vector<tile_protocol> &tiles,
+                             vector<bool> &results) const
+{
+   m_expiry->set_expired(tiles, true, results);
+}
+
 } // namespace rendermq
@@ -45,6 +45,11 @@ namespace rendermq
  * the expiry service is, we assume, capable of dealing
  * with the expiry information more efficiently than 
  * the underlying storage.
+ *
+ * the expiry service is asked about a tile before the tile
+ * is read from the underlying storage, and the answer is
+ * only waited for afterwards, so the two happen at the same
+ * time.
  */
 class expiry_overlay 
    : public tile_storage
@@ -60,6 +65,10 @@ public:
    // service.
    boost::shared_ptr<tile_storage::handle> get(const tile_protocol &tile) const;
 
+   // probe the underlying storage for the tile's existence, but
+   // take the expiry information from the expiry service.
+   boost::shared_ptr<tile_storage::handle> probe(const tile_protocol &tile) const;
+
    // get a metatile from the underlying storage.
    bool get_meta(const tile_protocol &, std::string &) const;
 
@@ -70,7 +79,35 @@ public:
    // update the expiry service with this information.
    bool expire(const tile_protocol &tile) const;
 
+   // asynchronous versions, driven by the underlying storage's
+   // event sources. the expiry service is still waited for before
+   // the call returns, while the underlying storage works.
+   void get_async(const tile_protocol &tile, const get_callback &callback) const;
+   void probe_async(const tile_protocol &tile, const get_callback &callback) const;
+   void get_meta_async(const tile_protocol &tile, const get_meta_callback &callback) const;
+   void put_meta_async(const tile_protocol &tile, const std::string &buf, const put_meta_callback &callback) const;
+   void async_fds(std::vector<int> &fds) const;
+   void async_perform() const;
+
+   // batches are passed to the underlying storage as a batch,
+   // and the expiry information for all of them is fetched
+   // from the expiry service in a single request.
+   void get_multi(const std::vector<tile_protocol> &tiles,
+                  std::vector<boost::shared_ptr<tile_storage::handle> > &handles) const;
+   void probe_multi(const std::vector<tile_protocol> &tiles,
+                    std::vector<boost::shared_ptr<tile_storage::handle> > &handles) const;
+   void expire_multi(const std::vector<tile_protocol> &tiles,
+                     std::vector<bool> &results) const;
+
 private:
+   // get or probe the tile while the expiry service is asked about it.
+   boost::shared_ptr<tile_storage::handle> fetch(const tile_protocol &tile, bool probe) const;
+   void fetch_async(const tile_protocol &tile, bool probe, const get_callback &callback) const;
+
+   // replace the expiry information in a batch of handles.
+   void overlay_multi(const std::vector<tile_protocol> &tiles,
+                      std::vector<boost::shared_ptr<tile_storage::handle> > &handles) const;
+
    boost::shared_ptr<tile_storage> m_storage;
    boost::shared_ptr<expiry_service> m_expiry;
 };
@@ -29,9 +29,13 @@
 #include "meta_tile.hpp"
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/optional.hpp>
 #include <google/sparse_hash_set>
+#include <endian.h>
+#include <cstring>
 #include <list>
 #include <map>
+#include <vector>
 
 #define HEARTBEAT (1000000)
 
@@ -45,6 +49,7 @@
 using std::string;
 using std::list;
 using std::map;
+using std::vector;
 using std::pair;
 using std::make_pair;
 using boost::shared_ptr;
@@ -272,6 +277,23 @@ struct expiry_server::expiry_data
       return true;
    }
 
+   // look up the tile, or set its status if there's a value.
+   bool handle(const tile_protocol &t, boost::optional<uint32_t> value)
+   {
+      if (!value)
+      {
+         return lookup(t);
+      }
+      else if (value.get() != 0)
+      {
+         return insert(t);
+      }
+      else
+      {
+         return erase(t);
+      }
+   }
+
    style_to_hash_t m_hash_sets;
 };
 
@@ -333,35 +355,76 @@ expiry_server::operator()()
          {
             // handle client request
             list<string> addresses;
-            tile_protocol tile;
-            bool response = false;
+            zmq::message_t first;
 
             manip::routing_headers headers(addresses);
             m_socket_frontend >> headers
-                              >> tile;
-            
-            if (m_socket_frontend.has_more())
+                              >> first;
+
+            if (first.size() == sizeof(uint32_t))
             {
-               // command to set the status of that tile
-               uint32_t value = 0;
-               m_socket_frontend >> value;
+               // a batch of tiles, preceded by the number of them
+               // and optionally followed by the value to set them
+               // all to. the reply has a byte for each tile.
+               uint32_t count = 0;
+               std::memcpy(&count, first.data(), sizeof(count));
+               count = be32toh(count);
+
+               vector<tile_protocol> tiles;
+               while ((tiles.size() < count) && m_socket_frontend.has_more())
+               {
+                  tiles.push_back(tile_protocol());
+                  m_socket_frontend >> tiles.back();
+               }
 
-               if (value != 0) 
+               boost::optional<uint32_t> value;
+               if (m_socket_frontend.has_more())
                {
-                  response = m_expired->insert(tile);
+                  uint32_t v = 0;
+                  m_socket_frontend >> v;
+                  value = v;
                }
-               else
+
+               string reply(tiles.size(), '\0');
+               for (size_t i = 0; i < tiles.size(); ++i)
                {
-                  response = m_expired->erase(tile);
+                  reply[i] = m_expired->handle(tiles[i], value) ? 1 : 0;
                }
+
+               m_socket_frontend.to(addresses) << reply;
             }
             else
             {
-               // was a query for the state of that tile
-               response = m_expired->lookup(tile);
-            }
+               tile_protocol tile;
+               bool payload_follows = false;
+               if (!unserialise_header(first.data(), first.size(), tile, &payload_follows))
+               {
+                  throw std::runtime_error("Can't deserialise tile from buffer!");
+               }
+
+               // the tile's data follows in its own part, unless it's
+               // from an older sender, but there isn't anything in it
+               // which is needed here.
+               if (payload_follows && m_socket_frontend.has_more())
+               {
+                  zmq::message_t payload;
+                  m_socket_frontend >> payload;
+               }
+
+               // if there's a value then it's a command to set the
+               // status of that tile, otherwise it was a query for
+               // the state of that tile.
+               boost::optional<uint32_t> value;
+               if (m_socket_frontend.has_more())
+               {
+                  uint32_t v = 0;
+                  m_socket_frontend >> v;
+                  value = v;
+               }
 
-            m_socket_frontend.to(addresses) << uint32_t(response ? 1 : 0);
+               bool response = m_expired->handle(tile, value);
+               m_socket_frontend.to(addresses) << uint32_t(response ? 1 : 0);
+            }
          }
          else
          {
@@ -26,6 +26,8 @@
 
 #include "expiry_service.hpp"
 #include <boost/bind.hpp>
+#include <boost/ref.hpp>
+#include <boost/optional.hpp>
 #include "../zstream_pbuf.hpp"
 
 #define REQUEST_TIMEOUT (1000000)
@@ -38,6 +40,16 @@ namespace manip = zstream::manip;
 
 namespace rendermq {
 
+namespace
+{
+
+void receive_flag(zstream::socket::req &socket, uint32_t &data)
+{
+   socket >> data;
+}
+
+} // anonymous namespace
+
 expiry_service::expiry_service(zmq::context_t &ctx, const pt::ptree &conf) 
    : m_context(ctx),
      m_req_ptr(new zstream::socket::req(m_context)),
@@ -55,10 +67,25 @@ expiry_service::~expiry_service()
 
 bool 
 expiry_service::request_with_failover(boost::function<void (zstream::socket::req &)> sender) const
+{
+   uint32_t data = 0;
+   request_with_failover(sender, boost::bind(receive_flag, _1, boost::ref(data)));
+   return data != 0;
+}
+
+void 
+expiry_service::request_with_failover(boost::function<void (zstream::socket::req &)> sender,
+                                      boost::function<void (zstream::socket::req &)> receiver) const
 {
    sender(*m_req_ptr);
+   receive_with_failover(sender, receiver);
+}
 
-   bool response = false, waiting_for_reply = true;
+void 
+expiry_service::receive_with_failover(boost::function<void (zstream::socket::req &)> sender,
+                                      boost::function<void (zstream::socket::req &)> receiver) const
+{
+   bool waiting_for_reply = true;
    while (waiting_for_reply) 
    {
       zmq::pollitem_t items[] = { { m_req_ptr->socket(), 0, ZMQ_POLLIN, 0 } };
@@ -75,9 +102,7 @@ expiry_service::request_with_failover(boost::function<void (zstream::socket::req
 
       if (items[0].revents & ZMQ_POLLIN) 
       {
-         uint32_t data = 0;
-         (*m_req_ptr) >> data;
-         response = data != 0;
+         receiver(*m_req_ptr);
          waiting_for_reply = false;
       }
       else
@@ -100,8 +125,6 @@ expiry_service::request_with_failover(boost::function<void (zstream::socket::req
          sender(*m_req_ptr);
       }
    }
-
-   return response;
 }
 
 namespace
@@ -120,6 +143,45 @@ void send_set_request(zstream::socket::req &socket,
    socket << manip::more << meta_tile << value;
 }
 
+// a batch is sent as the number of metatiles, followed by
+// each of the metatiles, and then the value to set them to
+// if it's a set request. the count can't be mistaken for a
+// single metatile, as a tile header is always bigger.
+void send_batch_request(zstream::socket::req &socket,
+                        const std::vector<tile_protocol> &meta_tiles,
+                        boost::optional<uint32_t> value)
+{
+   socket << manip::more << uint32_t(meta_tiles.size());
+   for (size_t i = 0; i < meta_tiles.size(); ++i)
+   {
+      if (value || (i + 1 < meta_tiles.size()))
+      {
+         socket << manip::more;
+      }
+      socket << meta_tiles[i];
+   }
+   if (value)
+   {
+      socket << value.get();
+   }
+}
+
+// the reply to a batch is a string with a byte for each of
+// the metatiles.
+void receive_batch_reply(zstream::socket::req &socket,
+                         size_t count,
+                         std::vector<bool> &results)
+{
+   string reply;
+   socket >> reply;
+
+   results.assign(count, false);
+   for (size_t i = 0; (i < count) && (i < reply.size()); ++i)
+   {
+      results[i] = reply[i] != 0;
+   }
+}
+
 } // anonymous namespace
 
 bool 
@@ -128,11 +190,54 @@ expiry_service::is_expired(const tile_protocol &meta_tile) const
    return request_with_failover(boost::bind(send_get_request, _1, meta_tile));
 }
 
+void
+expiry_service::start_is_expired(const tile_protocol &meta_tile) const
+{
+   send_get_request(*m_req_ptr, meta_tile);
+}
+
+bool
+expiry_service::finish_is_expired(const tile_protocol &meta_tile) const
+{
+   uint32_t data = 0;
+   receive_with_failover(boost::bind(send_get_request, _1, meta_tile),
+                         boost::bind(receive_flag, _1, boost::ref(data)));
+   return data != 0;
+}
+
 bool 
 expiry_service::set_expired(const tile_protocol &meta_tile, bool status) 
 {
    return request_with_failover(boost::bind(send_set_request, _1, meta_tile, status));
 }
 
-} // namespace rendermq
+void
+expiry_service::is_expired(const std::vector<tile_protocol> &meta_tiles,
+                           std::vector<bool> &results) const
+{
+   if (meta_tiles.empty())
+   {
+      results.clear();
+      return;
+   }
+
+   request_with_failover(boost::bind(send_batch_request, _1, boost::cref(meta_tiles), boost::optional<uint32_t>()),
+                         boost::bind(receive_batch_reply, _1, meta_tiles.size(), boost::ref(results)));
+}
+
+void
+expiry_service::set_expired(const std::vector<tile_protocol> &meta_tiles, 
+                            bool status,
+                            std::vector<bool> &results)
+{
+   if (meta_tiles.empty())
+   {
+      results.clear();
+      return;
+   }
 
+   request_with_failover(boost::bind(send_batch_request, _1, boost::cref(meta_tiles), boost::optional<uint32_t>(status)),
+                         boost::bind(receive_batch_reply, _1, meta_tiles.size(), boost::ref(results)));
+}
+
+} // namespace rendermq
@@ -33,6 +33,7 @@
 #include <boost/property_tree/ptree.hpp>
 #include <boost/function.hpp>
 #include <boost/shared_ptr.hpp>
+#include <vector>
 
 namespace rendermq 
 {
@@ -61,11 +62,25 @@ public:
    // returns whether or not a given metatile is expired.
    bool is_expired(const tile_protocol &) const;
 
+   // the two halves of is_expired(), so that something else can
+   // be done while the server works out the answer. only one
+   // request can be outstanding at a time, so every start has to
+   // be followed by a finish for the same metatile before anything
+   // else is asked of the service.
+   void start_is_expired(const tile_protocol &) const;
+   bool finish_is_expired(const tile_protocol &) const;
+
    // sets the expired flag information to be the same as
    // the boolean variable passed in. returns whether or
    // not the operation succeeded.
    bool set_expired(const tile_protocol &, bool);
 
+   // batched versions of the above, which send all the
+   // metatiles in a single request. the results are in the
+   // same order as the metatiles.
+   void is_expired(const std::vector<tile_protocol> &, std::vector<bool> &) const;
+   void set_expired(const std::vector<tile_protocol> &, bool, std::vector<bool> &);
+
 private:
    // context for zeromq communications
    zmq::context_t &m_context;
@@ -85,6 +100,16 @@ private:
    // backup server if it doesn't get a response. the 
    // functor argument is the bit that sends the request.
    bool request_with_failover(boost::function<void (zstream::socket::req &)>) const;
+
+   // as above, but with a functor to read the reply, for
+   // requests which don't just return a single flag.
+   void request_with_failover(boost::function<void (zstream::socket::req &)>,
+                              boost::function<void (zstream::socket::req &)>) const;
+
+   // wait for the reply to a request which has already been
+   // sent, failing over as above.
+   void receive_with_failover(boost::function<void (zstream::socket::req &)>,
+                              boost::function<void (zstream::socket::req &)>) const;
 };
 
 }
@@ -0,0 +1,570 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: artem@mapnik-consulting.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+
+#include "fan_out.hpp"
+#include "null_handle.hpp"
+#include "../logging/logger.hpp"
+
+#include <boost/bind.hpp>
+#include <boost/format.hpp>
+
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <stdexcept>
+
+using boost::shared_ptr;
+using std::string;
+using std::vector;
+
+namespace rendermq
+{
+
+namespace
+{
+
+// milliseconds on the monotonic clock, for the timeouts.
+int64_t monotonic_ms()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return int64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+shared_ptr<tile_storage::handle> missing()
+{
+   return shared_ptr<tile_storage::handle>(new null_handle());
+}
+
+void store_handle(bool *done, shared_ptr<tile_storage::handle> *result, shared_ptr<tile_storage::handle> handle)
+{
+   *result = handle;
+   *done = true;
+}
+
+void store_handles(bool *done, vector<shared_ptr<tile_storage::handle> > *result,
+                   const vector<shared_ptr<tile_storage::handle> > &handles)
+{
+   *result = handles;
+   *done = true;
+}
+
+void store_meta(bool *done, bool *ok, string *result, bool success, const string &data)
+{
+   *ok = success;
+   if (success)
+   {
+      *result = data;
+   }
+   *done = true;
+}
+
+void store_result(bool *done, bool *ok, bool result)
+{
+   *ok = result;
+   *done = true;
+}
+
+} // anonymous namespace
+
+// the state of one operation, shared between the callbacks of all the
+// storage it was sent to.
+struct fan_out::round
+{
+   explicit round(size_t n)
+      : finished(false), remaining(n), pending(n, false), deadlines(n)
+   {
+   }
+   virtual ~round() {}
+
+   // give the round the answer it gets from a storage which didn't
+   // answer in time.
+   virtual void timed_out(const fan_out &owner, shared_ptr<round> self, size_t i) = 0;
+
+   bool finished;
+   // storage which hasn't answered or timed out yet.
+   size_t remaining;
+   // which storage has been asked and not answered, and their timeouts.
+   vector<bool> pending;
+   vector<deadlines_t::iterator> deadlines;
+};
+
+struct fan_out::each_round : public fan_out::round
+{
+   each_round(size_t n, const handles_callback &cb)
+      : round(n), handles(n), callback(cb)
+   {
+   }
+   void timed_out(const fan_out &owner, shared_ptr<round> self, size_t i)
+   {
+      owner.handle_each(boost::static_pointer_cast<each_round>(self), i, missing());
+   }
+   vector<shared_ptr<tile_storage::handle> > handles;
+   handles_callback callback;
+};
+
+struct fan_out::first_round : public fan_out::round
+{
+   first_round(size_t n, const tile_storage::get_callback &cb)
+      : round(n), callback(cb)
+   {
+   }
+   void timed_out(const fan_out &owner, shared_ptr<round> self, size_t i)
+   {
+      owner.handle_first(boost::static_pointer_cast<first_round>(self), i, missing());
+   }
+   tile_storage::get_callback callback;
+};
+
+struct fan_out::meta_round : public fan_out::round
+{
+   meta_round(size_t n, const tile_storage::get_meta_callback &cb)
+      : round(n), callback(cb)
+   {
+   }
+   void timed_out(const fan_out &owner, shared_ptr<round> self, size_t i)
+   {
+      owner.handle_meta(boost::static_pointer_cast<meta_round>(self), i, false, string());
+   }
+   tile_storage::get_meta_callback callback;
+};
+
+struct fan_out::all_round : public fan_out::round
+{
+   all_round(size_t n, const boost::function<void (bool)> &cb)
+      : round(n), ok(true), callback(cb)
+   {
+   }
+   void timed_out(const fan_out &owner, shared_ptr<round> self, size_t i)
+   {
+      owner.handle_all(boost::static_pointer_cast<all_round>(self), i, false);
+   }
+   bool ok;
+   boost::function<void (bool)> callback;
+};
+
+fan_out::fan_out(const storages_t &storages, const vector<long> &timeouts)
+   : m_storages(storages), m_timeouts(timeouts), m_timer_fd(-1), m_armed(0)
+{
+   m_timeouts.resize(m_storages.size(), DEFAULT_FAN_OUT_TIMEOUT);
+
+   // the storage's event sources don't change, so they're only fetched
+   // once, the same as the storage worker does.
+   for (storages_t::const_iterator itr = m_storages.begin(); itr != m_storages.end(); ++itr)
+   {
+      (*itr)->async_fds(m_fds);
+   }
+
+   m_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+   if (m_timer_fd < 0)
+   {
+      throw std::runtime_error((boost::format("Cannot set up fan-out timer: %1%") % strerror(errno)).str());
+   }
+}
+
+fan_out::~fan_out()
+{
+   // break the cycles between the rounds and their deadlines.
+   m_deadlines.clear();
+   close(m_timer_fd);
+}
+
+void
+fan_out::start(shared_ptr<round> r, size_t i) const
+{
+   r->pending[i] = true;
+   r->deadlines[i] = m_deadlines.end();
+}
+
+void
+fan_out::started(shared_ptr<round> r, size_t i, int64_t now) const
+{
+   // storage which answered straight away doesn't need a timeout.
+   if (r->pending[i])
+   {
+      r->deadlines[i] = m_deadlines.insert(std::make_pair(now + m_timeouts[i], std::make_pair(r, i)));
+   }
+}
+
+bool
+fan_out::answered(shared_ptr<round> r, size_t i) const
+{
+   if (!r->pending[i])
+   {
+      // too late, or the round has already finished without it.
+      return false;
+   }
+   r->pending[i] = false;
+   if (r->deadlines[i] != m_deadlines.end())
+   {
+      m_deadlines.erase(r->deadlines[i]);
+      r->deadlines[i] = m_deadlines.end();
+   }
+   return true;
+}
+
+void
+fan_out::abandon(shared_ptr<round> r) const
+{
+   for (size_t i = 0; i < r->pending.size(); ++i)
+   {
+      answered(r, i);
+   }
+}
+
+void
+fan_out::get_each_async(const vector<tile_protocol> &tiles, bool probe, const handles_callback &callback) const
+{
+   shared_ptr<each_round> r(new each_round(m_storages.size(), callback));
+   if (m_storages.empty())
+   {
+      callback(r->handles);
+      return;
+   }
+
+   const int64_t now = monotonic_ms();
+   for (size_t i = 0; i < m_storages.size(); ++i)
+   {
+      start(r, i);
+      tile_storage::get_callback handler = boost::bind(&fan_out::handle_each, this, r, i, _1);
+      if (probe)
+      {
+         m_storages[i]->probe_async(tiles[i], handler);
+      }
+      else
+      {
+         m_storages[i]->get_async(tiles[i], handler);
+      }
+      started(r, i, now);
+   }
+   arm_timer();
+}
+
+void
+fan_out::get_first_async(const tile_protocol &tile, bool probe, const tile_storage::get_callback &callback) const
+{
+   shared_ptr<first_round> r(new first_round(m_storages.size(), callback));
+   if (m_storages.empty())
+   {
+      callback(missing());
+      return;
+   }
+
+   const int64_t now = monotonic_ms();
+   for (size_t i = 0; (i < m_storages.size()) && !r->finished; ++i)
+   {
+      start(r, i);
+      tile_storage::get_callback handler = boost::bind(&fan_out::handle_first, this, r, i, _1);
+      if (probe)
+      {
+         m_storages[i]->probe_async(tile, handler);
+      }
+      else
+      {
+         m_storages[i]->get_async(tile, handler);
+      }
+      started(r, i, now);
+   }
+   arm_timer();
+}
+
+void
+fan_out::get_meta_first_async(const tile_protocol &tile, const tile_storage::get_meta_callback &callback) const
+{
+   shared_ptr<meta_round> r(new meta_round(m_storages.size(), callback));
+   if (m_storages.empty())
+   {
+      callback(false, string());
+      return;
+   }
+
+   const int64_t now = monotonic_ms();
+   for (size_t i = 0; (i < m_storages.size()) && !r->finished; ++i)
+   {
+      start(r, i);
+      m_storages[i]->get_meta_async(tile, boost::bind(&fan_out::handle_meta, this, r, i, _1, _2));
+      started(r, i, now);
+   }
+   arm_timer();
+}
+
+void
+fan_out::put_meta_all_async(const tile_protocol &tile, const string &buf,
+                            const tile_storage::put_meta_callback &callback) const
+{
+   shared_ptr<all_round> r(new all_round(m_storages.size(), callback));
+   if (m_storages.empty())
+   {
+      callback(true);
+      return;
+   }
+
+   const int64_t now = monotonic_ms();
+   for (size_t i = 0; i < m_storages.size(); ++i)
+   {
+      start(r, i);
+      m_storages[i]->put_meta_async(tile, buf, boost::bind(&fan_out::handle_all, this, r, i, _1));
+      started(r, i, now);
+   }
+   arm_timer();
+}
+
+void
+fan_out::expire_all_async(const tile_protocol &tile, const tile_storage::expire_callback &callback) const
+{
+   shared_ptr<all_round> r(new all_round(m_storages.size(), callback));
+   if (m_storages.empty())
+   {
+      callback(true);
+      return;
+   }
+
+   const int64_t now = monotonic_ms();
+   for (size_t i = 0; i < m_storages.size(); ++i)
+   {
+      start(r, i);
+      m_storages[i]->expire_async(tile, boost::bind(&fan_out::handle_all, this, r, i, _1));
+      started(r, i, now);
+   }
+   arm_timer();
+}
+
+void
+fan_out::handle_each(shared_ptr<each_round> r, size_t i, shared_ptr<tile_storage::handle> handle) const
+{
+   if (!answered(r, i))
+   {
+      return;
+   }
+   r->handles[i] = handle;
+   if (--r->remaining == 0)
+   {
+      r->finished = true;
+      r->callback(r->handles);
+   }
+}
+
+void
+fan_out::handle_first(shared_ptr<first_round> r, size_t i, shared_ptr<tile_storage::handle> handle) const
+{
+   if (!answered(r, i) || r->finished)
+   {
+      return;
+   }
+   if (handle->exists())
+   {
+      // the rest can carry on, but nothing is waiting for them.
+      r->finished = true;
+      abandon(r);
+      r->callback(handle);
+   }
+   else if (--r->remaining == 0)
+   {
+      r->finished = true;
+      r->callback(missing());
+   }
+}
+
+void
+fan_out::handle_meta(shared_ptr<meta_round> r, size_t i, bool ok, const string &data) const
+{
+   if (!answered(r, i) || r->finished)
+   {
+      return;
+   }
+   if (ok)
+   {
+      r->finished = true;
+      abandon(r);
+      r->callback(true, data);
+   }
+   else if (--r->remaining == 0)
+   {
+      r->finished = true;
+      r->callback(false, string());
+   }
+}
+
+void
+fan_out::handle_all(shared_ptr<all_round> r, size_t i, bool ok) const
+{
+   if (!answered(r, i))
+   {
+      return;
+   }
+   r->ok = r->ok && ok;
+   if (--r->remaining == 0)
+   {
+      r->finished = true;
+      r->callback(r->ok);
+   }
+}
+
+void
+fan_out::get_each(const vector<tile_protocol> &tiles, bool probe,
+                  vector<shared_ptr<tile_storage::handle> > &handles) const
+{
+   bool done = false;
+   get_each_async(tiles, probe, boost::bind(&store_handles, &done, &handles, _1));
+   wait_for(done);
+}
+
+shared_ptr<tile_storage::handle>
+fan_out::get_first(const tile_protocol &tile, bool probe) const
+{
+   bool done = false;
+   shared_ptr<tile_storage::handle> result = missing();
+   get_first_async(tile, probe, boost::bind(&store_handle, &done, &result, _1));
+   wait_for(done);
+   return result;
+}
+
+bool
+fan_out::get_meta_first(const tile_protocol &tile, string &data) const
+{
+   bool done = false, ok = false;
+   get_meta_first_async(tile, boost::bind(&store_meta, &done, &ok, &data, _1, _2));
+   wait_for(done);
+   return ok;
+}
+
+bool
+fan_out::put_meta_all(const tile_protocol &tile, const string &buf) const
+{
+   bool done = false, ok = false;
+   put_meta_all_async(tile, buf, boost::bind(&store_result, &done, &ok, _1));
+   wait_for(done);
+   return ok;
+}
+
+bool
+fan_out::expire_all(const tile_protocol &tile) const
+{
+   bool done = false, ok = false;
+   expire_all_async(tile, boost::bind(&store_result, &done, &ok, _1));
+   wait_for(done);
+   return ok;
+}
+
+void
+fan_out::async_fds(vector<int> &fds) const
+{
+   fds.insert(fds.end(), m_fds.begin(), m_fds.end());
+   fds.push_back(m_timer_fd);
+}
+
+void
+fan_out::async_perform() const
+{
+   // the timer has either fired, in which case it needs setting again,
+   // or it hasn't and this does nothing.
+   uint64_t expirations = 0;
+   if (read(m_timer_fd, &expirations, sizeof(expirations)) == ssize_t(sizeof(expirations)))
+   {
+      m_armed = 0;
+   }
+
+   for (storages_t::const_iterator itr = m_storages.begin(); itr != m_storages.end(); ++itr)
+   {
+      (*itr)->async_perform();
+   }
+   check_deadlines();
+}
+
+void
+fan_out::wait_for(const bool &done) const
+{
+   vector<struct pollfd> items(m_fds.size());
+   while (!done)
+   {
+      if (m_deadlines.empty())
+      {
+         LOG_ERROR("Storage fan-out is waiting, but has nothing outstanding.");
+         break;
+      }
+
+      for (size_t i = 0; i < m_fds.size(); ++i)
+      {
+         items[i].fd = m_fds[i];
+         items[i].events = POLLIN;
+         items[i].revents = 0;
+      }
+      const int64_t wait = std::max(m_deadlines.begin()->first - monotonic_ms(), int64_t(0));
+      poll(items.empty() ? NULL : &items[0], items.size(), int(wait));
+
+      for (storages_t::const_iterator itr = m_storages.begin(); itr != m_storages.end(); ++itr)
+      {
+         (*itr)->async_perform();
+      }
+      check_deadlines();
+   }
+}
+
+void
+fan_out::check_deadlines() const
+{
+   const int64_t now = monotonic_ms();
+   while (!m_deadlines.empty() && (m_deadlines.begin()->first <= now))
+   {
+      shared_ptr<round> r = m_deadlines.begin()->second.first;
+      const size_t i = m_deadlines.begin()->second.second;
+      m_deadlines.erase(m_deadlines.begin());
+      r->deadlines[i] = m_deadlines.end();
+
+      LOG_WARNING(boost::format("Storage %1% of %2% in a fan-out didn't answer within %3%ms, carrying on without it.")
+                  % (i + 1) % m_storages.size() % m_timeouts[i]);
+      r->timed_out(*this, r, i);
+   }
+   arm_timer();
+}
+
+void
+fan_out::arm_timer() const
+{
+   // a timer which goes off early just wakes the caller up for nothing,
+   // so only set it when the next deadline is sooner.
+   if (m_deadlines.empty())
+   {
+      return;
+   }
+   const int64_t due = std::max(m_deadlines.begin()->first, int64_t(1));
+   if ((m_armed != 0) && (m_armed <= due))
+   {
+      return;
+   }
+
+   struct itimerspec its;
+   memset(&its, 0, sizeof(its));
+   its.it_value.tv_sec = due / 1000;
+   its.it_value.tv_nsec = (due % 1000) * 1000000;
+   timerfd_settime(m_timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+   m_armed = due;
+}
+
+} // namespace rendermq
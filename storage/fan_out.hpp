@@ -0,0 +1,150 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: artem@mapnik-consulting.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+
+#ifndef RENDERMQ_FAN_OUT_HPP
+#define RENDERMQ_FAN_OUT_HPP
+
+#include "tile_storage.hpp"
+#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/utility.hpp>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+
+// milliseconds which each storage has to answer a request from a
+// fan-out before it's given up on.
+#define DEFAULT_FAN_OUT_TIMEOUT (10000L)
+
+namespace rendermq
+{
+
+/* sends requests to several storage objects at once, for storage which
+ * is made out of other storage, such as union_storage, so that the time
+ * taken is that of the slowest of them rather than the sum.
+ *
+ * the requests go through the asynchronous interface of each storage,
+ * and are all outstanding together. storage which only has blocking
+ * calls answers each one straight away, so it's still called one after
+ * the other, but the rest aren't held up by it once they've started.
+ *
+ * each storage has its own timeout. a storage which hasn't answered by
+ * then counts as not having the tile, or as having failed, and its
+ * answer is ignored if it does arrive later.
+ *
+ * every operation has an asynchronous version, which calls back once
+ * the result is known, and a blocking version which waits for it. the
+ * asynchronous versions are driven by async_fds() and async_perform(),
+ * which cover all the storage as well as the timeouts, so storage built
+ * on top of a fan-out can just pass those through.
+ */
+class fan_out
+   : private boost::noncopyable
+{
+public:
+   typedef std::vector<boost::shared_ptr<tile_storage> > storages_t;
+   typedef boost::function<void (const std::vector<boost::shared_ptr<tile_storage::handle> > &)> handles_callback;
+
+   // the timeouts are in milliseconds, one for each storage in the same
+   // order. if there are fewer, the rest get the default.
+   fan_out(const storages_t &storages, const std::vector<long> &timeouts = std::vector<long>());
+   ~fan_out();
+
+   // get or probe tiles[i] from storage i, all at the same time. the
+   // handles are in the same order, with missing tiles for storage which
+   // didn't answer in time.
+   void get_each_async(const std::vector<tile_protocol> &tiles, bool probe, const handles_callback &callback) const;
+   void get_each(const std::vector<tile_protocol> &tiles, bool probe,
+                 std::vector<boost::shared_ptr<tile_storage::handle> > &handles) const;
+
+   // get or probe the tile, or get the metatile, from whichever storage
+   // has it first. the storage is asked in order, and if one answers
+   // straight away that it has it then the rest aren't asked at all.
+   void get_first_async(const tile_protocol &tile, bool probe, const tile_storage::get_callback &callback) const;
+   boost::shared_ptr<tile_storage::handle> get_first(const tile_protocol &tile, bool probe) const;
+   void get_meta_first_async(const tile_protocol &tile, const tile_storage::get_meta_callback &callback) const;
+   bool get_meta_first(const tile_protocol &tile, std::string &data) const;
+
+   // put the metatile to, or expire it from, all the storage at once.
+   // succeeds only if it did in all of them.
+   void put_meta_all_async(const tile_protocol &tile, const std::string &buf,
+                           const tile_storage::put_meta_callback &callback) const;
+   bool put_meta_all(const tile_protocol &tile, const std::string &buf) const;
+   void expire_all_async(const tile_protocol &tile, const tile_storage::expire_callback &callback) const;
+   bool expire_all(const tile_protocol &tile) const;
+
+   // event sources of all the storage and the timeouts, and progress
+   // them without blocking.
+   void async_fds(std::vector<int> &fds) const;
+   void async_perform() const;
+
+   // drive everything until the flag is set, or nothing is left.
+   void wait_for(const bool &done) const;
+
+private:
+   struct round;
+   struct each_round;
+   struct first_round;
+   struct meta_round;
+   struct all_round;
+
+   // outstanding requests by when they time out, and which storage of
+   // which round they're for.
+   typedef std::multimap<int64_t, std::pair<boost::shared_ptr<round>, size_t> > deadlines_t;
+
+   // note the request to a storage before it's sent, as the answer
+   // might come straight back, and set its timeout once it has been
+   // sent, if it's still outstanding.
+   void start(boost::shared_ptr<round> r, size_t i) const;
+   void started(boost::shared_ptr<round> r, size_t i, int64_t now) const;
+   // whether this is the first the round has heard from the storage,
+   // which stops its timeout.
+   bool answered(boost::shared_ptr<round> r, size_t i) const;
+   // forget about all the storage which hasn't answered yet.
+   void abandon(boost::shared_ptr<round> r) const;
+
+   void handle_each(boost::shared_ptr<each_round> r, size_t i, boost::shared_ptr<tile_storage::handle> handle) const;
+   void handle_first(boost::shared_ptr<first_round> r, size_t i, boost::shared_ptr<tile_storage::handle> handle) const;
+   void handle_meta(boost::shared_ptr<meta_round> r, size_t i, bool ok, const std::string &data) const;
+   void handle_all(boost::shared_ptr<all_round> r, size_t i, bool ok) const;
+
+   // time out anything which is due, and set the timer for the next.
+   void check_deadlines() const;
+   void arm_timer() const;
+
+   storages_t m_storages;
+   std::vector<long> m_timeouts;
+   std::vector<int> m_fds;
+
+   mutable deadlines_t m_deadlines;
+   int m_timer_fd;
+   mutable int64_t m_armed;
+};
+
+}
+
+#endif // RENDERMQ_FAN_OUT_HPP
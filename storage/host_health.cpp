@@ -0,0 +1,356 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: artem@mapnik-consulting.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+
+#include "host_health.hpp"
+#include "../http/http.hpp"
+#include "../logging/logger.hpp"
+
+#include <boost/thread.hpp>
+#include <boost/thread/once.hpp>
+#include <boost/bind.hpp>
+#include <boost/format.hpp>
+#include <boost/foreach.hpp>
+
+#include <stdint.h>
+#include <time.h>
+#include <list>
+#include <map>
+#include <sstream>
+#include <vector>
+
+// milliseconds to wait for the TCP connection of a probe, and for the
+// whole of it.
+#define PROBE_CONNECT_TIMEOUT (300L)
+#define PROBE_TIMEOUT (2000L)
+// milliseconds after which a half-open trial request which hasn't
+// reported back is given up on.
+#define TRIAL_TIMEOUT (10000L)
+
+using std::string;
+using std::vector;
+
+namespace rendermq
+{
+   namespace
+   {
+      int64_t monotonic_ms()
+      {
+         struct timespec ts;
+         clock_gettime(CLOCK_MONOTONIC, &ts);
+         return int64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+      }
+
+      // the gcc builtins are full barriers, which is plenty here.
+      template <typename T>
+      T load(volatile T &x)
+      {
+         return __sync_fetch_and_add(&x, T(0));
+      }
+
+      template <typename T>
+      void store(volatile T &x, T value)
+      {
+         T old = load(x);
+         while (!__sync_bool_compare_and_swap(&x, old, value))
+         {
+            old = load(x);
+         }
+      }
+
+      template <typename T>
+      bool compare_and_swap(volatile T &x, T old, T value)
+      {
+         return __sync_bool_compare_and_swap(&x, old, value);
+      }
+   }
+
+   struct host_health::host
+   {
+      host(const string &n, int p)
+         : name(n), port(p), state(state_closed), failures(0), retry_at(0), trial_at(0)
+      {
+         std::ostringstream url;
+         url << "http://" << name << ":" << port << "/";
+         probe_url = url.str();
+      }
+
+      const string name;
+      const int port;
+      string probe_url;
+
+      volatile int state;
+      // consecutive failed requests.
+      volatile int failures;
+      // monotonic times in milliseconds: when an open host may be tried
+      // again without a probe, and when the half-open trial was let
+      // through, or zero if there isn't one.
+      volatile int64_t retry_at, trial_at;
+   };
+
+   struct host_health::impl
+   {
+      impl(int failure_threshold, long open_time, long probe_interval)
+         : m_failure_threshold(failure_threshold), m_open_time(open_time),
+           m_probe_interval(probe_interval), m_prober_started(0)
+      {
+      }
+
+      ~impl()
+      {
+         if (load(m_prober_started))
+         {
+            m_prober.interrupt();
+            m_prober.join();
+         }
+      }
+
+      void open(host *h, int old_state)
+      {
+         // set the time first, so that nothing sees it open with an old one.
+         store(h->retry_at, monotonic_ms() + load(m_open_time));
+         if (compare_and_swap(h->state, old_state, int(state_open)))
+         {
+            store(h->trial_at, int64_t(0));
+            LOG_WARNING(boost::format("Storage host %1%:%2% is down, not sending it any requests until it's back.")
+                        % h->name % h->port);
+            start_prober();
+         }
+      }
+
+      void start_prober()
+      {
+         if (load(m_probe_interval) > 0 && compare_and_swap(m_prober_started, 0, 1))
+         {
+            m_prober = boost::thread(boost::bind(&impl::probe_loop, this));
+         }
+      }
+
+      // probe all the open hosts every interval, until interrupted.
+      void probe_loop()
+      {
+         try
+         {
+            while (true)
+            {
+               long interval = load(m_probe_interval);
+               boost::this_thread::sleep(boost::posix_time::milliseconds(interval > 0 ? interval : DEFAULT_PROBE_INTERVAL));
+               if (interval > 0)
+               {
+                  probe();
+               }
+            }
+         }
+         catch (const boost::thread_interrupted &)
+         {
+         }
+      }
+
+      void probe()
+      {
+         vector<host *> open;
+         {
+            boost::mutex::scoped_lock lock(m_mutex);
+            BOOST_FOREACH(host &h, m_hosts)
+            {
+               if (load(h.state) == state_open)
+               {
+                  open.push_back(&h);
+               }
+            }
+         }
+         if (open.empty())
+         {
+            return;
+         }
+
+         // anything still going at the deadline is abandoned with the client.
+         http::async_client client;
+         BOOST_FOREACH(host *h, open)
+         {
+            try
+            {
+               client.head(h->probe_url, http::headers_t(), boost::bind(&impl::probed, this, h, _1), PROBE_CONNECT_TIMEOUT);
+            }
+            catch (const std::exception &e)
+            {
+               LOG_ERROR(boost::format("Error starting probe of storage host %1%:%2%: %3%") % h->name % h->port % e.what());
+            }
+         }
+
+         const int64_t deadline = monotonic_ms() + PROBE_TIMEOUT;
+         int64_t now;
+         while (client.in_flight() > 0 && (now = monotonic_ms()) < deadline)
+         {
+            client.wait(long(deadline - now));
+         }
+      }
+
+      void probed(host *h, boost::shared_ptr<http::response> response)
+      {
+         // any answer at all means it's up, even an error status.
+         if (!response)
+         {
+            store(h->retry_at, monotonic_ms() + load(m_open_time));
+         }
+         else if (compare_and_swap(h->state, int(state_open), int(state_half_open)))
+         {
+            store(h->trial_at, int64_t(0));
+            LOG_INFO(boost::format("Storage host %1%:%2% answered a probe, trying it again.") % h->name % h->port);
+         }
+      }
+
+      volatile int m_failure_threshold;
+      volatile long m_open_time, m_probe_interval;
+
+      // protects adding hosts and going through them all, but not their
+      // states. hosts are in a list so that they never move.
+      boost::mutex m_mutex;
+      std::list<host> m_hosts;
+      std::map<std::pair<string, int>, host *> m_index;
+
+      volatile int m_prober_started;
+      boost::thread m_prober;
+   };
+
+   host_health::host_health(int failure_threshold, long open_time, long probe_interval)
+      : m_impl(new impl(failure_threshold, open_time, probe_interval))
+   {
+   }
+
+   host_health::~host_health()
+   {
+   }
+
+   host_health::host *host_health::add(const string &name, int port)
+   {
+      boost::mutex::scoped_lock lock(m_impl->m_mutex);
+      std::map<std::pair<string, int>, host *>::iterator itr = m_impl->m_index.find(std::make_pair(name, port));
+      if (itr != m_impl->m_index.end())
+      {
+         return itr->second;
+      }
+      m_impl->m_hosts.push_back(host(name, port));
+      host *h = &m_impl->m_hosts.back();
+      m_impl->m_index[std::make_pair(name, port)] = h;
+      return h;
+   }
+
+   bool host_health::allow(host *h)
+   {
+      int s = load(h->state);
+      if (s == state_closed)
+      {
+         return true;
+      }
+
+      const int64_t now = monotonic_ms();
+      if (s == state_open)
+      {
+         if (now < load(h->retry_at))
+         {
+            return false;
+         }
+         // it's been long enough to try again anyway. if this doesn't
+         // work then someone else has already moved it on.
+         compare_and_swap(h->state, int(state_open), int(state_half_open));
+         if (load(h->state) == state_closed)
+         {
+            return true;
+         }
+      }
+
+      // half-open, so only one request at a time gets through.
+      int64_t trial = load(h->trial_at);
+      if (trial != 0 && now - trial < TRIAL_TIMEOUT)
+      {
+         return false;
+      }
+      return compare_and_swap(h->trial_at, trial, now);
+   }
+
+   void host_health::succeeded(host *h)
+   {
+      if (load(h->failures) != 0)
+      {
+         store(h->failures, 0);
+      }
+      if (load(h->state) != state_closed)
+      {
+         int old = __sync_lock_test_and_set(&h->state, int(state_closed));
+         store(h->trial_at, int64_t(0));
+         if (old != state_closed)
+         {
+            LOG_INFO(boost::format("Storage host %1%:%2% is back up.") % h->name % h->port);
+         }
+      }
+   }
+
+   void host_health::failed(host *h)
+   {
+      int failures = __sync_add_and_fetch(&h->failures, 1);
+      int s = load(h->state);
+      if (s == state_half_open || (s == state_closed && failures >= load(m_impl->m_failure_threshold)))
+      {
+         m_impl->open(h, s);
+      }
+      else if (s == state_open)
+      {
+         // a request which was started before it opened, so it's still down.
+         store(h->retry_at, monotonic_ms() + load(m_impl->m_open_time));
+      }
+   }
+
+   host_health::state host_health::current(const host *h) const
+   {
+      return state(load(const_cast<host *>(h)->state));
+   }
+
+   void host_health::configure(int failure_threshold, long open_time, long probe_interval)
+   {
+      store(m_impl->m_failure_threshold, failure_threshold);
+      store(m_impl->m_open_time, open_time);
+      store(m_impl->m_probe_interval, probe_interval);
+   }
+
+   namespace
+   {
+      host_health *global_health = NULL;
+      boost::once_flag global_health_once = BOOST_ONCE_INIT;
+
+      void make_global_health()
+      {
+         // never deleted, as storage may still be using it during static
+         // destruction.
+         global_health = new host_health();
+      }
+   }
+
+   host_health &host_health::instance()
+   {
+      boost::call_once(&make_global_health, global_health_once);
+      return *global_health;
+   }
+}
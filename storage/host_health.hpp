@@ -0,0 +1,118 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: artem@mapnik-consulting.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+
+#ifndef RENDERMQ_HOST_HEALTH_HPP
+#define RENDERMQ_HOST_HEALTH_HPP
+
+#include <boost/shared_ptr.hpp>
+#include <boost/utility.hpp>
+#include <string>
+
+// consecutive failed requests before a host is taken out of use.
+#define DEFAULT_FAILURE_THRESHOLD (1)
+// milliseconds before a host which was taken out of use is tried again
+// with real requests, if the probes haven't already found it's back.
+#define DEFAULT_OPEN_TIME (300000L)
+// milliseconds between probes of hosts which are out of use, or zero
+// not to probe them at all.
+#define DEFAULT_PROBE_INTERVAL (1000L)
+
+namespace rendermq
+{
+   /* health of the storage hosts, shared by everything in the process, so
+    * that once one thread has found a host is down none of the others
+    * have to find out for themselves.
+    *
+    * each host has a circuit breaker, which is:
+    *
+    *   closed when the host is working, and requests go to it as normal.
+    *
+    *   open once failure_threshold requests in a row have failed. no
+    *   requests are sent to the host, so callers can go straight to
+    *   another copy. a background thread sends a HEAD to each open host
+    *   every probe_interval, and any answer at all moves it to half-open.
+    *   if there are no probes, or they don't get through, the host goes
+    *   to half-open after open_time anyway.
+    *
+    *   half-open while a single request is let through to try the host
+    *   out with real traffic. if it works then the breaker closes again,
+    *   and if it fails then it opens again. a trial request which never
+    *   reports back, for example because it was cancelled, is given up on
+    *   after a while and another is let through.
+    *
+    * hosts are added once, when the storage is set up, and never removed.
+    * after that, checking and updating a host's state doesn't take any
+    * locks, as it's done for every request.
+    */
+   class host_health : private boost::noncopyable
+   {
+   public:
+      enum state
+      {
+         state_closed,
+         state_open,
+         state_half_open
+      };
+
+      // a host in the table. pointers to them stay valid for as long as
+      // the table does.
+      struct host;
+
+      host_health(int failure_threshold = DEFAULT_FAILURE_THRESHOLD,
+                  long open_time = DEFAULT_OPEN_TIME,
+                  long probe_interval = DEFAULT_PROBE_INTERVAL);
+      ~host_health();
+
+      // find a host in the table, adding it if it isn't there yet.
+      host *add(const std::string &name, int port);
+
+      // whether a request may be sent to the host now. in the half-open
+      // state this lets one request through, so only call it when the
+      // request is actually going to be sent, and report what happened.
+      bool allow(host *h);
+
+      // report that a request to the host got an answer, or that it
+      // couldn't get through at all.
+      void succeeded(host *h);
+      void failed(host *h);
+
+      // the state of the host, without changing it.
+      state current(const host *h) const;
+
+      // change the settings for all hosts. they're process-wide, so
+      // every storage configured with them should agree.
+      void configure(int failure_threshold, long open_time, long probe_interval);
+
+      // the table used by all the storage in the process.
+      static host_health &instance();
+
+   private:
+      struct impl;
+      boost::shared_ptr<impl> m_impl;
+   };
+}
+
+#endif /* RENDERMQ_HOST_HEALTH_HPP */
@@ -65,11 +65,8 @@ namespace rendermq
       return this->response->statusCode == 200;
    }
 
-   http_storage::http_storage(const bool& persistent, const int& concurrency): persistent(persistent), concurrency(concurrency)
+   http_storage::http_storage(const int& concurrency): concurrency(concurrency)
    {
-      //get a persistent connection
-      if(persistent)
-         this->connection = http::createPersistentConnection();
    }
 
    http_storage::~http_storage()
@@ -114,7 +111,7 @@ namespace rendermq
       vector<shared_ptr<http::response> > responses;
       try
       {
-         responses = http::multiPostForm(requests, concurrency, connection, headers);
+         responses = http::multiPostForm(requests, concurrency, http::curl_ptr(), headers);
       }
       catch(std::runtime_error e)
       {
@@ -150,7 +147,7 @@ namespace rendermq
          //do the request
          try
          {
-            shared_ptr<http::response> response = http::postForm(request->first, request->second, connection, headers);
+            shared_ptr<http::response> response = http::postForm(request->first, request->second, http::curl_ptr(), headers);
             if(response->statusCode != 200)
             {
                LOG_ERROR(boost::format("Failed to PUT tile: %1% (status=%2%)") % request->first % response->statusCode);
@@ -208,7 +205,7 @@ namespace rendermq
       //do the requests
       try
       {
-         responses = http::multiGet(requests, concurrency, connection, headers);
+         responses = http::multiGet(requests, concurrency, http::curl_ptr(), headers);
       }
       catch(std::runtime_error e)
       {
@@ -242,7 +239,7 @@ namespace rendermq
          //do the request
          try
          {
-            shared_ptr<http::response> response = http::get(*request, connection, headers);
+            shared_ptr<http::response> response = http::get(*request, http::curl_ptr(), headers);
             //if we didn't get a 200 or the tile is dirty
             if(response->statusCode != 200 || response->timeStamp == INVALID_TIMESTAMP)
             {
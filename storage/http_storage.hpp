@@ -64,7 +64,7 @@ namespace rendermq
          };
          friend class handle;
 
-         http_storage(const bool& persistent = true, const int& concurrency = 1);
+         http_storage(const int& concurrency = 1);
          virtual ~http_storage();
          //get a single tile in a single format
          virtual boost::shared_ptr<tile_storage::handle> get(const tile_protocol &tile) const = 0;
@@ -104,9 +104,6 @@ namespace rendermq
 
          //for last modified headers
          const http_date_formatter date_formatter;
-         //keep a persistent connection
-         const bool persistent;
-         boost::shared_ptr<CURL> connection;
          // the number of outstanding connections to the HTTP storage
          const int concurrency;
    };
@@ -0,0 +1,673 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: artem@mapnik-consulting.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "../config.hpp"
+#include "io_engine.hpp"
+#include "../logging/logger.hpp"
+
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/format.hpp>
+#include <stdexcept>
+#include <vector>
+#include <deque>
+#include <cstring>
+
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define RENDERMQ_HAVE_IO_URING
+#endif
+
+using std::string;
+using std::vector;
+using std::deque;
+using std::runtime_error;
+
+namespace rendermq
+{
+
+namespace
+{
+
+// an operation which has been queued and not yet called back.
+struct operation
+{
+   enum type { op_open, op_read };
+
+   type t;
+   const char *path;
+   int fd;
+   char *buf;
+   size_t size;
+   off_t offset;
+   io_engine::callback cb;
+   int result;
+};
+
+// do the operation with the ordinary blocking call.
+int run_operation(const operation &op)
+{
+   int result = -1;
+   do
+   {
+      if (op.t == operation::op_open)
+      {
+         result = ::open(op.path, O_RDONLY | O_CLOEXEC);
+      }
+      else
+      {
+         result = pread(op.fd, op.buf, op.size, op.offset);
+      }
+   } while ((result < 0) && (errno == EINTR));
+
+   return (result < 0) ? -errno : result;
+}
+
+// empty the eventfd, so that it's only readable again once something
+// else has finished.
+void drain_event_fd(int fd)
+{
+   uint64_t count;
+   while (::read(fd, &count, sizeof(count)) < 0 && errno == EINTR)
+   {
+   }
+}
+
+// close files opened by operations which will never call back.
+void discard(const operation &op)
+{
+   if ((op.t == operation::op_open) && (op.result >= 0))
+   {
+      close(op.result);
+   }
+}
+
+/* the fallback engine, which hands the operations to a pool of threads
+ * doing the blocking calls. the queue depth is the number of threads.
+ */
+class thread_engine
+   : public io_engine
+{
+public:
+   explicit thread_engine(size_t threads)
+      : m_outstanding(0), m_stopping(false)
+   {
+      m_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (m_event_fd < 0)
+      {
+         throw runtime_error((boost::format("Unable to create eventfd: %1%") % strerror(errno)).str());
+      }
+      for (size_t i = 0; i < std::max(threads, size_t(1)); ++i)
+      {
+         m_threads.create_thread(boost::bind(&thread_engine::run, this));
+      }
+   }
+
+   ~thread_engine()
+   {
+      {
+         boost::mutex::scoped_lock lock(m_mutex);
+         m_stopping = true;
+      }
+      m_work.notify_all();
+      m_threads.join_all();
+
+      for (deque<operation>::const_iterator itr = m_done.begin(); itr != m_done.end(); ++itr)
+      {
+         discard(*itr);
+      }
+      close(m_event_fd);
+   }
+
+   void open(const char *path, const callback &cb)
+   {
+      operation op;
+      op.t = operation::op_open;
+      op.path = path;
+      op.cb = cb;
+      m_queued.push_back(op);
+   }
+
+   void read(int fd, char *buf, size_t size, off_t offset, const callback &cb)
+   {
+      operation op;
+      op.t = operation::op_read;
+      op.fd = fd;
+      op.buf = buf;
+      op.size = size;
+      op.offset = offset;
+      op.cb = cb;
+      m_queued.push_back(op);
+   }
+
+   void submit()
+   {
+      if (m_queued.empty())
+      {
+         return;
+      }
+      m_outstanding += m_queued.size();
+      {
+         boost::mutex::scoped_lock lock(m_mutex);
+         m_jobs.insert(m_jobs.end(), m_queued.begin(), m_queued.end());
+      }
+      m_queued.clear();
+      m_work.notify_all();
+   }
+
+   int fd() const
+   {
+      return m_event_fd;
+   }
+
+   void perform()
+   {
+      drain_event_fd(m_event_fd);
+
+      deque<operation> done;
+      {
+         boost::mutex::scoped_lock lock(m_mutex);
+         done.swap(m_done);
+      }
+
+      m_outstanding -= done.size();
+      for (deque<operation>::const_iterator itr = done.begin(); itr != done.end(); ++itr)
+      {
+         itr->cb(itr->result);
+      }
+      submit();
+   }
+
+   void wait()
+   {
+      submit();
+      if (m_outstanding == 0)
+      {
+         return;
+      }
+
+      struct pollfd pfd;
+      pfd.fd = m_event_fd;
+      pfd.events = POLLIN;
+      while ((poll(&pfd, 1, -1) < 0) && (errno == EINTR))
+      {
+      }
+      perform();
+   }
+
+   const char *name() const
+   {
+      return "threads";
+   }
+
+private:
+   void run()
+   {
+      while (true)
+      {
+         operation op;
+         {
+            boost::mutex::scoped_lock lock(m_mutex);
+            while (m_jobs.empty() && !m_stopping)
+            {
+               m_work.wait(lock);
+            }
+            if (m_stopping)
+            {
+               return;
+            }
+            op = m_jobs.front();
+            m_jobs.pop_front();
+         }
+
+         op.result = run_operation(op);
+
+         {
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_done.push_back(op);
+         }
+         const uint64_t one = 1;
+         if (::write(m_event_fd, &one, sizeof(one)) < 0)
+         {
+            // the counter can't overflow, so there's nothing to do.
+         }
+      }
+   }
+
+   int m_event_fd;
+   // only touched by the owning thread.
+   vector<operation> m_queued;
+   size_t m_outstanding;
+   // shared with the pool, under the mutex.
+   boost::mutex m_mutex;
+   boost::condition_variable m_work;
+   deque<operation> m_jobs, m_done;
+   bool m_stopping;
+   boost::thread_group m_threads;
+};
+
+#ifdef RENDERMQ_HAVE_IO_URING
+
+// the ring indexes are shared with the kernel, so need barriers.
+inline unsigned load_acquire(const volatile unsigned *p)
+{
+   unsigned v = *p;
+   __sync_synchronize();
+   return v;
+}
+
+inline void store_release(volatile unsigned *p, unsigned v)
+{
+   __sync_synchronize();
+   *p = v;
+}
+
+/* the io_uring engine, using the system calls directly. operations are
+ * kept in a table of slots, and the slot number is the user data which
+ * comes back with each completion.
+ */
+class uring_engine
+   : public io_engine
+{
+public:
+   explicit uring_engine(size_t depth)
+      : m_ring_fd(-1), m_event_fd(-1),
+        m_sq_ptr(MAP_FAILED), m_cq_ptr(MAP_FAILED), m_sqes(NULL),
+        m_in_flight(0), m_unsubmitted(0)
+   {
+      struct io_uring_params p;
+      memset(&p, 0, sizeof(p));
+      m_ring_fd = syscall(__NR_io_uring_setup, unsigned(std::max(depth, size_t(1))), &p);
+      if (m_ring_fd < 0)
+      {
+         throw runtime_error((boost::format("Unable to set up io_uring: %1%") % strerror(errno)).str());
+      }
+
+      m_sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+      m_cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+      const bool single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP);
+      if (single_mmap)
+      {
+         m_sq_size = m_cq_size = std::max(m_sq_size, m_cq_size);
+      }
+
+      m_sq_ptr = mmap(NULL, m_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      m_ring_fd, IORING_OFF_SQ_RING);
+      if (m_sq_ptr == MAP_FAILED)
+      {
+         cleanup();
+         throw runtime_error("Unable to map io_uring submission queue.");
+      }
+      if (single_mmap)
+      {
+         m_cq_ptr = m_sq_ptr;
+      }
+      else
+      {
+         m_cq_ptr = mmap(NULL, m_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         m_ring_fd, IORING_OFF_CQ_RING);
+         if (m_cq_ptr == MAP_FAILED)
+         {
+            cleanup();
+            throw runtime_error("Unable to map io_uring completion queue.");
+         }
+      }
+      m_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+      void *sqes = mmap(NULL, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        m_ring_fd, IORING_OFF_SQES);
+      if (sqes == MAP_FAILED)
+      {
+         cleanup();
+         throw runtime_error("Unable to map io_uring submission entries.");
+      }
+      m_sqes = (struct io_uring_sqe *)sqes;
+
+      char *sq = (char *)m_sq_ptr;
+      m_sq_head = (unsigned *)(sq + p.sq_off.head);
+      m_sq_tail = (unsigned *)(sq + p.sq_off.tail);
+      m_sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+      m_sq_entries = p.sq_entries;
+      m_sq_array = (unsigned *)(sq + p.sq_off.array);
+
+      char *cq = (char *)m_cq_ptr;
+      m_cq_head = (unsigned *)(cq + p.cq_off.head);
+      m_cq_tail = (unsigned *)(cq + p.cq_off.tail);
+      m_cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+      m_cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+      // never have more in flight than there's room for completions.
+      m_depth = std::min(size_t(p.cq_entries), std::max(depth, size_t(1)));
+
+      m_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if ((m_event_fd < 0) ||
+          (syscall(__NR_io_uring_register, m_ring_fd, IORING_REGISTER_EVENTFD, &m_event_fd, 1) < 0))
+      {
+         const int err = errno;
+         cleanup();
+         throw runtime_error((boost::format("Unable to register eventfd with io_uring: %1%") % strerror(err)).str());
+      }
+
+      // rings can be set up on kernels from before opening and reading
+      // files were supported, which fail each of them with EINVAL.
+      if (!supported(IORING_OP_OPENAT) || !supported(IORING_OP_READ))
+      {
+         cleanup();
+         throw runtime_error("io_uring doesn't support opening and reading files, which needs Linux 5.6");
+      }
+   }
+
+   ~uring_engine()
+   {
+      // the kernel may still be writing into buffers which belong to
+      // the callbacks, so wait for everything in flight before they go.
+      while (m_in_flight > 0)
+      {
+         if (enter(m_unsubmitted, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+         {
+            LOG_ERROR(boost::format("Unable to wait for io_uring to finish: %1%") % strerror(errno));
+            break;
+         }
+         vector<operation> done;
+         reap(done);
+         for (vector<operation>::const_iterator itr = done.begin(); itr != done.end(); ++itr)
+         {
+            discard(*itr);
+         }
+      }
+      cleanup();
+   }
+
+   void open(const char *path, const callback &cb)
+   {
+      operation &op = add(operation::op_open, cb);
+      op.path = path;
+   }
+
+   void read(int fd, char *buf, size_t size, off_t offset, const callback &cb)
+   {
+      operation &op = add(operation::op_read, cb);
+      op.fd = fd;
+      op.buf = buf;
+      op.size = size;
+      op.offset = offset;
+   }
+
+   void submit()
+   {
+      unsigned tail = *m_sq_tail;
+      const unsigned head = load_acquire(m_sq_head);
+      unsigned added = 0;
+
+      while (!m_waiting.empty() && (m_in_flight < m_depth) && (tail - head < m_sq_entries))
+      {
+         const size_t slot = m_waiting.front();
+         m_waiting.pop_front();
+         const operation &op = m_ops[slot];
+
+         const unsigned index = tail & m_sq_mask;
+         struct io_uring_sqe *sqe = &m_sqes[index];
+         memset(sqe, 0, sizeof(*sqe));
+         if (op.t == operation::op_open)
+         {
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (unsigned long)op.path;
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
+         }
+         else
+         {
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = op.fd;
+            sqe->addr = (unsigned long)op.buf;
+            sqe->len = op.size;
+            sqe->off = op.offset;
+         }
+         sqe->user_data = slot;
+         m_sq_array[index] = index;
+
+         ++tail;
+         ++added;
+         ++m_in_flight;
+      }
+
+      if (added > 0)
+      {
+         store_release(m_sq_tail, tail);
+         m_unsubmitted += added;
+      }
+      if (m_unsubmitted > 0)
+      {
+         enter(m_unsubmitted, 0, 0);
+      }
+   }
+
+   int fd() const
+   {
+      return m_event_fd;
+   }
+
+   void perform()
+   {
+      drain_event_fd(m_event_fd);
+      complete();
+   }
+
+   void wait()
+   {
+      submit();
+      if (m_in_flight == 0)
+      {
+         return;
+      }
+
+      while ((enter(m_unsubmitted, 1, IORING_ENTER_GETEVENTS) < 0) && (errno == EINTR))
+      {
+      }
+      perform();
+   }
+
+   const char *name() const
+   {
+      return "io_uring";
+   }
+
+private:
+   operation &add(operation::type t, const callback &cb)
+   {
+      size_t slot;
+      if (m_free.empty())
+      {
+         slot = m_ops.size();
+         m_ops.push_back(operation());
+      }
+      else
+      {
+         slot = m_free.back();
+         m_free.pop_back();
+      }
+      m_waiting.push_back(slot);
+
+      operation &op = m_ops[slot];
+      op.t = t;
+      op.cb = cb;
+      return op;
+   }
+
+   // whether the kernel supports the operation. kernels too old to be
+   // asked don't support any of the ones used here.
+   bool supported(unsigned op) const
+   {
+      const unsigned num_ops = 256;
+      vector<char> buf(sizeof(struct io_uring_probe) + num_ops * sizeof(struct io_uring_probe_op), 0);
+      struct io_uring_probe *probe = (struct io_uring_probe *)&buf[0];
+      if (syscall(__NR_io_uring_register, m_ring_fd, IORING_REGISTER_PROBE, probe, num_ops) < 0)
+      {
+         return false;
+      }
+      return (op <= probe->last_op) && (op < num_ops) && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+   }
+
+   // submit, and get any events, returning what io_uring_enter did.
+   int enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+   {
+      int ret = syscall(__NR_io_uring_enter, m_ring_fd, to_submit, min_complete, flags, NULL, 0);
+      if (ret > 0)
+      {
+         m_unsubmitted -= std::min(unsigned(ret), m_unsubmitted);
+      }
+      else if ((ret < 0) && (errno != EINTR) && (errno != EAGAIN) && (errno != EBUSY))
+      {
+         LOG_ERROR(boost::format("io_uring_enter failed: %1%") % strerror(errno));
+      }
+      return ret;
+   }
+
+   // take the finished operations off the completion queue, freeing
+   // their slots.
+   void reap(vector<operation> &done)
+   {
+      unsigned head = *m_cq_head;
+      const unsigned tail = load_acquire(m_cq_tail);
+      while (head != tail)
+      {
+         const struct io_uring_cqe &cqe = m_cqes[head & m_cq_mask];
+         operation &op = m_ops[cqe.user_data];
+         op.result = cqe.res;
+         done.push_back(op);
+         op.cb.clear();
+         m_free.push_back(cqe.user_data);
+         ++head;
+      }
+      store_release(m_cq_head, head);
+      m_in_flight -= done.size();
+   }
+
+   void complete()
+   {
+      vector<operation> done;
+      reap(done);
+      for (vector<operation>::const_iterator itr = done.begin(); itr != done.end(); ++itr)
+      {
+         itr->cb(itr->result);
+      }
+      submit();
+   }
+
+   void cleanup()
+   {
+      if (m_sqes != NULL)
+      {
+         munmap(m_sqes, m_sqes_size);
+      }
+      if ((m_cq_ptr != MAP_FAILED) && (m_cq_ptr != m_sq_ptr))
+      {
+         munmap(m_cq_ptr, m_cq_size);
+      }
+      if (m_sq_ptr != MAP_FAILED)
+      {
+         munmap(m_sq_ptr, m_sq_size);
+      }
+      if (m_event_fd >= 0)
+      {
+         close(m_event_fd);
+      }
+      if (m_ring_fd >= 0)
+      {
+         close(m_ring_fd);
+      }
+   }
+
+   int m_ring_fd, m_event_fd;
+   void *m_sq_ptr, *m_cq_ptr;
+   size_t m_sq_size, m_cq_size, m_sqes_size;
+   struct io_uring_sqe *m_sqes;
+   volatile unsigned *m_sq_head, *m_sq_tail, *m_sq_array;
+   unsigned m_sq_mask, m_sq_entries;
+   volatile unsigned *m_cq_head, *m_cq_tail;
+   unsigned m_cq_mask;
+   struct io_uring_cqe *m_cqes;
+
+   size_t m_depth, m_in_flight;
+   unsigned m_unsubmitted;
+   vector<operation> m_ops;
+   vector<size_t> m_free;
+   // queued, but not yet on the submission queue.
+   deque<size_t> m_waiting;
+};
+
+#endif // RENDERMQ_HAVE_IO_URING
+
+} // anonymous namespace
+
+io_engine::~io_engine()
+{
+}
+
+io_engine *
+io_engine::create(const string &type, size_t depth, size_t threads)
+{
+   if ((type == "io_uring") || (type == "auto"))
+   {
+#ifdef RENDERMQ_HAVE_IO_URING
+      try
+      {
+         return new uring_engine(depth);
+      }
+      catch (const std::exception &e)
+      {
+         if (type == "io_uring")
+         {
+            LOG_ERROR(e.what());
+            return NULL;
+         }
+         LOG_INFO(boost::format("%1%, falling back to threads.") % e.what());
+      }
+#else
+      if (type == "io_uring")
+      {
+         LOG_ERROR("io_uring support was not built in.");
+         return NULL;
+      }
+#endif
+      return new thread_engine(threads);
+   }
+   else if (type == "threads")
+   {
+      return new thread_engine(threads);
+   }
+
+   LOG_ERROR(boost::format("Unknown I/O engine type '%1%'.") % type);
+   return NULL;
+}
+
+}
@@ -0,0 +1,107 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: artem@mapnik-consulting.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef RENDERMQ_IO_ENGINE_HPP
+#define RENDERMQ_IO_ENGINE_HPP
+
+#include <boost/function.hpp>
+#include <boost/utility.hpp>
+#include <sys/types.h>
+#include <string>
+
+// type of engine, see io_engine::create().
+#define DEFAULT_IO_ENGINE "auto"
+// operations which an engine keeps outstanding with the kernel at once.
+#define DEFAULT_IO_DEPTH (256)
+// threads in the pool used when io_uring isn't available.
+#define DEFAULT_IO_THREADS (16)
+
+namespace rendermq
+{
+
+/* runs file system operations in the background for disk_storage, so
+ * that one thread can have many reads outstanding at once and the
+ * disks see enough of a queue to schedule them well.
+ *
+ * operations are queued, then started together by submit(), and each
+ * calls back with what the system call returned, or minus the error
+ * number if it failed. the callbacks are only called from perform() or
+ * wait(), in the thread which calls them, and may queue more
+ * operations, which are submitted when the callbacks have finished.
+ *
+ * where the kernel supports it, this uses io_uring, so that submitting
+ * a whole batch is a single system call. otherwise the operations are
+ * run by a pool of threads doing the ordinary blocking calls.
+ *
+ * like the storage which owns it, an engine is only used by one thread.
+ */
+class io_engine
+   : private boost::noncopyable
+{
+public:
+   typedef boost::function<void (int)> callback;
+
+   virtual ~io_engine();
+
+   // open the path for reading. the path must stay valid until the
+   // callback.
+   virtual void open(const char *path, const callback &cb) = 0;
+
+   // read into the buffer from the offset in the file. the buffer
+   // must stay valid until the callback.
+   virtual void read(int fd, char *buf, size_t size, off_t offset, const callback &cb) = 0;
+
+   // start everything which has been queued.
+   virtual void submit() = 0;
+
+   // a file descriptor which becomes readable when operations have
+   // finished.
+   virtual int fd() const = 0;
+
+   // call back for all the operations which have finished, without
+   // blocking.
+   virtual void perform() = 0;
+
+   // block until at least one operation has finished, and then call
+   // back for all of those which have.
+   virtual void wait() = 0;
+
+   // the name of the implementation, for logging.
+   virtual const char *name() const = 0;
+
+   /* make an engine of the given type, which is "io_uring", "threads"
+    * or "auto" to use io_uring if the kernel supports it, including
+    * opening and reading files, and threads otherwise. returns null if
+    * the type isn't known, or io_uring was asked for and isn't available.
+    *
+    * @param depth most operations outstanding with the kernel at once.
+    * @param threads number of threads when falling back to a pool.
+    */
+   static io_engine *create(const std::string &type, size_t depth, size_t threads);
+};
+
+}
+
+#endif // RENDERMQ_IO_ENGINE_HPP
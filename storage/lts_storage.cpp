@@ -29,6 +29,23 @@
 #define DEFAULT_CONCURRENCY (16) //how many HTTP connections to open to the back-end
 #define DEFAULT_VERSION "0"
 #define DEFAULT_DOWN_RECHECK_TIME (300) // how often to recheck that a down LTS host is still down.
+#define DEFAULT_HEALTH_FAILURE_THRESHOLD (1) // failed requests in a row before an LTS host is down
+#define DEFAULT_HEALTH_PROBE_INTERVAL (1000L) // ms between probes of a down LTS host, 0 not to probe
+#define DEFAULT_BUNDLES (true) // whether to get and put whole metatiles to each host in one request
+#define DEFAULT_HEDGE (true) // whether to send slow reads to the replica as well
+#define DEFAULT_HEDGE_DELAY (-1) // ms before hedging a read, negative to use the host's latency percentile
+#define DEFAULT_HEDGE_PERCENTILE (95.0) // percentile of the host's latency to hedge reads after
+
+// how many of the latest requests to each host to keep the latency of, how
+// many are needed before the percentile is used, and the delay to use
+// before that.
+#define HEDGE_WINDOW (256)
+#define HEDGE_MIN_SAMPLES (32)
+#define HEDGE_INITIAL_DELAY (100L)
+// how many new samples before the percentile is worked out again.
+#define HEDGE_RESORT_SAMPLES (16)
+// how often, in seconds, to log how many reads were hedged.
+#define HEDGE_LOG_INTERVAL (300)
 
 // 300ms timeout for connect (just the TCP handshake - not the whole HTTP
 // transaction) to help prevent the storage_worker getting bogged down in
@@ -38,6 +55,9 @@
 #include "lts_storage.hpp"
 #include "../tile_utils.hpp"
 #include <time.h>
+#include <deque>
+#include <list>
+#include <algorithm>
 
 #include <boost/foreach.hpp> //for each macro
 #include <boost/algorithm/string/split.hpp> //split
@@ -45,6 +65,7 @@
 #include <boost/algorithm/string/classification.hpp> //is_any_of
 #include <boost/algorithm/string/constants.hpp> //token_compress_on
 #include <boost/lexical_cast.hpp> //lexical_cast
+#include <boost/bind.hpp> //bind
 //#include <boost/algorithm/string.hpp> //str
 
 namespace rendermq
@@ -60,6 +81,12 @@ namespace rendermq
          string version = pt.get<string>("version", DEFAULT_VERSION);
          unsigned int concurrency = pt.get<unsigned int>("concurrency", DEFAULT_CONCURRENCY);
          int down_recheck_time = pt.get<unsigned int>("down_recheck_time", DEFAULT_DOWN_RECHECK_TIME);
+         bool bundles = pt.get<bool>("bundles", DEFAULT_BUNDLES);
+         bool hedge = pt.get<bool>("hedge", DEFAULT_HEDGE);
+         long hedge_delay = pt.get<long>("hedge_delay", DEFAULT_HEDGE_DELAY);
+         double hedge_percentile = pt.get<double>("hedge_percentile", DEFAULT_HEDGE_PERCENTILE);
+         int failure_threshold = pt.get<int>("failure_threshold", DEFAULT_HEALTH_FAILURE_THRESHOLD);
+         long health_probe_interval = pt.get<long>("health_probe_interval", DEFAULT_HEALTH_PROBE_INTERVAL);
 
          vecHostInfo vecHosts;
          if(hosts)
@@ -93,8 +120,12 @@ namespace rendermq
          //required
          if(vecHosts.size() && config && app_name)
          {
+            //shared by all the storage in the process, so the last one wins
+            host_health::instance().configure(failure_threshold, long(down_recheck_time) * 1000L, health_probe_interval);
+
             //make sure that it has hosts to write to
-            lts_storage* storage = new lts_storage(vecHosts, *config, *app_name, version, concurrency, down_recheck_time);
+            lts_storage* storage = new lts_storage(vecHosts, *config, *app_name, version, concurrency, down_recheck_time, bundles,
+                                                   hedge, hedge_delay, hedge_percentile);
             if(storage->getHostCount())
                return storage;
             else
@@ -108,11 +139,21 @@ namespace rendermq
    } // anonymous namespace
 
 
-   lts_storage::lts_storage(const vecHostInfo& vecHosts, const string& config, const string& app_name, const string& version, const int& concurency, int down_recheck_time):
-      http_storage(false, concurency), app_name(app_name), version(version),
-      m_down_recheck_time(down_recheck_time)
+   lts_storage::lts_storage(const vecHostInfo& vecHosts, const string& config, const string& app_name, const string& version, const int& concurency, int down_recheck_time, bool bundles,
+                            bool hedge, long hedge_delay, double hedge_percentile):
+      http_storage(concurency), app_name(app_name), version(version),
+      m_down_recheck_time(down_recheck_time), m_bundles(bundles),
+      m_hedge(hedge), m_hedge_delay(hedge_delay), m_hedge_percentile(hedge_percentile),
+      m_hedge_log_time(time(NULL))
    {
       this->pHashWrapper = boost::make_shared<hashWrapper>(config, vecHosts);
+
+      //the health of each host is shared with all the other storage in
+      //the process, so look them all up now and never change the map.
+      BOOST_FOREACH(const vecHostInfo::value_type &host, vecHosts)
+      {
+         m_health[host] = host_health::instance().add(host.first, host.second);
+      }
    }
 
    lts_storage::~lts_storage()
@@ -156,119 +197,923 @@ namespace rendermq
       part->fileName = url.c_str();
       requests.push_back(make_pair(url, parts));
 
-      //put the tile
-      put_meta_serial(requests, headers);
+      //put the tile
+      put_meta_serial(requests, headers);
+   }
+
+   host_health::host *lts_storage::health_of(const std::pair<string, int> &host) const
+   {
+      std::map<std::pair<string, int>, host_health::host *, cmp_pair>::const_iterator itr = m_health.find(host);
+      if (itr != m_health.end())
+      {
+         return itr->second;
+      }
+      //the hash only gives out hosts it was set up with, so this shouldn't
+      //happen, but the table can always look it up.
+      return host_health::instance().add(host.first, host.second);
+   }
+
+   bool lts_storage::is_host_down(const std::pair<string, int> &host) const
+   {
+      return !host_health::instance().allow(health_of(host));
+   }
+
+   bool lts_storage::is_host_known_down(const std::pair<string, int> &host) const
+   {
+      return host_health::instance().current(health_of(host)) == host_health::state_open;
+   }
+
+   void lts_storage::host_is_down(const std::pair<string, int> &host) const
+   {
+      host_health::instance().failed(health_of(host));
+   }
+
+   void lts_storage::host_is_up(const std::pair<string, int> &host) const
+   {
+      host_health::instance().succeeded(health_of(host));
+   }
+
+   shared_ptr<http::response> lts_storage::check_host_response(const tile_protocol &tile, const std::pair<string, int> &host, shared_ptr<http::response> response) const
+   {
+      if (!response)
+      {
+         LOG_ERROR(boost::format("Error getting LTS tile %1% from LTS host %2%, marking host as down.") % tile % host.first);
+         host_is_down(host);
+         return response;
+      }
+      host_is_up(host);
+
+      int status_code = response->statusCode;
+      if(status_code != 200)
+      {
+         response.reset();
+
+         // status code 404 (not found) is a perfectly normal runtime condition
+         // and doesn't need logging. anything else is interesting and wants to
+         // be logged.
+         if (status_code != 404)
+         {
+            LOG_WARNING((boost::format("getting LTS tile returned status code %1%") % status_code).str());
+         }
+      }
+
+      return response;
+   }
+
+   shared_ptr<tile_storage::handle> lts_storage::get(const tile_protocol &tile) const
+   {
+      return get_from_replicas(tile, false);
+   }
+
+   shared_ptr<tile_storage::handle> lts_storage::probe(const tile_protocol &tile) const
+   {
+      return get_from_replicas(tile, true);
+   }
+
+   namespace
+   {
+      // milliseconds on the monotonic clock, for timing requests.
+      double now_ms()
+      {
+         struct timespec ts;
+         clock_gettime(CLOCK_MONOTONIC, &ts);
+         return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+      }
+
+      // callbacks for the blocking calls which wait on the asynchronous ones
+      void store_handle(bool *done, shared_ptr<tile_storage::handle> *out, shared_ptr<tile_storage::handle> result)
+      {
+         *out = result;
+         *done = true;
+      }
+
+      void store_meta_result(bool *done, bool *ok, string *out, bool result, const string &metatile)
+      {
+         *ok = result;
+         if (result)
+         {
+            *out = metatile;
+         }
+         *done = true;
+      }
+
+      void store_result(bool *done, bool *ok, bool result)
+      {
+         *ok = result;
+         *done = true;
+      }
+   }
+
+   shared_ptr<tile_storage::handle> lts_storage::get_from_replicas(const tile_protocol &tile, bool head) const
+   {
+      bool done = false;
+      shared_ptr<tile_storage::handle> result;
+      read_async(tile, head, boost::bind(&store_handle, &done, &result, _1));
+      wait_for(done, "tile get");
+
+      if (!result)
+      {
+         //return a bad response
+         result.reset(new handle(shared_ptr<http::response>(new http::response())));
+      }
+      return result;
+   }
+
+   void lts_storage::get_async(const tile_protocol &tile, const get_callback &callback) const
+   {
+      read_async(tile, false, callback);
+   }
+
+   void lts_storage::probe_async(const tile_protocol &tile, const get_callback &callback) const
+   {
+      read_async(tile, true, callback);
+   }
+
+   struct lts_storage::hedged_read
+   {
+      tile_protocol tile;
+      bool head;
+      get_callback callback;
+      std::pair<string, int> hosts[2];
+      // the request to each replica, and whether it's been started and
+      // has finished.
+      http::async_client::request_id requests[2];
+      bool started[2], finished[2];
+      // the hedge timer, if it hasn't gone off yet.
+      http::async_client::request_id timer;
+      bool timer_pending;
+      bool hedged, done;
+   };
+
+   void lts_storage::read_async(const tile_protocol &tile, bool head, const get_callback &callback) const
+   {
+      shared_ptr<hedged_read> read(new hedged_read);
+      read->tile = tile;
+      read->head = head;
+      read->callback = callback;
+      for (int replica = 0; replica < 2; ++replica)
+      {
+         read->hosts[replica] = hashed_host(tile.x, tile.y, tile.z, replica);
+         read->started[replica] = read->finished[replica] = false;
+      }
+      read->timer_pending = read->hedged = read->done = false;
+      ++m_hedge_stats.reads;
+
+      start_read(read, 0);
+
+      //if the primary is still going, give it until the hedge delay
+      //before asking the replica too
+      if (m_hedge && !read->done && !read->started[1] && read->hosts[0] != read->hosts[1] && !is_host_known_down(read->hosts[1]))
+      {
+         long delay = hedge_delay(read->hosts[0]);
+         read->timer = m_async.after(delay, boost::bind(&lts_storage::hedge_read, this, read));
+         read->timer_pending = true;
+      }
+   }
+
+   void lts_storage::start_read(shared_ptr<hedged_read> read, int replica) const
+   {
+      read->started[replica] = true;
+
+      // if the host is down, then don't bother trying again, go straight
+      // to the next replica.
+      if (is_host_down(read->hosts[replica]))
+      {
+         read->finished[replica] = true;
+         read_failed(read);
+         return;
+      }
+
+      const tile_protocol &tile = read->tile;
+      string url = this->form_url(tile.x, tile.y, tile.z, tile.style, tile.format, replica);
+      vector<string> headers;
+      headers.push_back((boost::format("X-Replica: %1%") % replica).str());
+
+      const double started = now_ms();
+      try
+      {
+         http::async_client::callback_t handler =
+            boost::bind(&lts_storage::handle_read, this, read, replica, started, _1);
+         if (read->head)
+         {
+            read->requests[replica] = m_async.head(url, headers, handler, LTS_CONNECT_TIMEOUT);
+         }
+         else
+         {
+            read->requests[replica] = m_async.get(url, headers, handler, LTS_CONNECT_TIMEOUT);
+         }
+      }
+      catch (const std::exception &e)
+      {
+         LOG_ERROR(boost::format("Runtime error starting get of LTS tile %1%: %2%") % tile % e.what());
+         handle_read(read, replica, started, shared_ptr<http::response>());
+      }
+   }
+
+   void lts_storage::hedge_read(shared_ptr<hedged_read> read) const
+   {
+      read->timer_pending = false;
+      if (read->done || read->started[1] || is_host_known_down(read->hosts[1]))
+      {
+         return;
+      }
+
+      read->hedged = true;
+      ++m_hedge_stats.hedged;
+      start_read(read, 1);
+   }
+
+   void lts_storage::handle_read(shared_ptr<hedged_read> read, int replica, double started,
+                                 shared_ptr<http::response> response) const
+   {
+      read->finished[replica] = true;
+      if (response)
+      {
+         record_latency(read->hosts[replica], now_ms() - started);
+      }
+
+      response = check_host_response(read->tile, read->hosts[replica], response);
+      if (read->done)
+      {
+         return;
+      }
+
+      if (response)
+      {
+         if (replica == 1 && read->hedged)
+         {
+            ++m_hedge_stats.replica_won;
+         }
+         finish_read(read, response);
+      }
+      else
+      {
+         read_failed(read);
+      }
+   }
+
+   void lts_storage::read_failed(shared_ptr<hedged_read> read) const
+   {
+      if (!read->started[1])
+      {
+         //try to get the secondary copy, without waiting for the hedge
+         start_read(read, 1);
+      }
+      else if ((!read->started[0] || read->finished[0]) && read->finished[1])
+      {
+         //return a bad response
+         // no logging here - this happens when we get a 404, which is a
+         // perfectly normal situation.
+         finish_read(read, shared_ptr<http::response>(new http::response()));
+      }
+      //otherwise the other replica is still going
+   }
+
+   void lts_storage::finish_read(shared_ptr<hedged_read> read, shared_ptr<http::response> response) const
+   {
+      read->done = true;
+
+      //first one back wins, so the other doesn't need to bother
+      if (read->timer_pending)
+      {
+         m_async.cancel(read->timer);
+         read->timer_pending = false;
+      }
+      for (int replica = 0; replica < 2; ++replica)
+      {
+         if (read->started[replica] && !read->finished[replica])
+         {
+            m_async.cancel(read->requests[replica]);
+         }
+      }
+
+      log_hedge_stats();
+      read->callback(shared_ptr<tile_storage::handle>(new handle(response)));
+   }
+
+   lts_storage::latency_window::latency_window()
+      : next(0), since_sorted(0), cached_p(-1.0), cached(-1.0)
+   {
+      samples.reserve(HEDGE_WINDOW);
+   }
+
+   void lts_storage::latency_window::add(double latency)
+   {
+      if (samples.size() < HEDGE_WINDOW)
+      {
+         samples.push_back(latency);
+      }
+      else
+      {
+         samples[next] = latency;
+         next = (next + 1) % HEDGE_WINDOW;
+      }
+      ++since_sorted;
+   }
+
+   double lts_storage::latency_window::percentile(double p)
+   {
+      if (samples.size() < HEDGE_MIN_SAMPLES)
+      {
+         return -1.0;
+      }
+
+      //working it out for every read would be a waste, it doesn't change much
+      if (p != cached_p || since_sorted >= HEDGE_RESORT_SAMPLES)
+      {
+         vector<double> sorted(samples);
+         size_t rank = std::min(sorted.size() - 1, size_t(p / 100.0 * sorted.size()));
+         std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+         cached = sorted[rank];
+         cached_p = p;
+         since_sorted = 0;
+      }
+      return cached;
+   }
+
+   void lts_storage::record_latency(const std::pair<string, int> &host, double latency) const
+   {
+      m_latency[host].add(latency);
+   }
+
+   long lts_storage::hedge_delay(const std::pair<string, int> &host) const
+   {
+      if (!m_hedge)
+      {
+         return -1;
+      }
+      if (m_hedge_delay >= 0)
+      {
+         return m_hedge_delay;
+      }
+
+      double latency = m_latency[host].percentile(m_hedge_percentile);
+      if (latency < 0.0)
+      {
+         return HEDGE_INITIAL_DELAY;
+      }
+      //round up, so that very quick hosts don't get every read hedged
+      return long(latency) + 1;
+   }
+
+   lts_storage::hedge_stats lts_storage::get_hedge_stats() const
+   {
+      return m_hedge_stats;
+   }
+
+   void lts_storage::log_hedge_stats() const
+   {
+      time_t now = time(NULL);
+      if (now < m_hedge_log_time + HEDGE_LOG_INTERVAL)
+      {
+         return;
+      }
+
+      const size_t reads = m_hedge_stats.reads - m_hedge_logged.reads;
+      const size_t hedged = m_hedge_stats.hedged - m_hedge_logged.hedged;
+      const size_t won = m_hedge_stats.replica_won - m_hedge_logged.replica_won;
+      if (reads > 0)
+      {
+         LOG_INFO(boost::format("LTS hedged %1% of %2% reads (%3$.1f%%) in the last %4%s, the replica answered first for %5% of them.")
+                  % hedged % reads % (100.0 * hedged / reads) % (now - m_hedge_log_time) % won);
+      }
+      m_hedge_logged = m_hedge_stats;
+      m_hedge_log_time = now;
+   }
+
+   struct lts_storage::meta_fetch
+   {
+      tile_protocol tile;
+      get_meta_callback callback;
+      // responses from the primary and the replica
+      vector<shared_ptr<http::response> > responses[2];
+      // which replica is currently being fetched and how many of its
+      // requests are still outstanding.
+      int replica;
+      size_t remaining;
+   };
+
+   void lts_storage::get_meta_async(const tile_protocol &tile, const get_meta_callback &callback) const
+   {
+      shared_ptr<meta_fetch> fetch(new meta_fetch);
+      fetch->tile = tile;
+      fetch->callback = callback;
+      fetch_meta_async(fetch, 0);
+   }
+
+   void lts_storage::fetch_meta_async(shared_ptr<meta_fetch> fetch, int replica) const
+   {
+      if (m_bundles)
+      {
+         fetch->replica = replica;
+         get_bundles_async(fetch->tile, replica, boost::bind(&lts_storage::handle_meta_bundles, this, fetch, _2));
+         return;
+      }
+
+      vector<string> headers = this->make_headers(NULL, (replica == 0 ? "X-Replica: 0" : "X-Replica: 1"), (char*)NULL);
+      vector<string> requests = make_get_urls(fetch->tile, replica == 0);
+
+      fetch->replica = replica;
+      fetch->remaining = requests.size();
+      fetch->responses[replica].resize(requests.size());
+
+      for (size_t i = 0; i < requests.size(); ++i)
+      {
+         try
+         {
+            m_async.get(requests[i], headers,
+                        boost::bind(&lts_storage::handle_meta_response, this, fetch, i, _1));
+         }
+         catch (const std::exception &e)
+         {
+            LOG_ERROR(boost::format("Runtime error starting get of LTS tile: %1%") % e.what());
+            handle_meta_response(fetch, i, shared_ptr<http::response>());
+         }
+      }
+   }
+
+   void lts_storage::handle_meta_response(shared_ptr<meta_fetch> fetch, size_t index, shared_ptr<http::response> response) const
+   {
+      //an error is treated the same as a missing tile
+      if (!response)
+      {
+         response = shared_ptr<http::response>(new http::response());
+      }
+      fetch->responses[fetch->replica][index] = response;
+
+      if (--fetch->remaining == 0)
+      {
+         finish_meta_async(fetch);
+      }
+   }
+
+   void lts_storage::handle_meta_bundles(shared_ptr<meta_fetch> fetch, const vector<shared_ptr<http::response> > &responses) const
+   {
+      fetch->responses[fetch->replica] = responses;
+      finish_meta_async(fetch);
+   }
+
+   void lts_storage::finish_meta_async(shared_ptr<meta_fetch> fetch) const
+   {
+      const vector<shared_ptr<http::response> > &current = fetch->responses[fetch->replica];
+
+      bool complete = true;
+      BOOST_FOREACH(shared_ptr<http::response> response, current)
+      {
+         if (response->statusCode != 200 || response->timeStamp == INVALID_TIMESTAMP)
+         {
+            complete = false;
+            break;
+         }
+      }
+
+      string metatile;
+      if (complete)
+      {
+         make_metatile(fetch->tile, current, metatile);
+         fetch->callback(true, metatile);
+      }
+      else if (fetch->replica == 0)
+      {
+         //try to get the second copy
+         fetch_meta_async(fetch, 1);
+      }
+      else
+      {
+         //see if we can get the full set by combining the two
+         vector<shared_ptr<http::response> > responsesCombined;
+         vector<shared_ptr<http::response> >::const_iterator response0, response1;
+         for(response0 = fetch->responses[0].begin(), response1 = fetch->responses[1].begin(); response0 != fetch->responses[0].end(); ++response0, ++response1)
+         {
+            if((*response0)->statusCode == 200 && (*response0)->timeStamp != INVALID_TIMESTAMP)
+               responsesCombined.push_back(*response0);
+            else if((*response1)->statusCode == 200 && (*response1)->timeStamp != INVALID_TIMESTAMP)
+               responsesCombined.push_back(*response1);
+            else
+            {
+               fetch->callback(false, metatile);
+               return;
+            }
+         }
+         make_metatile(fetch->tile, responsesCombined, metatile);
+         fetch->callback(true, metatile);
+      }
+   }
+
+   struct lts_storage::bundle_op
+   {
+      tile_protocol tile;
+      int replica;
+      bool put;
+      vector<protoFmt> formats;
+      int dim;
+      pair<int, int> coord;
+      vector<string> headers;
+      bundle_callback callback;
+      //get: a response for each tile, in the same order as make_get_urls
+      vector<shared_ptr<http::response> > responses;
+      //put: the metatile, its headers, and the bundles and urls which the
+      //requests point into. a list, so that adding more doesn't move them.
+      shared_ptr<const string> metatile;
+      vector<meta_layout*> layouts;
+      std::list<string> buffers;
+      //requests still outstanding, plus one while they're being started
+      size_t remaining;
+      bool ok;
+   };
+
+   lts_storage::host_positions lts_storage::positions_by_host(const tile_protocol &tile, int replica) const
+   {
+      host_positions hosts;
+      pair<int, int> coord = xy_to_meta_xy(tile.x, tile.y);
+      int dim = get_meta_dimensions(tile.z);
+      for (int dy = 0; dy < dim; ++dy)
+      {
+         for (int dx = 0; dx < dim; ++dx)
+         {
+            hosts[hashed_host(coord.first + dx, coord.second + dy, tile.z, replica)].push_back(dy * dim + dx);
+         }
+      }
+      return hosts;
+   }
+
+   string lts_storage::form_bundle_url(const tile_protocol &tile, const std::pair<string, int> &host, int formats) const
+   {
+      pair<int, int> coord = xy_to_meta_xy(tile.x, tile.y);
+      std::stringstream stream;
+      stream << "http://" << host.first << ":" << host.second << "/" << version << "/" << this->app_name << tile.style << "/"
+             << tile.z << "/" << coord.first << "/" << coord.second << ".meta?formats=" << formats;
+      return stream.str();
+   }
+
+   bool lts_storage::bundles_supported(const std::pair<string, int> &host) const
+   {
+      boost::mutex::scoped_lock lock(m_no_bundles_mutex);
+      std::map<std::pair<string, int>, time_t, cmp_pair>::iterator itr = m_no_bundles.find(host);
+      if (itr == m_no_bundles.end())
+      {
+         return true;
+      }
+      if (time(NULL) > itr->second)
+      {
+         //time to give it another go
+         m_no_bundles.erase(itr);
+         return true;
+      }
+      return false;
+   }
+
+   void lts_storage::no_bundles(const std::pair<string, int> &host) const
+   {
+      boost::mutex::scoped_lock lock(m_no_bundles_mutex);
+      if (m_no_bundles.find(host) == m_no_bundles.end())
+      {
+         LOG_INFO(boost::format("LTS host %1%:%2% doesn't support metatile bundles, using per-tile requests.") % host.first % host.second);
+      }
+      m_no_bundles[host] = time(NULL) + m_down_recheck_time;
+   }
+
+   void lts_storage::wait_for(const bool &done, const char *what) const
+   {
+      while (!done)
+      {
+         if (m_async.in_flight() == 0)
+         {
+            LOG_ERROR(boost::format("LTS %1% not finished, but no requests in flight.") % what);
+            break;
+         }
+         m_async.wait(-1);
+      }
+   }
+
+   void lts_storage::complete_bundle_request(shared_ptr<bundle_op> op) const
+   {
+      if (--op->remaining > 0)
+      {
+         return;
+      }
+
+      //for a get, all the tiles have to be there and not dirty
+      if (!op->put)
+      {
+         BOOST_FOREACH(shared_ptr<http::response> response, op->responses)
+         {
+            if (response->statusCode != 200 || response->timeStamp == INVALID_TIMESTAMP)
+            {
+               op->ok = false;
+               break;
+            }
+         }
+      }
+      op->callback(op->ok, op->responses);
+   }
+
+   void lts_storage::get_bundles_async(const tile_protocol &tile, int replica, const bundle_callback &callback) const
+   {
+      shared_ptr<bundle_op> op(new bundle_op);
+      op->tile = tile;
+      op->replica = replica;
+      op->put = false;
+      op->formats = get_formats_vec(tile.format);
+      op->dim = get_meta_dimensions(tile.z);
+      op->coord = xy_to_meta_xy(tile.x, tile.y);
+      op->headers = this->make_headers(NULL, (replica == 0 ? "X-Replica: 0" : "X-Replica: 1"), (char*)NULL);
+      op->callback = callback;
+      op->remaining = 1;
+      op->ok = true;
+
+      //tiles which don't come back stay as bad responses
+      op->responses.resize(op->formats.size() * op->dim * op->dim);
+      BOOST_FOREACH(shared_ptr<http::response> &response, op->responses)
+      {
+         response.reset(new http::response());
+      }
+
+      const host_positions hosts = positions_by_host(tile, replica);
+      for (host_positions::const_iterator itr = hosts.begin(); itr != hosts.end(); ++itr)
+      {
+         if (is_host_down(itr->first))
+         {
+            continue;
+         }
+         if (!bundles_supported(itr->first))
+         {
+            start_tile_gets(op, itr->second);
+            continue;
+         }
+
+         http::async_client::callback_t handler =
+            boost::bind(&lts_storage::handle_bundle_get, this, op, itr->first, itr->second, _1);
+         ++op->remaining;
+         try
+         {
+            m_async.get(form_bundle_url(tile, itr->first, tile.format), op->headers, handler, LTS_CONNECT_TIMEOUT);
+         }
+         catch (const std::exception &e)
+         {
+            LOG_ERROR(boost::format("Runtime error starting get of LTS metatile %1%: %2%") % tile % e.what());
+            handler(shared_ptr<http::response>());
+         }
+      }
+
+      complete_bundle_request(op);
    }
 
-   bool lts_storage::is_host_down(const std::pair<string, int> &host) const
+   void lts_storage::start_tile_gets(shared_ptr<bundle_op> op, const vector<int> &positions) const
    {
-      std::map<std::pair<string, int>, time_t>::iterator itr = m_hosts_down.find(host);
-      if (itr != m_hosts_down.end())
+      for (size_t f = 0; f < op->formats.size(); ++f)
       {
-         time_t now = time(NULL);
-         if (now > itr->second)
+         BOOST_FOREACH(int pos, positions)
          {
-            // time has elapsed - remove the record and treat as if it were
-            // not down.
-            m_hosts_down.erase(itr);
-            return false;
-         }
-         else
-         {
-            return true;
+            const size_t index = f * op->dim * op->dim + pos;
+            const string url = form_url(op->coord.first + pos % op->dim, op->coord.second + pos / op->dim,
+                                        op->tile.z, op->tile.style, op->formats[f], op->replica);
+            http::async_client::callback_t handler = boost::bind(&lts_storage::handle_tile_get, this, op, index, _1);
+            ++op->remaining;
+            try
+            {
+               m_async.get(url, op->headers, handler, LTS_CONNECT_TIMEOUT);
+            }
+            catch (const std::exception &e)
+            {
+               LOG_ERROR(boost::format("Runtime error starting get of LTS tile: %1%") % e.what());
+               handler(shared_ptr<http::response>());
+            }
          }
       }
-      return false;
    }
 
-   void lts_storage::host_is_down(const std::pair<string, int> &host) const
+   void lts_storage::handle_bundle_get(shared_ptr<bundle_op> op, const std::pair<string, int> &host, const vector<int> &positions,
+                                       shared_ptr<http::response> response) const
    {
-      time_t recheck_time = time(NULL) + m_down_recheck_time;
-      std::map<std::pair<string, int>, time_t>::iterator itr = m_hosts_down.find(host);
-      if (itr == m_hosts_down.end())
+      if (!response)
       {
-         m_hosts_down.insert(make_pair(host, recheck_time));
+         LOG_ERROR(boost::format("Error getting LTS metatile %1% from LTS host %2%, marking host as down.") % op->tile % host.first);
+         host_is_down(host);
+         complete_bundle_request(op);
+         return;
       }
-      else
+
+      host_is_up(host);
+      if (response->statusCode != 200 || !unpack_bundle(op, positions, *response))
+      {
+         no_bundles(host);
+         start_tile_gets(op, positions);
+      }
+      complete_bundle_request(op);
+   }
+
+   void lts_storage::handle_tile_get(shared_ptr<bundle_op> op, size_t index, shared_ptr<http::response> response) const
+   {
+      //an error is treated the same as a missing tile
+      if (response)
       {
-         itr->second = recheck_time;
+         op->responses[index] = response;
       }
+      complete_bundle_request(op);
    }
 
-   shared_ptr<http::response> lts_storage::attempt_get_host(const tile_protocol &tile, int replica) const
+   bool lts_storage::unpack_bundle(shared_ptr<bundle_op> op, const vector<int> &positions, const http::response &bundle) const
    {
-      shared_ptr<http::response> response;
-      std::pair<string, int> hashedHost = hashed_host(tile.x, tile.y, tile.z, replica);
+      const string &body = bundle.body;
+      vector<meta_layout*> layouts = read_headers(body, fmtAll);
+      if (layouts.empty())
+      {
+         return false;
+      }
 
-      // if the host is down, then don't bother trying again - it's just
-      // a waste of time and blocks other requests in the queue.
-      if (!is_host_down(hashedHost))
+      for (size_t f = 0; f < op->formats.size(); ++f)
       {
-         // try to get the tile
-         try
+         const meta_layout *layout = NULL;
+         BOOST_FOREACH(const meta_layout *l, layouts)
+         {
+            if (l->fmt == op->formats[f])
+            {
+               layout = l;
+               break;
+            }
+         }
+         //the node doesn't have any tiles in this format
+         if (layout == NULL)
+         {
+            continue;
+         }
+
+         BOOST_FOREACH(int pos, positions)
          {
-            //make the url
-            string url = this->form_url(tile.x, tile.y, tile.z, tile.style, tile.format, replica);
+            const entry &e = layout->index[(pos / op->dim) * METATILE + pos % op->dim];
+            if (e.size <= 0 || e.offset < 0 || size_t(e.offset) + size_t(e.size) > body.size())
+            {
+               continue;
+            }
+            shared_ptr<http::response> response(new http::response(200, bundle.timeStamp));
+            response->body.assign(body, e.offset, e.size);
+            op->responses[f * op->dim * op->dim + pos] = response;
+         }
+      }
+      return true;
+   }
 
-            // make the header - need for accessing the correct replica
-            vector<string> headers;
-            headers.push_back((boost::format("X-Replica: %1%") % replica).str());
+   void lts_storage::put_bundles_async(const tile_protocol &tile, shared_ptr<const string> metatile, int replica,
+                                       std::time_t last_modified, const bundle_callback &callback) const
+   {
+      shared_ptr<bundle_op> op(new bundle_op);
+      op->tile = tile;
+      op->replica = replica;
+      op->put = true;
+      op->dim = get_meta_dimensions(tile.z);
+      op->coord = xy_to_meta_xy(tile.x, tile.y);
+      op->headers = this->make_headers(&last_modified, (replica == 0 ? "X-Replica: 0" : "X-Replica: 1"), (char*)NULL);
+      op->callback = callback;
+      op->metatile = metatile;
+      op->layouts = read_headers(*metatile, fmtAll);
+      op->remaining = 1;
+      op->ok = true;
 
-            //curl to get the tile data, returns a shared_ptr, forget the last shared pointer we had
-            response = http::get(url, boost::shared_ptr<CURL>(), headers, false, LTS_CONNECT_TIMEOUT);
+      int mask = 0;
+      BOOST_FOREACH(const meta_layout *layout, op->layouts)
+      {
+         op->formats.push_back(protoFmt(layout->fmt));
+         mask |= layout->fmt;
+      }
 
-            int status_code = response->statusCode;
-            if(status_code != 200)
+      const host_positions hosts = positions_by_host(tile, replica);
+      for (host_positions::const_iterator itr = hosts.begin(); itr != hosts.end(); ++itr)
+      {
+         //only the tiles which are actually there get sent
+         vector<int> present;
+         vector<int> sizes(op->layouts.size() * METATILE * METATILE, 0);
+         BOOST_FOREACH(int pos, itr->second)
+         {
+            const int i = (pos / op->dim) * METATILE + pos % op->dim;
+            bool any = false;
+            for (size_t f = 0; f < op->layouts.size(); ++f)
             {
-               response.reset();
+               sizes[f * METATILE * METATILE + i] = op->layouts[f]->index[i].size;
+               any = any || op->layouts[f]->index[i].size > 0;
+            }
+            if (any)
+            {
+               present.push_back(pos);
+            }
+         }
+         if (present.empty())
+         {
+            continue;
+         }
+
+         if (!bundles_supported(itr->first))
+         {
+            start_tile_puts(op, present);
+            continue;
+         }
 
-               // status code 404 (not found) is a perfectly normal runtime condition
-               // and doesn't need logging. anything else is interesting and wants to
-               // be logged.
-               if (status_code != 404)
+         //this host's share of the metatile, with the tiles in header order
+         string bundle = write_headers(op->coord.first, op->coord.second, tile.z, op->formats, sizes);
+         for (size_t f = 0; f < op->layouts.size(); ++f)
+         {
+            for (int i = 0; i < METATILE * METATILE; ++i)
+            {
+               if (sizes[f * METATILE * METATILE + i] > 0)
                {
-                  LOG_WARNING((boost::format("getting LTS tile returned status code %1%") % status_code).str());
+                  bundle.append(*metatile, op->layouts[f]->index[i].offset, op->layouts[f]->index[i].size);
                }
             }
-         }//couldn't get to the hosts
-         catch(const std::exception &e)
-         {
-            LOG_ERROR(boost::format("Runtime error getting LTS tile %1% from LTS host %2%, marking host as down. Error was: %3%") % tile % hashedHost.first % e.what());
-            host_is_down(hashedHost);
          }
+         op->buffers.push_back(string());
+         op->buffers.back().swap(bundle);
+         const string &data = op->buffers.back();
+
+         start_post(op, form_bundle_url(tile, itr->first, mask), data.data(), data.size(), "application/octet-stream",
+                    boost::bind(&lts_storage::handle_bundle_put, this, op, itr->first, present, _1));
       }
 
-      return response;
+      complete_bundle_request(op);
    }
 
-   shared_ptr<tile_storage::handle> lts_storage::get(const tile_protocol &tile) const
+   void lts_storage::start_tile_puts(shared_ptr<bundle_op> op, const vector<int> &positions) const
    {
-      //for getting the response
-      shared_ptr<http::response> response;
+      for (size_t f = 0; f < op->layouts.size(); ++f)
+      {
+         const meta_layout *layout = op->layouts[f];
+         BOOST_FOREACH(int pos, positions)
+         {
+            const entry &e = layout->index[(pos / op->dim) * METATILE + pos % op->dim];
+            if (e.size == 0)
+            {
+               continue;
+            }
+            const string url = form_url(op->coord.first + pos % op->dim, op->coord.second + pos / op->dim,
+                                        op->tile.z, op->tile.style, op->formats[f], op->replica);
+            start_post(op, url, op->metatile->data() + e.offset, e.size, rendermq::mime_type_for(op->formats[f]).c_str(),
+                       boost::bind(&lts_storage::handle_tile_put, this, op, url, _1));
+         }
+      }
+   }
 
-      //try to get the primary copy
-      response = attempt_get_host(tile, 0);
+   void lts_storage::start_post(shared_ptr<bundle_op> op, const string &url, const char *data, size_t size, const char *mime,
+                                const http::async_client::callback_t &handler) const
+   {
+      //have to mimic html form post, and the file name is required to trick
+      //curl into <input type=file> instead of <input type=text>
+      op->buffers.push_back(url);
+      const string &file_name = op->buffers.back();
+      vector<http::part> parts;
+      parts.push_back(http::part(data, long(size), "file", file_name.c_str(), mime));
 
-      if (!response) 
+      ++op->remaining;
+      try
+      {
+         m_async.post_form(url, parts, op->headers, handler, LTS_CONNECT_TIMEOUT);
+      }
+      catch (const std::exception &e)
       {
-         //try to get the secondary copy
-         response = attempt_get_host(tile, 1);
+         LOG_ERROR(boost::format("Runtime error starting put of LTS tile: %1%") % e.what());
+         handler(shared_ptr<http::response>());
       }
+   }
 
+   void lts_storage::handle_bundle_put(shared_ptr<bundle_op> op, const std::pair<string, int> &host, const vector<int> &positions,
+                                       shared_ptr<http::response> response) const
+   {
       if (!response)
       {
-         //return a bad response
-         // no logging here - this happens when we get a 404, which is a
-         // perfectly normal situation.
-         response = shared_ptr<http::response>(new http::response());
+         LOG_ERROR(boost::format("Error putting LTS metatile %1% to LTS host %2%, marking host as down.") % op->tile % host.first);
+         host_is_down(host);
+         op->ok = false;
+         complete_bundle_request(op);
+         return;
+      }
+
+      host_is_up(host);
+      if (response->statusCode != 200)
+      {
+         no_bundles(host);
+         start_tile_puts(op, positions);
       }
+      complete_bundle_request(op);
+   }
 
-      //return the response, good or bad
-      return shared_ptr<tile_storage::handle> (new handle(response));
+   void lts_storage::handle_tile_put(shared_ptr<bundle_op> op, const string &url, shared_ptr<http::response> response) const
+   {
+      if (!response || response->statusCode != 200)
+      {
+         LOG_ERROR(boost::format("Failed to PUT tile: %1% (status=%2%)") % url % (response ? response->statusCode : -1));
+         op->ok = false;
+      }
+      complete_bundle_request(op);
    }
 
    bool lts_storage::get_meta(const tile_protocol &tile, string &metatile) const
    {
+      if (m_bundles)
+      {
+         bool done = false, ok = false;
+         get_meta_async(tile, boost::bind(&store_meta_result, &done, &ok, &metatile, _1, _2));
+         wait_for(done, "metatile get");
+         return ok;
+      }
+
       //get the requests
       vector<string> headers = this->make_headers(NULL, "X-Replica: 0", (char*)NULL);
       vector<string> requests = make_get_urls(tile, true);
@@ -320,10 +1165,75 @@ namespace rendermq
       return true;
    }
 
+   struct lts_storage::meta_put
+   {
+      tile_protocol tile;
+      put_meta_callback callback;
+      int remaining;
+      bool ok;
+   };
+
+   void lts_storage::put_meta_async(const tile_protocol &tile, const string &metatile, const put_meta_callback &callback) const
+   {
+      if (!m_bundles)
+      {
+         callback(put_meta(tile, metatile));
+         return;
+      }
+
+      //both copies at once, the requests point into the copy of the metatile
+      shared_ptr<const string> data(new string(metatile));
+      shared_ptr<meta_put> put(new meta_put);
+      put->tile = tile;
+      put->callback = callback;
+      put->remaining = 2;
+      put->ok = false;
+
+      std::time_t now = std::time(0);
+      for (int replica = 0; replica < 2; ++replica)
+      {
+         put_bundles_async(tile, data, replica, now, boost::bind(&lts_storage::handle_meta_put, this, put, _1));
+      }
+   }
+
+   namespace
+   {
+      void expired_after_put(const tile_storage::put_meta_callback &callback, bool)
+      {
+         callback(false);
+      }
+   }
+
+   void lts_storage::handle_meta_put(shared_ptr<meta_put> put, bool ok) const
+   {
+      put->ok = put->ok || ok;
+      if (--put->remaining > 0)
+      {
+         return;
+      }
+
+      //its only a failure if both copies fail, just make the tile dirty
+      if (!put->ok)
+      {
+         expire_async(put->tile, boost::bind(&expired_after_put, put->callback, _1));
+         return;
+      }
+      put->callback(true);
+   }
+
    bool lts_storage::put_meta(const tile_protocol &tile, const string &metatile) const
    {
+      if (m_bundles)
+      {
+         bool done = false, ok = false;
+         put_meta_async(tile, metatile, boost::bind(&store_result, &done, &ok, _1));
+         wait_for(done, "metatile put");
+         return ok;
+      }
+
       //put extra stuff in the http header
       std::time_t now = std::time(0);
+
       vector<string> headers = this->make_headers(&now, "X-Replica: 0", (char*)NULL);
       //get the put requests
       vector<pair<string, vector<http::part> > > requests = make_put_requests(tile, metatile);
@@ -462,31 +1372,281 @@ namespace rendermq
       return make_headers(&invalid, is_primary ? primary_hdr : replica_hdr, (char*)NULL);
    }
 
-   bool lts_storage::expire(const tile_protocol &tile) const
+   struct lts_storage::expiry
    {
-      //do a get with time stamp set to invalid
-      //next time its requested timestamp will look dirty and force a rerender
-      //meanwhile we can still serve it to clients regardless of whether its dirty or not
-      vector<string> primaryUrls = make_get_urls(tile, true), replicaUrls = make_get_urls(tile, false);
+      expire_callback callback;
+      // for each tile, whether it's been expired on one of the copies, or
+      // failed on both, and how many copies have failed.
+      vector<bool> done;
+      vector<int> failures;
+      // tiles which aren't done yet.
+      size_t remaining;
+      bool ok;
+   };
+
+   void lts_storage::expire_async(const tile_protocol &tile, const expire_callback &callback) const
+   {
+      pair<int, int> coord = xy_to_meta_xy(tile.x, tile.y);
+      int dim = get_meta_dimensions(tile.z);
+      vector<protoFmt> fmts = get_formats_vec(tile.format);
+      const vector<string> headers[2] = { expiry_headers(true), expiry_headers(false) };
 
-      //use invalid time stamp to mark as dirty
-      const vector<string> primaryHeaders = expiry_headers(true);
-      const vector<string> replicaHeaders = expiry_headers(false);
+      shared_ptr<expiry> state(new expiry);
+      state->callback = callback;
+      state->remaining = fmts.size() * dim * dim;
+      state->done.assign(state->remaining, false);
+      state->failures.assign(state->remaining, 0);
+      state->ok = true;
 
-      //parallelize the requests
-      try
+      if (state->remaining == 0)
       {
-         //expire primary copy
-         http::multiGet(primaryUrls, concurrency, connection, primaryHeaders);
-         //expire replica copy
-         http::multiGet(replicaUrls, concurrency, connection, replicaHeaders);
+         callback(true);
+         return;
       }
-      catch(std::runtime_error e)
+
+      //the same order as make_get_urls, with both copies of each tile together
+      size_t index = 0;
+      BOOST_FOREACH(protoFmt fmt, fmts)
       {
-         LOG_ERROR(boost::format("Runtime error while expiring LTS tile: %1%") % e.what());
-         return false;
+         for (int dy = 0; dy < dim; ++dy)
+         {
+            for (int dx = 0; dx < dim; ++dx, ++index)
+            {
+               for (int replica = 0; replica < 2; ++replica)
+               {
+                  const int x = coord.first + dx, y = coord.second + dy;
+                  const std::pair<string, int> host = hashed_host(x, y, tile.z, replica);
+                  //a down host counts as a failed copy straight away
+                  if (is_host_down(host))
+                  {
+                     expire_result(state, index, false);
+                     continue;
+                  }
+                  http::async_client::callback_t handler =
+                     boost::bind(&lts_storage::handle_expire, this, state, index, host, now_ms(), _1);
+                  try
+                  {
+                     m_async.get(form_url(x, y, tile.z, tile.style, fmt, replica), headers[replica], handler);
+                  }
+                  catch (const std::exception &e)
+                  {
+                     LOG_ERROR(boost::format("Runtime error while expiring LTS tile: %1%") % e.what());
+                     handler(shared_ptr<http::response>());
+                  }
+               }
+            }
+         }
       }
-      return true;
+   }
+
+   void lts_storage::handle_expire(shared_ptr<expiry> state, size_t index, const std::pair<string, int> &host, double started,
+                                   shared_ptr<http::response> response) const
+   {
+      if (response)
+      {
+         record_latency(host, now_ms() - started);
+         host_is_up(host);
+      }
+      else
+      {
+         host_is_down(host);
+      }
+      expire_result(state, index, bool(response));
+   }
+
+   void lts_storage::expire_result(shared_ptr<expiry> state, size_t index, bool ok) const
+   {
+      if (state->done[index])
+      {
+         return;
+      }
+
+      //only transport errors count as failures, same as in multiGet, and
+      //only if both copies failed, same as put_meta. the slower copy is
+      //left to finish on its own.
+      if (!ok && ++state->failures[index] < 2)
+      {
+         return;
+      }
+      if (!ok)
+      {
+         state->ok = false;
+      }
+      state->done[index] = true;
+
+      if (--state->remaining == 0)
+      {
+         state->callback(state->ok);
+      }
+   }
+
+   void lts_storage::async_fds(std::vector<int> &fds) const
+   {
+      fds.push_back(m_async.fd());
+   }
+
+   void lts_storage::async_perform() const
+   {
+      m_async.perform();
+   }
+
+   struct lts_storage::batch
+   {
+      const vector<tile_protocol> *tiles;
+      bool head;
+      vector<shared_ptr<tile_storage::handle> > handles;
+      //tiles waiting to be started, by the host with their primary copy
+      std::map<std::pair<string, int>, std::deque<size_t>, cmp_pair> queued;
+      //a host for each request which can be started without going over the concurrency for that host
+      std::deque<std::pair<string, int> > ready;
+      size_t remaining;
+   };
+
+   void lts_storage::get_multi(const vector<tile_protocol> &tiles, vector<shared_ptr<tile_storage::handle> > &handles) const
+   {
+      fetch_multi(tiles, false, handles);
+   }
+
+   void lts_storage::probe_multi(const vector<tile_protocol> &tiles, vector<shared_ptr<tile_storage::handle> > &handles) const
+   {
+      fetch_multi(tiles, true, handles);
+   }
+
+   void lts_storage::fetch_multi(const vector<tile_protocol> &tiles, bool head, vector<shared_ptr<tile_storage::handle> > &handles) const
+   {
+      //the batch owns the results, so callbacks which come in late don't write to anything that's gone
+      shared_ptr<batch> b(new batch);
+      b->tiles = &tiles;
+      b->head = head;
+      b->handles.resize(tiles.size());
+      b->remaining = tiles.size();
+
+      //queue the tiles up by the host with the primary copy, so that each host
+      //gets at most concurrency requests at a time from the batch
+      for (size_t i = 0; i < tiles.size(); ++i)
+      {
+         b->queued[hashed_host(tiles[i].x, tiles[i].y, tiles[i].z, 0)].push_back(i);
+      }
+      for (std::map<std::pair<string, int>, std::deque<size_t>, cmp_pair>::const_iterator itr = b->queued.begin(); itr != b->queued.end(); ++itr)
+      {
+         for (int n = 0; n < std::max(concurrency, 1); ++n)
+         {
+            b->ready.push_back(itr->first);
+         }
+      }
+
+      while (b->remaining > 0)
+      {
+         //some requests finish straight away, for example when the hosts are
+         //down, which makes room for the next one on that host
+         while (!b->ready.empty())
+         {
+            std::pair<string, int> host = b->ready.front();
+            b->ready.pop_front();
+            start_multi(b, host);
+         }
+
+         if (b->remaining == 0)
+         {
+            break;
+         }
+         if (m_async.in_flight() == 0)
+         {
+            LOG_ERROR(boost::format("LTS batch has %1% tiles outstanding, but no requests in flight.") % b->remaining);
+            break;
+         }
+         m_async.wait(-1);
+      }
+
+      handles.swap(b->handles);
+      BOOST_FOREACH(shared_ptr<tile_storage::handle> &h, handles)
+      {
+         if (!h)
+         {
+            h.reset(new handle(shared_ptr<http::response>(new http::response())));
+         }
+      }
+   }
+
+   void lts_storage::start_multi(shared_ptr<batch> b, const std::pair<string, int> &host) const
+   {
+      std::deque<size_t> &queue = b->queued[host];
+      if (queue.empty())
+      {
+         return;
+      }
+
+      size_t index = queue.front();
+      queue.pop_front();
+      read_async((*b->tiles)[index], b->head, boost::bind(&lts_storage::handle_multi, this, b, host, index, _1));
+   }
+
+   void lts_storage::handle_multi(shared_ptr<batch> b, const std::pair<string, int> &host, size_t index,
+                                  shared_ptr<tile_storage::handle> handle) const
+   {
+      b->handles[index] = handle;
+      --b->remaining;
+      b->ready.push_back(host);
+   }
+
+   namespace
+   {
+      // results of a batch of expiries.
+      struct expire_batch
+      {
+         vector<bool> results;
+         size_t remaining;
+      };
+
+      void handle_expire_batch(shared_ptr<expire_batch> b, size_t index, bool ok)
+      {
+         b->results[index] = ok;
+         --b->remaining;
+      }
+   }
+
+   void lts_storage::expire_multi(const vector<tile_protocol> &tiles, vector<bool> &results) const
+   {
+      //each expiry is a request for every tile in the metatile, and they can
+      //be on any of the hosts, so just limit the number of metatiles at once.
+      shared_ptr<expire_batch> b(new expire_batch);
+      b->results.assign(tiles.size(), false);
+      b->remaining = tiles.size();
+
+      const size_t window = std::max(concurrency, 1);
+      size_t next = 0;
+      while (b->remaining > 0)
+      {
+         while (next < tiles.size() && (next - (tiles.size() - b->remaining)) < window)
+         {
+            expire_async(tiles[next], boost::bind(&handle_expire_batch, b, next, _1));
+            ++next;
+         }
+
+         if (b->remaining == 0)
+         {
+            break;
+         }
+         if (m_async.in_flight() == 0)
+         {
+            LOG_ERROR(boost::format("LTS expiry batch has %1% tiles outstanding, but no requests in flight.") % b->remaining);
+            break;
+         }
+         m_async.wait(-1);
+      }
+
+      results = b->results;
+   }
+
+   bool lts_storage::expire(const tile_protocol &tile) const
+   {
+      //do a get with time stamp set to invalid
+      //next time its requested timestamp will look dirty and force a rerender
+      //meanwhile we can still serve it to clients regardless of whether its dirty or not
+      bool done = false, ok = false;
+      expire_async(tile, boost::bind(&store_result, &done, &ok, _1));
+      wait_for(done, "expiry");
+      return ok;
    }
 
 }
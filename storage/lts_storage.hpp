@@ -29,18 +29,81 @@
 
 #include "http_storage.hpp"
 #include "hashwrapper.hpp"
+#include "host_health.hpp"
+#include <boost/thread/mutex.hpp>
+#include <list>
 
 namespace rendermq
 {
 
+   /* metatile bundles
+    *
+    * as well as a URL for each tile, storage nodes may support a URL for
+    * each metatile:
+    *
+    *    /<version>/<app><style>/<z>/<x>/<y>.meta?formats=<mask>
+    *
+    * where x and y are those of the top-left tile of the metatile and the
+    * mask is the protoFmt bits of the formats wanted. the body of a bundle
+    * is encoded exactly like a metatile, with a meta_layout header for each
+    * format followed by the data.
+    *
+    * a GET of a bundle, with the usual X-Replica header, returns all the
+    * tiles of the metatile which the node has for that replica. tiles which
+    * it doesn't have have zero size. the Last-Modified of the bundle is
+    * that of its oldest tile, so a bundle with an expired tile in it looks
+    * expired too, which is all a metatile get needs to know. a POST of
+    * a multipart form with a bundle in its "file" part stores each tile with
+    * a non-zero size, just as if it had been POSTed on its own.
+    *
+    * tiles are hashed onto hosts individually, so each host only gets, and
+    * is only asked for, its own share of a metatile's tiles. that's one
+    * request for each host rather than one for each tile and format.
+    *
+    * a node which doesn't support bundles answers with something other
+    * than a 200 and a bundle. per-tile requests are used for that host
+    * instead, and bundles aren't tried on it again for down_recheck_time
+    * seconds.
+    */
+
+   /* hedged reads
+    *
+    * a get or probe asks the primary copy first, and if it hasn't answered
+    * within the hedge delay then the same request goes to the replica as
+    * well. whichever gives a good answer first wins, and the other request
+    * is cancelled. a primary which fails or doesn't have the tile moves on
+    * to the replica straight away, as it always has.
+    *
+    * the delay is either fixed, or the given percentile of the recent
+    * latencies of the host with the primary copy, so that only reads which
+    * are already slower than that percentile are hedged.
+    *
+    * expiries have to go to both copies, so they aren't hedged as such,
+    * but they finish as soon as every tile has been expired on one of the
+    * copies, without waiting for the slower one.
+    */
+
+   /* down hosts
+    *
+    * whether each host is up is kept in the process-wide host_health
+    * table, so once any storage in the process has found a host down,
+    * reads go straight to the replica everywhere else too. a host stops
+    * being used after failure_threshold requests in a row can't get
+    * through, and it's probed every health_probe_interval milliseconds
+    * until it answers. it's tried again with a real request anyway after
+    * down_recheck_time seconds.
+    */
    class lts_storage: public http_storage
    {
       public:
 
-         lts_storage(const vecHostInfo& vecHosts,const string& config, const string& app_name, const string& version, const int& concurrency = 1, int down_recheck_time = 300);
+         lts_storage(const vecHostInfo& vecHosts,const string& config, const string& app_name, const string& version, const int& concurrency = 1, int down_recheck_time = 300, bool bundles = true,
+                     bool hedge = true, long hedge_delay = -1, double hedge_percentile = 95.0);
          virtual ~lts_storage();
          //get a single tile in a single format
          virtual boost::shared_ptr<tile_storage::handle> get(const tile_protocol &tile) const;
+         //checks a single tile with a HEAD, without getting the data
+         virtual boost::shared_ptr<tile_storage::handle> probe(const tile_protocol &tile) const;
          //get each tile in each format and constructs a metatile from them
          virtual bool get_meta(const tile_protocol &tile, string &metatile) const;
          //put each tile in each format by deconstructing a metatile
@@ -50,6 +113,29 @@ namespace rendermq
          //returns the total number of hashable hosts
          virtual unsigned int getHostCount() const {return pHashWrapper->getHostCount();}
 
+         //asynchronous versions of the above, all driven from a single curl_multi
+         virtual void get_async(const tile_protocol &tile, const get_callback &callback) const;
+         virtual void get_meta_async(const tile_protocol &tile, const get_meta_callback &callback) const;
+         virtual void expire_async(const tile_protocol &tile, const expire_callback &callback) const;
+         virtual void probe_async(const tile_protocol &tile, const get_callback &callback) const;
+         virtual void put_meta_async(const tile_protocol &tile, const string &metatile, const put_meta_callback &callback) const;
+         virtual void async_fds(std::vector<int> &fds) const;
+         virtual void async_perform() const;
+
+         //batches of gets, probes and expiries, all running together on the curl_multi
+         virtual void get_multi(const std::vector<tile_protocol> &tiles, std::vector<boost::shared_ptr<tile_storage::handle> > &handles) const;
+         virtual void probe_multi(const std::vector<tile_protocol> &tiles, std::vector<boost::shared_ptr<tile_storage::handle> > &handles) const;
+         virtual void expire_multi(const std::vector<tile_protocol> &tiles, std::vector<bool> &results) const;
+
+         //counts of reads since the storage was made, how many of them were
+         //hedged and how many of those the replica answered first
+         struct hedge_stats
+         {
+            hedge_stats() : reads(0), hedged(0), replica_won(0) {}
+            size_t reads, hedged, replica_won;
+         };
+         hedge_stats get_hedge_stats() const;
+
       // note: this section for "special" LTS expiry
       public:
          std::vector<std::string> expiry_headers(bool is_primary) const;
@@ -68,23 +154,72 @@ namespace rendermq
          //if we fail on getting the primary we can resync the tile to it after getting it from the secondary
          void resync_tile(const tile_protocol &tile, const string& data, const long& timeStamp, const int& replica) const;
 
-         // attempt a get to a host, checking the current list of blocked hosts
-         // and return a shared pointer to the result, or an empty shared pointer
-         // (null) on error.
-         boost::shared_ptr<http::response> attempt_get_host(const tile_protocol &tile, int replica) const;
+         // read the tile from the replicas, waiting for the result. if head
+         // is true then only the headers are requested.
+         boost::shared_ptr<tile_storage::handle> get_from_replicas(const tile_protocol &tile, bool head) const;
 
-         // make the host for a particular tile and replica
-         std::pair<string, int> hashed_host(int x, int y, int z, unsigned int replica) const;
+         // check the response from a host, returning it if the tile was found
+         // or an empty shared pointer otherwise. a null response means the
+         // host couldn't be reached, so it's marked as down.
+         boost::shared_ptr<http::response> check_host_response(const tile_protocol &tile, const std::pair<string, int> &host,
+                                                                boost::shared_ptr<http::response> response) const;
 
-         // check if a host has been marked down or not
-         bool is_host_down(const std::pair<string, int> &host) const;
-         // mark a host as down, which will prevent it being checked for some time period
-         void host_is_down(const std::pair<string, int> &host) const;
+         // state of a hedged read, shared between the callbacks of the
+         // requests to each replica and the hedge timer.
+         struct hedged_read;
+         // read the tile from the primary, hedged by the replica, or moving
+         // on to the replica if the primary doesn't have the tile.
+         void read_async(const tile_protocol &tile, bool head, const get_callback &callback) const;
+         void start_read(boost::shared_ptr<hedged_read> read, int replica) const;
+         void hedge_read(boost::shared_ptr<hedged_read> read) const;
+         void handle_read(boost::shared_ptr<hedged_read> read, int replica, double started,
+                          boost::shared_ptr<http::response> response) const;
+         void read_failed(boost::shared_ptr<hedged_read> read) const;
+         void finish_read(boost::shared_ptr<hedged_read> read, boost::shared_ptr<http::response> response) const;
 
-         shared_ptr<hashWrapper> pHashWrapper;
-         const string app_name;
-         const string version;
-         const int m_down_recheck_time;
+         // state of an asynchronous expiry, shared between the callbacks of
+         // all the individual tile requests.
+         struct expiry;
+         void handle_expire(boost::shared_ptr<expiry> state, size_t index, const std::pair<string, int> &host, double started,
+                            boost::shared_ptr<http::response> response) const;
+         // count one copy of a tile as expired, or failed.
+         void expire_result(boost::shared_ptr<expiry> state, size_t index, bool ok) const;
+
+         // recent latencies of the requests to a host, in milliseconds.
+         struct latency_window
+         {
+            latency_window();
+            void add(double latency);
+            // the given percentile of the samples, or negative if there
+            // aren't enough of them yet.
+            double percentile(double p);
+
+            std::vector<double> samples;
+            size_t next, since_sorted;
+            double cached_p, cached;
+         };
+         void record_latency(const std::pair<string, int> &host, double latency) const;
+         // milliseconds to wait for the host before hedging a read from it,
+         // or negative if reads aren't hedged.
+         long hedge_delay(const std::pair<string, int> &host) const;
+         // log the hedge rate every so often.
+         void log_hedge_stats() const;
+
+         // state of an asynchronous get_meta, shared between the callbacks of
+         // all the individual tile requests.
+         struct meta_fetch;
+         void fetch_meta_async(boost::shared_ptr<meta_fetch> fetch, int replica) const;
+         void handle_meta_response(boost::shared_ptr<meta_fetch> fetch, size_t index,
+                                   boost::shared_ptr<http::response> response) const;
+         void finish_meta_async(boost::shared_ptr<meta_fetch> fetch) const;
+
+         // state of a batch of gets or probes, shared between the callbacks
+         // of all the tiles in it.
+         struct batch;
+         void fetch_multi(const std::vector<tile_protocol> &tiles, bool head, std::vector<boost::shared_ptr<tile_storage::handle> > &handles) const;
+         void start_multi(boost::shared_ptr<batch> b, const std::pair<string, int> &host) const;
+         void handle_multi(boost::shared_ptr<batch> b, const std::pair<string, int> &host, size_t index,
+                           boost::shared_ptr<tile_storage::handle> handle) const;
 
          /* functor used as a comparator so that hostname:port pairs can
           * be stored in a std::map.
@@ -99,8 +234,101 @@ namespace rendermq
             }
          };
 
-         // maps the host into the time it was last checked as down
-         mutable std::map<std::pair<string,int>, time_t, cmp_pair> m_hosts_down;
+         // state of a bundled get or put of a metatile to one replica,
+         // shared between the callbacks of the requests to each host.
+         struct bundle_op;
+         // called with whether every tile was got or put, and the responses
+         // for each tile of a get in the same order as make_get_urls.
+         typedef boost::function<void (bool, const std::vector<boost::shared_ptr<http::response> > &)> bundle_callback;
+         // the positions (dy * dim + dx) of the tiles in the metatile,
+         // by the host which has them.
+         typedef std::map<std::pair<string, int>, std::vector<int>, cmp_pair> host_positions;
+         host_positions positions_by_host(const tile_protocol &tile, int replica) const;
+         // constructs the url of a bundle on the given host
+         string form_bundle_url(const tile_protocol &tile, const std::pair<string, int> &host, int formats) const;
+
+         // start getting all the tiles of the metatile from one replica,
+         // calling back once they're all in.
+         void get_bundles_async(const tile_protocol &tile, int replica, const bundle_callback &callback) const;
+         void start_tile_gets(boost::shared_ptr<bundle_op> op, const std::vector<int> &positions) const;
+         void handle_bundle_get(boost::shared_ptr<bundle_op> op, const std::pair<string, int> &host, const std::vector<int> &positions,
+                                boost::shared_ptr<http::response> response) const;
+         void handle_tile_get(boost::shared_ptr<bundle_op> op, size_t index, boost::shared_ptr<http::response> response) const;
+         // copies the tiles for the given positions out of a bundle into the op's responses, returning
+         // false if the bundle isn't valid.
+         bool unpack_bundle(boost::shared_ptr<bundle_op> op, const std::vector<int> &positions, const http::response &bundle) const;
+
+         // start putting all the tiles of the metatile to one replica,
+         // calling back once they're all done.
+         void put_bundles_async(const tile_protocol &tile, boost::shared_ptr<const string> metatile, int replica,
+                                std::time_t last_modified, const bundle_callback &callback) const;
+         void start_tile_puts(boost::shared_ptr<bundle_op> op, const std::vector<int> &positions) const;
+         void start_post(boost::shared_ptr<bundle_op> op, const string &url, const char *data, size_t size, const char *mime,
+                         const http::async_client::callback_t &handler) const;
+         void handle_bundle_put(boost::shared_ptr<bundle_op> op, const std::pair<string, int> &host, const std::vector<int> &positions,
+                                boost::shared_ptr<http::response> response) const;
+         void handle_tile_put(boost::shared_ptr<bundle_op> op, const string &url, boost::shared_ptr<http::response> response) const;
+         // state of a put of both copies of a metatile in bundles.
+         struct meta_put;
+         void handle_meta_put(boost::shared_ptr<meta_put> put, bool ok) const;
+         // count off a finished request, calling back if it was the last.
+         void complete_bundle_request(boost::shared_ptr<bundle_op> op) const;
+         // get_meta_async's callback when using bundles.
+         void handle_meta_bundles(boost::shared_ptr<meta_fetch> fetch, const std::vector<boost::shared_ptr<http::response> > &responses) const;
+
+         // wait for the asynchronous client until the flag is set.
+         void wait_for(const bool &done, const char *what) const;
+
+         // whether it's worth trying bundles on a host, and to stop
+         // trying them for a while.
+         bool bundles_supported(const std::pair<string, int> &host) const;
+         void no_bundles(const std::pair<string, int> &host) const;
+
+         // make the host for a particular tile and replica
+         std::pair<string, int> hashed_host(int x, int y, int z, unsigned int replica) const;
+
+         // the host's entry in the process-wide health table
+         host_health::host *health_of(const std::pair<string, int> &host) const;
+         // whether to skip sending a request to the host. if this says
+         // not to skip it, then the result of the request must be passed
+         // to host_is_down or host_is_up, as it may be the trial request
+         // for a host which is coming back.
+         bool is_host_down(const std::pair<string, int> &host) const;
+         // whether the host is down, without letting a trial request
+         // through. for deciding whether to plan a request for later.
+         bool is_host_known_down(const std::pair<string, int> &host) const;
+         // report a request which couldn't get through to the host at
+         // all, or one which got any answer back.
+         void host_is_down(const std::pair<string, int> &host) const;
+         void host_is_up(const std::pair<string, int> &host) const;
+
+         shared_ptr<hashWrapper> pHashWrapper;
+         const string app_name;
+         const string version;
+         const int m_down_recheck_time;
+
+         // the hosts' entries in the health table, which is shared by all
+         // the storage in the process. filled in by the constructor.
+         std::map<std::pair<string,int>, host_health::host *, cmp_pair> m_health;
+
+         // whether to try bundles at all
+         const bool m_bundles;
+         // maps hosts which don't support bundles into the time to try
+         // them again.
+         mutable std::map<std::pair<string,int>, time_t, cmp_pair> m_no_bundles;
+         mutable boost::mutex m_no_bundles_mutex;
+
+         // whether to hedge reads, the fixed delay or negative to use the
+         // percentile of each host's latency.
+         const bool m_hedge;
+         const long m_hedge_delay;
+         const double m_hedge_percentile;
+         mutable std::map<std::pair<string,int>, latency_window, cmp_pair> m_latency;
+         mutable hedge_stats m_hedge_stats, m_hedge_logged;
+         mutable time_t m_hedge_log_time;
+
+         // client for all the asynchronous requests
+         mutable http::async_client m_async;
    };
 
 }
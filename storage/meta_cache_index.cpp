@@ -0,0 +1,525 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: artem@mapnik-consulting.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "meta_cache_index.hpp"
+#include "meta_tile.hpp"
+#include "../logging/logger.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstddef>
+#include <cstring>
+#include <map>
+
+#define BOOST_FILESYSTEM_VERSION 3
+#include <boost/filesystem/operations.hpp>
+#include <boost/format.hpp>
+#include <boost/bind.hpp>
+#include <boost/weak_ptr.hpp>
+
+// once over budget, metatiles are removed until the cache is down to
+// this percentage of it, so that it isn't swept for every put.
+#define CACHE_LOW_WATER (90)
+// most metatiles removed at once, before letting reads and puts at the
+// index again.
+#define EVICT_BATCH (256)
+
+// how the style, zoom and position of a metatile are packed into its
+// key. positions are in metatiles, so zoom levels up to 27 fit.
+#define KEY_STYLE_SHIFT (54)
+#define KEY_ZOOM_SHIFT (48)
+#define KEY_X_SHIFT (24)
+#define KEY_POS_MASK ((uint64_t(1) << KEY_X_SHIFT) - 1)
+#define MAX_STYLES (1024)
+
+using std::string;
+using std::vector;
+using boost::shared_ptr;
+namespace fs = boost::filesystem;
+
+namespace rendermq
+{
+
+namespace
+{
+
+int key_zoom(uint64_t key)
+{
+   return int(key >> KEY_ZOOM_SHIFT) & (CACHE_ZOOMS - 1);
+}
+
+// indexes shared by everything in the process, by tile directory.
+boost::mutex shared_mutex;
+std::map<string, boost::weak_ptr<meta_cache_index> > shared_indexes;
+
+} // anonymous namespace
+
+meta_cache_index::stats::stats()
+   : evicted(0), evicted_bytes(0)
+{
+   hits.assign(0);
+   misses.assign(0);
+   metatiles.assign(0);
+   bytes.assign(0);
+}
+
+meta_cache_index::meta_cache_index(const string &dir, uint64_t capacity, long log_interval, bool scan)
+   : m_dir(dir), m_capacity(capacity), m_log_interval(log_interval),
+     m_hand(0), m_bytes(0), m_evicting(false), m_log_time(time(NULL)),
+     m_scanning(scan), m_stopping(false)
+{
+   m_thread = boost::thread(boost::bind(&meta_cache_index::run, this, scan));
+}
+
+meta_cache_index::~meta_cache_index()
+{
+   {
+      boost::unique_lock<boost::mutex> lock(m_mutex);
+      m_stopping = true;
+      m_wake.notify_all();
+   }
+   m_thread.join();
+}
+
+void
+meta_cache_index::adding(const tile_protocol &tile)
+{
+   boost::unique_lock<boost::mutex> lock(m_mutex);
+   uint64_t key = 0;
+   if (make_key(tile.style, tile.x, tile.y, tile.z, true, key))
+   {
+      ++m_pins[key];
+   }
+}
+
+void
+meta_cache_index::abandoned(const tile_protocol &tile)
+{
+   boost::unique_lock<boost::mutex> lock(m_mutex);
+   uint64_t key = 0;
+   if (make_key(tile.style, tile.x, tile.y, tile.z, false, key))
+   {
+      unpin(key);
+   }
+   // it might have been all that was left to remove.
+   if ((m_capacity > 0) && (m_bytes > m_capacity))
+   {
+      m_wake.notify_all();
+   }
+}
+
+void
+meta_cache_index::added(const tile_protocol &tile, size_t size)
+{
+   boost::unique_lock<boost::mutex> lock(m_mutex);
+   uint64_t key = 0;
+   if (!make_key(tile.style, tile.x, tile.y, tile.z, true, key))
+   {
+      return;
+   }
+   unpin(key);
+
+   boost::unordered_map<uint64_t, uint32_t>::iterator itr = m_index.find(key);
+   if (itr == m_index.end())
+   {
+      insert(key, size, true);
+   }
+   else
+   {
+      slot &s = m_slots[itr->second];
+      m_bytes += size - s.size;
+      m_stats.bytes[key_zoom(key)] += size - s.size;
+      s.size = size;
+      s.referenced = true;
+   }
+
+   if ((m_capacity > 0) && (m_bytes > m_capacity))
+   {
+      m_wake.notify_all();
+   }
+}
+
+void
+meta_cache_index::accessed(const tile_protocol &tile, bool found)
+{
+   boost::unique_lock<boost::mutex> lock(m_mutex);
+   if ((tile.z >= 0) && (tile.z < CACHE_ZOOMS))
+   {
+      ++(found ? m_stats.hits : m_stats.misses)[tile.z];
+   }
+
+   uint64_t key = 0;
+   if (found && make_key(tile.style, tile.x, tile.y, tile.z, false, key))
+   {
+      boost::unordered_map<uint64_t, uint32_t>::iterator itr = m_index.find(key);
+      if (itr != m_index.end())
+      {
+         m_slots[itr->second].referenced = true;
+      }
+   }
+}
+
+uint64_t
+meta_cache_index::size() const
+{
+   boost::unique_lock<boost::mutex> lock(m_mutex);
+   return m_bytes;
+}
+
+meta_cache_index::stats
+meta_cache_index::get_stats() const
+{
+   boost::unique_lock<boost::mutex> lock(m_mutex);
+   return m_stats;
+}
+
+void
+meta_cache_index::flush()
+{
+   boost::unique_lock<boost::mutex> lock(m_mutex);
+   while (!m_stopping && (m_scanning || ((m_capacity > 0) && (m_bytes > m_capacity))))
+   {
+      m_idle.wait(lock);
+   }
+}
+
+shared_ptr<meta_cache_index>
+meta_cache_index::shared(const string &dir, uint64_t capacity, long log_interval)
+{
+   boost::unique_lock<boost::mutex> lock(shared_mutex);
+   shared_ptr<meta_cache_index> index = shared_indexes[dir].lock();
+   if (index)
+   {
+      index->set_capacity(capacity);
+   }
+   else
+   {
+      index.reset(new meta_cache_index(dir, capacity, log_interval));
+      shared_indexes[dir] = index;
+   }
+   return index;
+}
+
+bool
+meta_cache_index::make_key(const string &style, int x, int y, int z, bool create, uint64_t &key)
+{
+   if ((z < 0) || (z >= CACHE_ZOOMS) || (x < 0) || (y < 0))
+   {
+      return false;
+   }
+   const uint64_t mx = uint64_t(x) / METATILE, my = uint64_t(y) / METATILE;
+   if ((mx > KEY_POS_MASK) || (my > KEY_POS_MASK))
+   {
+      return false;
+   }
+
+   uint32_t id = 0;
+   boost::unordered_map<string, uint32_t>::iterator itr = m_style_ids.find(style);
+   if (itr != m_style_ids.end())
+   {
+      id = itr->second;
+   }
+   else if (create && (m_styles.size() < MAX_STYLES))
+   {
+      id = m_styles.size();
+      m_styles.push_back(style);
+      m_style_ids.insert(std::make_pair(style, id));
+   }
+   else
+   {
+      return false;
+   }
+
+   key = (uint64_t(id) << KEY_STYLE_SHIFT) | (uint64_t(z) << KEY_ZOOM_SHIFT) |
+      (mx << KEY_X_SHIFT) | my;
+   return true;
+}
+
+void
+meta_cache_index::insert(uint64_t key, uint64_t size, bool referenced)
+{
+   slot s;
+   s.key = key;
+   s.size = size;
+   s.referenced = referenced;
+   s.used = true;
+
+   uint32_t i = 0;
+   if (m_free.empty())
+   {
+      i = m_slots.size();
+      m_slots.push_back(s);
+   }
+   else
+   {
+      i = m_free.back();
+      m_free.pop_back();
+      m_slots[i] = s;
+   }
+   m_index.insert(std::make_pair(key, i));
+
+   const int z = key_zoom(key);
+   m_bytes += size;
+   ++m_stats.metatiles[z];
+   m_stats.bytes[z] += size;
+}
+
+void
+meta_cache_index::remove(uint32_t i)
+{
+   slot &s = m_slots[i];
+   const int z = key_zoom(s.key);
+   m_bytes -= s.size;
+   --m_stats.metatiles[z];
+   m_stats.bytes[z] -= s.size;
+
+   m_index.erase(s.key);
+   s.used = false;
+   m_free.push_back(i);
+}
+
+void
+meta_cache_index::unpin(uint64_t key)
+{
+   boost::unordered_map<uint64_t, uint32_t>::iterator itr = m_pins.find(key);
+   if ((itr != m_pins.end()) && (--itr->second == 0))
+   {
+      m_pins.erase(itr);
+   }
+}
+
+void
+meta_cache_index::set_capacity(uint64_t capacity)
+{
+   boost::unique_lock<boost::mutex> lock(m_mutex);
+   if (capacity != m_capacity)
+   {
+      LOG_INFO(boost::format("Disk cache %1% budget changed from %2% to %3% bytes.")
+               % m_dir % m_capacity % capacity);
+      m_capacity = capacity;
+      m_wake.notify_all();
+   }
+}
+
+void
+meta_cache_index::run(bool scan)
+{
+   if (scan)
+   {
+      scan_dir();
+   }
+
+   boost::unique_lock<boost::mutex> lock(m_mutex);
+   m_scanning = false;
+   while (!m_stopping)
+   {
+      if (evict(lock))
+      {
+         continue;
+      }
+      m_idle.notify_all();
+
+      if (m_log_interval <= 0)
+      {
+         m_wake.wait(lock);
+         continue;
+      }
+      const std::time_t now = time(NULL);
+      if (now >= m_log_time + m_log_interval)
+      {
+         log_stats(now);
+      }
+      m_wake.timed_wait(lock, boost::posix_time::seconds(m_log_time + m_log_interval - now));
+   }
+   m_idle.notify_all();
+}
+
+void
+meta_cache_index::scan_dir()
+{
+   size_t found = 0;
+   try
+   {
+      const fs::path root(m_dir);
+      if (!fs::is_directory(root))
+      {
+         return;
+      }
+
+      for (fs::recursive_directory_iterator itr(root), end; itr != end; ++itr)
+      {
+         // metatiles are in a directory for their style, and the writer's
+         // temporary files don't end in .meta.
+         if ((itr.level() == 0) || (itr->path().extension() != ".meta") ||
+             !fs::is_regular_file(itr->status()))
+         {
+            continue;
+         }
+         const string style = itr->path().string().substr(m_dir.size());
+         const size_t start = style.find_first_not_of('/');
+         const size_t slash = style.find('/', start);
+
+         int fd = open(itr->path().c_str(), O_RDONLY);
+         if (fd < 0)
+         {
+            continue;
+         }
+         meta_layout m;
+         struct stat st;
+         const size_t header_size = offsetof(meta_layout, index);
+         const bool ok = (fstat(fd, &st) == 0) &&
+            (pread(fd, &m, header_size, 0) == ssize_t(header_size)) && m.magic_ok();
+         close(fd);
+         if (!ok || (slash == string::npos))
+         {
+            continue;
+         }
+
+         boost::unique_lock<boost::mutex> lock(m_mutex);
+         if (m_stopping)
+         {
+            return;
+         }
+         // anything put since the scan started is already in the index,
+         // and more recently used than this.
+         uint64_t key = 0;
+         if (make_key(style.substr(start, slash - start), m.x, m.y, m.z, true, key) &&
+             (m_index.find(key) == m_index.end()))
+         {
+            insert(key, st.st_size, false);
+            ++found;
+         }
+         evict(lock);
+      }
+   }
+   catch (const fs::filesystem_error &e)
+   {
+      LOG_ERROR(boost::format("Unable to scan disk cache %1%: %2%") % m_dir % e.what());
+   }
+
+   LOG_INFO(boost::format("Disk cache %1% scanned, found %2% metatiles.") % m_dir % found);
+}
+
+bool
+meta_cache_index::evict(boost::unique_lock<boost::mutex> &lock)
+{
+   const uint64_t low_water = m_capacity / 100 * CACHE_LOW_WATER;
+   if ((m_capacity == 0) || (m_bytes <= (m_evicting ? low_water : m_capacity)))
+   {
+      m_evicting = false;
+      return false;
+   }
+   m_evicting = true;
+
+   // each metatile the hand passes either has its bit cleared or is
+   // removed, so two turns always find something unless everything is
+   // being written.
+   size_t evicted = 0, passed = 0;
+   while ((m_bytes > low_water) && (evicted < EVICT_BATCH) && !m_index.empty() &&
+          (passed < 2 * m_slots.size()))
+   {
+      if (m_hand >= m_slots.size())
+      {
+         m_hand = 0;
+      }
+      const uint32_t i = m_hand++;
+      ++passed;
+      slot &s = m_slots[i];
+      if (!s.used || (m_pins.find(s.key) != m_pins.end()))
+      {
+         continue;
+      }
+      if (s.referenced)
+      {
+         s.referenced = false;
+         continue;
+      }
+
+      // the file is removed with the lock held, so it can't be put again
+      // in the meantime, and the lock is let go of in between each one.
+      const uint64_t key = s.key;
+      const string path = xyz_to_meta(m_dir,
+                                      int((key >> KEY_X_SHIFT) & KEY_POS_MASK) * METATILE,
+                                      int(key & KEY_POS_MASK) * METATILE,
+                                      key_zoom(key), m_styles[key >> KEY_STYLE_SHIFT]).first;
+      if ((unlink(path.c_str()) < 0) && (errno != ENOENT))
+      {
+         LOG_ERROR(boost::format("Unable to remove %1% from disk cache: %2%") % path % strerror(errno));
+      }
+      ++m_stats.evicted;
+      m_stats.evicted_bytes += s.size;
+      remove(i);
+      ++evicted;
+      passed = 0;
+
+      lock.unlock();
+      lock.lock();
+      if (m_stopping)
+      {
+         break;
+      }
+   }
+   if (evicted == 0)
+   {
+      m_evicting = false;
+      return false;
+   }
+   return true;
+}
+
+void
+meta_cache_index::log_stats(std::time_t now)
+{
+   uint64_t hits = 0, misses = 0, metatiles = 0;
+   for (int z = 0; z < CACHE_ZOOMS; ++z)
+   {
+      const uint64_t zhits = m_stats.hits[z] - m_logged.hits[z];
+      const uint64_t zmisses = m_stats.misses[z] - m_logged.misses[z];
+      if (zhits + zmisses > 0)
+      {
+         LOG_INFO(boost::format("Disk cache %1% zoom %2%: %3$.1f%% of %4% reads hit, %5% metatiles in %6% bytes.")
+                  % m_dir % z % (100.0 * zhits / (zhits + zmisses)) % (zhits + zmisses)
+                  % m_stats.metatiles[z] % m_stats.bytes[z]);
+      }
+      hits += zhits;
+      misses += zmisses;
+      metatiles += m_stats.metatiles[z];
+   }
+
+   const uint64_t evicted = m_stats.evicted - m_logged.evicted;
+   if ((hits + misses > 0) || (evicted > 0))
+   {
+      LOG_INFO(boost::format("Disk cache %1%: %2$.1f%% of %3% reads hit in the last %4%s, %5% metatiles evicted, "
+                             "%6% metatiles in %7% of %8% bytes.")
+               % m_dir % (hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0) % (hits + misses)
+               % (now - m_log_time) % evicted % metatiles % m_bytes % m_capacity);
+   }
+   m_logged = m_stats;
+   m_log_time = now;
+}
+
+}
@@ -0,0 +1,190 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: artem@mapnik-consulting.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef RENDERMQ_META_CACHE_INDEX_HPP
+#define RENDERMQ_META_CACHE_INDEX_HPP
+
+#include "../tile_protocol.hpp"
+#include <boost/utility.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/array.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/thread.hpp>
+#include <stdint.h>
+#include <ctime>
+#include <string>
+#include <vector>
+
+// seconds between logging the hit rate and size of the cache.
+#define DEFAULT_CACHE_LOG_INTERVAL (300L)
+// zoom levels which statistics are kept for.
+#define CACHE_ZOOMS (32)
+
+namespace rendermq
+{
+
+/* keeps a tile directory used as a cache within a budget of bytes, by
+ * remembering which metatiles are in it and which have been read
+ * recently, and removing the others in the background.
+ *
+ * the metatiles are swept with the CLOCK algorithm, an approximation
+ * of LRU which only needs a bit for each metatile. reading a tile from
+ * a metatile sets its bit, and putting a metatile adds it with the bit
+ * set. once the cache is over budget, a background thread moves a hand
+ * round the metatiles, clearing the bits which are set and removing the
+ * metatiles whose bits are already clear, until the cache is back down
+ * to CACHE_LOW_WATER percent of the budget. the metatiles to remove are
+ * found from the index, without looking at the tile directory.
+ *
+ * the index is only kept in memory, in about 50 bytes for each metatile,
+ * so when it's made the tile directory is scanned once in the
+ * background to find what's already there. until that's finished the
+ * cache may go over budget.
+ *
+ * the index only knows about metatiles put through the storage in this
+ * process, and the ones found by the scan, so each tile directory
+ * should only be written to by one process, which uses shared() so
+ * that all the storage for the directory goes through the same index.
+ *
+ * a metatile is only removed with the lock held, and a metatile which
+ * is being written is pinned from adding() until added() or abandoned()
+ * and never removed, so a metatile can't be removed from under a put,
+ * and everything written ends up in the index.
+ *
+ * hits and misses are counted for each zoom level, along with the
+ * number of metatiles and bytes, and logged every log_interval.
+ */
+class meta_cache_index
+   : private boost::noncopyable
+{
+public:
+   struct stats
+   {
+      stats();
+      // tile reads which found and didn't find the tile, for each zoom.
+      boost::array<uint64_t, CACHE_ZOOMS> hits, misses;
+      // what's in the cache at each zoom.
+      boost::array<uint64_t, CACHE_ZOOMS> metatiles, bytes;
+      // metatiles removed to keep within the budget, and their size.
+      uint64_t evicted, evicted_bytes;
+   };
+
+   /* @param dir the tile directory.
+    * @param capacity the most bytes of metatiles to keep in it.
+    * @param log_interval seconds between logging the statistics, or
+    *          zero not to log them.
+    * @param scan whether to scan the directory for what's already there.
+    */
+   meta_cache_index(const std::string &dir, uint64_t capacity,
+                    long log_interval = DEFAULT_CACHE_LOG_INTERVAL, bool scan = true);
+   ~meta_cache_index();
+
+   // the metatile which the tile is in is about to be written, and
+   // mustn't be removed until it has been, or the write has failed.
+   // each call must be followed by one to added() or abandoned().
+   void adding(const tile_protocol &tile);
+
+   // the metatile which the tile is in has been written, with the size
+   // given in bytes.
+   void added(const tile_protocol &tile, size_t size);
+
+   // the metatile which the tile is in wasn't written after all.
+   void abandoned(const tile_protocol &tile);
+
+   // a tile has been read, and was found or not.
+   void accessed(const tile_protocol &tile, bool found);
+
+   // total size of the metatiles in the cache.
+   uint64_t size() const;
+
+   stats get_stats() const;
+
+   // wait until the scan has finished and the cache is within budget.
+   void flush();
+
+   // the index for the tile directory which everything in the process
+   // shares, making it if it doesn't exist yet. if it does, its budget
+   // is changed to the given capacity.
+   static boost::shared_ptr<meta_cache_index> shared(const std::string &dir, uint64_t capacity,
+                                                     long log_interval = DEFAULT_CACHE_LOG_INTERVAL);
+
+private:
+   // a metatile in the clock. the key packs the style, zoom and
+   // position of the metatile, see make_key().
+   struct slot
+   {
+      uint64_t key;
+      uint32_t size;
+      bool referenced, used;
+   };
+
+   // the key for the metatile which the tile is in, returning false if
+   // it can't be given one, or if the style hasn't been seen before and
+   // create isn't set. must be called with the lock held.
+   bool make_key(const std::string &style, int x, int y, int z, bool create, uint64_t &key);
+   void insert(uint64_t key, uint64_t size, bool referenced);
+   void unpin(uint64_t key);
+   void remove(uint32_t index);
+   void set_capacity(uint64_t capacity);
+
+   void run(bool scan);
+   void scan_dir();
+   // remove a batch of metatiles, if the cache is over budget, returning
+   // whether there were any. must be called with the lock held, which is
+   // released between removing each of them.
+   bool evict(boost::unique_lock<boost::mutex> &lock);
+   void log_stats(std::time_t now);
+
+   const std::string m_dir;
+   uint64_t m_capacity;
+   const long m_log_interval;
+
+   mutable boost::mutex m_mutex;
+   boost::condition_variable m_wake, m_idle;
+
+   std::vector<slot> m_slots;
+   std::vector<uint32_t> m_free;
+   boost::unordered_map<uint64_t, uint32_t> m_index;
+   // metatiles being written, with the number of writes of each.
+   boost::unordered_map<uint64_t, uint32_t> m_pins;
+   uint32_t m_hand;
+   uint64_t m_bytes;
+   // whether the cache went over budget and is being brought down to
+   // the low water mark.
+   bool m_evicting;
+
+   std::vector<std::string> m_styles;
+   boost::unordered_map<std::string, uint32_t> m_style_ids;
+
+   stats m_stats, m_logged;
+   std::time_t m_log_time;
+
+   bool m_scanning, m_stopping;
+   boost::thread m_thread;
+};
+
+}
+
+#endif // RENDERMQ_META_CACHE_INDEX_HPP
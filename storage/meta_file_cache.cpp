@@ -0,0 +1,313 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: artem@mapnik-consulting.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "meta_file_cache.hpp"
+#include <boost/functional/hash.hpp>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+#include <ctime>
+
+namespace rendermq
+{
+
+namespace
+{
+
+int64_t monotonic_ms()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return int64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+// open the metatile, and read the start of it.
+bool load(const char *path, meta_file_cache::file &f)
+{
+   f.map.reset();
+   f.fd = ::open(path, O_RDONLY);
+   if (f.fd < 0)
+   {
+      return false;
+   }
+
+   struct stat st;
+   ssize_t got = -1;
+   if ((fstat(f.fd, &st) == 0) && S_ISREG(st.st_mode))
+   {
+      do
+      {
+         got = pread(f.fd, f.header, sizeof(f.header), 0);
+      } while ((got < 0) && (errno == EINTR));
+   }
+
+   if (got < 0)
+   {
+      close(f.fd);
+      f.fd = -1;
+      return false;
+   }
+
+   f.mtime = st.st_mtime;
+   f.size = st.st_size;
+   f.dev = st.st_dev;
+   f.ino = st.st_ino;
+   f.header_size = got;
+   return true;
+}
+
+} // anonymous namespace
+
+boost::shared_ptr<const meta_mapping>
+meta_mapping::create(int fd, size_t size)
+{
+   if (size == 0)
+   {
+      return boost::shared_ptr<const meta_mapping>();
+   }
+   void *ptr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+   if (ptr == MAP_FAILED)
+   {
+      return boost::shared_ptr<const meta_mapping>();
+   }
+   return boost::shared_ptr<const meta_mapping>(new meta_mapping((const char *)ptr, size));
+}
+
+meta_mapping::meta_mapping(const char *data, size_t size)
+   : m_data(data), m_size(size)
+{
+}
+
+meta_mapping::~meta_mapping()
+{
+   munmap((void *)m_data, m_size);
+}
+
+meta_file_cache::meta_file_cache(size_t max_files, long revalidate)
+   : m_max_files(max_files), m_revalidate(revalidate)
+{
+   m_scratch.fd = -1;
+}
+
+meta_file_cache::~meta_file_cache()
+{
+   clear();
+}
+
+const meta_file_cache::file *
+meta_file_cache::open(const char *path)
+{
+   if (m_max_files == 0)
+   {
+      if (m_scratch.fd >= 0)
+      {
+         close(m_scratch.fd);
+      }
+      return load(path, m_scratch) ? &m_scratch : NULL;
+   }
+
+   const file *f = lookup(path);
+   if (f != NULL)
+   {
+      return f;
+   }
+
+   entry &e = add();
+   if (!load(path, e.f))
+   {
+      m_lru.pop_front();
+      return NULL;
+   }
+   added(e, path, boost::hash_range(path, path + strlen(path)));
+   return &e.f;
+}
+
+const meta_file_cache::file *
+meta_file_cache::lookup(const char *path)
+{
+   index_t::iterator itr = find(path, boost::hash_range(path, path + strlen(path)));
+   if (itr == m_index.end())
+   {
+      return NULL;
+   }
+
+   lru_t::iterator e = itr->second;
+   if (!revalidate(*e))
+   {
+      erase(itr);
+      return NULL;
+   }
+   m_lru.splice(m_lru.begin(), m_lru, e);
+   return &e->f;
+}
+
+void
+meta_file_cache::insert(const char *path, const file &f)
+{
+   if (m_max_files == 0)
+   {
+      close(f.fd);
+      return;
+   }
+
+   invalidate(path);
+   entry &e = add();
+   e.f = f;
+   added(e, path, boost::hash_range(path, path + strlen(path)));
+}
+
+meta_file_cache::entry &
+meta_file_cache::add()
+{
+   // re-use the least recently used entry when full, so that only
+   // the first few misses allocate anything.
+   if (m_index.size() >= m_max_files)
+   {
+      lru_t::iterator e = --m_lru.end();
+      m_index.erase(find(e->path.c_str(), e->hash));
+      close(e->f.fd);
+      e->f.map.reset();
+      m_lru.splice(m_lru.begin(), m_lru, e);
+   }
+   else
+   {
+      m_lru.push_front(entry());
+   }
+   return m_lru.front();
+}
+
+void
+meta_file_cache::added(entry &e, const char *path, size_t hash)
+{
+   e.path.assign(path);
+   e.hash = hash;
+   e.checked = (m_revalidate > 0) ? monotonic_ms() : 0;
+   m_index.insert(std::make_pair(hash, m_lru.begin()));
+}
+
+void
+meta_file_cache::invalidate(const char *path)
+{
+   index_t::iterator itr = find(path, boost::hash_range(path, path + strlen(path)));
+   if (itr != m_index.end())
+   {
+      erase(itr);
+   }
+}
+
+void
+meta_file_cache::clear()
+{
+   for (lru_t::iterator itr = m_lru.begin(); itr != m_lru.end(); ++itr)
+   {
+      if (itr->f.fd >= 0)
+      {
+         close(itr->f.fd);
+      }
+   }
+   m_lru.clear();
+   m_index.clear();
+
+   if (m_scratch.fd >= 0)
+   {
+      close(m_scratch.fd);
+      m_scratch.fd = -1;
+   }
+   m_scratch.map.reset();
+}
+
+meta_file_cache::index_t::iterator
+meta_file_cache::find(const char *path, size_t hash)
+{
+   std::pair<index_t::iterator, index_t::iterator> range = m_index.equal_range(hash);
+   for (index_t::iterator itr = range.first; itr != range.second; ++itr)
+   {
+      if (strcmp(itr->second->path.c_str(), path) == 0)
+      {
+         return itr;
+      }
+   }
+   return m_index.end();
+}
+
+void
+meta_file_cache::erase(index_t::iterator itr)
+{
+   lru_t::iterator e = itr->second;
+   if (e->f.fd >= 0)
+   {
+      close(e->f.fd);
+   }
+   m_index.erase(itr);
+   m_lru.erase(e);
+}
+
+bool
+meta_file_cache::revalidate(entry &e)
+{
+   if (m_revalidate < 0)
+   {
+      return true;
+   }
+
+   int64_t now = 0;
+   if (m_revalidate > 0)
+   {
+      now = monotonic_ms();
+      if (now - e.checked < m_revalidate)
+      {
+         return true;
+      }
+   }
+
+   struct stat st;
+   if (stat(e.path.c_str(), &st) < 0)
+   {
+      return false;
+   }
+
+   if ((st.st_dev != e.f.dev) || (st.st_ino != e.f.ino) || (st.st_size != e.f.size))
+   {
+      // a new metatile has been put in its place.
+      close(e.f.fd);
+      if (!load(e.path.c_str(), e.f))
+      {
+         return false;
+      }
+   }
+   else
+   {
+      // expiry only changes the modification time.
+      e.f.mtime = st.st_mtime;
+   }
+
+   e.checked = now;
+   return true;
+}
+
+}
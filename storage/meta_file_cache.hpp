@@ -0,0 +1,167 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: artem@mapnik-consulting.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef RENDERMQ_META_FILE_CACHE_HPP
+#define RENDERMQ_META_FILE_CACHE_HPP
+
+#include <boost/utility.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/shared_ptr.hpp>
+#include <sys/types.h>
+#include <stdint.h>
+#include <ctime>
+#include <string>
+#include <list>
+
+// how much of the start of each metatile is read to find the headers.
+#define META_HEADER_READ_SIZE (4096)
+
+namespace rendermq
+{
+
+/* a read-only mapping of the whole of a metatile, which is unmapped
+ * when the last reference to it goes. views of tiles in the mapping
+ * hold a reference, so they stay valid after the file is closed or a
+ * new metatile is renamed over it.
+ *
+ * the file mustn't be truncated while it's mapped, or reading the
+ * views will fault. metatiles are always replaced by renaming, so
+ * that doesn't happen to the tile directory in normal use.
+ */
+class meta_mapping
+   : private boost::noncopyable
+{
+public:
+   // map size bytes of the file, or return null if it can't be mapped.
+   static boost::shared_ptr<const meta_mapping> create(int fd, size_t size);
+   ~meta_mapping();
+
+   const char *data() const { return m_data; }
+   size_t size() const { return m_size; }
+
+private:
+   meta_mapping(const char *data, size_t size);
+
+   const char *m_data;
+   size_t m_size;
+};
+
+/* a bounded, least recently used cache of open metatile files along
+ * with the start of each file, where the headers are. reading a tile
+ * from a metatile which is in the cache is then a single pread(),
+ * rather than opening the file, reading the header and closing it.
+ *
+ * metatiles are written by renaming a new file over the old one, so an
+ * open file keeps reading the old metatile. to pick up metatiles which
+ * are written or expired by other processes, entries are checked
+ * against the path with stat() once they're older than the
+ * revalidation time. a revalidation time of zero checks on every use,
+ * and a negative one never checks. metatiles written or expired by the
+ * owner of the cache should be invalidated straight away.
+ *
+ * this isn't thread safe, and is meant to be owned by one storage.
+ */
+class meta_file_cache
+   : private boost::noncopyable
+{
+public:
+   struct file
+   {
+      int fd;
+      std::time_t mtime;
+      off_t size;
+      dev_t dev;
+      ino_t ino;
+      // the start of the file, which may be shorter than the buffer.
+      size_t header_size;
+      char header[META_HEADER_READ_SIZE];
+      // mapping of the whole file, made by the user of the cache when
+      // it's first needed, and dropped when the file is closed.
+      mutable boost::shared_ptr<const meta_mapping> map;
+   };
+
+   /* @param max_files the most files to keep open. with zero, nothing
+    *          is kept open after the next call.
+    * @param revalidate milliseconds after which an entry is checked
+    *          against the file system before use.
+    */
+   meta_file_cache(size_t max_files, long revalidate);
+   ~meta_file_cache();
+
+   /* the metatile at the path, opening it and reading its header if it
+    * isn't already open. returns null if it isn't there or can't be
+    * read. the file is only valid until the next call to the cache.
+    */
+   const file *open(const char *path);
+
+   /* the metatile at the path if it's already open, or null if it
+    * isn't. this never opens anything, but may still check the file
+    * is up to date.
+    */
+   const file *lookup(const char *path);
+
+   /* add a metatile which has been opened and had its header read
+    * elsewhere. the cache takes over the file descriptor, replacing
+    * any entry which was already there.
+    */
+   void insert(const char *path, const file &f);
+
+   // close the metatile at the path, if it's open.
+   void invalidate(const char *path);
+
+   // close all the metatiles.
+   void clear();
+
+private:
+   struct entry
+   {
+      std::string path;
+      size_t hash;
+      int64_t checked;
+      file f;
+   };
+   typedef std::list<entry> lru_t;
+   typedef boost::unordered_multimap<size_t, lru_t::iterator> index_t;
+
+   index_t::iterator find(const char *path, size_t hash);
+   // a new entry at the front, evicting the oldest when full.
+   entry &add();
+   void added(entry &e, const char *path, size_t hash);
+   void erase(index_t::iterator itr);
+   // make sure the entry is still the file at its path.
+   bool revalidate(entry &e);
+
+   const size_t m_max_files;
+   const long m_revalidate;
+   // most recently used at the front.
+   lru_t m_lru;
+   index_t m_index;
+   // the file used when nothing is kept open.
+   file m_scratch;
+};
+
+}
+
+#endif // RENDERMQ_META_FILE_CACHE_HPP
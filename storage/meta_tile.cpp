@@ -34,16 +34,32 @@
 #include <pthread.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include "meta_tile.hpp"
 #include "../logging/logger.hpp"
 
 #include <cstring> // for strlen
+#include <cstdio>
+#include <climits>
+#include <stdexcept>
 #define META_MAGIC "META"
 
 namespace rendermq
 {
 
    std::pair<std::string, int> xyz_to_meta(std::string const& tile_dir, int x, int y, int z, std::string const &style)
+   {
+      char path[PATH_MAX];
+      int offset = xyz_to_meta_path(path, sizeof(path), tile_dir, x, y, z, style);
+      if(offset < 0)
+      {
+         throw std::runtime_error((boost::format("Metatile path for %1%/%2%/%3%/%4% is too long")
+                                   % tile_dir % style % z % x).str());
+      }
+      return std::make_pair(std::string(path), offset);
+   }
+
+   int xyz_to_meta_path(char *path, size_t size, std::string const& tile_dir, int x, int y, int z, std::string const &style)
    {
       unsigned hash[5];
       unsigned mask = METATILE - 1;
@@ -56,9 +72,11 @@ namespace rendermq
          x >>= 4;
          y >>= 4;
       }
-      std::string path = (boost::format("%s/%s/%d/%u/%u/%u/%u/%u.meta") % tile_dir % style % z % hash[4] % hash[3] % hash[2]
-               % hash[1] % hash[0]).str();
-      return std::make_pair(path, offset);
+      int len = snprintf(path, size, "%s/%s/%d/%u/%u/%u/%u/%u.meta", tile_dir.c_str(), style.c_str(), z,
+                         hash[4], hash[3], hash[2], hash[1], hash[0]);
+      if((len < 0) || (size_t(len) >= size))
+         return -1;
+      return offset;
    }
 
    int xyz_to_meta_offset(const int& x, const int& y, const int& z)
@@ -250,6 +268,67 @@ namespace rendermq
       return pos;
    }
 
+   int stat_from_meta(std::string const& tile_dir, int x, int y, int z, std::string const &style, int fmt,
+            std::time_t &mtime)
+   {
+      char header[4096];
+      std::pair<std::string, int> metatile = xyz_to_meta(tile_dir, x, y, z, style);
+
+      int fd = open(metatile.first.c_str(), O_RDONLY);
+      if(fd < 0)
+         return -1;
+
+      struct stat st;
+      if(fstat(fd, &st) < 0)
+      {
+         close(fd);
+         return -2;
+      }
+      mtime = st.st_mtime;
+
+      ssize_t got = pread(fd, header, sizeof(header), 0);
+      close(fd);
+      if(got < 0)
+         return -2;
+      const meta_layout *m = find_meta_layout(header, got, fmt, metatile.first.c_str());
+      if(m == NULL)
+         return -3;
+
+      return m->index[metatile.second].size;
+   }
+
+   const meta_layout *find_meta_layout(const char *header, size_t size, int fmt,
+            const char *name)
+   {
+      // search for the correct format metatile header.
+      size_t n_header = 0;
+      const meta_layout *m = NULL;
+      do
+      {
+         if(size < (n_header + 1) * metaTile::header_size)
+         {
+            LOG_ERROR(boost::format("Meta file %1% too small to contain header") % name);
+            return NULL;
+         }
+         m = (const meta_layout *)(header + n_header * metaTile::header_size);
+         if(memcmp(m->magic, META_MAGIC, strlen(META_MAGIC)))
+         {
+            LOG_WARNING(boost::format("Meta file %1% header magic mismatch") % name);
+            return NULL;
+         }
+         ++n_header;
+      }while(m->fmt != fmt);
+
+      if(m->count != (METATILE * METATILE))
+      {
+         LOG_WARNING(boost::format("Meta file %1% header bad count %2% != %3%")
+                     % name % m->count % (METATILE * METATILE));
+         return NULL;
+      }
+
+      return m;
+   }
+
    metaTile::metaTile(int x, int y, int z, std::string const &style) :
       x_(x), y_(y), z_(z), style_(style)
    {
@@ -333,6 +412,16 @@ namespace rendermq
     * relative to the beginning of the *file*, not relative to the
     * metatile header. */
    metatile_reader::metatile_reader(const std::string &data, int fmt):data_(data.c_str()), size_(data.size()), initialized_(false)
+   {
+      init(fmt);
+   }
+
+   metatile_reader::metatile_reader(const char *data, size_t size, int fmt):data_(data), size_(size), initialized_(false)
+   {
+      init(fmt);
+   }
+
+   void metatile_reader::init(int fmt)
    {
       int offset = 0;
       // now that metatiles might have some arbitrary number of
@@ -376,5 +465,22 @@ namespace rendermq
       return std::make_pair(data_ + size_, data_ + size_);
    }
 
+   std::pair<size_t, size_t> metatile_reader::get_range(int x, int y) const
+   {
+      if(initialized_)
+      {
+         unsigned mask = METATILE - 1;
+         unsigned offset = (y & mask) * METATILE + (x & mask);
+         size_t tile_offset = header_.index[offset].offset;
+         size_t tile_size = header_.index[offset].size;
+
+         if(tile_offset + tile_size <= size_)
+         {
+            return std::make_pair(tile_offset, tile_size);
+         }
+      }
+      return std::make_pair(size_, size_t(0));
+   }
+
 }
 
@@ -30,6 +30,7 @@
 #include <string>
 #include <boost/array.hpp>
 #include <vector>
+#include <ctime>
 #include "../tile_utils.hpp"
 
 // how wide and high a metatile is, in tiles
@@ -80,7 +81,13 @@ namespace rendermq
       public:
          typedef std::string::const_iterator iterator_type;
          metatile_reader(const std::string &data, int fmt);
+         metatile_reader(const char *data, size_t size, int fmt);
          std::pair<iterator_type, iterator_type> get(int x, int y) const;
+         // the offset and size of the tile within the metatile data, or
+         // a zero size if it isn't there.
+         std::pair<size_t, size_t> get_range(int x, int y) const;
+
+         void init(int fmt);
 
          meta_layout header_;
          const char * data_;
@@ -89,6 +96,9 @@ namespace rendermq
    };
 
    std::pair<std::string, int> xyz_to_meta(std::string const& tile_dir, int x, int y, int z, std::string const &style);
+   // like xyz_to_meta, but writes the path into a buffer rather than
+   // allocating a string. returns the offset, or -1 if it doesn't fit.
+   int xyz_to_meta_path(char *path, size_t size, std::string const& tile_dir, int x, int y, int z, std::string const &style);
    std::pair<int, int> xy_to_meta_xy(const int& x, const int& y);
    int xyz_to_meta_offset(const int& x, const int& y, const int& z);
    int get_meta_dimensions(const int& zoom, const int& limit = METATILE);
@@ -98,6 +108,15 @@ namespace rendermq
    std::string write_headers(const int& x, const int& y, const int& z, const std::vector<protoFmt>& formats, const std::vector<int>& sizes);
    int read_from_meta(std::string const& tile_dir, int x, int y, int z, std::string const &style, unsigned char* buf,
             size_t sz, int fmt);
+   // like read_from_meta, but only reads the header and returns the size of the tile
+   // without its data. the modification time of the metatile is put in mtime.
+   int stat_from_meta(std::string const& tile_dir, int x, int y, int z, std::string const &style, int fmt,
+            std::time_t &mtime);
+   // find the header for the format in a buffer read from the start of a metatile,
+   // returning null if it isn't there or the header is bad. the name of the
+   // metatile is only used for logging.
+   const meta_layout *find_meta_layout(const char *header, size_t size, int fmt,
+            const char *name);
 
 }
 
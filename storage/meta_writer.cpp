@@ -0,0 +1,494 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: artem@mapnik-consulting.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "meta_writer.hpp"
+#include "../logging/logger.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+#include <cstdio>
+#include <stdexcept>
+#include <set>
+#include <map>
+
+#define BOOST_FILESYSTEM_VERSION 3
+#include <boost/filesystem/operations.hpp>
+#include <boost/format.hpp>
+#include <boost/bind.hpp>
+#include <boost/weak_ptr.hpp>
+
+// directories remembered as having been made. the cache is cleared
+// when it's full, which is cheap as the directories just get checked
+// again.
+#define MAX_CACHED_DIRS (65536)
+
+using std::string;
+using std::vector;
+using std::set;
+using boost::shared_ptr;
+namespace fs = boost::filesystem;
+
+namespace rendermq
+{
+
+namespace
+{
+
+bool write_fully(int fd, const char *buf, size_t size)
+{
+   while (size > 0)
+   {
+      ssize_t done = ::write(fd, buf, size);
+      if ((done < 0) && (errno == EINTR))
+      {
+         continue;
+      }
+      if (done <= 0)
+      {
+         return false;
+      }
+      buf += done;
+      size -= done;
+   }
+   return true;
+}
+
+string dir_of(const string &path)
+{
+   const size_t slash = path.rfind('/');
+   return (slash == string::npos) ? string(".") : path.substr(0, slash);
+}
+
+// sync the directory, or the whole file system it's on.
+bool sync_dir(const string &dir, bool whole_fs)
+{
+   int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+   if (fd < 0)
+   {
+      return false;
+   }
+   const bool ok = (whole_fs ? syncfs(fd) : fsync(fd)) == 0;
+   close(fd);
+   return ok;
+}
+
+string error(const char *what, const string &path)
+{
+   return (boost::format("%1% %2%: %3%") % what % path % strerror(errno)).str();
+}
+
+// writers shared by everything in the process, by tile directory.
+boost::mutex shared_mutex;
+std::map<string, boost::weak_ptr<meta_writer> > shared_writers;
+
+} // anonymous namespace
+
+meta_writer::meta_writer(size_t threads, size_t max_queue, const string &sync, size_t max_batch)
+   : m_max_queue(std::max(max_queue, size_t(1))), m_max_batch(std::max(max_batch, size_t(1))),
+     m_num_pending(0), m_stopping(false)
+{
+   if (sync == "none")
+   {
+      m_sync = sync_none;
+   }
+   else if (sync == "fsync")
+   {
+      m_sync = sync_fsync;
+   }
+   else if (sync == "syncfs")
+   {
+      m_sync = sync_syncfs;
+   }
+   else
+   {
+      throw std::runtime_error((boost::format("Unknown write sync mode \"%1%\".") % sync).str());
+   }
+
+   for (size_t i = 0; i < std::max(threads, size_t(1)); ++i)
+   {
+      m_threads.create_thread(boost::bind(&meta_writer::run, this));
+   }
+}
+
+meta_writer::~meta_writer()
+{
+   {
+      boost::unique_lock<boost::mutex> lock(m_mutex);
+      m_stopping = true;
+   }
+   m_queued.notify_all();
+   m_threads.join_all();
+}
+
+void
+meta_writer::put(const string &path, const string &data, const boost::function<void (bool)> &written)
+{
+   shared_ptr<metatile> m(new metatile);
+   m->data.reset(new string(data));
+   m->mtime = std::time(NULL);
+   m->written = written;
+   update(path, m);
+}
+
+shared_ptr<meta_writer>
+meta_writer::shared(const string &dir, size_t threads, size_t max_queue,
+                    const string &sync, size_t max_batch)
+{
+   boost::unique_lock<boost::mutex> lock(shared_mutex);
+   shared_ptr<meta_writer> writer = shared_writers[dir].lock();
+   if (!writer)
+   {
+      writer.reset(new meta_writer(threads, max_queue, sync, max_batch));
+      shared_writers[dir] = writer;
+   }
+   return writer;
+}
+
+bool
+meta_writer::expire(const string &path)
+{
+   boost::unique_lock<boost::mutex> lock(m_mutex);
+   pending_t::iterator itr = m_pending.find(path);
+   if (itr == m_pending.end())
+   {
+      return false;
+   }
+   // the data is shared with the metatile being replaced, and so is the
+   // callback, unless that's called when the old one's been written.
+   const slot &s = itr->second;
+   shared_ptr<metatile> m(new metatile(*s.m));
+   m->mtime = 0;
+   if (s.m == s.in_flight)
+   {
+      m->written.clear();
+   }
+   replace(itr, m);
+   return true;
+}
+
+shared_ptr<const meta_writer::metatile>
+meta_writer::find(const char *path) const
+{
+   // reads don't need to take the lock, or make a string, when nothing
+   // is being written.
+   if (__sync_fetch_and_add(&m_num_pending, 0) == 0)
+   {
+      return shared_ptr<const metatile>();
+   }
+   boost::unique_lock<boost::mutex> lock(m_mutex);
+   pending_t::const_iterator itr = m_pending.find(string(path));
+   return (itr == m_pending.end()) ? shared_ptr<const metatile>() : itr->second.m;
+}
+
+void
+meta_writer::flush()
+{
+   boost::unique_lock<boost::mutex> lock(m_mutex);
+   while (!m_pending.empty())
+   {
+      m_written.wait(lock);
+   }
+}
+
+void
+meta_writer::update(const string &path, const shared_ptr<const metatile> &m)
+{
+   boost::unique_lock<boost::mutex> lock(m_mutex);
+   pending_t::iterator itr = m_pending.find(path);
+
+   // a new metatile waits for room in the queue, but replacing one
+   // which is already pending doesn't need any.
+   while ((itr == m_pending.end()) && (m_pending.size() >= m_max_queue))
+   {
+      m_written.wait(lock);
+      itr = m_pending.find(path);
+   }
+
+   if (itr == m_pending.end())
+   {
+      itr = m_pending.insert(std::make_pair(path, slot())).first;
+      itr->second.queued = false;
+      __sync_fetch_and_add(&m_num_pending, 1);
+   }
+   boost::function<void (bool)> dropped = replace(itr, m);
+   if (dropped)
+   {
+      dropped(false);
+   }
+}
+
+boost::function<void (bool)>
+meta_writer::replace(pending_t::iterator itr, const shared_ptr<const metatile> &m)
+{
+   slot &s = itr->second;
+   boost::function<void (bool)> dropped;
+   if (s.m && (s.m != s.in_flight))
+   {
+      dropped = s.m->written;
+   }
+   s.m = m;
+   s.failures = 0;
+   // if a thread is writing the old one then it queues this one again
+   // once it's finished, so that two threads never write the same path
+   // at once and the older one can't be renamed over the newer.
+   if (!s.queued && !s.in_flight)
+   {
+      queue(itr->first, s);
+   }
+   return dropped;
+}
+
+void
+meta_writer::queue(const string &path, slot &s)
+{
+   s.queued = true;
+   m_queue.push_back(path);
+   m_queued.notify_one();
+}
+
+void
+meta_writer::run()
+{
+   vector<write> batch;
+   while (true)
+   {
+      batch.clear();
+      {
+         boost::unique_lock<boost::mutex> lock(m_mutex);
+         while (m_queue.empty() && !m_stopping)
+         {
+            m_queued.wait(lock);
+         }
+         if (m_queue.empty())
+         {
+            return;
+         }
+         while (!m_queue.empty() && (batch.size() < m_max_batch))
+         {
+            write w;
+            w.path.swap(m_queue.front());
+            m_queue.pop_front();
+            slot &s = m_pending[w.path];
+            s.queued = false;
+            s.in_flight = s.m;
+            w.m = s.m;
+            w.ok = false;
+            batch.push_back(w);
+         }
+      }
+
+      write_batch(batch);
+
+      {
+         boost::unique_lock<boost::mutex> lock(m_mutex);
+         for (vector<write>::iterator itr = batch.begin(); itr != batch.end(); ++itr)
+         {
+            pending_t::iterator jtr = m_pending.find(itr->path);
+            slot &s = jtr->second;
+            s.in_flight.reset();
+            if ((s.m == itr->m) && !itr->ok && (++s.failures < MAX_WRITE_ATTEMPTS))
+            {
+               // stays pending, so reads still see it, and is tried
+               // again after everything else which is queued.
+               queue(jtr->first, s);
+               continue;
+            }
+
+            if (itr->m->written)
+            {
+               itr->m->written(itr->ok);
+            }
+            if (s.m != itr->m)
+            {
+               // replaced while it was being written, so write it again.
+               queue(jtr->first, s);
+            }
+            else
+            {
+               if (!itr->ok)
+               {
+                  LOG_ERROR(boost::format("Giving up writing metatile %1% after %2% attempts, it is lost.")
+                            % itr->path % s.failures);
+               }
+               m_pending.erase(jtr);
+               __sync_fetch_and_sub(&m_num_pending, 1);
+            }
+         }
+      }
+      m_written.notify_all();
+   }
+}
+
+void
+meta_writer::write_batch(vector<write> &batch)
+{
+   for (vector<write>::iterator itr = batch.begin(); itr != batch.end(); ++itr)
+   {
+      itr->ok = write_tmp(*itr);
+   }
+
+   // nothing is renamed until the whole batch is durable, so a crash
+   // never leaves a renamed metatile which isn't all there.
+   if ((m_sync == sync_syncfs) && !batch.empty() && !sync_dir(dir_of(batch.front().path), true))
+   {
+      LOG_ERROR(error("Unable to sync file system of", dir_of(batch.front().path)));
+   }
+
+   set<string> dirs;
+   for (vector<write>::iterator itr = batch.begin(); itr != batch.end(); ++itr)
+   {
+      if (!itr->ok)
+      {
+         continue;
+      }
+      if (::rename(itr->tmp.c_str(), itr->path.c_str()) < 0)
+      {
+         LOG_ERROR(error("Unable to rename metatile into place at", itr->path));
+         unlink(itr->tmp.c_str());
+         itr->ok = false;
+         continue;
+      }
+      if (m_sync == sync_fsync)
+      {
+         dirs.insert(dir_of(itr->path));
+      }
+   }
+
+   // and then the renames themselves.
+   for (set<string>::const_iterator itr = dirs.begin(); itr != dirs.end(); ++itr)
+   {
+      if (!sync_dir(*itr, false))
+      {
+         LOG_ERROR(error("Unable to sync directory", *itr));
+      }
+   }
+   if ((m_sync == sync_syncfs) && !batch.empty())
+   {
+      sync_dir(dir_of(batch.front().path), true);
+   }
+}
+
+bool
+meta_writer::write_tmp(write &w)
+{
+   const string dir = dir_of(w.path);
+   if (!make_dir(dir))
+   {
+      return false;
+   }
+
+   vector<char> tmp(w.path.begin(), w.path.end());
+   const char suffix[] = ".XXXXXX";
+   tmp.insert(tmp.end(), suffix, suffix + sizeof(suffix));
+   int fd = mkstemp(&tmp[0]);
+   if ((fd < 0) && (errno == ENOENT))
+   {
+      // the directory has been removed since it was made.
+      {
+         boost::unique_lock<boost::mutex> lock(m_mutex);
+         m_dirs.erase(dir);
+      }
+      std::copy(suffix, suffix + sizeof(suffix), tmp.end() - sizeof(suffix));
+      if (make_dir(dir))
+      {
+         fd = mkstemp(&tmp[0]);
+      }
+   }
+   if (fd < 0)
+   {
+      LOG_ERROR(error("Unable to create temporary metatile for", w.path));
+      return false;
+   }
+   w.tmp.assign(&tmp[0]);
+
+   // allocating the whole file up front keeps it in one piece, and
+   // fails early if the disk is full. not all file systems can.
+   const string &data = *w.m->data;
+   bool ok = true;
+   if (!data.empty() && (posix_fallocate(fd, 0, data.size()) == ENOSPC))
+   {
+      errno = ENOSPC;
+      ok = false;
+   }
+   ok = ok && (fchmod(fd, 0644) == 0) && write_fully(fd, data.data(), data.size());
+   if (ok && (w.m->mtime == 0))
+   {
+      // expired while it was pending, as disk_storage::expire() does.
+      const struct timespec epoch[2] = { { 0, 0 }, { 0, 0 } };
+      ok = (futimens(fd, epoch) == 0);
+   }
+   if (ok && (m_sync == sync_fsync))
+   {
+      ok = (fdatasync(fd) == 0);
+   }
+   if (!ok)
+   {
+      LOG_ERROR(error("Unable to write metatile", w.tmp));
+      close(fd);
+      unlink(w.tmp.c_str());
+      return false;
+   }
+   close(fd);
+   return true;
+}
+
+bool
+meta_writer::make_dir(const string &dir)
+{
+   {
+      boost::unique_lock<boost::mutex> lock(m_mutex);
+      if (m_dirs.count(dir) > 0)
+      {
+         return true;
+      }
+   }
+
+   try
+   {
+      fs::create_directories(dir);
+   }
+   catch (const fs::filesystem_error &e)
+   {
+      // another thread may have made it at the same time.
+      if (!fs::is_directory(dir))
+      {
+         LOG_ERROR(boost::format("Unable to create metatile directory: %1%") % e.what());
+         return false;
+      }
+   }
+
+   boost::unique_lock<boost::mutex> lock(m_mutex);
+   if (m_dirs.size() >= MAX_CACHED_DIRS)
+   {
+      m_dirs.clear();
+   }
+   m_dirs.insert(dir);
+   return true;
+}
+
+}
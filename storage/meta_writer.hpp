@@ -0,0 +1,187 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: artem@mapnik-consulting.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef RENDERMQ_META_WRITER_HPP
+#define RENDERMQ_META_WRITER_HPP
+
+#include <boost/utility.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
+#include <boost/thread.hpp>
+#include <ctime>
+#include <deque>
+#include <string>
+#include <vector>
+
+// metatiles which can be waiting to be written before put() blocks.
+#define DEFAULT_WRITE_QUEUE (256)
+// most metatiles written together and made durable with one sync.
+#define DEFAULT_WRITE_BATCH (32)
+// how writes are made durable, see meta_writer.
+#define DEFAULT_WRITE_SYNC "none"
+// times a metatile is tried before it's given up on.
+#define MAX_WRITE_ATTEMPTS (3)
+
+namespace rendermq
+{
+
+/* writes metatiles for disk_storage in the background, so that the
+ * thread putting them doesn't wait on the file system.
+ *
+ * metatiles are put in a bounded queue, and put() only blocks when it
+ * is full. each writer thread takes a batch of metatiles off the queue
+ * and writes each to a temporary file in the metatile's directory,
+ * then makes the batch durable and renames them all into place. a
+ * crash leaves either the old or the new metatile, never part of one,
+ * and the directories which have been made are remembered, so most
+ * metatiles need no more than a create, a write and a rename.
+ *
+ * the sync mode says how durable a metatile is before it's renamed:
+ *
+ *   none   - not at all, as disk_storage always used to do. a crash
+ *            may leave an empty metatile, which is read as missing.
+ *   fsync  - each file is synced, then each directory which had a
+ *            metatile renamed into it once per batch.
+ *   syncfs - the whole file system is synced once before the batch is
+ *            renamed and once after, which is much cheaper than fsync
+ *            for large batches on a file system nothing else is using.
+ *
+ * metatiles which are queued or being written are pending, and can be
+ * found with find(), so that reads see them before they're on disk.
+ * putting or expiring a metatile which is already pending replaces it,
+ * and it's written again once the thread writing the old one is done.
+ *
+ * a metatile which can't be written stays pending and is tried again,
+ * up to MAX_WRITE_ATTEMPTS times. after that it's logged and dropped,
+ * so a put which returned successfully can still be lost, e.g: if the
+ * disk is full. the callback given to put() says which happened.
+ */
+class meta_writer
+   : private boost::noncopyable
+{
+public:
+   // a metatile which hasn't been written yet.
+   struct metatile
+   {
+      boost::shared_ptr<const std::string> data;
+      // when it was put, or zero if it has been expired since.
+      std::time_t mtime;
+      // called once it's been written, or given up on, or replaced
+      // before it was written, with whether it's on disk.
+      boost::function<void (bool)> written;
+   };
+
+   /* @param threads writer threads, at least one.
+    * @param max_queue most metatiles pending before put() blocks.
+    * @param sync how to make writes durable: none, fsync or syncfs.
+    *          throws std::runtime_error if it's none of those.
+    * @param max_batch most metatiles each thread writes at once.
+    */
+   meta_writer(size_t threads, size_t max_queue, const std::string &sync, size_t max_batch);
+   // writes everything which is still pending before returning.
+   ~meta_writer();
+
+   // queue the metatile to be written to the path. the callback is
+   // called with the lock held, so mustn't call back into the writer.
+   void put(const std::string &path, const std::string &data,
+            const boost::function<void (bool)> &written = boost::function<void (bool)>());
+
+   // mark the pending metatile at the path as expired, returning false
+   // if there isn't one.
+   bool expire(const std::string &path);
+
+   // the metatile pending at the path, or null if there isn't one.
+   // this is cheap when nothing is pending.
+   boost::shared_ptr<const metatile> find(const char *path) const;
+
+   // wait until everything put so far has been written.
+   void flush();
+
+   // the writer for the tile directory which everything in the process
+   // shares, making it with the given settings if it doesn't exist yet.
+   // storage writing to the same directory has to share a writer, or
+   // one writer's rename can put an older metatile over a newer one
+   // which the other has already written.
+   static boost::shared_ptr<meta_writer> shared(const std::string &dir, size_t threads,
+                                                size_t max_queue, const std::string &sync,
+                                                size_t max_batch);
+
+private:
+   struct slot
+   {
+      boost::shared_ptr<const metatile> m;
+      // whether the path is in the queue, and the metatile a thread is
+      // writing to it, if any. a path which is queued while it's being
+      // written is only queued once the thread has finished with it.
+      bool queued;
+      boost::shared_ptr<const metatile> in_flight;
+      // failed attempts at writing this metatile.
+      int failures;
+   };
+   typedef boost::unordered_map<std::string, slot> pending_t;
+
+   // a metatile being written by a thread.
+   struct write
+   {
+      std::string path, tmp;
+      boost::shared_ptr<const metatile> m;
+      bool ok;
+   };
+
+   void run();
+   void write_batch(std::vector<write> &batch);
+   bool write_tmp(write &w);
+   bool make_dir(const std::string &dir);
+   // replace the slot for the path, queueing it if it isn't already.
+   void update(const std::string &path, const boost::shared_ptr<const metatile> &m);
+   // replace the pending metatile, returning the callback of the old one
+   // if it's now never going to be written. must be called with the
+   // lock held.
+   boost::function<void (bool)> replace(pending_t::iterator itr, const boost::shared_ptr<const metatile> &m);
+   // put the path at the back of the queue. must be called with the
+   // lock held.
+   void queue(const std::string &path, slot &s);
+
+   enum sync_mode { sync_none, sync_fsync, sync_syncfs };
+
+   const size_t m_max_queue, m_max_batch;
+   sync_mode m_sync;
+
+   mutable boost::mutex m_mutex;
+   boost::condition_variable m_queued, m_written;
+   pending_t m_pending;
+   // size of m_pending, which can be read without the lock.
+   mutable size_t m_num_pending;
+   std::deque<std::string> m_queue;
+   boost::unordered_set<std::string> m_dirs;
+   bool m_stopping;
+   boost::thread_group m_threads;
+};
+
+}
+
+#endif // RENDERMQ_META_WRITER_HPP
@@ -179,5 +179,163 @@ per_style_storage::expire(const tile_protocol &tile) const
    }
 }
 
+shared_ptr<tile_storage::handle> 
+per_style_storage::probe(const tile_protocol &tile) const 
+{
+   return storage_for(tile).probe(tile);
+}
+
+void
+per_style_storage::get_async(const tile_protocol &tile, const get_callback &callback) const
+{
+   storage_for(tile).get_async(tile, callback);
+}
+
+void
+per_style_storage::get_meta_async(const tile_protocol &tile, const get_meta_callback &callback) const
+{
+   storage_for(tile).get_meta_async(tile, callback);
+}
+
+void
+per_style_storage::expire_async(const tile_protocol &tile, const expire_callback &callback) const
+{
+   storage_for(tile).expire_async(tile, callback);
+}
+
+void
+per_style_storage::probe_async(const tile_protocol &tile, const get_callback &callback) const
+{
+   storage_for(tile).probe_async(tile, callback);
+}
+
+void
+per_style_storage::put_meta_async(const tile_protocol &tile, const std::string &buf, const put_meta_callback &callback) const
+{
+   storage_for(tile).put_meta_async(tile, buf, callback);
+}
+
+void
+per_style_storage::async_fds(std::vector<int> &fds) const
+{
+   for (map_of_storage_t::const_iterator itr = m_storages.begin();
+        itr != m_storages.end(); ++itr)
+   {
+      itr->second->async_fds(fds);
+   }
+   m_default_storage->async_fds(fds);
+}
+
+void
+per_style_storage::async_perform() const
+{
+   for (map_of_storage_t::const_iterator itr = m_storages.begin();
+        itr != m_storages.end(); ++itr)
+   {
+      itr->second->async_perform();
+   }
+   m_default_storage->async_perform();
+}
+
+void
+per_style_storage::get_multi(const std::vector<tile_protocol> &tiles,
+                             std::vector<shared_ptr<tile_storage::handle> > &handles) const
+{
+   fetch_multi(tiles, false, handles);
+}
+
+void
+per_style_storage::probe_multi(const std::vector<tile_protocol> &tiles,
+                               std::vector<shared_ptr<tile_storage::handle> > &handles) const
+{
+   fetch_multi(tiles, true, handles);
+}
+
+void
+per_style_storage::fetch_multi(const std::vector<tile_protocol> &tiles, bool probe,
+                               std::vector<shared_ptr<tile_storage::handle> > &handles) const
+{
+   batches_t batches;
+   split_batch(tiles, batches);
+   handles.resize(tiles.size());
+
+   vector<tile_protocol> batch;
+   vector<shared_ptr<tile_storage::handle> > results;
+   for (batches_t::const_iterator itr = batches.begin(); itr != batches.end(); ++itr)
+   {
+      const vector<size_t> &indexes = itr->second;
+      batch.clear();
+      BOOST_FOREACH(size_t i, indexes)
+      {
+         batch.push_back(tiles[i]);
+      }
+
+      if (probe)
+      {
+         itr->first->probe_multi(batch, results);
+      }
+      else
+      {
+         itr->first->get_multi(batch, results);
+      }
+
+      for (size_t j = 0; j < indexes.size(); ++j)
+      {
+         handles[indexes[j]] = results[j];
+      }
+   }
+}
+
+void
+per_style_storage::expire_multi(const std::vector<tile_protocol> &tiles,
+                                std::vector<bool> &results) const
+{
+   batches_t batches;
+   split_batch(tiles, batches);
+   results.resize(tiles.size());
+
+   vector<tile_protocol> batch;
+   vector<bool> batch_results;
+   for (batches_t::const_iterator itr = batches.begin(); itr != batches.end(); ++itr)
+   {
+      const vector<size_t> &indexes = itr->second;
+      batch.clear();
+      BOOST_FOREACH(size_t i, indexes)
+      {
+         batch.push_back(tiles[i]);
+      }
+
+      itr->first->expire_multi(batch, batch_results);
+
+      for (size_t j = 0; j < indexes.size(); ++j)
+      {
+         results[indexes[j]] = batch_results[j];
+      }
+   }
+}
+
+void
+per_style_storage::split_batch(const std::vector<tile_protocol> &tiles, batches_t &batches) const
+{
+   for (size_t i = 0; i < tiles.size(); ++i)
+   {
+      batches[&storage_for(tiles[i])].push_back(i);
+   }
+}
+
+const tile_storage &
+per_style_storage::storage_for(const tile_protocol &tile) const
+{
+   map_of_storage_t::const_iterator itr = m_storages.find(tile.style);
+   if (itr == m_storages.end()) 
+   {
+      return *m_default_storage;
+   }
+   else
+   {
+      return *itr->second;
+   }
+}
+
 } // namespace rendermq
 
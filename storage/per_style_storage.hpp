@@ -64,9 +64,41 @@ public:
    bool get_meta(const tile_protocol &, std::string &) const;
    bool put_meta(const tile_protocol &tile, const std::string &buf) const;
    bool expire(const tile_protocol &tile) const;
+   boost::shared_ptr<tile_storage::handle> probe(const tile_protocol &tile) const;
+
+   // asynchronous versions are proxied in the same way, and the
+   // event sources of all the sub-storages are passed through.
+   void get_async(const tile_protocol &tile, const get_callback &callback) const;
+   void get_meta_async(const tile_protocol &tile, const get_meta_callback &callback) const;
+   void expire_async(const tile_protocol &tile, const expire_callback &callback) const;
+   void probe_async(const tile_protocol &tile, const get_callback &callback) const;
+   void put_meta_async(const tile_protocol &tile, const std::string &buf, const put_meta_callback &callback) const;
+   void async_fds(std::vector<int> &fds) const;
+   void async_perform() const;
+
+   // batches are split up by style, and each part is passed on to
+   // the appropriate storage object as a batch.
+   void get_multi(const std::vector<tile_protocol> &tiles,
+                  std::vector<boost::shared_ptr<tile_storage::handle> > &handles) const;
+   void probe_multi(const std::vector<tile_protocol> &tiles,
+                    std::vector<boost::shared_ptr<tile_storage::handle> > &handles) const;
+   void expire_multi(const std::vector<tile_protocol> &tiles,
+                     std::vector<bool> &results) const;
 
 private:
 
+   // the parts of a batch for each storage object, as indexes into
+   // the batch.
+   typedef std::map<const tile_storage *, std::vector<size_t> > batches_t;
+   void split_batch(const std::vector<tile_protocol> &tiles, batches_t &batches) const;
+
+   // get or probe a batch, split up by style.
+   void fetch_multi(const std::vector<tile_protocol> &tiles, bool probe,
+                    std::vector<boost::shared_ptr<tile_storage::handle> > &handles) const;
+
+   // the storage object responsible for the tile's style.
+   const tile_storage &storage_for(const tile_protocol &tile) const;
+
    // maps style name into a storage object to provide per-style
    // overrides for the storage behaviour.
    map_of_storage_t m_storages;
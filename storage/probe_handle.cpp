@@ -0,0 +1,64 @@
+/*------------------------------------------------------------------------------
+ *
+ * Null handle - a handle which doesn't exist, hasn't been 
+ * modified, has no data, etc...
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2011 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "probe_handle.hpp"
+
+namespace rendermq {
+
+using std::time_t;
+using std::string;
+
+probe_handle::probe_handle(bool exists, time_t last_modified, bool expired)
+   : m_exists(exists), m_last_modified(last_modified), m_expired(expired)
+{
+}
+
+probe_handle::~probe_handle()
+{
+}
+
+bool probe_handle::exists() const
+{
+   return m_exists;
+}
+
+time_t probe_handle::last_modified() const
+{
+   return m_last_modified;
+}
+
+bool probe_handle::data(string &) const 
+{
+   // the data wasn't read, so there is nothing to give back.
+   return false;
+}
+
+bool probe_handle::expired() const 
+{
+   return m_expired;
+}
+
+}
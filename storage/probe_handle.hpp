@@ -0,0 +1,60 @@
+/*------------------------------------------------------------------------------
+ *
+ * Null handle - a handle which doesn't exist, hasn't been 
+ * modified, has no data, etc...
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2011 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef RENDERMQ_PROBE_HANDLE_HPP
+#define RENDERMQ_PROBE_HANDLE_HPP
+
+#include <string>
+#include <ctime>
+#include "tile_storage.hpp"
+
+namespace rendermq {
+
+/* Probe handle carries only the metadata about a tile, without
+ * any of its data. This is what storage classes return from
+ * probe() when they are able to find out about a tile without
+ * reading it.
+ */
+class probe_handle : public tile_storage::handle 
+{
+public:
+   probe_handle(bool exists, std::time_t last_modified, bool expired);
+   ~probe_handle();
+
+   virtual bool exists() const;
+   virtual std::time_t last_modified() const;
+   virtual bool data(std::string &) const;
+   virtual bool expired() const;
+
+private:
+   bool m_exists;
+   std::time_t m_last_modified;
+   bool m_expired;
+};
+
+}
+
+#endif // RENDERMQ_PROBE_HANDLE_HPP
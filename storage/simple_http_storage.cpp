@@ -90,8 +90,7 @@ bool simple_http_storage::handle::data(string &output) const
 }
 
 simple_http_storage::simple_http_storage(const string &format)
-   : m_format(format),
-     m_connection(http::createPersistentConnection())
+   : m_format(format)
 {
 }
 
@@ -103,7 +102,7 @@ shared_ptr<tile_storage::handle>
 simple_http_storage::get(const tile_protocol &tile) const 
 {
    string url = make_url(tile.style, tile.z, tile.x, tile.y);
-   shared_ptr<http::response> response = http::get(url, m_connection);
+   shared_ptr<http::response> response = http::get(url);
    if (response->statusCode == 200)
    {
       return shared_ptr<tile_storage::handle>(new handle(response));
@@ -114,6 +113,28 @@ simple_http_storage::get(const tile_protocol &tile) const
    }
 }
 
+shared_ptr<tile_storage::handle> 
+simple_http_storage::probe(const tile_protocol &tile) const 
+{
+   string url = make_url(tile.style, tile.z, tile.x, tile.y);
+   try
+   {
+      shared_ptr<http::response> response = http::head(url);
+      if (response->statusCode == 200)
+      {
+         // the blocking head() puts the headers in the body, which
+         // isn't the tile data, so don't pass it on.
+         response->body.clear();
+         return shared_ptr<tile_storage::handle>(new handle(response));
+      }
+   }
+   catch (const std::exception &e)
+   {
+      LOG_ERROR(boost::format("Runtime error while probing tile: %1%") % e.what());
+   }
+   return shared_ptr<tile_storage::handle>(new null_handle());
+}
+
 bool 
 simple_http_storage::get_meta(const tile_protocol &tile, string &data) const
 {
@@ -140,7 +161,7 @@ simple_http_storage::get_meta(const tile_protocol &tile, string &data) const
             try
             {
                string url = make_url(tile.style, tile.z, x, y);
-               shared_ptr<http::response> response = http::get(url, m_connection);
+               shared_ptr<http::response> response = http::get(url);
                if(response->statusCode != 200 || response->timeStamp == INVALID_TIMESTAMP)
                   return false;
 
@@ -72,6 +72,9 @@ public:
    //get a single tile in a single format
    boost::shared_ptr<tile_storage::handle> get(const tile_protocol &tile) const;
 
+   // check the tile with a HEAD request, without fetching the data.
+   boost::shared_ptr<tile_storage::handle> probe(const tile_protocol &tile) const;
+
    //get each tile in each format and constructs a metatile from them
    bool get_meta(const tile_protocol &tile, string &metatile) const;
 
@@ -84,7 +87,6 @@ public:
 protected:
 
    std::string m_format;
-   boost::shared_ptr<CURL> m_connection;
 
    std::string make_url(const std::string &style, int z, int x, int y) const;
 };
@@ -0,0 +1,641 @@
+/*------------------------------------------------------------------------------
+ *
+ *  Tiers of storage, from fastest to slowest, with tiles which are read
+ *  from the slower tiers copied into the faster ones.
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include <vector>
+#include <string>
+#include <deque>
+#include <stdexcept>
+
+#include "tiered_storage.hpp"
+#include "meta_tile.hpp"
+#include "null_handle.hpp"
+#include "../logging/logger.hpp"
+#include <boost/foreach.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/bind.hpp>
+#include <boost/format.hpp>
+#include <boost/thread.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
+
+using boost::shared_ptr;
+using std::string;
+using std::vector;
+namespace bt = boost::property_tree;
+
+namespace 
+{
+
+bt::ptree get_subtree(const bt::ptree &pt, const string &name)
+{
+   // create a new property tree for the sub storage to use.
+   bt::ptree sub_pt = pt.get_child(name, bt::ptree());
+   
+   // the substring that we want to match is the name, plus a dot
+   // as a separator - the rest is the key that the sub storage 
+   // instance will be looking for.
+   string prefix = name + ".";
+   
+   BOOST_FOREACH(bt::ptree::value_type entry, pt) 
+   {
+      if (entry.first.compare(0, prefix.size(), prefix) == 0)
+      {
+         // use semi-colon as a path separator we're not likely to 
+         // see, since that is the comment character for INI files.
+         boost::property_tree::path_of<string>::type p(entry.first, ';');
+         
+         sub_pt.put(entry.first.substr(prefix.size()), pt.get<string>(p));
+      }
+   }
+
+   return sub_pt;
+}
+
+shared_ptr<rendermq::tile_storage> 
+make_tier(const bt::ptree &pt, boost::optional<zmq::context_t &> ctx, const string &name)
+{
+   rendermq::tile_storage *ptr = rendermq::get_tile_storage(get_subtree(pt, name), ctx);
+   if (ptr == NULL)
+   {
+      throw std::runtime_error((boost::format("Failed to create `%1%' tier within tiered storage.") % name).str());
+   }
+   return shared_ptr<rendermq::tile_storage>(ptr);
+}
+
+rendermq::tile_storage *create_tiered_storage(const bt::ptree &pt,
+                                              boost::optional<zmq::context_t &> ctx)
+{
+   vector<string> names;
+   string storage_names = pt.get<string>("storages");
+   boost::split(names, storage_names, boost::is_any_of(", "), boost::token_compress_on);
+
+   // zero hits turns copying between the tiers off, in which case the
+   // background thread doesn't need its own tiers.
+   const size_t promote_after = pt.get<size_t>("promote_after", DEFAULT_PROMOTE_AFTER);
+
+   rendermq::tiered_storage::tiers_t tiers, promote_tiers;
+   BOOST_FOREACH(const string &name, names)
+   {
+      tiers.push_back(make_tier(pt, ctx, name));
+      if (promote_after > 0)
+      {
+         promote_tiers.push_back(make_tier(pt, ctx, name));
+      }
+   }
+
+   return new rendermq::tiered_storage(tiers, promote_tiers, promote_after,
+                                       pt.get<size_t>("promote_queue", DEFAULT_PROMOTE_QUEUE),
+                                       pt.get<size_t>("promote_history", DEFAULT_PROMOTE_HISTORY));
+}
+
+const bool registered = register_tile_storage("tiered", create_tiered_storage);
+
+// a metatile, for counting its hits.
+struct meta_key
+{
+   string style;
+   int z, x, y;
+};
+
+bool operator==(const meta_key &a, const meta_key &b)
+{
+   return a.z == b.z && a.x == b.x && a.y == b.y && a.style == b.style;
+}
+
+meta_key key_of(const rendermq::tile_protocol &tile)
+{
+   meta_key k;
+   k.style = tile.style;
+   k.z = tile.z;
+   k.x = tile.x & ~(METATILE - 1);
+   k.y = tile.y & ~(METATILE - 1);
+   return k;
+}
+
+size_t hash_value(const meta_key &k)
+{
+   size_t seed = 0;
+   boost::hash_combine(seed, k.style);
+   boost::hash_combine(seed, k.z);
+   boost::hash_combine(seed, k.x);
+   boost::hash_combine(seed, k.y);
+   return seed;
+}
+
+} // anonymous namespace
+
+namespace rendermq 
+{
+
+/* copies metatiles into the faster tiers in a background thread, once
+ * they've had enough hits in a slower one.
+ */
+class tiered_storage::promoter
+   : private boost::noncopyable
+{
+public:
+   promoter(const tiers_t &tiers, size_t after, size_t max_queue, size_t history)
+      : m_tiers(tiers), m_after(std::max(after, size_t(1))),
+        m_max_queue(std::max(max_queue, size_t(1))), m_history(std::max(history, size_t(1))),
+        m_busy(false), m_cancelled(false), m_stopping(false)
+   {
+      m_thread = boost::thread(boost::bind(&promoter::run, this));
+   }
+
+   // copies which haven't started yet are dropped.
+   ~promoter()
+   {
+      {
+         boost::unique_lock<boost::mutex> lock(m_mutex);
+         m_stopping = true;
+         m_queued.notify_all();
+      }
+      m_thread.join();
+   }
+
+   // note a hit in the tier, and queue a copy of the metatile if it's
+   // had enough of them.
+   void offer(size_t tier, const tile_protocol &tile, const string *data)
+   {
+      const meta_key k = key_of(tile);
+
+      boost::unique_lock<boost::mutex> lock(m_mutex);
+      if (m_queued_keys.find(k) != m_queued_keys.end())
+      {
+         return;
+      }
+
+      size_t hits = ++m_hits[k];
+      hits_t::iterator itr = m_last_hits.find(k);
+      if (itr != m_last_hits.end())
+      {
+         hits += itr->second;
+      }
+      if (hits < m_after)
+      {
+         // once this generation is full, it becomes the last one, and
+         // hits from the one before are forgotten.
+         if (m_hits.size() >= m_history)
+         {
+            m_last_hits.swap(m_hits);
+            m_hits.clear();
+         }
+         return;
+      }
+
+      m_hits.erase(k);
+      if (itr != m_last_hits.end())
+      {
+         m_last_hits.erase(itr);
+      }
+      if (m_queue.size() >= m_max_queue)
+      {
+         return;
+      }
+
+      job j;
+      j.tile = tile;
+      j.tile.x = k.x;
+      j.tile.y = k.y;
+      j.tier = tier;
+      if (data != NULL)
+      {
+         j.data = *data;
+      }
+      m_queue.push_back(j);
+      m_queued_keys.insert(k);
+      m_queued.notify_one();
+   }
+
+   // the metatile is about to be put or expired, so any copy of it
+   // would be of the old one. copies which are waiting are dropped, and
+   // one which is being made is cancelled, waiting for whatever it's
+   // putting to finish, so that the new metatile is put after it.
+   void changed(const tile_protocol &tile)
+   {
+      const meta_key k = key_of(tile);
+      {
+         boost::unique_lock<boost::mutex> lock(m_mutex);
+         if (m_queued_keys.find(k) == m_queued_keys.end())
+         {
+            return;
+         }
+         if (m_busy && (m_running == k))
+         {
+            m_cancelled = true;
+         }
+         else
+         {
+            for (std::deque<job>::iterator itr = m_queue.begin(); itr != m_queue.end(); ++itr)
+            {
+               if (key_of(itr->tile) == k)
+               {
+                  m_queue.erase(itr);
+                  break;
+               }
+            }
+            m_queued_keys.erase(k);
+            m_done.notify_all();
+            return;
+         }
+      }
+      boost::unique_lock<boost::mutex> copying(m_copy_mutex);
+   }
+
+   void flush()
+   {
+      boost::unique_lock<boost::mutex> lock(m_mutex);
+      while (!m_queue.empty() || m_busy)
+      {
+         m_done.wait(lock);
+      }
+   }
+
+private:
+   struct job
+   {
+      tile_protocol tile;
+      // the tier the metatile was found in, and its data if it has
+      // already been read from there.
+      size_t tier;
+      string data;
+   };
+   typedef boost::unordered_map<meta_key, size_t> hits_t;
+
+   void run()
+   {
+      boost::unique_lock<boost::mutex> lock(m_mutex);
+      while (true)
+      {
+         while (m_queue.empty() && !m_stopping)
+         {
+            m_queued.wait(lock);
+         }
+         if (m_stopping)
+         {
+            break;
+         }
+
+         job j;
+         std::swap(j, m_queue.front());
+         m_queue.pop_front();
+         m_running = key_of(j.tile);
+         m_busy = true;
+         m_cancelled = false;
+         lock.unlock();
+
+         copy(j);
+
+         lock.lock();
+         m_queued_keys.erase(m_running);
+         m_busy = false;
+         m_done.notify_all();
+      }
+      m_queue.clear();
+      m_done.notify_all();
+   }
+
+   void copy(job &j)
+   {
+      try
+      {
+         if (j.data.empty() && !m_tiers[j.tier]->get_meta(j.tile, j.data))
+         {
+            return;
+         }
+         for (size_t i = 0; i < j.tier; ++i)
+         {
+            // the copy lock is held while putting, so that changed()
+            // can wait for it, and the check is made under it.
+            boost::unique_lock<boost::mutex> copying(m_copy_mutex);
+            if (cancelled())
+            {
+               return;
+            }
+            m_tiers[i]->put_meta(j.tile, j.data);
+         }
+      }
+      catch (const std::exception &e)
+      {
+         LOG_ERROR(boost::format("Unable to copy %1% between storage tiers: %2%") % j.tile % e.what());
+      }
+   }
+
+   bool cancelled()
+   {
+      boost::unique_lock<boost::mutex> lock(m_mutex);
+      return m_cancelled;
+   }
+
+   const tiers_t m_tiers;
+   const size_t m_after, m_max_queue, m_history;
+
+   // held by the thread while it puts a copy into a tier, and taken
+   // before m_mutex if both are.
+   boost::mutex m_copy_mutex;
+   boost::mutex m_mutex;
+   boost::condition_variable m_queued, m_done;
+   // hits of metatiles in this generation and the last one.
+   hits_t m_hits, m_last_hits;
+   std::deque<job> m_queue;
+   // metatiles which are queued or being copied.
+   boost::unordered_set<meta_key> m_queued_keys;
+   // the metatile being copied, if busy, and whether it has changed
+   // since the copy was started.
+   meta_key m_running;
+   bool m_busy, m_cancelled, m_stopping;
+   boost::thread m_thread;
+};
+
+tiered_storage::tiered_storage(const tiers_t &tiers, const tiers_t &promote_tiers,
+                               size_t promote_after, size_t promote_queue, size_t promote_history)
+   : m_tiers(tiers)
+{
+   if (m_tiers.empty())
+   {
+      throw std::runtime_error("Tiered storage needs at least one tier.");
+   }
+   if ((promote_tiers.size() == m_tiers.size()) && (promote_after > 0))
+   {
+      m_promoter.reset(new promoter(promote_tiers, promote_after, promote_queue, promote_history));
+   }
+}
+
+tiered_storage::~tiered_storage() 
+{
+}
+
+shared_ptr<tile_storage::handle> 
+tiered_storage::get(const tile_protocol &tile) const 
+{
+   for (size_t i = 0; i < m_tiers.size(); ++i)
+   {
+      shared_ptr<tile_storage::handle> handle = m_tiers[i]->get(tile);
+      if (handle->exists())
+      {
+         // an expired tile is about to be replaced, so isn't worth
+         // copying.
+         if (!handle->expired())
+         {
+            found(i, tile);
+         }
+         return handle;
+      }
+   }
+   return shared_ptr<tile_storage::handle>(new null_handle());
+}
+
+shared_ptr<tile_storage::handle> 
+tiered_storage::probe(const tile_protocol &tile) const 
+{
+   for (size_t i = 0; i < m_tiers.size(); ++i)
+   {
+      shared_ptr<tile_storage::handle> handle = m_tiers[i]->probe(tile);
+      if (handle->exists())
+      {
+         return handle;
+      }
+   }
+   return shared_ptr<tile_storage::handle>(new null_handle());
+}
+
+bool 
+tiered_storage::get_meta(const tile_protocol &tile, std::string &data) const
+{
+   for (size_t i = 0; i < m_tiers.size(); ++i)
+   {
+      if (m_tiers[i]->get_meta(tile, data))
+      {
+         found(i, tile, &data);
+         return true;
+      }
+   }
+   return false;
+}
+
+bool 
+tiered_storage::put_meta(const tile_protocol &tile, const std::string &buf) const 
+{
+   changed(tile);
+   const bool ok = m_tiers.back()->put_meta(tile, buf);
+   for (size_t i = m_tiers.size() - 1; i-- > 0; )
+   {
+      if (!m_tiers[i]->put_meta(tile, buf))
+      {
+         m_tiers[i]->expire(tile);
+      }
+   }
+   changed(tile);
+   return ok;
+}   
+
+bool 
+tiered_storage::expire(const tile_protocol &tile) const 
+{
+   // the faster tiers may well not have the metatile, so only the
+   // slowest one has to succeed.
+   changed(tile);
+   const bool ok = m_tiers.back()->expire(tile);
+   for (size_t i = m_tiers.size() - 1; i-- > 0; )
+   {
+      m_tiers[i]->expire(tile);
+   }
+   changed(tile);
+   return ok;
+}
+
+void
+tiered_storage::get_multi(const vector<tile_protocol> &tiles,
+                          vector<shared_ptr<tile_storage::handle> > &handles) const
+{
+   fetch_multi(tiles, false, handles);
+}
+
+void
+tiered_storage::probe_multi(const vector<tile_protocol> &tiles,
+                            vector<shared_ptr<tile_storage::handle> > &handles) const
+{
+   fetch_multi(tiles, true, handles);
+}
+
+void
+tiered_storage::fetch_multi(const vector<tile_protocol> &tiles, bool probe,
+                            vector<shared_ptr<tile_storage::handle> > &handles) const
+{
+   handles.assign(tiles.size(), shared_ptr<tile_storage::handle>(new null_handle()));
+
+   // indexes into the batch of the tiles which haven't been found
+   // yet, and those tiles.
+   vector<size_t> missing(tiles.size());
+   for (size_t i = 0; i < missing.size(); ++i)
+   {
+      missing[i] = i;
+   }
+   vector<tile_protocol> batch(tiles);
+   vector<shared_ptr<tile_storage::handle> > results;
+
+   for (size_t tier = 0; (tier < m_tiers.size()) && !batch.empty(); ++tier)
+   {
+      if (probe)
+      {
+         m_tiers[tier]->probe_multi(batch, results);
+      }
+      else
+      {
+         m_tiers[tier]->get_multi(batch, results);
+      }
+
+      // keep the ones which were found and pass the rest on.
+      size_t still_missing = 0;
+      for (size_t i = 0; i < batch.size(); ++i)
+      {
+         if (results[i]->exists())
+         {
+            handles[missing[i]] = results[i];
+            if (!probe && !results[i]->expired())
+            {
+               found(tier, batch[i]);
+            }
+         }
+         else
+         {
+            missing[still_missing] = missing[i];
+            batch[still_missing] = batch[i];
+            ++still_missing;
+         }
+      }
+      missing.resize(still_missing);
+      batch.resize(still_missing);
+   }
+}
+
+void
+tiered_storage::get_async(const tile_protocol &tile, const get_callback &callback) const
+{
+   m_tiers[0]->get_async(tile, boost::bind(&tiered_storage::got_async, this, 0, tile, false, callback, _1));
+}
+
+void
+tiered_storage::probe_async(const tile_protocol &tile, const get_callback &callback) const
+{
+   m_tiers[0]->probe_async(tile, boost::bind(&tiered_storage::got_async, this, 0, tile, true, callback, _1));
+}
+
+void
+tiered_storage::get_meta_async(const tile_protocol &tile, const get_meta_callback &callback) const
+{
+   m_tiers[0]->get_meta_async(tile, boost::bind(&tiered_storage::got_meta_async, this, 0, tile, callback, _1, _2));
+}
+
+void
+tiered_storage::got_async(size_t tier, const tile_protocol &tile, bool probe, const get_callback &callback,
+                          shared_ptr<tile_storage::handle> handle) const
+{
+   if (handle->exists() || (tier + 1 == m_tiers.size()))
+   {
+      if (!probe && handle->exists() && !handle->expired())
+      {
+         found(tier, tile);
+      }
+      callback(handle);
+      return;
+   }
+
+   ++tier;
+   if (probe)
+   {
+      m_tiers[tier]->probe_async(tile, boost::bind(&tiered_storage::got_async, this, tier, tile, true, callback, _1));
+   }
+   else
+   {
+      m_tiers[tier]->get_async(tile, boost::bind(&tiered_storage::got_async, this, tier, tile, false, callback, _1));
+   }
+}
+
+void
+tiered_storage::got_meta_async(size_t tier, const tile_protocol &tile, const get_meta_callback &callback,
+                               bool ok, const std::string &data) const
+{
+   if (ok || (tier + 1 == m_tiers.size()))
+   {
+      if (ok)
+      {
+         found(tier, tile, &data);
+      }
+      callback(ok, data);
+      return;
+   }
+
+   ++tier;
+   m_tiers[tier]->get_meta_async(tile, boost::bind(&tiered_storage::got_meta_async, this, tier, tile, callback, _1, _2));
+}
+
+void
+tiered_storage::async_fds(std::vector<int> &fds) const
+{
+   BOOST_FOREACH(const shared_ptr<tile_storage> &tier, m_tiers)
+   {
+      tier->async_fds(fds);
+   }
+}
+
+void
+tiered_storage::async_perform() const
+{
+   BOOST_FOREACH(const shared_ptr<tile_storage> &tier, m_tiers)
+   {
+      tier->async_perform();
+   }
+}
+
+void
+tiered_storage::flush() const
+{
+   if (m_promoter)
+   {
+      m_promoter->flush();
+   }
+}
+
+void
+tiered_storage::found(size_t tier, const tile_protocol &tile, const std::string *data) const
+{
+   if ((tier > 0) && m_promoter)
+   {
+      m_promoter->offer(tier, tile, data);
+   }
+}
+
+void
+tiered_storage::changed(const tile_protocol &tile) const
+{
+   if (m_promoter)
+   {
+      m_promoter->changed(tile);
+   }
+}
+
+} // namespace rendermq
@@ -0,0 +1,135 @@
+/*------------------------------------------------------------------------------
+ *
+ *  Tiers of storage, from fastest to slowest, with tiles which are read
+ *  from the slower tiers copied into the faster ones.
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef RENDERMQ_TIERED_STORAGE_HPP
+#define RENDERMQ_TIERED_STORAGE_HPP
+
+#include <string>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include "tile_storage.hpp"
+
+// hits in a lower tier before a metatile is copied into the tiers above.
+#define DEFAULT_PROMOTE_AFTER (2)
+// metatiles waiting to be copied before more are dropped.
+#define DEFAULT_PROMOTE_QUEUE (256)
+// metatiles whose hits are remembered for admission, per generation.
+#define DEFAULT_PROMOTE_HISTORY (65536)
+
+namespace rendermq 
+{
+
+/* storage made of tiers, from the fastest to the slowest, such as a
+ * local disk cache in front of LTS. reads go to each tier in turn and
+ * stop at the first which has the tile, so the slower tiers are only
+ * asked for what the faster ones don't have.
+ *
+ * unlike union_storage, a hit in a lower tier is copied into the tiers
+ * above it, so that they fill up with the tiles which are actually
+ * read. the copies are made by a background thread with its own
+ * instance of each tier, so reads never wait for them. metatiles are
+ * only copied once they've been read from a lower tier promote_after
+ * times, so that tiles which are read once and never again don't push
+ * the popular ones out of the faster tiers. hits are remembered for
+ * the last two generations of promote_history metatiles. if too many
+ * copies are waiting, more are dropped until the queue has room.
+ *
+ * puts and expiries go to every tier, the slowest first, as it holds
+ * the authoritative copy. they succeed if they succeed there. a tier
+ * above which fails to take a new metatile has its old copy expired,
+ * so that it isn't served in place of the new one. copies of the
+ * metatile which are waiting, or being made, are dropped both before
+ * and after, so that the old metatile is never copied over the new.
+ */
+class tiered_storage 
+   : public tile_storage 
+{
+public:
+   typedef std::vector<boost::shared_ptr<tile_storage> > tiers_t;
+
+   // @param tiers the storage to read from, fastest first.
+   // @param promote_tiers another instance of each of the tiers, in the
+   //          same order, for the background thread to copy metatiles
+   //          with. if empty, nothing is copied.
+   // @param promote_after lower tier hits before a metatile is copied.
+   // @param promote_queue most copies waiting before more are dropped.
+   // @param promote_history metatiles whose hits are remembered.
+   tiered_storage(const tiers_t &tiers, const tiers_t &promote_tiers = tiers_t(),
+                  size_t promote_after = DEFAULT_PROMOTE_AFTER,
+                  size_t promote_queue = DEFAULT_PROMOTE_QUEUE,
+                  size_t promote_history = DEFAULT_PROMOTE_HISTORY);
+   ~tiered_storage();
+
+   boost::shared_ptr<tile_storage::handle> get(const tile_protocol &tile) const;
+   boost::shared_ptr<tile_storage::handle> probe(const tile_protocol &tile) const;
+   bool get_meta(const tile_protocol &, std::string &) const;
+   bool put_meta(const tile_protocol &tile, const std::string &buf) const;
+   bool expire(const tile_protocol &tile) const;
+
+   // batches go to each tier in turn, with only the tiles which haven't
+   // been found yet passed on to the next.
+   void get_multi(const std::vector<tile_protocol> &tiles,
+                  std::vector<boost::shared_ptr<tile_storage::handle> > &handles) const;
+   void probe_multi(const std::vector<tile_protocol> &tiles,
+                    std::vector<boost::shared_ptr<tile_storage::handle> > &handles) const;
+
+   // the next tier is only asked once the one before has answered, with
+   // the event sources of all the tiers passed through.
+   void get_async(const tile_protocol &tile, const get_callback &callback) const;
+   void probe_async(const tile_protocol &tile, const get_callback &callback) const;
+   void get_meta_async(const tile_protocol &tile, const get_meta_callback &callback) const;
+   void async_fds(std::vector<int> &fds) const;
+   void async_perform() const;
+
+   // wait until the metatiles waiting to be copied have been.
+   void flush() const;
+
+private:
+   class promoter;
+
+   // get or probe a batch from the first tier to have each tile.
+   void fetch_multi(const std::vector<tile_protocol> &tiles, bool probe,
+                    std::vector<boost::shared_ptr<tile_storage::handle> > &handles) const;
+
+   // the next tier's answer to an asynchronous read.
+   void got_async(size_t tier, const tile_protocol &tile, bool probe, const get_callback &callback,
+                  boost::shared_ptr<tile_storage::handle> handle) const;
+   void got_meta_async(size_t tier, const tile_protocol &tile, const get_meta_callback &callback,
+                       bool ok, const std::string &data) const;
+
+   // a tile was found in a tier, which might need copying upwards. the
+   // data is the whole metatile, if it has already been read.
+   void found(size_t tier, const tile_protocol &tile, const std::string *data = NULL) const;
+   // the metatile is being put or expired, so mustn't be copied.
+   void changed(const tile_protocol &tile) const;
+
+   tiers_t m_tiers;
+   boost::shared_ptr<promoter> m_promoter;
+};
+
+}
+
+#endif // RENDERMQ_TIERED_STORAGE_HPP
@@ -0,0 +1,373 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: artem@mapnik-consulting.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "tile_archive.hpp"
+#include "meta_tile.hpp"
+
+#include <boost/format.hpp>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define ARCHIVE_MAGIC "RMQTILES"
+#define ARCHIVE_VERSION (1)
+#define ARCHIVE_BYTE_ORDER (0x01020304)
+// size of the buffer used to copy metatiles into the archive.
+#define COPY_BUFFER_SIZE (1024 * 1024)
+
+using std::string;
+using std::vector;
+using std::runtime_error;
+
+namespace rendermq
+{
+
+namespace
+{
+
+string error(const string &what, const string &file)
+{
+   return (boost::format("%1% %2%: %3%") % what % file % strerror(errno)).str();
+}
+
+bool pread_fully(int fd, char *buf, size_t size, uint64_t offset)
+{
+   while (size > 0)
+   {
+      ssize_t got = pread(fd, buf, size, offset);
+      if (got < 0 && errno == EINTR)
+      {
+         continue;
+      }
+      if (got <= 0)
+      {
+         return false;
+      }
+      buf += got;
+      size -= got;
+      offset += got;
+   }
+   return true;
+}
+
+bool write_fully(int fd, const char *buf, size_t size)
+{
+   while (size > 0)
+   {
+      ssize_t put = write(fd, buf, size);
+      if (put < 0 && errno == EINTR)
+      {
+         continue;
+      }
+      if (put <= 0)
+      {
+         return false;
+      }
+      buf += put;
+      size -= put;
+   }
+   return true;
+}
+
+bool key_less(const archive_entry &a, const archive_entry &b)
+{
+   return a.key < b.key;
+}
+
+} // anonymous namespace
+
+uint64_t archive_key(int z, int x, int y)
+{
+   // position of the metatile on the hilbert curve covering all the
+   // metatiles at this zoom.
+   uint64_t mx = uint64_t(x) / METATILE, my = uint64_t(y) / METATILE;
+   uint64_t n = 1;
+   while (n * METATILE < (uint64_t(1) << z))
+   {
+      n <<= 1;
+   }
+
+   uint64_t d = 0;
+   for (uint64_t s = n / 2; s > 0; s /= 2)
+   {
+      const uint64_t rx = (mx & s) ? 1 : 0;
+      const uint64_t ry = (my & s) ? 1 : 0;
+      d += s * s * ((3 * rx) ^ ry);
+      if (ry == 0)
+      {
+         if (rx == 1)
+         {
+            mx = n - 1 - mx;
+            my = n - 1 - my;
+         }
+         std::swap(mx, my);
+      }
+   }
+
+   return (uint64_t(z) << 56) | d;
+}
+
+tile_archive::tile_archive(const string &file, bool use_mmap)
+   : m_file(file), m_fd(-1), m_file_size(0), m_map(NULL), m_index(NULL)
+{
+   m_fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+   if (m_fd < 0)
+   {
+      throw runtime_error(error("Unable to open tile archive", file));
+   }
+
+   struct stat st;
+   if (fstat(m_fd, &st) < 0)
+   {
+      close(m_fd);
+      throw runtime_error(error("Unable to stat tile archive", file));
+   }
+   m_file_size = st.st_size;
+
+   if (!pread_fully(m_fd, (char *)&m_header, sizeof(m_header), 0) ||
+       (memcmp(m_header.magic, ARCHIVE_MAGIC, sizeof(m_header.magic)) != 0))
+   {
+      close(m_fd);
+      throw runtime_error((boost::format("%1% is not a tile archive.") % file).str());
+   }
+   if ((m_header.byte_order != ARCHIVE_BYTE_ORDER) || (m_header.version != ARCHIVE_VERSION) ||
+       (m_header.index_offset + m_header.index_count * sizeof(archive_entry) > m_file_size))
+   {
+      close(m_fd);
+      throw runtime_error((boost::format("Tile archive %1% is from a different version or machine, "
+                                         "or is damaged.") % file).str());
+   }
+   m_style.assign(m_header.style, strnlen(m_header.style, sizeof(m_header.style)));
+
+   if (use_mmap && m_file_size > 0)
+   {
+      void *map = mmap(NULL, m_file_size, PROT_READ, MAP_SHARED, m_fd, 0);
+      if (map != MAP_FAILED)
+      {
+         m_map = (const char *)map;
+         m_index = (const archive_entry *)(m_map + m_header.index_offset);
+         return;
+      }
+      // carry on without it, for example when out of address space.
+   }
+
+   m_index_copy.resize(m_header.index_count);
+   if (!m_index_copy.empty() &&
+       !pread_fully(m_fd, (char *)&m_index_copy[0], m_index_copy.size() * sizeof(archive_entry),
+                    m_header.index_offset))
+   {
+      close(m_fd);
+      throw runtime_error(error("Unable to read the index of tile archive", file));
+   }
+   m_index = m_index_copy.empty() ? NULL : &m_index_copy[0];
+}
+
+tile_archive::~tile_archive()
+{
+   if (m_map != NULL)
+   {
+      munmap((void *)m_map, m_file_size);
+   }
+   close(m_fd);
+}
+
+bool
+tile_archive::find(int z, int x, int y, archive_entry &entry) const
+{
+   if ((z < int(m_header.min_zoom)) || (z > int(m_header.max_zoom)) || (m_index == NULL))
+   {
+      return false;
+   }
+
+   archive_entry wanted;
+   wanted.key = archive_key(z, x, y);
+   const archive_entry *end = m_index + m_header.index_count;
+   const archive_entry *itr = std::lower_bound(m_index, end, wanted, key_less);
+   if ((itr == end) || (itr->key != wanted.key) ||
+       (itr->offset + itr->size > m_file_size))
+   {
+      return false;
+   }
+
+   entry = *itr;
+   return true;
+}
+
+const char *
+tile_archive::mapped(uint64_t offset, size_t size) const
+{
+   if ((m_map == NULL) || (offset + size > m_file_size))
+   {
+      return NULL;
+   }
+   return m_map + offset;
+}
+
+bool
+tile_archive::read(uint64_t offset, size_t size, char *buf) const
+{
+   const char *ptr = mapped(offset, size);
+   if (ptr != NULL)
+   {
+      memcpy(buf, ptr, size);
+      return true;
+   }
+   return pread_fully(m_fd, buf, size, offset);
+}
+
+tile_archive_writer::tile_archive_writer(const string &file, const string &style)
+   : m_file(file), m_style(style), m_data_file(file + ".data.tmp"), m_data_fd(-1),
+     m_data_size(0), m_min_zoom(-1), m_max_zoom(-1)
+{
+   if (style.size() >= sizeof(((archive_header *)0)->style))
+   {
+      throw runtime_error((boost::format("Style name %1% is too long for a tile archive.") % style).str());
+   }
+
+   m_data_fd = open(m_data_file.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+   if (m_data_fd < 0)
+   {
+      throw runtime_error(error("Unable to create", m_data_file));
+   }
+}
+
+tile_archive_writer::~tile_archive_writer()
+{
+   if (m_data_fd >= 0)
+   {
+      close(m_data_fd);
+      unlink(m_data_file.c_str());
+   }
+}
+
+void
+tile_archive_writer::add(int z, int x, int y, std::time_t mtime, const string &metatile)
+{
+   if (!write_fully(m_data_fd, metatile.data(), metatile.size()))
+   {
+      throw runtime_error(error("Unable to write to", m_data_file));
+   }
+
+   archive_entry e;
+   e.key = archive_key(z, x, y);
+   e.offset = m_data_size;
+   e.size = metatile.size();
+   e.mtime = mtime;
+   m_entries.push_back(e);
+   m_data_size += metatile.size();
+
+   if ((m_min_zoom < 0) || (z < m_min_zoom)) { m_min_zoom = z; }
+   if (z > m_max_zoom) { m_max_zoom = z; }
+}
+
+void
+tile_archive_writer::finish()
+{
+   // sort into index order. for metatiles added more than once, the
+   // stable sort leaves the last one added last.
+   std::stable_sort(m_entries.begin(), m_entries.end(), key_less);
+   vector<archive_entry> index;
+   index.reserve(m_entries.size());
+   for (size_t i = 0; i < m_entries.size(); ++i)
+   {
+      if ((i + 1 < m_entries.size()) && (m_entries[i + 1].key == m_entries[i].key))
+      {
+         continue;
+      }
+      index.push_back(m_entries[i]);
+   }
+
+   const string tmp = m_file + ".tmp";
+   int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+   if (fd < 0)
+   {
+      throw runtime_error(error("Unable to create", tmp));
+   }
+
+   archive_header header;
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, ARCHIVE_MAGIC, sizeof(header.magic));
+   header.version = ARCHIVE_VERSION;
+   header.byte_order = ARCHIVE_BYTE_ORDER;
+   header.min_zoom = std::max(m_min_zoom, 0);
+   header.max_zoom = std::max(m_max_zoom, 0);
+   header.index_count = index.size();
+   memcpy(header.style, m_style.data(), m_style.size());
+
+   // the metatiles and the index are kept aligned, so that their
+   // headers can be used straight from a mapping.
+   const char padding[sizeof(uint64_t)] = { 0 };
+   bool ok = write_fully(fd, (const char *)&header, sizeof(header));
+   uint64_t offset = sizeof(header);
+   vector<char> buf(COPY_BUFFER_SIZE);
+   for (vector<archive_entry>::iterator itr = index.begin(); ok && itr != index.end(); ++itr)
+   {
+      if (itr->size > buf.size())
+      {
+         buf.resize(itr->size);
+      }
+      ok = pread_fully(m_data_fd, &buf[0], itr->size, itr->offset) &&
+           write_fully(fd, &buf[0], itr->size);
+      itr->offset = offset;
+      offset += itr->size;
+      const size_t pad = (sizeof(uint64_t) - offset % sizeof(uint64_t)) % sizeof(uint64_t);
+      ok = ok && write_fully(fd, padding, pad);
+      offset += pad;
+   }
+   header.index_offset = offset;
+
+   ok = ok && (index.empty() || write_fully(fd, (const char *)&index[0], index.size() * sizeof(archive_entry)));
+   ok = ok && (pwrite(fd, &header, sizeof(header), 0) == ssize_t(sizeof(header)));
+   ok = ok && (fsync(fd) == 0);
+   if (!ok)
+   {
+      const string message = error("Unable to write", tmp);
+      close(fd);
+      unlink(tmp.c_str());
+      throw runtime_error(message);
+   }
+   close(fd);
+
+   if (rename(tmp.c_str(), m_file.c_str()) < 0)
+   {
+      const string message = error("Unable to rename archive to", m_file);
+      unlink(tmp.c_str());
+      throw runtime_error(message);
+   }
+
+   close(m_data_fd);
+   unlink(m_data_file.c_str());
+   m_data_fd = -1;
+   m_entries.swap(index);
+}
+
+}
@@ -0,0 +1,154 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: artem@mapnik-consulting.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef RENDERMQ_TILE_ARCHIVE_HPP
+#define RENDERMQ_TILE_ARCHIVE_HPP
+
+#include <boost/utility.hpp>
+#include <stdint.h>
+#include <ctime>
+#include <string>
+#include <vector>
+
+namespace rendermq
+{
+
+/* a tile archive packs the metatiles of one style into a single large,
+ * read-only file, so that serving them needs no directory lookups or
+ * opens, and copying them around is copying one file.
+ *
+ * the file is laid out as:
+ *
+ *   archive_header
+ *   the metatiles, each exactly as disk_storage would store it, one
+ *     after the other in index order, padded to 8 bytes.
+ *   the index, an array of archive_entry sorted by key.
+ *
+ * the key of a metatile is its zoom level in the top byte and the
+ * position of the metatile along a hilbert curve at that zoom in the
+ * rest. metatiles which are close together on the map are then close
+ * together in the file, which is good for the page cache and for
+ * read-ahead, and finding a metatile is a binary search of the index.
+ *
+ * numbers are stored in the byte order of the machine which wrote the
+ * archive, which is checked when it's opened.
+ */
+struct archive_header
+{
+   char magic[8];
+   uint32_t version;
+   uint32_t byte_order;
+   uint32_t min_zoom, max_zoom;
+   uint64_t index_offset;
+   uint64_t index_count;
+   char style[64];
+};
+
+struct archive_entry
+{
+   uint64_t key;
+   // position of the metatile from the start of the file.
+   uint64_t offset;
+   uint32_t size;
+   // modification time of the metatile. zero means it's expired.
+   uint32_t mtime;
+};
+
+// the key of the metatile which the tile is in.
+uint64_t archive_key(int z, int x, int y);
+
+/* reads an archive, either through a memory mapping of the whole file
+ * or with pread(). lookups don't change anything, so an archive can be
+ * shared between threads.
+ */
+class tile_archive
+   : private boost::noncopyable
+{
+public:
+   // open the archive, throwing std::runtime_error if it isn't one.
+   tile_archive(const std::string &file, bool use_mmap);
+   ~tile_archive();
+
+   const std::string &file() const { return m_file; }
+   const std::string &style() const { return m_style; }
+   int min_zoom() const { return m_header.min_zoom; }
+   int max_zoom() const { return m_header.max_zoom; }
+   size_t size() const { return m_header.index_count; }
+
+   // find the metatile which the tile is in, returning false if it
+   // isn't in the archive.
+   bool find(int z, int x, int y, archive_entry &entry) const;
+
+   // pointer to part of the archive, or null if it isn't mapped.
+   const char *mapped(uint64_t offset, size_t size) const;
+
+   // copy part of the archive into the buffer.
+   bool read(uint64_t offset, size_t size, char *buf) const;
+
+private:
+   std::string m_file, m_style;
+   int m_fd;
+   uint64_t m_file_size;
+   archive_header m_header;
+   const char *m_map;
+   // the index, pointing into the mapping or at m_index_copy.
+   const archive_entry *m_index;
+   std::vector<archive_entry> m_index_copy;
+};
+
+/* builds an archive from metatiles added in any order. the metatiles
+ * are written to a temporary file as they're added, and then sorted
+ * into the archive when it's finished, which is renamed into place so
+ * that an archive being served is never seen half written.
+ */
+class tile_archive_writer
+   : private boost::noncopyable
+{
+public:
+   // throws std::runtime_error if the temporary file can't be made.
+   tile_archive_writer(const std::string &file, const std::string &style);
+   // removes the temporary files if the archive wasn't finished.
+   ~tile_archive_writer();
+
+   // add the metatile. adding the same metatile again replaces it.
+   void add(int z, int x, int y, std::time_t mtime, const std::string &metatile);
+
+   // write the archive, throwing std::runtime_error if that fails.
+   void finish();
+
+   // metatiles added so far, or in the archive once it's finished.
+   size_t count() const { return m_entries.size(); }
+
+private:
+   std::string m_file, m_style, m_data_file;
+   int m_data_fd;
+   uint64_t m_data_size;
+   int m_min_zoom, m_max_zoom;
+   std::vector<archive_entry> m_entries;
+};
+
+}
+
+#endif // RENDERMQ_TILE_ARCHIVE_HPP
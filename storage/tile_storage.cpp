@@ -34,6 +34,132 @@ namespace rendermq
 tile_storage::~tile_storage() {}
 tile_storage::handle::~handle() {}
 
+bool tile_storage::handle::payload(tile_data &out) const
+{
+   std::string buf;
+   if (!data(buf))
+   {
+      return false;
+   }
+   out = tile_data::adopt(buf);
+   return true;
+}
+
+void tile_from_handle(tile_protocol &tile, const tile_storage::handle &handle)
+{
+   if (handle.exists()) 
+   {
+      // don't change the status if the command was for the status,
+      // otherwise the handler won't know it was a status query and
+      // not a render request.
+      if (tile.status != cmdStatus)
+      {
+         if (handle.expired()) 
+         {
+            tile.status = cmdIgnore;
+         } 
+         else 
+         {
+            tile.status = cmdDone;
+         }
+      }
+
+      // status queries are answered from a probe, which has no data,
+      // so whether the tile is dirty has to be said explicitly.
+      tile.dirty = handle.expired();
+      
+      // storage which can share its buffer, e.g: a mapped metatile,
+      // hands it over without copying.
+      tile_data data;
+      handle.payload(data);
+      tile.set_payload(data);
+      tile.last_modified = handle.last_modified();
+   }
+   else 
+   {
+      // the status command sees this from the tile being neither
+      // dirty nor modified.
+      tile.dirty = false;
+      if (tile.status != cmdStatus) 
+      {
+         tile.status = cmdNotDone;
+      }
+   }
+}
+
+boost::shared_ptr<tile_storage::handle> tile_storage::probe(const tile_protocol &tile) const
+{
+   return get(tile);
+}
+
+void tile_storage::get_multi(const std::vector<tile_protocol> &tiles,
+                             std::vector<boost::shared_ptr<handle> > &handles) const
+{
+   handles.clear();
+   handles.reserve(tiles.size());
+   for (std::vector<tile_protocol>::const_iterator itr = tiles.begin(); itr != tiles.end(); ++itr)
+   {
+      handles.push_back(get(*itr));
+   }
+}
+
+void tile_storage::probe_multi(const std::vector<tile_protocol> &tiles,
+                               std::vector<boost::shared_ptr<handle> > &handles) const
+{
+   handles.clear();
+   handles.reserve(tiles.size());
+   for (std::vector<tile_protocol>::const_iterator itr = tiles.begin(); itr != tiles.end(); ++itr)
+   {
+      handles.push_back(probe(*itr));
+   }
+}
+
+void tile_storage::expire_multi(const std::vector<tile_protocol> &tiles,
+                                std::vector<bool> &results) const
+{
+   results.clear();
+   results.reserve(tiles.size());
+   for (std::vector<tile_protocol>::const_iterator itr = tiles.begin(); itr != tiles.end(); ++itr)
+   {
+      results.push_back(expire(*itr));
+   }
+}
+
+void tile_storage::get_async(const tile_protocol &tile, const get_callback &callback) const
+{
+   callback(get(tile));
+}
+
+void tile_storage::get_meta_async(const tile_protocol &tile, const get_meta_callback &callback) const
+{
+   std::string buf;
+   bool ok = get_meta(tile, buf);
+   callback(ok, buf);
+}
+
+void tile_storage::expire_async(const tile_protocol &tile, const expire_callback &callback) const
+{
+   callback(expire(tile));
+}
+
+void tile_storage::probe_async(const tile_protocol &tile, const get_callback &callback) const
+{
+   callback(probe(tile));
+}
+
+void tile_storage::put_meta_async(const tile_protocol &tile, const std::string &buf, const put_meta_callback &callback) const
+{
+   callback(put_meta(tile, buf));
+}
+
+void tile_storage::async_fds(std::vector<int> &) const
+{
+}
+
+void tile_storage::async_perform() const
+{
+}
+
 bool tile_storage_factory::add(std::string const& type, 
                                tile_storage* (*func) (boost::property_tree::ptree const&,
                                                       boost::optional<zmq::context_t &> ctx))
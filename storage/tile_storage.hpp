@@ -31,8 +31,10 @@
 #include <boost/utility.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/optional.hpp>
+#include <boost/function.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <string>
+#include <vector>
 #include <map>
 
 namespace rendermq
@@ -63,6 +65,13 @@ struct tile_storage
     // and not the whole metatile. for that, use get_meta().
     virtual bool data(std::string &) const = 0;
 
+    // the same data as data(), but as a read-only view which storage
+    // can point straight at its own buffers, or a mapping of the file,
+    // rather than copying. the view keeps what it points into alive,
+    // so it can outlive the handle. the default implementation copies
+    // data() into a new buffer.
+    virtual bool payload(tile_data &) const;
+
     // whether the tile has been marked as dirty, or expired. the tile
     // might be present and, under some circumstances, it might still be
     // worth serving it to the client.
@@ -75,6 +84,17 @@ struct tile_storage
    */
   virtual boost::shared_ptr<handle> get(const tile_protocol &tile) const = 0;
 
+  /* gets a handle with only the metadata about a tile; whether it
+   * exists, when it was last modified and whether it has expired. the
+   * data() of the handle may not return anything, which allows the
+   * storage to avoid reading or transferring the tile itself. this is
+   * useful for conditional requests and status queries, where the
+   * data usually isn't needed.
+   *
+   * the default implementation just calls get().
+   */
+  virtual boost::shared_ptr<handle> probe(const tile_protocol &tile) const;
+
   /* reads a full, encoded meta tile into the given string. returns whether
    * the copy was successful or not. note that this *may* be less efficient
    * than calling get() if all you need is a single tile.
@@ -90,6 +110,59 @@ struct tile_storage
    */
   virtual bool expire(const tile_protocol &tile) const = 0;
 
+  /* batched versions of get(), probe() and expire(), which handle a
+   * whole vector of tiles in one call. the results are put in the
+   * output vector in the same order as the tiles, replacing anything
+   * which was in there before.
+   *
+   * storage which can do many tiles more cheaply than one at a time,
+   * for example by sorting reads or sending requests in parallel,
+   * should override these. the default implementations just loop over
+   * the single tile calls.
+   */
+  virtual void get_multi(const std::vector<tile_protocol> &tiles,
+                         std::vector<boost::shared_ptr<handle> > &handles) const;
+  virtual void probe_multi(const std::vector<tile_protocol> &tiles,
+                           std::vector<boost::shared_ptr<handle> > &handles) const;
+  virtual void expire_multi(const std::vector<tile_protocol> &tiles,
+                            std::vector<bool> &results) const;
+
+  /* callbacks for the asynchronous interface. each is given the
+   * result that the corresponding blocking call would have returned.
+   */
+  typedef boost::function<void (boost::shared_ptr<handle>)> get_callback;
+  typedef boost::function<void (bool, const std::string &)> get_meta_callback;
+  typedef boost::function<void (bool)> expire_callback;
+  typedef boost::function<void (bool)> put_meta_callback;
+
+  /* asynchronous versions of get(), get_meta(), expire(), probe() and
+   * put_meta(). the callback is called exactly once with the result,
+   * possibly before the call returns. put_meta_async() copies the
+   * buffer if it needs it after returning.
+   *
+   * the default implementations just call the blocking versions, so
+   * storage which can't do any better doesn't have to do anything.
+   * storage which can do the work asynchronously should override
+   * these, along with async_fds() and async_perform(), which the
+   * caller uses to drive the work from its event loop.
+   */
+  virtual void get_async(const tile_protocol &tile, const get_callback &callback) const;
+  virtual void get_meta_async(const tile_protocol &tile, const get_meta_callback &callback) const;
+  virtual void expire_async(const tile_protocol &tile, const expire_callback &callback) const;
+  virtual void probe_async(const tile_protocol &tile, const get_callback &callback) const;
+  virtual void put_meta_async(const tile_protocol &tile, const std::string &buf, const put_meta_callback &callback) const;
+
+  /* append any file descriptors which become readable when there is
+   * asynchronous work to be progressed. storage which completes
+   * everything synchronously has none.
+   */
+  virtual void async_fds(std::vector<int> &fds) const;
+
+  /* progress any outstanding asynchronous work without blocking,
+   * calling the callbacks of any operations which have finished.
+   */
+  virtual void async_perform() const;
+
   virtual ~tile_storage();
 };
 
@@ -115,6 +188,11 @@ private:
     std::map<std::string,storage_creator> cont;
 };
 
+/* fill in the tile's status, data, timestamp and whether it's dirty
+ * from the result of a storage lookup.
+ */
+void tile_from_handle(tile_protocol &tile, const tile_storage::handle &handle);
+
 /* called from storage implementations to register them with the singleton
  * factory instance.
  */
@@ -32,6 +32,7 @@
 #include "union_storage.hpp"
 #include <boost/foreach.hpp>
 #include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
 #include "null_handle.hpp"
 
 using boost::shared_ptr;
@@ -56,6 +57,22 @@ rendermq::tile_storage *create_union_storage(const bt::ptree &pt,
 
    boost::split(splits, storage_names, boost::is_any_of(", "), boost::token_compress_on);
 
+   // milliseconds each storage has to answer, either one for all of
+   // them or a list in the same order as the storages.
+   vector<long> timeouts;
+   const long timeout = pt.get<long>("timeout", DEFAULT_FAN_OUT_TIMEOUT);
+   boost::optional<string> timeout_list = pt.get_optional<string>("timeouts");
+   if (timeout_list)
+   {
+      vector<string> parts;
+      boost::split(parts, *timeout_list, boost::is_any_of(", "), boost::token_compress_on);
+      BOOST_FOREACH(const string &part, parts)
+      {
+         timeouts.push_back(boost::lexical_cast<long>(part));
+      }
+   }
+   timeouts.resize(splits.size(), timeout);
+
    // for each storage specified, look for a child tree with that name, 
    // or keys prefixed with the name and a dot '.', which is used to
    // simulate hierarchical configs in the INI format, which doesn't
@@ -95,7 +112,7 @@ rendermq::tile_storage *create_union_storage(const bt::ptree &pt,
       }
    }
 
-   return new rendermq::union_storage(storages);
+   return new rendermq::union_storage(storages, timeouts);
 }
 
 const bool registered = register_tile_storage("union", create_union_storage);
@@ -105,8 +122,9 @@ const bool registered = register_tile_storage("union", create_union_storage);
 namespace rendermq 
 {
 
-union_storage::union_storage(list_of_storage_t storages) 
-   : m_storages(storages) 
+union_storage::union_storage(list_of_storage_t storages, const vector<long> &timeouts) 
+   : m_storages(storages),
+     m_fan_out(fan_out::storages_t(storages.begin(), storages.end()), timeouts)
 {
 }
 
@@ -117,51 +135,155 @@ union_storage::~union_storage()
 shared_ptr<tile_storage::handle> 
 union_storage::get(const tile_protocol &tile) const 
 {
-   BOOST_FOREACH(shared_ptr<tile_storage> storage, m_storages) 
-   {
-      shared_ptr<tile_storage::handle> handle = storage->get(tile);
-      if (handle->exists()) 
-      {
-         return handle;
-      }
-   }
-   return shared_ptr<tile_storage::handle>(new null_handle());
+   return m_fan_out.get_first(tile, false);
+}
+
+shared_ptr<tile_storage::handle> 
+union_storage::probe(const tile_protocol &tile) const 
+{
+   return m_fan_out.get_first(tile, true);
 }
 
 bool 
 union_storage::get_meta(const tile_protocol &tile, std::string &data) const {
-   BOOST_FOREACH(shared_ptr<tile_storage> storage, m_storages) 
-   {
-      bool success = storage->get_meta(tile, data);
-      if (success)
-      {
-         return success;
-      }
-   }
-   return false;
+   return m_fan_out.get_meta_first(tile, data);
 }
 
 bool 
 union_storage::put_meta(const tile_protocol &tile, const std::string &buf) const 
 {
-   bool success = true;
-   BOOST_FOREACH(shared_ptr<tile_storage> storage, m_storages) 
-   {
-      success &= storage->put_meta(tile, buf);
-   }
-   return success;
+   return m_fan_out.put_meta_all(tile, buf);
 }   
 
 bool 
 union_storage::expire(const tile_protocol &tile) const 
 {
-   bool success = true;
+   return m_fan_out.expire_all(tile);
+}
+
+void
+union_storage::get_async(const tile_protocol &tile, const get_callback &callback) const
+{
+   m_fan_out.get_first_async(tile, false, callback);
+}
+
+void
+union_storage::get_meta_async(const tile_protocol &tile, const get_meta_callback &callback) const
+{
+   m_fan_out.get_meta_first_async(tile, callback);
+}
+
+void
+union_storage::expire_async(const tile_protocol &tile, const expire_callback &callback) const
+{
+   m_fan_out.expire_all_async(tile, callback);
+}
+
+void
+union_storage::probe_async(const tile_protocol &tile, const get_callback &callback) const
+{
+   m_fan_out.get_first_async(tile, true, callback);
+}
+
+void
+union_storage::put_meta_async(const tile_protocol &tile, const std::string &buf, const put_meta_callback &callback) const
+{
+   m_fan_out.put_meta_all_async(tile, buf, callback);
+}
+
+void
+union_storage::async_fds(std::vector<int> &fds) const
+{
+   m_fan_out.async_fds(fds);
+}
+
+void
+union_storage::async_perform() const
+{
+   m_fan_out.async_perform();
+}
+
+void
+union_storage::get_multi(const vector<tile_protocol> &tiles,
+                         vector<shared_ptr<tile_storage::handle> > &handles) const
+{
+   fetch_multi(tiles, false, handles);
+}
+
+void
+union_storage::probe_multi(const vector<tile_protocol> &tiles,
+                           vector<shared_ptr<tile_storage::handle> > &handles) const
+{
+   fetch_multi(tiles, true, handles);
+}
+
+void
+union_storage::fetch_multi(const vector<tile_protocol> &tiles, bool probe,
+                           vector<shared_ptr<tile_storage::handle> > &handles) const
+{
+   handles.assign(tiles.size(), shared_ptr<tile_storage::handle>(new null_handle()));
+
+   // indexes into the batch of the tiles which haven't been found
+   // yet, and those tiles.
+   vector<size_t> missing(tiles.size());
+   for (size_t i = 0; i < missing.size(); ++i)
+   {
+      missing[i] = i;
+   }
+   vector<tile_protocol> batch(tiles);
+   vector<shared_ptr<tile_storage::handle> > results;
+
+   BOOST_FOREACH(shared_ptr<tile_storage> storage, m_storages) 
+   {
+      if (batch.empty())
+      {
+         break;
+      }
+
+      if (probe)
+      {
+         storage->probe_multi(batch, results);
+      }
+      else
+      {
+         storage->get_multi(batch, results);
+      }
+
+      // keep the ones which were found and pass the rest on.
+      size_t still_missing = 0;
+      for (size_t i = 0; i < batch.size(); ++i)
+      {
+         if (results[i]->exists())
+         {
+            handles[missing[i]] = results[i];
+         }
+         else
+         {
+            missing[still_missing] = missing[i];
+            batch[still_missing] = batch[i];
+            ++still_missing;
+         }
+      }
+      missing.resize(still_missing);
+      batch.resize(still_missing);
+   }
+}
+
+void
+union_storage::expire_multi(const vector<tile_protocol> &tiles,
+                            vector<bool> &results) const
+{
+   results.assign(tiles.size(), true);
+
+   vector<bool> storage_results;
    BOOST_FOREACH(shared_ptr<tile_storage> storage, m_storages) 
    {
-      success &= storage->expire(tile);
+      storage->expire_multi(tiles, storage_results);
+      for (size_t i = 0; i < tiles.size(); ++i)
+      {
+         results[i] = results[i] && storage_results[i];
+      }
    }
-   return success;
 }
 
 } // namespace rendermq
-
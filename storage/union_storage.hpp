@@ -30,8 +30,10 @@
 #include <string>
 #include <ctime>
 #include <list>
+#include <vector>
 #include <boost/shared_ptr.hpp>
 #include "tile_storage.hpp"
+#include "fan_out.hpp"
 
 namespace rendermq 
 {
@@ -45,6 +47,11 @@ namespace rendermq
  * over gradually, having the cache of the secondary storage
  * filled as jobs are requested due to expiry from the main
  * storage.
+ *
+ * requests go to all the storages at once, through a fan_out, so
+ * the union is only as slow as the slowest of them. each storage
+ * has its own timeout, after which it's treated as not having the
+ * tile.
  */
 class union_storage 
    : public tile_storage 
@@ -54,14 +61,20 @@ public:
    // this implementation.
    typedef std::list<boost::shared_ptr<tile_storage> > list_of_storage_t;
 
-   // create a union storage from existing storage objects
-   union_storage(list_of_storage_t storages);
+   // create a union storage from existing storage objects, with
+   // the timeout in milliseconds for each of them.
+   union_storage(list_of_storage_t storages,
+                 const std::vector<long> &timeouts = std::vector<long>());
    ~union_storage();
 
-   // get the tile from the first storage in the list which
-   // claims to have it.
+   // get the tile from whichever storage is first to claim to
+   // have it. storages which answer straight away are asked in
+   // the order of the list.
    boost::shared_ptr<tile_storage::handle> get(const tile_protocol &tile) const;
 
+   // probe the storages, in the same way as get().
+   boost::shared_ptr<tile_storage::handle> probe(const tile_protocol &tile) const;
+
    // attempt to get the meta tile from the first storage
    // which claims to have it.
    bool get_meta(const tile_protocol &, std::string &) const;
@@ -72,9 +85,38 @@ public:
    // expire the tile from *all* unioned storages.
    bool expire(const tile_protocol &tile) const;
 
+   // asynchronous versions of the above, with the event sources of
+   // all the unioned storages passed through.
+   void get_async(const tile_protocol &tile, const get_callback &callback) const;
+   void get_meta_async(const tile_protocol &tile, const get_meta_callback &callback) const;
+   void expire_async(const tile_protocol &tile, const expire_callback &callback) const;
+   void probe_async(const tile_protocol &tile, const get_callback &callback) const;
+   void put_meta_async(const tile_protocol &tile, const std::string &buf, const put_meta_callback &callback) const;
+   void async_fds(std::vector<int> &fds) const;
+   void async_perform() const;
+
+   // batches go to each storage in turn as a batch, with only
+   // the tiles which haven't been found yet being passed on to
+   // the next storage.
+   void get_multi(const std::vector<tile_protocol> &tiles,
+                  std::vector<boost::shared_ptr<tile_storage::handle> > &handles) const;
+   void probe_multi(const std::vector<tile_protocol> &tiles,
+                    std::vector<boost::shared_ptr<tile_storage::handle> > &handles) const;
+
+   // expire the batch from *all* unioned storages.
+   void expire_multi(const std::vector<tile_protocol> &tiles,
+                     std::vector<bool> &results) const;
+
 private:
+   // get or probe a batch from the first storage to have each tile.
+   void fetch_multi(const std::vector<tile_protocol> &tiles, bool probe,
+                    std::vector<boost::shared_ptr<tile_storage::handle> > &handles) const;
+
    
    list_of_storage_t m_storages;
+
+   // sends the single tile requests to all the storages at once.
+   fan_out m_fan_out;
 };
 
 }
@@ -32,6 +32,7 @@
 #include <boost/date_time/microsec_time_clock.hpp>
 #include <boost/foreach.hpp>
 #include <boost/make_shared.hpp>
+#include <boost/bind.hpp>
 
 #include <signal.h> // to ignore child termination signals
 
@@ -58,6 +59,24 @@ using std::string;
 namespace rendermq {
 
 namespace {
+/* status queries and conditional requests usually only need to know
+ * about the tile, not have its data, so they can start with a probe.
+ */
+bool wants_probe(const tile_protocol &tile)
+{
+   return (tile.status == cmdStatus) || (tile.request_last_modified != 0);
+}
+
+/* whether the data is needed after probing. this is only the case
+ * when the client's copy is out of date, otherwise the handler will
+ * send a 304 (or a status message) without the data.
+ */
+bool needs_data_after_probe(const tile_protocol &tile, const tile_storage::handle &handle)
+{
+   return (tile.status != cmdStatus) && handle.exists() &&
+      (handle.last_modified() > tile.request_last_modified);
+}
+
 void handle_tile(tile_protocol &tile,
                  shared_ptr<tile_storage> storage,
                  const map<string, list<string> > &dirty_list) 
@@ -82,42 +101,19 @@ void handle_tile(tile_protocol &tile,
          }
       }
    }   
-   else // command is not to dirty the tile
+   else if (wants_probe(tile))
    {
-      boost::shared_ptr<tile_storage::handle> handle = storage->get(tile);
-      
-      if (handle->exists()) 
+      boost::shared_ptr<tile_storage::handle> handle = storage->probe(tile);
+      if (needs_data_after_probe(tile, *handle))
       {
-         // don't change the status if the command was for the status,
-         // otherwise the handler won't know it was a status query and
-         // not a render request.
-         if (tile.status != cmdStatus)
-         {
-            if (handle->expired()) 
-            {
-               tile.status = cmdIgnore;
-            } 
-            else 
-            {
-               tile.status = cmdDone;
-            }
-         }
-         
-         std::string data;
-         handle->data(data);
-         tile.set_data(data);
-         tile.last_modified = handle->last_modified();
-      }
-      else 
-      {
-         // this case is indicated to the status command by the lack
-         // of data... yeah, it's a bit messy... the whole status /
-         // command thing could do with a refactor.
-         if (tile.status != cmdStatus) 
-         {
-            tile.status = cmdNotDone;
-         }
+         handle = storage->get(tile);
       }
+      tile_from_handle(tile, *handle);
+   }
+   else // command is not to dirty the tile
+   {
+      boost::shared_ptr<tile_storage::handle> handle = storage->get(tile);
+      tile_from_handle(tile, *handle);
    }
 }
 } // anonymous namespace
@@ -377,4 +373,191 @@ storage_worker::operator()() {
    }
 }
 
+async_storage_worker::async_storage_worker(zmq::context_t &ctx, 
+                                           const pt::ptree &c,
+                                           const std::string &handler_id,
+                                           size_t max_in_flight,
+                                           const map<string, list<string> > &dirty_list) 
+   : m_context(ctx), requests_in(m_context), results_out(m_context),
+     max_in_flight(max_in_flight), cur_in_flight(0), conf(c),
+     m_dirty_list(dirty_list)
+{
+   requests_in.connect("inproc://storage_request_" + handler_id);
+   results_out.connect("inproc://storage_results_" + handler_id);
+}
+
+async_storage_worker::~async_storage_worker()
+{
+}
+
+void 
+async_storage_worker::operator()() {
+   try {
+      storage.reset(get_tile_storage(conf, m_context));
+      if (!storage) {
+         LOG_ERROR("Couldn't instantiate storage, sending direct to queue.");
+      }
+
+      // the storage's event sources don't change, so they only need to
+      // be fetched once.
+      std::vector<int> fds;
+      if (storage) {
+         storage->async_fds(fds);
+      }
+
+      std::vector<zmq::pollitem_t> items(1 + fds.size());
+      for (size_t i = 0; i < fds.size(); ++i) {
+         zmq::pollitem_t item = { NULL, fds[i], ZMQ_POLLIN, 0 };
+         items[i + 1] = item;
+      }
+
+      tile_protocol tile;
+
+      while (true) {
+         zmq::pollitem_t item = { requests_in.socket(), 0, ZMQ_POLLIN, 0 };
+         items[0] = item;
+         for (size_t i = 1; i < items.size(); ++i) {
+            items[i].revents = 0;
+         }
+
+         try {
+            zmq::poll(&items[0], items.size(), STORAGE_WORKER_POLL_TIMEOUT);
+         } catch (const zmq::error_t &) {
+            // interrupted system calls, as in the threaded worker.
+            continue;
+         }
+
+         if (items[0].revents & ZMQ_POLLIN) {
+            requests_in >> tile;
+
+            if (cur_in_flight < max_in_flight) {
+               start(tile);
+            } else {
+               queued_requests.push_back(tile);
+            }
+         }
+
+         bool storage_ready = false;
+         for (size_t i = 1; i < items.size(); ++i) {
+            storage_ready = storage_ready || (items[i].revents & ZMQ_POLLIN);
+         }
+         if (storage_ready) {
+            // completion callbacks are run from in here, each of which
+            // will send its result back to the handler.
+            storage->async_perform();
+         }
+
+         // start any requests which are waiting for room.
+         while (!queued_requests.empty() && (cur_in_flight < max_in_flight)) {
+            tile_protocol queued = queued_requests.front();
+            queued_requests.pop_front();
+            start(queued);
+         }
+      }
+   } catch (const std::exception &e) {
+      LOG_ERROR(boost::format("Asynchronous storage worker exiting: %1%") % e.what());
+   } catch (...) {
+   }
+}
+
+void
+async_storage_worker::start(const tile_protocol &tile) {
+   if (!storage) {
+      tile_protocol reply(tile);
+      if (reply.status != cmdDirty && reply.status != cmdStatus) {
+         reply.status = cmdNotDone;
+      }
+      results_out << reply;
+      return;
+   }
+
+   const bt::ptime begin = bt::microsec_clock::local_time();
+   ++cur_in_flight;
+
+   try {
+      if (tile.status == cmdDirty) {
+         // expire the tile and all of its dependent styles, replying
+         // only once all of them have finished.
+         std::vector<tile_protocol> tiles(1, tile);
+         map<string, list<string> >::const_iterator itr = m_dirty_list.find(tile.style);
+         if (itr != m_dirty_list.end()) {
+            BOOST_FOREACH(string style, itr->second) {
+               tiles.push_back(tile);
+               tiles.back().style = style;
+            }
+         }
+
+         shared_ptr<size_t> remaining = make_shared<size_t>(tiles.size());
+         BOOST_FOREACH(const tile_protocol &t, tiles) {
+            storage->expire_async(t, boost::bind(&async_storage_worker::handle_expire, this, tile, begin, remaining, _1));
+         }
+
+      } else if (wants_probe(tile)) {
+         storage->probe_async(tile, boost::bind(&async_storage_worker::handle_probe, this, tile, begin, _1));
+
+      } else {
+         storage->get_async(tile, boost::bind(&async_storage_worker::handle_get, this, tile, begin, _1));
+      }
+
+   } catch (const std::exception &e) {
+      LOG_ERROR(boost::format("Exception during storage activity: %1%, sending "
+                              "'not done' response.") % e.what());
+      tile_protocol reply(tile);
+      reply.status = cmdNotDone;
+      finish(reply, begin);
+   }
+}
+
+void
+async_storage_worker::handle_get(tile_protocol tile, bt::ptime begin, 
+                                 shared_ptr<tile_storage::handle> handle) {
+   try {
+      tile_from_handle(tile, *handle);
+   } catch (const std::exception &e) {
+      tile.status = cmdNotDone;
+      LOG_ERROR(boost::format("Exception during storage activity: %1%, sending "
+                              "'not done' response.") % e.what());
+   }
+   finish(tile, begin);
+}
+
+void
+async_storage_worker::handle_probe(tile_protocol tile, bt::ptime begin, 
+                                   shared_ptr<tile_storage::handle> handle) {
+   try {
+      if (needs_data_after_probe(tile, *handle)) {
+         storage->get_async(tile, boost::bind(&async_storage_worker::handle_get, this, tile, begin, _1));
+         return;
+      }
+   } catch (const std::exception &e) {
+      LOG_ERROR(boost::format("Exception during storage activity: %1%, sending "
+                              "'not done' response.") % e.what());
+      tile.status = cmdNotDone;
+      finish(tile, begin);
+      return;
+   }
+   handle_get(tile, begin, handle);
+}
+
+void
+async_storage_worker::handle_expire(tile_protocol tile, bt::ptime begin,
+                                    shared_ptr<size_t> remaining, bool) {
+   // failures to expire aren't reported back to the handler by the
+   // threaded worker either, so they're ignored here.
+   if (--(*remaining) == 0) {
+      finish(tile, begin);
+   }
+}
+
+void
+async_storage_worker::finish(const tile_protocol &tile, bt::ptime begin) {
+   bt::ptime end = bt::microsec_clock::local_time();
+   if ((end - begin) > bt::seconds(5)) {
+      LOG_WARNING(boost::format("Took %1% seconds to fetch %2% from storage.") % (end - begin) % tile);
+   }
+
+   --cur_in_flight;
+   results_out << tile;
+}
+
 } // namespace rendermq
@@ -28,10 +28,12 @@
 
 #include "zstream.hpp"
 #include "tile_protocol.hpp"
+#include "storage/tile_storage.hpp"
 
 #include <boost/property_tree/ptree.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <string>
 #include <list>
 
@@ -117,6 +119,72 @@ private:
    std::list<boost::shared_ptr<tile_protocol> > queued_requests;
 };
 
+/* event-driven storage worker. this listens on the same sockets as
+ * the threaded storage_worker, but uses the asynchronous interface to
+ * the storage so that a single thread and a single storage instance
+ * can have many lookups in flight at once.
+ *
+ * this only helps for storage which implements the asynchronous
+ * interface (e.g: lts). anything else will run synchronously in this
+ * thread, one request at a time, and should use the threaded worker.
+ */
+class async_storage_worker {
+public:
+   /* constructs an asynchronous storage worker. the parameters are
+    * the same as for the threaded storage_worker, except that
+    * max_in_flight limits the number of outstanding storage operations
+    * rather than threads.
+    */
+   async_storage_worker(zmq::context_t &ctx, 
+                        const boost::property_tree::ptree &c,
+                        const std::string &handler_id,
+                        size_t max_in_flight,
+                        const std::map<std::string, std::list<std::string> > &dirty_list); 
+
+   ~async_storage_worker();
+
+   // main loop
+   void operator()();
+
+private:
+   // start a storage operation for the tile.
+   void start(const tile_protocol &tile);
+
+   // completion callbacks for the storage operations.
+   void handle_get(tile_protocol tile, boost::posix_time::ptime begin,
+                   boost::shared_ptr<tile_storage::handle> handle);
+   void handle_probe(tile_protocol tile, boost::posix_time::ptime begin,
+                     boost::shared_ptr<tile_storage::handle> handle);
+   void handle_expire(tile_protocol tile, boost::posix_time::ptime begin,
+                      boost::shared_ptr<size_t> remaining, bool ok);
+
+   // send the result back to the handler.
+   void finish(const tile_protocol &tile, boost::posix_time::ptime begin);
+
+   // context for zeromq operations
+   zmq::context_t &m_context;
+
+   // streams for requests and responses
+   zstream::socket::pull requests_in;
+   zstream::socket::push results_out;
+
+   // maximum and current number of storage operations in flight.
+   size_t max_in_flight, cur_in_flight;
+
+   // storage configuration
+   const boost::property_tree::ptree &conf;
+
+   // map of style names into a list of style names which are dependent
+   // and should be dirtied whenever the keyed style is dirtied.
+   std::map<std::string, std::list<std::string> > m_dirty_list;
+
+   // the single storage instance shared by all requests.
+   boost::shared_ptr<tile_storage> storage;
+
+   // requests waiting for the number in flight to drop.
+   std::list<tile_protocol> queued_requests;
+};
+
 } // namespace rendermq
 
 #endif /* STORAGE_WORKER_HPP */
@@ -72,18 +72,56 @@ struct task : tile_protocol
       return priority_;
    }
    
-   void add_subscriber(tile_protocol const& tile, std::string const& addr)
+   void add_subscriber(tile_protocol const& tile, std::string const& addr, int priority=0)
    {
       if (&tile == this) {
          LOG_WARNING("Adding self to own subscribers vector - this shouldn't happen");
       }
       subscribers_.push_back(std::make_pair(tile,addr));
+      subscriber_priorities_.push_back(priority);
    }
    
    std::pair<iterator,iterator> subscribers() const
    {
       return std::make_pair(subscribers_.begin(),subscribers_.end());
    }
+
+   /* removes the subscribers whose deadlines have passed, as there's
+    * no-one waiting for those any more. if some are left, the priority
+    * and deadline are set from just those, as the ones which have gone
+    * may have been the ones which raised them. returns true if there
+    * were subscribers and they've all gone.
+    */
+   bool prune_expired_subscribers(std::time_t now)
+   {
+      if (subscribers_.empty()) return false;
+      cont_type live;
+      std::vector<int> live_priorities;
+      for (size_t i = 0; i < subscribers_.size(); ++i)
+      {
+         if (!subscribers_[i].first.expired(now))
+         {
+            live.push_back(subscribers_[i]);
+            live_priorities.push_back(subscriber_priorities_[i]);
+         }
+      }
+      if (!live.empty() && (live.size() != subscribers_.size()))
+      {
+         // as when the subscribers were added, the task is wanted until
+         // the last deadline, or forever if any of them doesn't have one.
+         priority_ = live_priorities[0];
+         deadline = live[0].first.deadline;
+         for (size_t i = 1; i < live.size(); ++i)
+         {
+            if (live_priorities[i] > priority_) priority_ = live_priorities[i];
+            const std::time_t d = live[i].first.deadline;
+            if ((deadline != 0) && ((d == 0) || (d > deadline))) deadline = d;
+         }
+      }
+      subscribers_.swap(live);
+      subscriber_priorities_.swap(live_priorities);
+      return subscribers_.empty();
+   }
    
    void set_processed(bool b) 
    {
@@ -108,6 +146,8 @@ struct task : tile_protocol
    int priority_;
    std::time_t timestamp_;
    cont_type subscribers_;
+   // the priority each subscriber was added with, in the same order.
+   std::vector<int> subscriber_priorities_;
    bool processed_; 
 };
 
@@ -127,10 +167,18 @@ inline std::size_t hash_value( task const& t)
 struct priority {};
 struct metatile {};
 struct timestamp {};
+struct unprocessed {};
 
 /* a priority queue of tasks, sorted by priority (highest priority at the 
  * *front* of the queue) and unique by position and style parameters. finally
  * it's sorted on timestamp.
+ *
+ * the timestamp and unprocessed indexes are both keyed first on whether the
+ * task is being processed, so the unprocessed tasks and the in-flight tasks
+ * each form a contiguous range. this means finding the highest priority
+ * unprocessed task or the oldest in-flight tasks doesn't need to walk past
+ * all the others, which matters when there are hundreds of thousands of 
+ * bulk tasks in the queue.
  */
 class task_queue 
 {
@@ -143,10 +191,18 @@ class task_queue
 // hash index on x,y,z & style
                                  hashed_unique<tag<metatile>,
                                                identity<task> >,
-// index to order by timestamp 
+// index to order by timestamp, unprocessed tasks first and then in-flight
                                  ordered_non_unique<tag<timestamp>,
-                                                    member<task,std::time_t, &task::timestamp_>,
-                                                    std::less<int> >
+                                                    composite_key<task,
+                                                                  member<task,bool, &task::processed_>,
+                                                                  member<task,std::time_t, &task::timestamp_> > >,
+// index to order by priority, unprocessed tasks first and then in-flight
+                                 ordered_non_unique<tag<unprocessed>,
+                                                    composite_key<task,
+                                                                  member<task,bool, &task::processed_>,
+                                                                  member<task,int, &task::priority_> >,
+                                                    composite_key_compare<std::less<bool>,
+                                                                          std::greater<int> > >
                                  > > cont_type;
     
    typedef cont_type::index<rendermq::priority>::type priority_index_type;
@@ -189,7 +245,13 @@ class task_queue
       {
          if (priority_ > t.priority())
             t.set_priority(priority_);
-         t.add_subscriber(tile_,addr_);
+         // the task is wanted until the last subscriber's deadline, or
+         // forever if any subscriber doesn't have one.
+         if (t.subscribers_.empty())
+            t.deadline = tile_.deadline;
+         else if ((t.deadline != 0) && ((tile_.deadline == 0) || (tile_.deadline > t.deadline)))
+            t.deadline = tile_.deadline;
+         t.add_subscriber(tile_,addr_,priority_);
          // union all the requested formats for the same metatile
          t.format = static_cast<protoFmt>(t.format | tile_.format);
       }
@@ -199,15 +261,43 @@ class task_queue
       int priority_;
    };
 
-   // marks the task as being processed.
+   // marks the task as being processed and resets the timestamp, so
+   // that the time it's been leased to a worker for can be tracked.
    struct processed_fun
    {
       void operator() (task & t)
       {            
          t.set_processed(true);
+         t.set_timestamp(std::time(0));
       }
    };
    
+   // drops expired subscribers, remembering whether they all were.
+   struct prune_fun
+   {
+      prune_fun(std::time_t now, bool &all_expired)
+         : now_(now), all_expired_(all_expired) {}
+
+      void operator() (task & t)
+      {
+         all_expired_ = t.prune_expired_subscribers(now_);
+      }
+
+      std::time_t now_;
+      bool &all_expired_;
+   };
+
+   // demotes a task to bulk priority, for when nobody is waiting for it
+   // any more but the result is still worth having.
+   struct demote_fun
+   {
+      void operator() (task & t)
+      {
+         t.set_priority(0);
+         t.deadline = 0;
+      }
+   };
+
    // unmarks the task as being processed and resets the timestamp so
    // that it doesn't immediately get resubmitted again.
    struct unprocessed_fun
@@ -221,6 +311,8 @@ class task_queue
    };
     
 public:
+   task_queue() : unprocessed_count(0) {}
+
    /* sets the task identified by the tile parameter as being processed.
     * 
     * this means that the task will not appear as available via the 
@@ -233,10 +325,64 @@ public:
       typedef cont_type::index<rendermq::metatile>::type meta_index_type;
       meta_index_type & index = queue.get<rendermq::metatile>();
       meta_index_type::iterator itr = index.find(task(tile,0));
-      if (itr!=index.end())
+      if (itr!=index.end() && !itr->processed())
       {            
          processed_fun op;
          index.modify(itr,op);
+         --unprocessed_count;
+      }
+   }
+
+   /* drops any subscribers of the task whose deadlines have passed.
+    *
+    * returns true if the task had subscribers and they have all now
+    * expired, in which case the caller should erase() or demote() the
+    * task.
+    */
+   bool prune_expired(tile_protocol const& tile, std::time_t now)
+   {
+      typedef cont_type::index<rendermq::metatile>::type meta_index_type;
+      meta_index_type & index = queue.get<rendermq::metatile>();
+      meta_index_type::iterator itr = index.find(task(tile,0));
+      bool all_expired = false;
+      if (itr!=index.end())
+      {
+         prune_fun op(now, all_expired);
+         index.modify(itr,op);
+      }
+      return all_expired;
+   }
+
+   /* moves the task to the lowest (bulk) priority and removes its 
+    * deadline. later subscribers will raise the priority again as
+    * usual.
+    */
+   void demote(tile_protocol const& tile)
+   {
+      typedef cont_type::index<rendermq::metatile>::type meta_index_type;
+      meta_index_type & index = queue.get<rendermq::metatile>();
+      meta_index_type::iterator itr = index.find(task(tile,0));
+      if (itr!=index.end())
+      {
+         demote_fun op;
+         index.modify(itr,op);
+      }
+   }
+
+   /* the opposite of set_processed(), for when a task was given to a 
+    * worker which has handed it back without processing it. the task
+    * becomes available via front() again.
+    */
+   void set_unprocessed(tile_protocol const& tile)
+   {
+      typedef cont_type::index<rendermq::metatile>::type meta_index_type;
+      meta_index_type & index = queue.get<rendermq::metatile>();
+      meta_index_type::iterator itr = index.find(task(tile,0));
+      if (itr!=index.end() && itr->processed())
+      {            
+         unprocessed_fun op;
+         index.modify(itr,op);
+         ++unprocessed_count;
       }
    }
    
@@ -247,26 +393,33 @@ public:
     * possibly due to worker failure, and make them available to be 
     * processed by other workers.
     *
-    * jobs are resubmitted only when they have been in the queue for at
-    * least timeout seconds, are marked as being processed and are not
-    * bulk requests.
+    * jobs are resubmitted only when they have been marked as being 
+    * processed for at least timeout seconds and are not bulk requests.
+    *
+    * only the in-flight tasks which are old enough are visited, so this
+    * costs O(log n) plus the number of tasks resubmitted.
     */
    void resubmit_older_than (int timeout)
    {
       typedef cont_type::index<rendermq::timestamp>::type index_type;
       index_type & index = queue.get<rendermq::timestamp>();
-      index_type::iterator itr = index.begin();
-      index_type::iterator end = index.end();
-      std::time_t now = std::time(0);
-      for (; itr!=end; ++itr) 
+      std::time_t cutoff = std::time(0) - timeout;
+      index_type::iterator itr = index.lower_bound(boost::make_tuple(true));
+      index_type::iterator end = index.upper_bound(boost::make_tuple(true, cutoff));
+      while (itr!=end) 
       {
-         if (itr->status != cmdRenderBulk && now - itr->timestamp() >= timeout &&
-             itr->processed())
+         // resubmitting moves the task into the unprocessed range, so
+         // step past it first.
+         index_type::iterator next = itr;
+         ++next;
+         if (itr->status != cmdRenderBulk)
          {
             LOG_INFO(boost::format("Resubmitting task: %1%") % static_cast<tile_protocol>(*itr));
             unprocessed_fun op;
             index.modify(itr,op);
+            ++unprocessed_count;
          }
+         itr = next;
       }
    }
 
@@ -300,6 +453,7 @@ public:
          add_subscriber sub(tile,address,priority);
          queue.modify(result.first,sub);   
       }
+      if (result.second) ++unprocessed_count;
       return result.second;
    }
    
@@ -316,7 +470,11 @@ public:
       priority_index_type & index = queue.get<rendermq::priority>();
       priority_index_type::iterator itr = index.begin();
       priority_index_type::iterator end = index.end();
-      if (itr!=end) index.erase(itr);
+      if (itr!=end) 
+      {
+         if (!itr->processed()) --unprocessed_count;
+         index.erase(itr);
+      }
    }
    
    /* remove a specific task from the queue.
@@ -334,7 +492,8 @@ public:
       meta_index_type::iterator itr = index.find(task(tile,0));
       if (itr!=index.end())
       {
-         index.erase(*itr);
+         if (!itr->processed()) --unprocessed_count;
+         index.erase(itr);
          return true;
       }
       return false;
@@ -363,7 +522,7 @@ public:
       priority_index_type const& index = queue.get<rendermq::priority>();
       priority_index_iterator itr = index.begin();
       priority_index_iterator end = index.end();
-      return std::make_pair<priority_index_iterator,priority_index_iterator>(itr,end);
+      return std::make_pair(itr,end);
    }
    
    /* returns the highest priority unprocessed task, if there is
@@ -373,16 +532,14 @@ public:
     */
    boost::optional<task const&> front() const
    {
-      typedef cont_type::index<rendermq::priority>::type priority_index_type;
-      priority_index_type const& index = queue.get<rendermq::priority>();
-      priority_index_type::iterator itr = index.begin();
-      priority_index_type::iterator end = index.end();
+      typedef cont_type::index<rendermq::unprocessed>::type unprocessed_index_type;
+      unprocessed_index_type const& index = queue.get<rendermq::unprocessed>();
+      unprocessed_index_type::iterator itr = index.begin();
       boost::optional<task const&> result;
-      for (;itr!=end;++itr) 
-      {
-         if (!itr->processed())
-            return boost::optional<task const&>(*itr);
-      }
+      // unprocessed tasks sort first, so if the first one is being
+      // processed then they all are.
+      if (itr!=index.end() && !itr->processed())
+         return boost::optional<task const&>(*itr);
       return result;
    }
    
@@ -400,26 +557,25 @@ public:
     */
    size_t count_unprocessed() const
    {
-      size_t count=0;
-      typedef cont_type::index<rendermq::priority>::type priority_index_type;
-      priority_index_type const& index = queue.get<rendermq::priority>();
-      priority_index_type::iterator itr = index.begin();
-      priority_index_type::iterator end = index.end();
-      for (; itr!=end;++itr)
-      {
-         if (!itr->processed()) ++count;
-      }
-      return count;
+      return unprocessed_count;
    }
    
    /* removes all tasks from the queue.
     */
-   void clear() { queue.clear();}
+   void clear() 
+   { 
+      queue.clear();
+      unprocessed_count = 0;
+   }
 
 private:
 
    // the queue itself.
    cont_type queue;
+
+   // number of tasks in the queue which aren't being processed, kept up
+   // to date as tasks change state rather than counted on demand.
+   size_t unprocessed_count;
 };
 
 } // namespace rendermq
@@ -0,0 +1,180 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+
+/* benchmark of batched reads from disk_storage, comparing the blocking
+ * pread() path, which splits big batches between a few threads, with
+ * the I/O engines, which keep many reads outstanding from one thread.
+ *
+ * usage: bench_disk_batch [metatiles [batch [rounds [mode...]]]]
+ *
+ * this writes the given number of fake metatiles, 4096 by default, in
+ * a tree under a temporary directory, and then reads batches of random
+ * tiles from them with get_multi(). the modes are "pread", "threads"
+ * and "io_uring".
+ *
+ * each mode is run cold, after asking the kernel to drop the metatiles
+ * from the page cache, and then warm. storage on spinning disks or
+ * NVMe arrays is where the cold numbers differ most, as they need a
+ * deep queue to go fast; on a RAM-backed /tmp they mostly show the
+ * overhead of each path. set TMPDIR to put the tree somewhere else.
+ */
+
+#include "storage/disk_storage.hpp"
+#include "storage/meta_tile.hpp"
+#include "test/fake_tile.hpp"
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#define BOOST_FILESYSTEM_VERSION 3
+#include <boost/filesystem.hpp>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using std::string;
+using std::vector;
+using std::cout;
+using std::endl;
+using std::runtime_error;
+using boost::shared_ptr;
+using rendermq::disk_storage;
+using rendermq::tile_protocol;
+using rendermq::tile_storage;
+namespace bt = boost::posix_time;
+namespace fs = boost::filesystem;
+
+namespace {
+
+// the zoom level the fake metatiles are at, big enough for the tree
+// to spread over several directories.
+#define ZOOM (16)
+
+// ask the kernel to forget the contents of all the metatiles.
+void drop_caches(const string &dir, const vector<tile_protocol> &metatiles) {
+  for (vector<tile_protocol>::const_iterator itr = metatiles.begin(); itr != metatiles.end(); ++itr) {
+    const string path = rendermq::xyz_to_meta(dir, itr->x, itr->y, itr->z, itr->style).first;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd >= 0) {
+      fdatasync(fd);
+      posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+      close(fd);
+    }
+  }
+}
+
+// read the batches, returning the tiles per second.
+double run(const disk_storage &storage, const vector<vector<tile_protocol> > &batches) {
+  vector<shared_ptr<tile_storage::handle> > handles;
+  size_t count = 0;
+  const bt::ptime start = bt::microsec_clock::universal_time();
+  for (vector<vector<tile_protocol> >::const_iterator itr = batches.begin(); itr != batches.end(); ++itr) {
+    storage.get_multi(*itr, handles);
+    for (size_t i = 0; i < handles.size(); ++i) {
+      if (!handles[i]->exists()) {
+        throw runtime_error((boost::format("Couldn't read %1%.") % (*itr)[i]).str());
+      }
+    }
+    count += handles.size();
+  }
+  const bt::time_duration elapsed = bt::microsec_clock::universal_time() - start;
+
+  return double(count) * 1000000.0 / double(elapsed.total_microseconds());
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  size_t metatiles = 4096, batch = 1024, rounds = 8;
+  vector<string> modes;
+  if (argc > 1) { metatiles = boost::lexical_cast<size_t>(argv[1]); }
+  if (argc > 2) { batch = boost::lexical_cast<size_t>(argv[2]); }
+  if (argc > 3) { rounds = boost::lexical_cast<size_t>(argv[3]); }
+  for (int i = 4; i < argc; ++i) { modes.push_back(argv[i]); }
+  if (modes.empty()) {
+    modes.push_back("pread");
+    modes.push_back("threads");
+    modes.push_back("io_uring");
+  }
+
+  const char *tmp = getenv("TMPDIR");
+  const fs::path dir = fs::path(tmp ? tmp : "/tmp") / fs::unique_path();
+  fs::create_directories(dir);
+
+  cout << "== Benchmarking disk_storage batches ==" << endl << endl;
+
+  try {
+    // spread the metatiles out so they're in many directories.
+    disk_storage writer(dir.native(), 0, 0, "none");
+    vector<tile_protocol> meta;
+    const int side = 1 << ZOOM;
+    for (size_t i = 0; i < metatiles; ++i) {
+      const int x = int((i * 2654435761u) % (side / METATILE)) * METATILE;
+      const int y = int((i * 40503u) % (side / METATILE)) * METATILE;
+      tile_protocol tile(rendermq::cmdRender, x, y, ZOOM, 0, "osm", rendermq::fmtPNG, 0, 0);
+      fake_tile fake(tile.x, tile.y, tile.z, tile.format);
+      if (!writer.put_meta(tile, string(fake.ptr, fake.total_size))) {
+        throw runtime_error("Can't save meta tile.");
+      }
+      meta.push_back(tile);
+    }
+
+    // the same random tiles for each mode.
+    srand(1);
+    vector<vector<tile_protocol> > batches(rounds);
+    for (size_t r = 0; r < rounds; ++r) {
+      for (size_t i = 0; i < batch; ++i) {
+        tile_protocol tile = meta[rand() % meta.size()];
+        tile.x += rand() % METATILE;
+        tile.y += rand() % METATILE;
+        batches[r].push_back(tile);
+      }
+    }
+
+    cout << boost::format("   %1% metatiles, %2% batches of %3% tiles") % metatiles % rounds % batch << endl;
+    for (vector<string>::const_iterator itr = modes.begin(); itr != modes.end(); ++itr) {
+      // no metatiles kept open, so every batch opens them all again.
+      disk_storage storage(dir.native(), 0, 0, (*itr == "pread") ? "none" : *itr);
+      drop_caches(dir.native(), meta);
+      const double cold = run(storage, batches);
+      const double warm = run(storage, batches);
+      cout << boost::format("   %1$-8s: %2$.0f tiles/s cold, %3$.0f tiles/s warm") % *itr % cold % warm << endl;
+    }
+
+  } catch (const std::exception &e) {
+    cout << "   error: " << e.what() << endl;
+  }
+
+  fs::remove_all(dir);
+  cout << endl;
+
+  return 0;
+}
@@ -0,0 +1,158 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+/* benchmark of disk_storage::put_meta(), comparing writing each
+ * metatile in the calling thread with the background writer in its
+ * different sync modes.
+ *
+ * usage: bench_disk_put [metatiles [write_threads [write_queue [mode...]]]]
+ *
+ * this puts the given number of fake metatiles, 8192 by default,
+ * spread over many directories under a temporary directory, and
+ * reports the metatiles per second seen by the caller and the rate
+ * including the time taken to get them all on disk. with a queue as
+ * long as the number of metatiles, the put rate is what a burst of
+ * puts costs the caller. the modes are
+ * "sync", which is the blocking put_meta(), and "none", "fsync" and
+ * "syncfs" for the writer. each mode writes into a new tree, so the
+ * directories have to be made each time.
+ *
+ * on a RAM-backed /tmp the sync modes cost little, and this mostly
+ * shows the cost of the metadata operations and of the queue. set
+ * TMPDIR to a real disk to see the cost of durability.
+ */
+
+#include "storage/disk_storage.hpp"
+#include "storage/meta_writer.hpp"
+#include "storage/meta_tile.hpp"
+#include "test/fake_tile.hpp"
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#define BOOST_FILESYSTEM_VERSION 3
+#include <boost/filesystem.hpp>
+
+using std::string;
+using std::vector;
+using std::cout;
+using std::endl;
+using std::runtime_error;
+using boost::scoped_ptr;
+using boost::shared_ptr;
+using rendermq::disk_storage;
+using rendermq::tile_protocol;
+namespace bt = boost::posix_time;
+namespace fs = boost::filesystem;
+
+namespace {
+
+// the zoom level the fake metatiles are at, big enough for the tree
+// to spread over several directories.
+#define ZOOM (16)
+
+double per_second(size_t count, const bt::ptime &start) {
+  const bt::time_duration elapsed = bt::microsec_clock::universal_time() - start;
+  return double(count) * 1000000.0 / double(std::max(elapsed.total_microseconds(), 1L));
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  size_t metatiles = 8192, threads = 4, queue = DEFAULT_WRITE_QUEUE;
+  vector<string> modes;
+  if (argc > 1) { metatiles = boost::lexical_cast<size_t>(argv[1]); }
+  if (argc > 2) { threads = boost::lexical_cast<size_t>(argv[2]); }
+  if (argc > 3) { queue = boost::lexical_cast<size_t>(argv[3]); }
+  for (int i = 4; i < argc; ++i) { modes.push_back(argv[i]); }
+  if (modes.empty()) {
+    modes.push_back("sync");
+    modes.push_back("none");
+    modes.push_back("fsync");
+    modes.push_back("syncfs");
+  }
+
+  const char *tmp = getenv("TMPDIR");
+  const fs::path base = fs::path(tmp ? tmp : "/tmp") / fs::unique_path();
+
+  cout << "== Benchmarking disk_storage puts ==" << endl << endl;
+
+  try {
+    // the same metatiles for each mode, made up front.
+    vector<tile_protocol> meta;
+    vector<string> data;
+    const int side = 1 << ZOOM;
+    for (size_t i = 0; i < metatiles; ++i) {
+      const int x = int((i * 2654435761u) % (side / METATILE)) * METATILE;
+      const int y = int((i * 40503u) % (side / METATILE)) * METATILE;
+      tile_protocol tile(rendermq::cmdRender, x, y, ZOOM, 0, "osm", rendermq::fmtPNG, 0, 0);
+      fake_tile fake(tile.x, tile.y, tile.z, tile.format);
+      meta.push_back(tile);
+      data.push_back(string(fake.ptr, fake.total_size));
+    }
+
+    cout << boost::format("   %1% metatiles, %2% writer threads, queue of %3%") % metatiles % threads % queue << endl;
+    for (vector<string>::const_iterator itr = modes.begin(); itr != modes.end(); ++itr) {
+      const fs::path dir = base / *itr;
+      fs::create_directories(dir);
+
+      double put = 0.0, written = 0.0;
+      {
+        shared_ptr<rendermq::meta_writer> writer;
+        if (*itr != "sync") {
+          writer.reset(new rendermq::meta_writer(threads, queue, *itr, DEFAULT_WRITE_BATCH));
+        }
+        scoped_ptr<disk_storage> storage(new disk_storage(dir.native(), 0, 0, "none", 1, 1, true, writer));
+
+        const bt::ptime start = bt::microsec_clock::universal_time();
+        for (size_t i = 0; i < meta.size(); ++i) {
+          if (!storage->put_meta(meta[i], data[i])) {
+            throw runtime_error("Can't save meta tile.");
+          }
+        }
+        put = per_second(meta.size(), start);
+        // the storage writes everything before it goes.
+        storage.reset();
+        written = per_second(meta.size(), start);
+      }
+
+      cout << boost::format("   %1$-8s: %2$.0f puts/s, %3$.0f metatiles/s on disk") % *itr % put % written << endl;
+      fs::remove_all(dir);
+    }
+
+  } catch (const std::exception &e) {
+    cout << "   error: " << e.what() << endl;
+  }
+
+  fs::remove_all(base);
+  cout << endl;
+
+  return 0;
+}
@@ -0,0 +1,177 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+
+/* benchmark of reading single tiles from disk_storage, comparing the
+ * old read path, which found and opened the metatile for every tile,
+ * with the metatiles kept open between reads.
+ *
+ * usage: bench_disk_read [metatiles [rounds [mode...]]]
+ *
+ * this writes the given number of fake metatiles, 256 by default, to a
+ * temporary directory and then reads every tile in them the given
+ * number of rounds. the modes are:
+ *
+ *   old        - the read path before metatiles were kept open: stat
+ *                the metatile twice and then read_from_meta(), which
+ *                opens, reads, seeks, reads again and closes it.
+ *   uncached   - disk_storage with no metatiles kept open.
+ *   revalidate - metatiles kept open, checked with stat() on each read.
+ *   trusting   - metatiles kept open, checked once a second.
+ *
+ * the system calls for each mode can be compared by running them one
+ * at a time under strace, e.g: strace -c bench_disk_read 256 10 old
+ */
+
+#include "storage/disk_storage.hpp"
+#include "storage/meta_tile.hpp"
+#include "test/fake_tile.hpp"
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <boost/array.hpp>
+#include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#define BOOST_FILESYSTEM_VERSION 3
+#include <boost/filesystem.hpp>
+
+using std::string;
+using std::vector;
+using std::cout;
+using std::endl;
+using std::runtime_error;
+using boost::shared_ptr;
+using rendermq::disk_storage;
+using rendermq::tile_protocol;
+using rendermq::tile_storage;
+namespace bt = boost::posix_time;
+namespace fs = boost::filesystem;
+
+namespace {
+
+// the zoom level the fake metatiles are at.
+#define ZOOM (12)
+
+// the read path of disk_storage::get() before metatiles were kept open.
+size_t read_old(const string &dir, const tile_protocol &tile, boost::array<unsigned char, 1024*1024> &buf) {
+  fs::path p(rendermq::xyz_to_meta(dir, tile.x, tile.y, tile.z, tile.style).first);
+  if (!fs::exists(p)) { return 0; }
+  fs::last_write_time(p);
+  int ret = rendermq::read_from_meta(dir, tile.x, tile.y, tile.z, tile.style,
+                                     buf.c_array(), buf.size(), tile.format);
+  return (ret > 0) ? ret : 0;
+}
+
+size_t read_storage(const disk_storage &storage, const tile_protocol &tile, string &data) {
+  shared_ptr<tile_storage::handle> handle = storage.get(tile);
+  return handle->data(data) ? data.size() : 0;
+}
+
+// read every tile in the metatiles, returning the microseconds per tile.
+double run(const string &mode, const string &dir, const vector<tile_protocol> &tiles, size_t rounds) {
+  boost::array<unsigned char, 1024*1024> buf;
+  string data;
+  shared_ptr<disk_storage> storage;
+  if (mode == "uncached") {
+    storage.reset(new disk_storage(dir, 0, 0));
+  } else if (mode == "revalidate") {
+    storage.reset(new disk_storage(dir, tiles.size(), 0));
+  } else if (mode == "trusting") {
+    storage.reset(new disk_storage(dir, tiles.size(), 1000));
+  } else if (mode != "old") {
+    throw runtime_error((boost::format("Unknown mode %1%.") % mode).str());
+  }
+
+  const bt::ptime start = bt::microsec_clock::universal_time();
+  size_t count = 0;
+  for (size_t r = 0; r < rounds; ++r) {
+    // go through the metatiles a tile at a time, as separate requests
+    // for neighbouring tiles would.
+    for (int i = 0; i < METATILE * METATILE; ++i) {
+      for (vector<tile_protocol>::const_iterator itr = tiles.begin(); itr != tiles.end(); ++itr) {
+        tile_protocol tile = *itr;
+        tile.x += i % METATILE;
+        tile.y += i / METATILE;
+        const size_t size = storage ? read_storage(*storage, tile, data) : read_old(dir, tile, buf);
+        if (size == 0) {
+          throw runtime_error((boost::format("Couldn't read %1%.") % tile).str());
+        }
+        ++count;
+      }
+    }
+  }
+  const bt::time_duration elapsed = bt::microsec_clock::universal_time() - start;
+
+  return double(elapsed.total_microseconds()) / double(count);
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  size_t metatiles = 256, rounds = 10;
+  vector<string> modes;
+  if (argc > 1) { metatiles = boost::lexical_cast<size_t>(argv[1]); }
+  if (argc > 2) { rounds = boost::lexical_cast<size_t>(argv[2]); }
+  for (int i = 3; i < argc; ++i) { modes.push_back(argv[i]); }
+  if (modes.empty()) {
+    modes.push_back("old");
+    modes.push_back("uncached");
+    modes.push_back("revalidate");
+    modes.push_back("trusting");
+  }
+
+  const fs::path dir = fs::path("/tmp") / fs::unique_path();
+  fs::create_directories(dir);
+
+  cout << "== Benchmarking disk_storage reads ==" << endl << endl;
+
+  try {
+    disk_storage writer(dir.native());
+    vector<tile_protocol> tiles;
+    for (size_t i = 0; i < metatiles; ++i) {
+      tile_protocol tile(rendermq::cmdRender, METATILE * (i % 64), METATILE * (i / 64), ZOOM, 0, "osm", rendermq::fmtPNG, 0, 0);
+      fake_tile meta(tile.x, tile.y, tile.z, tile.format);
+      if (!writer.put_meta(tile, string(meta.ptr, meta.total_size))) {
+        throw runtime_error("Can't save meta tile.");
+      }
+      tiles.push_back(tile);
+    }
+
+    for (vector<string>::const_iterator itr = modes.begin(); itr != modes.end(); ++itr) {
+      cout << boost::format("   %1$-10s: %2$.2fus per tile") % *itr % run(*itr, dir.native(), tiles, rounds) << endl;
+    }
+
+  } catch (const std::exception &e) {
+    cout << "   error: " << e.what() << endl;
+  }
+
+  fs::remove_all(dir);
+  cout << endl;
+
+  return 0;
+}
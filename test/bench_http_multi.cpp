@@ -0,0 +1,234 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+
+/* benchmark of the blocking http::multiGet against a stub HTTP server
+ * on the loopback interface, which answers every request straight away
+ * with a fixed body. this measures the overhead of the client's event
+ * loop rather than anything to do with the network.
+ *
+ * usage: bench_http_multi [transfers [concurrency...]]
+ *
+ * by default this does 10000 transfers at each of several levels of
+ * concurrency, up to all 10000 at once. each level is run twice, the
+ * first time setting up new connections and the second re-using them.
+ */
+
+#include "http/http.hpp"
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <boost/thread/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using std::string;
+using std::vector;
+using std::cout;
+using std::endl;
+using std::runtime_error;
+using boost::shared_ptr;
+namespace bt = boost::posix_time;
+
+// size of the body the stub server sends back, about that of a tile.
+#define BODY_SIZE (4096)
+
+namespace {
+
+/* minimal HTTP/1.1 server which answers every request on a connection
+ * with the same 200 response, keeping the connection open. it doesn't
+ * look at the request at all beyond finding where it ends.
+ */
+class stub_server {
+public:
+  stub_server() : m_listen_fd(-1), m_epoll_fd(-1), m_port(0) {
+    const string body(BODY_SIZE, 'x');
+    m_response = (boost::format("HTTP/1.1 200 OK\r\n"
+                                "Content-Type: image/png\r\n"
+                                "Last-Modified: Sat, 01 Jan 2011 00:00:00 GMT\r\n"
+                                "Content-Length: %1%\r\n\r\n") % body.size()).str() + body;
+
+    m_listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int one = 1;
+    setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    if ((bind(m_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) ||
+        (listen(m_listen_fd, SOMAXCONN) != 0)) {
+      throw runtime_error((boost::format("Cannot set up stub server: %1%") % strerror(errno)).str());
+    }
+    socklen_t len = sizeof(addr);
+    getsockname(m_listen_fd, (struct sockaddr *)&addr, &len);
+    m_port = ntohs(addr.sin_port);
+
+    m_epoll_fd = epoll_create1(0);
+    add(m_listen_fd);
+    m_thread.reset(new boost::thread(boost::bind(&stub_server::run, this)));
+  }
+
+  int port() const { return m_port; }
+
+private:
+  void add(int fd) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+  }
+
+  void run() {
+    struct epoll_event events[256];
+    vector<string> pending(1024);
+
+    while (true) {
+      int n = epoll_wait(m_epoll_fd, events, 256, -1);
+      for (int i = 0; i < n; ++i) {
+        const int fd = events[i].data.fd;
+        if (fd == m_listen_fd) {
+          int conn;
+          while ((conn = accept4(m_listen_fd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+            if (size_t(conn) >= pending.size()) { pending.resize(conn * 2); }
+            pending[conn].clear();
+            add(conn);
+          }
+        } else {
+          serve(fd, pending[fd]);
+        }
+      }
+    }
+  }
+
+  // read what's there and answer each complete request in it. the
+  // responses are small enough that they always fit in the socket
+  // buffer, so there's no need to wait for it to be writable.
+  void serve(int fd, string &buffer) {
+    char buf[8192];
+    ssize_t len = read(fd, buf, sizeof(buf));
+    if (len <= 0) {
+      if ((len < 0) && (errno == EAGAIN)) { return; }
+      close(fd);
+      return;
+    }
+    buffer.append(buf, len);
+
+    string::size_type end;
+    while ((end = buffer.find("\r\n\r\n")) != string::npos) {
+      buffer.erase(0, end + 4);
+      if (write(fd, m_response.data(), m_response.size()) != ssize_t(m_response.size())) {
+        close(fd);
+        return;
+      }
+    }
+  }
+
+  int m_listen_fd, m_epoll_fd, m_port;
+  string m_response;
+  boost::scoped_ptr<boost::thread> m_thread;
+};
+
+// do all the transfers, returning the number per second.
+double run_batch(const vector<string> &urls, size_t concurrency) {
+  const bt::ptime start = bt::microsec_clock::universal_time();
+  vector<shared_ptr<http::response> > responses = http::multiGet(urls, concurrency);
+  const bt::time_duration elapsed = bt::microsec_clock::universal_time() - start;
+
+  for (size_t i = 0; i < responses.size(); ++i) {
+    if ((responses[i]->statusCode != 200) || (responses[i]->body.size() != BODY_SIZE)) {
+      throw runtime_error((boost::format("Bad response %1% for transfer %2%.")
+                           % responses[i]->statusCode % i).str());
+    }
+  }
+  return double(urls.size()) * 1.0e6 / double(std::max(elapsed.total_microseconds(), 1L));
+}
+
+// each concurrent transfer needs a socket at each end, and both ends are
+// in this process.
+size_t raise_fd_limit(size_t concurrency) {
+  struct rlimit lim;
+  getrlimit(RLIMIT_NOFILE, &lim);
+  lim.rlim_cur = lim.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &lim);
+  getrlimit(RLIMIT_NOFILE, &lim);
+
+  const size_t max_concurrency = (lim.rlim_cur > 256) ? (lim.rlim_cur - 128) / 2 : 64;
+  if (concurrency > max_concurrency) {
+    cout << boost::format("   (limiting concurrency %1% to %2% by the open file limit)")
+      % concurrency % max_concurrency << endl;
+    return max_concurrency;
+  }
+  return concurrency;
+}
+
+}
+
+int main(int argc, char *argv[]) {
+  size_t transfers = 10000;
+  vector<size_t> levels;
+  if (argc > 1) { transfers = boost::lexical_cast<size_t>(argv[1]); }
+  for (int i = 2; i < argc; ++i) { levels.push_back(boost::lexical_cast<size_t>(argv[i])); }
+  if (levels.empty()) {
+    levels.push_back(1);
+    levels.push_back(64);
+    levels.push_back(1024);
+    levels.push_back(transfers);
+  }
+
+  cout << "== Benchmarking http::multiGet ==" << endl << endl;
+
+  stub_server server;
+  const string url = (boost::format("http://127.0.0.1:%1%/osm/18/0/0.png") % server.port()).str();
+  vector<string> urls(transfers, url);
+
+  for (size_t i = 0; i < levels.size(); ++i) {
+    const size_t concurrency = raise_fd_limit(levels[i]);
+    const double cold = run_batch(urls, concurrency);
+    const double warm = run_batch(urls, concurrency);
+    cout << boost::format("   %1% transfers, concurrency %2%: %3$.0f/s new connections, %4$.0f/s re-used")
+      % transfers % concurrency % cold % warm << endl;
+  }
+  cout << endl;
+
+  // the server thread never finishes, so don't wait for it.
+  _exit(0);
+}
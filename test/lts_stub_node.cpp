@@ -0,0 +1,551 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *  Author: kevin.kreiser@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "test/lts_stub_node.hpp"
+#include "storage/meta_tile.hpp"
+#include "tile_utils.hpp"
+
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+using std::string;
+using std::vector;
+using std::map;
+using rendermq::protoFmt;
+
+namespace test {
+
+namespace {
+
+struct stored_tile
+{
+   string data, mime;
+   time_t mtime;
+};
+
+struct request
+{
+   string method, path, query;
+   map<string, string> headers;
+   string body;
+
+   string header(const string &name) const
+   {
+      map<string, string>::const_iterator itr = headers.find(name);
+      return (itr == headers.end()) ? string() : itr->second;
+   }
+};
+
+string lower(string s)
+{
+   std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+   return s;
+}
+
+string format_date(time_t t)
+{
+   char buf[64];
+   struct tm tm;
+   gmtime_r(&t, &tm);
+   strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+   return buf;
+}
+
+bool parse_date(const string &s, time_t &t)
+{
+   struct tm tm;
+   memset(&tm, 0, sizeof(tm));
+   if (strptime(s.c_str(), "%a, %d %b %Y %H:%M:%S", &tm) == NULL)
+   {
+      return false;
+   }
+   t = timegm(&tm);
+   return true;
+}
+
+// the data and type of the "file" part of a multipart form.
+bool file_part(const request &req, string &data, string &mime)
+{
+   const string type = req.header("content-type");
+   const size_t b = type.find("boundary=");
+   if (b == string::npos)
+   {
+      return false;
+   }
+   const string boundary = "--" + type.substr(b + 9);
+
+   size_t start = req.body.find(boundary);
+   while (start != string::npos)
+   {
+      const size_t headers_end = req.body.find("\r\n\r\n", start);
+      if (headers_end == string::npos)
+      {
+         return false;
+      }
+      const size_t end = req.body.find("\r\n" + boundary, headers_end + 4);
+      if (end == string::npos)
+      {
+         return false;
+      }
+      const string headers = req.body.substr(start, headers_end - start);
+      if (headers.find("name=\"file\"") != string::npos)
+      {
+         const size_t ct = lower(headers).find("content-type: ");
+         if (ct != string::npos)
+         {
+            mime = headers.substr(ct + 14, headers.find("\r\n", ct) - ct - 14);
+         }
+         data = req.body.substr(headers_end + 4, end - headers_end - 4);
+         return true;
+      }
+      start = end + 2;
+   }
+   return false;
+}
+
+// splits a tile path, /<version>/<app><style>/<z>/<x>/<y>.<ext>, into the
+// prefix up to and including z, the x and y, and the extension.
+bool split_path(const string &path, string &prefix, int &x, int &y, string &ext)
+{
+   const size_t dot = path.rfind('.');
+   const size_t y_slash = path.rfind('/', dot);
+   if (dot == string::npos || y_slash == string::npos || y_slash == 0)
+   {
+      return false;
+   }
+   const size_t x_slash = path.rfind('/', y_slash - 1);
+   if (x_slash == string::npos)
+   {
+      return false;
+   }
+   prefix = path.substr(0, x_slash + 1);
+   x = atoi(path.substr(x_slash + 1, y_slash - x_slash - 1).c_str());
+   y = atoi(path.substr(y_slash + 1, dot - y_slash - 1).c_str());
+   ext = path.substr(dot + 1);
+   return true;
+}
+
+string tile_key(const string &replica, const string &prefix, int x, int y, protoFmt fmt)
+{
+   std::ostringstream key;
+   key << replica << " " << prefix << x << "/" << y << "." << rendermq::file_type_for(fmt);
+   return key.str();
+}
+
+} // anonymous namespace
+
+struct lts_stub_node::impl
+{
+   impl(bool bundles)
+      : m_bundles(bundles), m_port(0), m_listener(-1), m_requests(0), m_bundle_requests(0), m_delay(0)
+   {
+   }
+
+   void start()
+   {
+      m_listener = socket(AF_INET, SOCK_STREAM, 0);
+      int on = 1;
+      setsockopt(m_listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+      struct sockaddr_in addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      addr.sin_port = htons(m_port);
+      socklen_t len = sizeof(addr);
+      if (bind(m_listener, (struct sockaddr *)&addr, len) != 0 ||
+          listen(m_listener, 128) != 0 ||
+          getsockname(m_listener, (struct sockaddr *)&addr, &len) != 0)
+      {
+         close(m_listener);
+         m_listener = -1;
+         throw std::runtime_error("Unable to start the stub LTS node.");
+      }
+      m_port = ntohs(addr.sin_port);
+      m_acceptor = boost::thread(boost::bind(&impl::accept_loop, this));
+   }
+
+   void stop()
+   {
+      if (m_listener < 0)
+      {
+         return;
+      }
+      // shutting the sockets down wakes up the threads blocked on them.
+      shutdown(m_listener, SHUT_RDWR);
+      m_acceptor.join();
+      close(m_listener);
+      m_listener = -1;
+      {
+         boost::mutex::scoped_lock lock(m_mutex);
+         BOOST_FOREACH(int fd, m_connections)
+         {
+            shutdown(fd, SHUT_RDWR);
+         }
+      }
+      m_workers.join_all();
+   }
+
+   void accept_loop()
+   {
+      while (true)
+      {
+         int fd = accept(m_listener, NULL, NULL);
+         if (fd < 0)
+         {
+            return;
+         }
+         boost::mutex::scoped_lock lock(m_mutex);
+         m_connections.insert(fd);
+         m_workers.create_thread(boost::bind(&impl::serve, this, fd));
+      }
+   }
+
+   void serve(int fd)
+   {
+      string buffer;
+      request req;
+      while (read_request(fd, buffer, req))
+      {
+         const string reply = respond(req);
+         long delay;
+         {
+            boost::mutex::scoped_lock lock(m_mutex);
+            delay = m_delay;
+         }
+         if (delay > 0)
+         {
+            boost::this_thread::sleep(boost::posix_time::milliseconds(delay));
+         }
+         if (!write_all(fd, reply))
+         {
+            break;
+         }
+      }
+      boost::mutex::scoped_lock lock(m_mutex);
+      m_connections.erase(fd);
+      close(fd);
+   }
+
+   static bool write_all(int fd, const string &data)
+   {
+      size_t done = 0;
+      while (done < data.size())
+      {
+         ssize_t n = send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+         if (n <= 0)
+         {
+            return false;
+         }
+         done += n;
+      }
+      return true;
+   }
+
+   static bool fill(int fd, string &buffer)
+   {
+      char chunk[16384];
+      ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+      if (n <= 0)
+      {
+         return false;
+      }
+      buffer.append(chunk, n);
+      return true;
+   }
+
+   static bool read_request(int fd, string &buffer, request &req)
+   {
+      size_t end;
+      while ((end = buffer.find("\r\n\r\n")) == string::npos)
+      {
+         if (!fill(fd, buffer))
+         {
+            return false;
+         }
+      }
+
+      req = request();
+      std::istringstream head(buffer.substr(0, end));
+      string line, target, version;
+      std::getline(head, line);
+      std::istringstream(line) >> req.method >> target >> version;
+      const size_t q = target.find('?');
+      req.path = target.substr(0, q);
+      req.query = (q == string::npos) ? string() : target.substr(q + 1);
+      while (std::getline(head, line))
+      {
+         const size_t colon = line.find(':');
+         if (colon == string::npos)
+         {
+            continue;
+         }
+         string value = line.substr(colon + 1);
+         value.erase(0, value.find_first_not_of(' '));
+         value.erase(value.find_last_not_of("\r ") + 1);
+         req.headers[lower(line.substr(0, colon))] = value;
+      }
+      buffer.erase(0, end + 4);
+
+      if (lower(req.header("expect")) == "100-continue")
+      {
+         write_all(fd, "HTTP/1.1 100 Continue\r\n\r\n");
+      }
+      const size_t length = atol(req.header("content-length").c_str());
+      while (buffer.size() < length)
+      {
+         if (!fill(fd, buffer))
+         {
+            return false;
+         }
+      }
+      req.body = buffer.substr(0, length);
+      buffer.erase(0, length);
+      return true;
+   }
+
+   static string response(int status, const string &body, const string &mime = string(), time_t *mtime = NULL, bool head = false)
+   {
+      std::ostringstream out;
+      out << "HTTP/1.1 " << status << ((status == 200) ? " OK" : " Not Found") << "\r\n"
+          << "Content-Length: " << body.size() << "\r\n";
+      if (!mime.empty())
+      {
+         out << "Content-Type: " << mime << "\r\n";
+      }
+      if (mtime != NULL)
+      {
+         out << "Last-Modified: " << format_date(*mtime) << "\r\n";
+      }
+      out << "\r\n";
+      if (!head)
+      {
+         out << body;
+      }
+      return out.str();
+   }
+
+   string respond(const request &req)
+   {
+      const string replica = req.header("x-replica");
+      const bool bundle = req.path.size() > 5 && req.path.compare(req.path.size() - 5, 5, ".meta") == 0;
+
+      boost::mutex::scoped_lock lock(m_mutex);
+      ++m_requests;
+      if (bundle)
+      {
+         ++m_bundle_requests;
+         if (!m_bundles)
+         {
+            return response(404, string());
+         }
+         return (req.method == "POST") ? put_bundle(req, replica) : get_bundle(req, replica);
+      }
+
+      const string key = replica + " " + req.path;
+      if (req.method == "POST")
+      {
+         stored_tile tile;
+         if (!file_part(req, tile.data, tile.mime))
+         {
+            return response(404, string());
+         }
+         tile.mtime = time(NULL);
+         parse_date(req.header("last-modified"), tile.mtime);
+         m_tiles[key] = tile;
+         return response(200, string());
+      }
+
+      map<string, stored_tile>::iterator itr = m_tiles.find(key);
+      if (itr == m_tiles.end())
+      {
+         return response(404, string());
+      }
+      // a GET with a Last-Modified is how tiles are expired.
+      parse_date(req.header("last-modified"), itr->second.mtime);
+      return response(200, itr->second.data, itr->second.mime, &itr->second.mtime, req.method == "HEAD");
+   }
+
+   string get_bundle(const request &req, const string &replica)
+   {
+      string prefix, ext;
+      int x, y;
+      if (!split_path(req.path, prefix, x, y, ext) || req.query.compare(0, 8, "formats=") != 0)
+      {
+         return response(404, string());
+      }
+      const vector<protoFmt> formats = rendermq::get_formats_vec(protoFmt(atoi(req.query.substr(8).c_str())));
+
+      vector<int> sizes(formats.size() * METATILE * METATILE, 0);
+      string data;
+      time_t oldest = 0;
+      bool any = false;
+      for (size_t f = 0; f < formats.size(); ++f)
+      {
+         for (int i = 0; i < METATILE * METATILE; ++i)
+         {
+            map<string, stored_tile>::const_iterator itr =
+               m_tiles.find(tile_key(replica, prefix, x + i % METATILE, y + i / METATILE, formats[f]));
+            if (itr == m_tiles.end())
+            {
+               continue;
+            }
+            sizes[f * METATILE * METATILE + i] = itr->second.data.size();
+            data += itr->second.data;
+            if (!any || itr->second.mtime < oldest)
+            {
+               oldest = itr->second.mtime;
+            }
+            any = true;
+         }
+      }
+
+      const size_t z_slash = prefix.rfind('/', prefix.size() - 2);
+      const int z = atoi(prefix.substr(z_slash + 1).c_str());
+      const string body = rendermq::write_headers(x, y, z, formats, sizes) + data;
+      return response(200, body, "application/octet-stream", any ? &oldest : NULL);
+   }
+
+   string put_bundle(const request &req, const string &replica)
+   {
+      string prefix, ext, bundle, mime;
+      int x, y;
+      if (!split_path(req.path, prefix, x, y, ext) || !file_part(req, bundle, mime))
+      {
+         return response(404, string());
+      }
+      time_t mtime = time(NULL);
+      parse_date(req.header("last-modified"), mtime);
+
+      BOOST_FOREACH(const rendermq::meta_layout *layout, rendermq::read_headers(bundle, rendermq::fmtAll))
+      {
+         const protoFmt fmt = protoFmt(layout->fmt);
+         for (int i = 0; i < METATILE * METATILE; ++i)
+         {
+            const rendermq::entry &e = layout->index[i];
+            if (e.size <= 0 || size_t(e.offset) + size_t(e.size) > bundle.size())
+            {
+               continue;
+            }
+            stored_tile &tile = m_tiles[tile_key(replica, prefix, x + i % METATILE, y + i / METATILE, fmt)];
+            tile.data = bundle.substr(e.offset, e.size);
+            tile.mime = rendermq::mime_type_for(fmt);
+            tile.mtime = mtime;
+         }
+      }
+      return response(200, string());
+   }
+
+   const bool m_bundles;
+   int m_port, m_listener;
+   boost::thread m_acceptor;
+   boost::thread_group m_workers;
+
+   // protects everything below.
+   mutable boost::mutex m_mutex;
+   std::set<int> m_connections;
+   map<string, stored_tile> m_tiles;
+   size_t m_requests, m_bundle_requests;
+   long m_delay;
+};
+
+lts_stub_node::lts_stub_node(bool bundles)
+   : m_impl(new impl(bundles))
+{
+   m_impl->start();
+}
+
+lts_stub_node::~lts_stub_node()
+{
+   m_impl->stop();
+}
+
+int lts_stub_node::port() const
+{
+   return m_impl->m_port;
+}
+
+void lts_stub_node::stop()
+{
+   m_impl->stop();
+}
+
+void lts_stub_node::start()
+{
+   m_impl->start();
+}
+
+size_t lts_stub_node::requests() const
+{
+   boost::mutex::scoped_lock lock(m_impl->m_mutex);
+   return m_impl->m_requests;
+}
+
+size_t lts_stub_node::bundle_requests() const
+{
+   boost::mutex::scoped_lock lock(m_impl->m_mutex);
+   return m_impl->m_bundle_requests;
+}
+
+void lts_stub_node::reset_counts()
+{
+   boost::mutex::scoped_lock lock(m_impl->m_mutex);
+   m_impl->m_requests = 0;
+   m_impl->m_bundle_requests = 0;
+}
+
+size_t lts_stub_node::tiles() const
+{
+   boost::mutex::scoped_lock lock(m_impl->m_mutex);
+   return m_impl->m_tiles.size();
+}
+
+void lts_stub_node::set_delay(long delay)
+{
+   boost::mutex::scoped_lock lock(m_impl->m_mutex);
+   m_impl->m_delay = delay;
+}
+
+} // namespace test
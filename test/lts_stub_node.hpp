@@ -0,0 +1,80 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *  Author: kevin.kreiser@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef TEST_LTS_STUB_NODE_HPP
+#define TEST_LTS_STUB_NODE_HPP
+
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <string>
+
+namespace test {
+
+/* a storage node for the lts tests, serving HTTP/1.1 on an ephemeral
+ * port of 127.0.0.1 from a thread of its own. it understands per-tile
+ * GET, HEAD and multipart POST, with the X-Replica and Last-Modified
+ * headers, and optionally the metatile bundles described in
+ * storage/lts_storage.hpp. tiles are only kept in memory.
+ *
+ * the node can be stopped and started again on the same port, keeping
+ * its tiles, to test how clients cope with a host going away.
+ */
+class lts_stub_node
+   : private boost::noncopyable
+{
+public:
+   // starts serving straight away. nodes which don't support bundles
+   // answer 404 for them.
+   explicit lts_stub_node(bool bundles = true);
+   ~lts_stub_node();
+
+   int port() const;
+
+   // stop serving, dropping any open connections, and start again.
+   void stop();
+   void start();
+
+   // requests handled since the counts were last reset, and how many of
+   // those were for bundles.
+   size_t requests() const;
+   size_t bundle_requests() const;
+   void reset_counts();
+
+   // number of tiles stored, over all formats and replicas.
+   size_t tiles() const;
+
+   // wait this many milliseconds before answering each request, to look
+   // like a node which is having a bad time.
+   void set_delay(long delay);
+
+private:
+   struct impl;
+   boost::scoped_ptr<impl> m_impl;
+};
+
+} // namespace test
+
+#endif /* TEST_LTS_STUB_NODE_HPP */
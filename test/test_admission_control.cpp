@@ -0,0 +1,224 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "admission_control.hpp"
+#include "test/common.hpp"
+#include <stdexcept>
+#include <iostream>
+#include <limits>
+#include <boost/date_time/gregorian/gregorian_types.hpp>
+
+using rendermq::admission_control;
+using rendermq::queue_length_admission;
+using rendermq::latency_admission;
+using rendermq::tile_protocol;
+using std::runtime_error;
+using std::cout;
+using std::endl;
+using boost::posix_time::ptime;
+using boost::posix_time::milliseconds;
+
+using rendermq::cmdRender;
+using rendermq::fmtPNG;
+
+namespace {
+
+tile_protocol request(int x, int y, int z, const char *style = "osm") {
+  return tile_protocol(cmdRender, x, y, z, 1, style, fmtPNG);
+}
+
+// some fixed time for the tests to start at.
+ptime start() {
+  return ptime(boost::gregorian::date(2011, 1, 1));
+}
+
+// submit a render and have it come back after the given latency.
+void render(latency_admission &ac, const tile_protocol &tile, size_t queue_length,
+            ptime &now, long latency) {
+  ac.submitted(tile, queue_length, now);
+  now += milliseconds(latency);
+  ac.completed(tile, now);
+}
+
+}
+
+/* test that the queue length mode does what the fixed thresholds used
+ * to do.
+ */
+void test_queue_length() {
+  queue_length_admission ac(100, 500, 1000);
+  const tile_protocol t = request(0, 0, 10);
+  const ptime now = start();
+
+  if (ac.level(t, 99, now) != admission_control::load_normal) { throw runtime_error("Expected normal below stale threshold."); }
+  if (ac.level(t, 100, now) != admission_control::load_stale) { throw runtime_error("Expected stale at stale threshold."); }
+  if (ac.level(t, 500, now) != admission_control::load_satisfy) { throw runtime_error("Expected satisfy at satisfy threshold."); }
+  if (ac.level(t, 1000, now) != admission_control::load_shed) { throw runtime_error("Expected shed at max threshold."); }
+}
+
+/* test that latency is tracked separately for each style and zoom, and
+ * that the same queue length gives different decisions for cheap and
+ * expensive renders.
+ */
+void test_per_style_and_zoom() {
+  latency_admission ac(1000, 10000, 10000, 30000);
+  ptime now = start();
+
+  const tile_protocol cheap = request(0, 0, 5, "osm");
+  const tile_protocol costly = request(0, 0, 18, "hyb");
+
+  if (ac.level(cheap, 10, now) != admission_control::load_normal) {
+    throw runtime_error("Expected normal with no measurements.");
+  }
+
+  // both measured with 10 jobs in the queue.
+  render(ac, cheap, 10, now, 100);
+  render(ac, costly, 10, now, 5000);
+
+  if (ac.level(cheap, 10, now) != admission_control::load_normal) {
+    throw runtime_error("Expected cheap renders to be admitted.");
+  }
+  if (ac.level(costly, 10, now) != admission_control::load_stale) {
+    throw runtime_error("Expected costly renders to serve stale tiles.");
+  }
+
+  // when the queue has grown, the prediction grows with it.
+  if (ac.level(costly, 40, now) != admission_control::load_satisfy) {
+    throw runtime_error("Expected costly renders in a longer queue to go to the background.");
+  }
+  if (ac.level(costly, 100, now) != admission_control::load_shed) {
+    throw runtime_error("Expected costly renders in a much longer queue to be refused.");
+  }
+
+  // and a zoom level which hasn't been seen uses all the measurements.
+  if (ac.predicted_latency(request(0, 0, 12, "osm"), 10) <= 100.0) {
+    throw runtime_error("Expected unmeasured zoom to use the overall latency.");
+  }
+}
+
+/* test that a standing queue, where even the quickest render over an
+ * interval is over the target, turns on stale serving, and that it
+ * turns off again once renders are quick again.
+ */
+void test_standing_queue() {
+  latency_admission ac(1000, 10000, 60000, 120000);
+  ptime now = start();
+  const tile_protocol t = request(0, 0, 10);
+
+  // a whole interval of slow renders, measured with a long queue so
+  // the prediction for a short queue stays below the target.
+  for (int i = 0; i < 10; ++i) {
+    render(ac, request(i * 8, 0, 10), 100, now, 2000);
+  }
+  if (ac.level(t, 0, now) != admission_control::load_stale) {
+    throw runtime_error("Expected stale serving with a standing queue.");
+  }
+
+  // then an interval of quick ones.
+  for (int i = 0; i < 130; ++i) {
+    render(ac, request(i * 8, 8, 10), 0, now, 100);
+  }
+  if (ac.level(t, 0, now) != admission_control::load_normal) {
+    throw runtime_error("Expected normal once the standing queue has gone.");
+  }
+}
+
+/* test that renders which never come back count as overload.
+ */
+void test_lost_renders() {
+  latency_admission ac(1000, 1000, 5000, 10000);
+  ptime now = start();
+  const tile_protocol t = request(0, 0, 10);
+
+  render(ac, request(8, 0, 10), 0, now, 100);
+  ac.submitted(t, 0, now);
+  now += milliseconds(20000);
+
+  // asking for the level notices the lost render, and records it.
+  ac.level(t, 0, now);
+  if (ac.predicted_latency(t, 0) < 2000.0) {
+    throw runtime_error("Expected the lost render to push the latency up.");
+  }
+
+  // the queue length being unknown while settling means no renders.
+  if (ac.level(t, std::numeric_limits<size_t>::max(), now) != admission_control::load_shed) {
+    throw runtime_error("Expected shed while the queue is settling.");
+  }
+}
+
+/* test that once a spike has pushed the predicted latency high enough
+ * that nothing is rendered for clients, and so nothing is measured, the
+ * load comes back down again.
+ */
+void test_recovery_after_spike() {
+  latency_admission ac(1000, 1000, 5000, 10000);
+  ptime now = start();
+  const tile_protocol t = request(0, 0, 10);
+
+  for (int i = 0; i < 4; ++i) {
+    ac.submitted(request(i * 8, 0, 10), 0, now);
+  }
+  now += milliseconds(20000);
+  for (int i = 0; i < 4; ++i) {
+    ac.completed(request(i * 8, 0, 10), now);
+  }
+  if (ac.level(t, 0, now) != admission_control::load_shed) {
+    throw runtime_error("Expected shed after a spike.");
+  }
+
+  // nothing is rendered while shedding, but the level drops anyway.
+  admission_control::load level = admission_control::load_shed;
+  for (int i = 0; (i < 20) && (level >= admission_control::load_satisfy); ++i) {
+    now += milliseconds(500);
+    level = ac.level(t, 0, now);
+  }
+  if (level >= admission_control::load_satisfy) {
+    throw runtime_error("Expected renders to be let through again without any measurements.");
+  }
+
+  // and once they're measured as quick again, it's back to normal.
+  for (int i = 0; i < 20; ++i) {
+    render(ac, request(i * 8, 8, 10), 0, now, 100);
+  }
+  if (ac.level(t, 0, now) != admission_control::load_normal) {
+    throw runtime_error("Expected normal once renders are quick again.");
+  }
+}
+
+int main() {
+  int tests_failed = 0;
+
+  cout << "== Testing Admission Control ==" << endl << endl;
+
+  tests_failed += test::run("test_queue_length", &test_queue_length);
+  tests_failed += test::run("test_per_style_and_zoom", &test_per_style_and_zoom);
+  tests_failed += test::run("test_standing_queue", &test_standing_queue);
+  tests_failed += test::run("test_lost_renders", &test_lost_renders);
+  tests_failed += test::run("test_recovery_after_spike", &test_recovery_after_spike);
+
+  cout << " >> Tests failed: " << tests_failed << endl << endl;
+
+  return 0;
+}
@@ -0,0 +1,345 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "test/common.hpp"
+#include "test/fake_tile.hpp"
+#include "storage/tile_storage.hpp"
+#include "storage/tile_archive.hpp"
+#include "storage/meta_tile.hpp"
+#include <stdexcept>
+#include <iostream>
+#include <fstream>
+#include <set>
+#include <cstdlib>
+#include <boost/format.hpp>
+#define BOOST_FILESYSTEM_VERSION 3
+#include <boost/filesystem.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+using boost::shared_ptr;
+using boost::scoped_ptr;
+using std::runtime_error;
+using std::cout;
+using std::endl;
+using std::string;
+
+using rendermq::cmdStatus;
+using rendermq::fmtPNG;
+using rendermq::fmtJPEG;
+using rendermq::tile_protocol;
+using rendermq::tile_storage;
+using rendermq::tile_archive;
+using rendermq::tile_archive_writer;
+
+namespace fs = boost::filesystem;
+
+namespace 
+{
+/* utility class to create a directory and clean up using
+ * the RAII idiom.
+ */
+class tmp_dir
+{
+public:
+   tmp_dir()
+   {
+      m_dir = fs::path("/tmp") / fs::unique_path();
+      if (!fs::create_directories(m_dir))
+      {
+         throw runtime_error("Cannot create temporary directory for archive tests.");
+      }
+   }
+
+   ~tmp_dir()
+   {
+      fs::remove_all(m_dir);
+   }
+
+   const fs::path &dir() const
+   {
+      return m_dir;
+   }
+
+private:
+   fs::path m_dir;
+};
+
+// add a fake metatile made for the given metatile coordinates to the
+// archive at the given location.
+void add_fake(tile_archive_writer &writer, int x, int y, int z, std::time_t mtime,
+              int fake_x, int fake_y)
+{
+   fake_tile meta(fake_x, fake_y, z, fmtPNG);
+   writer.add(z, x, y, mtime, string(meta.ptr, meta.total_size));
+}
+
+// the data of a tile from a fake metatile.
+string fake_data(int x, int y, int z)
+{
+   return (boost::format("%03d|%06d|%06d") % z % x % y).str().substr(0, 16);
+}
+
+tile_protocol tile_at(int x, int y, int z, rendermq::protoFmt fmt = fmtPNG)
+{
+   return tile_protocol(cmdStatus, x, y, z, 0, "default", fmt);
+}
+
+// build an archive with a few metatiles in it, added out of order,
+// with one replaced and one expired.
+string build_archive(const tmp_dir &tmp)
+{
+   const string file = (tmp.dir() / "default.rma").native();
+   tile_archive_writer writer(file, "default");
+   add_fake(writer, 8, 16, 10, 1000, 0, 0);
+   add_fake(writer, 0, 0, 3, 1000, 0, 0);
+   add_fake(writer, 0, 0, 10, 2000, 0, 0);
+   add_fake(writer, 8, 16, 10, 3000, 8, 16);
+   add_fake(writer, 24, 8, 5, 0, 24, 8);
+   writer.finish();
+   if (writer.count() != 4)
+   {
+      throw runtime_error((boost::format("Expected 4 metatiles in the archive, got %1%.") % writer.count()).str());
+   }
+   return file;
+}
+
+shared_ptr<tile_storage> archive_storage(const string &file, bool use_mmap)
+{
+   boost::property_tree::ptree conf;
+   conf.put("type", "archive");
+   conf.put("files", file);
+   conf.put("mmap", use_mmap);
+   shared_ptr<tile_storage> storage(rendermq::get_tile_storage(conf));
+   if (!storage)
+   {
+      throw runtime_error("Unable to create archive storage.");
+   }
+   return storage;
+}
+
+void check_reads(const tile_storage &storage)
+{
+   // every tile of the metatiles which are there.
+   for (int i = 0; i < METATILE * METATILE; ++i)
+   {
+      const int dx = i % METATILE, dy = i / METATILE;
+      string data;
+      shared_ptr<tile_storage::handle> h = storage.get(tile_at(dx, dy, 10));
+      if (!h->exists() || !h->data(data) || (data != fake_data(dx, dy, 10)) ||
+          (h->last_modified() != 2000) || h->expired())
+      {
+         throw runtime_error((boost::format("Bad tile %1%/%2%/10 from archive.") % dx % dy).str());
+      }
+      // the later add of the same metatile replaced the earlier one.
+      h = storage.get(tile_at(8 + dx, 16 + dy, 10));
+      if (!h->exists() || !h->data(data) || (data != fake_data(8 + dx, 16 + dy, 10)) ||
+          (h->last_modified() != 3000))
+      {
+         throw runtime_error((boost::format("Bad tile %1%/%2%/10 from archive.") % (8 + dx) % (16 + dy)).str());
+      }
+   }
+
+   // low zooms have fewer tiles than the metatile, but are still there.
+   string data;
+   if (!storage.get(tile_at(1, 1, 3))->data(data) || (data != fake_data(1, 1, 3)))
+   {
+      throw runtime_error("Bad tile 1/1/3 from archive.");
+   }
+
+   // probing finds the same tiles without reading them.
+   shared_ptr<tile_storage::handle> h = storage.probe(tile_at(9, 17, 10));
+   if (!h->exists() || (h->last_modified() != 3000) || h->expired())
+   {
+      throw runtime_error("Bad probe of 9/17/10 from archive.");
+   }
+
+   // metatiles which aren't there, in a style or format which isn't
+   // there, or at a zoom which isn't there.
+   if (storage.get(tile_at(16, 16, 10))->exists() ||
+       storage.probe(tile_at(16, 16, 10))->exists() ||
+       storage.get(tile_at(0, 0, 10, fmtJPEG))->exists() ||
+       storage.get(tile_at(0, 0, 11))->exists() ||
+       storage.get(tile_protocol(cmdStatus, 0, 0, 10, 0, "other", fmtPNG))->exists())
+   {
+      throw runtime_error("Got a tile which isn't in the archive.");
+   }
+
+   // the expired metatile is there, but expired, and isn't returned
+   // whole, as with disk storage.
+   h = storage.get(tile_at(25, 9, 5));
+   if (!h->exists() || !h->expired() || !h->data(data) || (data != fake_data(25, 9, 5)))
+   {
+      throw runtime_error("Expected expired tile 25/9/5 from archive.");
+   }
+   if (storage.get_meta(tile_at(25, 9, 5), data))
+   {
+      throw runtime_error("Expected expired metatile not to be returned.");
+   }
+
+   // whole metatiles come back as they were added.
+   fake_tile meta(8, 16, 10, fmtPNG);
+   if (!storage.get_meta(tile_at(12, 20, 10), data) || (data != string(meta.ptr, meta.total_size)))
+   {
+      throw runtime_error("Bad metatile 8/16/10 from archive.");
+   }
+
+   // archives are read-only.
+   if (storage.put_meta(tile_at(16, 16, 10), data) || storage.expire(tile_at(0, 0, 10)))
+   {
+      throw runtime_error("Expected archive storage to be read-only.");
+   }
+}
+
+} // anonymous namespace
+
+void test_archive_mmap()
+{
+   tmp_dir tmp;
+   shared_ptr<tile_storage> storage = archive_storage(build_archive(tmp), true);
+   check_reads(*storage);
+
+   // tiles are views of the mapping, which outlive the storage.
+   rendermq::tile_data a, b;
+   if (!storage->get(tile_at(1, 2, 10))->payload(a) || !storage->get(tile_at(9, 17, 10))->payload(b) ||
+       (a.owner() != b.owner()))
+   {
+      throw runtime_error("Expected tiles to be views of the mapped archive.");
+   }
+   storage.reset();
+   if ((a.str() != fake_data(1, 2, 10)) || (b.str() != fake_data(9, 17, 10)))
+   {
+      throw runtime_error("Expected views to stay valid after the storage has gone.");
+   }
+}
+
+void test_archive_pread()
+{
+   tmp_dir tmp;
+   check_reads(*archive_storage(build_archive(tmp), false));
+}
+
+/* test that files which aren't archives, or are truncated, are
+ * refused rather than served.
+ */
+void test_archive_bad_file()
+{
+   tmp_dir tmp;
+   const string file = build_archive(tmp);
+   const string bad = (tmp.dir() / "bad.rma").native();
+
+   {
+      std::ofstream out(bad.c_str());
+      out << "this is not an archive, but is longer than the header of one. "
+          << "this is not an archive, but is longer than the header of one.";
+   }
+   bool thrown = false;
+   try { tile_archive archive(bad, true); } catch (const runtime_error &) { thrown = true; }
+   if (!thrown)
+   {
+      throw runtime_error("Expected a file which isn't an archive to be refused.");
+   }
+
+   fs::copy_file(file, bad, fs::copy_option::overwrite_if_exists);
+   fs::resize_file(bad, fs::file_size(bad) - 8);
+   thrown = false;
+   try { tile_archive archive(bad, false); } catch (const runtime_error &) { thrown = true; }
+   if (!thrown)
+   {
+      throw runtime_error("Expected a truncated archive to be refused.");
+   }
+
+   boost::property_tree::ptree conf;
+   conf.put("type", "archive");
+   conf.put("files", bad);
+   scoped_ptr<tile_storage> storage(rendermq::get_tile_storage(conf));
+   if (storage)
+   {
+      throw runtime_error("Expected no storage from a bad archive.");
+   }
+}
+
+/* test that the index is in Hilbert order, so that metatiles next to
+ * each other on the map are next to each other in the archive.
+ */
+void test_archive_hilbert_order()
+{
+   const int z = 7, n = (1 << z) / METATILE;
+   std::map<uint64_t, std::pair<int, int> > order;
+   for (int x = 0; x < n; ++x)
+   {
+      for (int y = 0; y < n; ++y)
+      {
+         // any tile in the metatile gives the same key.
+         const uint64_t key = rendermq::archive_key(z, x * METATILE + 3, y * METATILE + 5);
+         if (key != rendermq::archive_key(z, x * METATILE, y * METATILE))
+         {
+            throw runtime_error("Expected tiles in a metatile to have the same key.");
+         }
+         order[key] = std::make_pair(x, y);
+      }
+   }
+
+   if ((order.size() != size_t(n * n)) ||
+       (order.begin()->first != (uint64_t(z) << 56)) ||
+       (order.rbegin()->first != (uint64_t(z) << 56) + n * n - 1))
+   {
+      throw runtime_error("Expected the keys to number the metatiles of the zoom.");
+   }
+
+   std::map<uint64_t, std::pair<int, int> >::const_iterator prev = order.begin(), itr = prev;
+   for (++itr; itr != order.end(); prev = itr++)
+   {
+      if (std::abs(itr->second.first - prev->second.first) +
+          std::abs(itr->second.second - prev->second.second) != 1)
+      {
+         throw runtime_error((boost::format("Metatiles %1%,%2% and %3%,%4% are next to each other in the "
+                                            "index, but not on the map.") % prev->second.first
+                              % prev->second.second % itr->second.first % itr->second.second).str());
+      }
+   }
+
+   // and lower zooms sort before higher ones.
+   if (rendermq::archive_key(z, (1 << z) - 1, (1 << z) - 1) >= rendermq::archive_key(z + 1, 0, 0))
+   {
+      throw runtime_error("Expected lower zooms to sort first.");
+   }
+}
+
+int main() 
+{
+   int tests_failed = 0;
+   
+   cout << "== Testing Archive Storage Functions ==" << endl << endl;
+
+   tests_failed += test::run("test_archive_mmap", &test_archive_mmap);
+   tests_failed += test::run("test_archive_pread", &test_archive_pread);
+   tests_failed += test::run("test_archive_bad_file", &test_archive_bad_file);
+   tests_failed += test::run("test_archive_hilbert_order", &test_archive_hilbert_order);
+
+   cout << " >> Tests failed: " << tests_failed << endl << endl;
+
+   return 0;
+}
@@ -0,0 +1,158 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+
+#include "http/connection_pool.hpp"
+#include "test/common.hpp"
+#include <stdexcept>
+#include <iostream>
+#include <boost/thread/thread.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+using http::connection_pool;
+using http::curl_ptr;
+using std::runtime_error;
+using std::string;
+using std::cout;
+using std::endl;
+
+/* test that a handle which goes back into the pool comes out again for
+ * another request to the same host.
+ */
+void test_reuse_same_host() {
+  connection_pool pool;
+  CURL *first = NULL;
+  {
+    curl_ptr conn = pool.acquire("http://tiles.example.com:8080/osm/1/0/0.png");
+    first = conn.get();
+    if (pool.idle() != 0) { throw runtime_error("Expected no idle handles while one is in use."); }
+  }
+  if (pool.idle("http://tiles.example.com:8080/") != 1) {
+    throw runtime_error("Expected the handle to be back in the pool.");
+  }
+
+  curl_ptr conn = pool.acquire("http://tiles.example.com:8080/osm/1/1/0.png");
+  if (conn.get() != first) {
+    throw runtime_error("Expected the same handle for the same host.");
+  }
+}
+
+/* test that handles for different hosts, or different ports on the same
+ * host, are kept apart.
+ */
+void test_hosts_separate() {
+  connection_pool pool;
+  CURL *first = NULL;
+  {
+    curl_ptr conn = pool.acquire("http://tiles.example.com:8080/osm/1/0/0.png");
+    first = conn.get();
+  }
+
+  curl_ptr other_port = pool.acquire("http://tiles.example.com:8081/osm/1/0/0.png");
+  curl_ptr other_host = pool.acquire("http://other.example.com:8080/osm/1/0/0.png");
+  if ((other_port.get() == first) || (other_host.get() == first)) {
+    throw runtime_error("Expected a new handle for a different host.");
+  }
+  if (pool.idle() != 1) {
+    throw runtime_error("Expected the first host's handle to still be idle.");
+  }
+}
+
+/* test that only the configured number of idle handles are kept for
+ * each host.
+ */
+void test_per_host_limit() {
+  connection_pool pool(2);
+  {
+    curl_ptr a = pool.acquire("http://tiles.example.com/a");
+    curl_ptr b = pool.acquire("http://tiles.example.com/b");
+    curl_ptr c = pool.acquire("http://tiles.example.com/c");
+    curl_ptr d = pool.acquire("http://other.example.com/d");
+  }
+  if (pool.idle("http://tiles.example.com/") != 2) {
+    throw runtime_error("Expected idle handles to be limited per host.");
+  }
+  if (pool.idle() != 3) {
+    throw runtime_error("Expected the other host's handle to be kept too.");
+  }
+}
+
+/* test that handles which have been idle too long are closed.
+ */
+void test_idle_timeout() {
+  connection_pool pool(4, 50);
+  {
+    curl_ptr conn = pool.acquire("http://tiles.example.com/a");
+  }
+  if (pool.idle() != 1) { throw runtime_error("Expected an idle handle."); }
+
+  boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+  pool.prune();
+  if (pool.idle() != 0) {
+    throw runtime_error("Expected the idle handle to have timed out.");
+  }
+}
+
+/* test that a handle can be released after the pool has gone.
+ */
+void test_outlives_pool() {
+  curl_ptr conn;
+  {
+    connection_pool pool;
+    conn = pool.acquire("http://tiles.example.com/a");
+  }
+  conn.reset();
+}
+
+/* test that the host part of URLs is picked out correctly.
+ */
+void test_host_key() {
+  if (connection_pool::host_key("http://a.example.com:80/x/y?z") != "http://a.example.com:80") {
+    throw runtime_error("Expected path to be stripped from the host key.");
+  }
+  if (connection_pool::host_key("https://a.example.com?x=/y") != "https://a.example.com") {
+    throw runtime_error("Expected query to be stripped from the host key.");
+  }
+  if (connection_pool::host_key("a.example.com") != "a.example.com") {
+    throw runtime_error("Expected a bare host name to be the host key.");
+  }
+}
+
+int main() {
+  int tests_failed = 0;
+
+  cout << "== Testing Connection Pool ==" << endl << endl;
+
+  tests_failed += test::run("test_reuse_same_host", &test_reuse_same_host);
+  tests_failed += test::run("test_hosts_separate", &test_hosts_separate);
+  tests_failed += test::run("test_per_host_limit", &test_per_host_limit);
+  tests_failed += test::run("test_idle_timeout", &test_idle_timeout);
+  tests_failed += test::run("test_outlives_pool", &test_outlives_pool);
+  tests_failed += test::run("test_host_key", &test_host_key);
+
+  cout << " >> Tests failed: " << tests_failed << endl << endl;
+
+  return 0;
+}
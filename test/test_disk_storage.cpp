@@ -27,6 +27,7 @@
 #include "test/fake_tile.hpp"
 #include "storage/tile_storage.hpp"
 #include "storage/disk_storage.hpp"
+#include "storage/meta_tile.hpp"
 #include <stdexcept>
 #include <iostream>
 #include <cstdio>
@@ -35,6 +36,8 @@
 #define BOOST_FILESYSTEM_VERSION 3
 #include <boost/filesystem.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/bind.hpp>
+#include <poll.h>
 
 using boost::function;
 using boost::optional;
@@ -90,6 +93,85 @@ private:
    fs::path m_dir;
 };
 
+// save a fake metatile made for the given metatile coordinates over
+// the metatile which the tile is in.
+void put_fake(const disk_storage &storage, const tile_protocol &tile, int x, int y)
+{
+   fake_tile meta(x, y, tile.z, tile.format);
+   if (!storage.put_meta(tile, string(meta.ptr, meta.total_size)))
+   {
+      throw runtime_error("Can't save meta tile!");
+   }
+}
+
+// the data of a tile from a fake metatile.
+string fake_data(int x, int y, int z)
+{
+   return (boost::format("%03d|%06d|%06d") % z % x % y).str().substr(0, 16);
+}
+
+void store_handle(shared_ptr<tile_storage::handle> *result, shared_ptr<tile_storage::handle> handle)
+{
+   *result = handle;
+}
+
+void store_meta(int *result, string *data, bool ok, const string &buf)
+{
+   *result = ok ? 1 : 0;
+   *data = buf;
+}
+
+// drive the storage's asynchronous calls until done is set.
+template <typename T>
+void wait_for(const disk_storage &storage, const T &done)
+{
+   std::vector<int> fds;
+   storage.async_fds(fds);
+   std::vector<pollfd> pfds(fds.size());
+   for (size_t i = 0; i < fds.size(); ++i)
+   {
+      pfds[i].fd = fds[i];
+      pfds[i].events = POLLIN;
+   }
+   while (!done())
+   {
+      if (poll(&pfds[0], pfds.size(), 5000) <= 0)
+      {
+         throw runtime_error("Timed out waiting for asynchronous reads.");
+      }
+      storage.async_perform();
+   }
+}
+
+struct handles_done
+{
+   const std::vector<shared_ptr<tile_storage::handle> > &handles;
+   bool operator()() const
+   {
+      for (size_t i = 0; i < handles.size(); ++i)
+      {
+         if (!handles[i]) { return false; }
+      }
+      return true;
+   }
+};
+
+struct meta_done
+{
+   const int &result;
+   bool operator()() const { return result >= 0; }
+};
+
+string get_data(const disk_storage &storage, const tile_protocol &tile)
+{
+   string data;
+   if (!storage.get(tile)->data(data))
+   {
+      throw runtime_error((boost::format("Can't get data for %1%.") % tile).str());
+   }
+   return data;
+}
+
 } // anonymous namespace
 
 void test_disk_round_trip_empty() 
@@ -194,6 +276,610 @@ void test_disk_round_trip_multiformat()
    }
 }
 
+/* test that probing gives the same metadata as a full get, without
+ * any data, and sees the tile being expired.
+ */
+void test_disk_probe() 
+{
+   tmp_dir tmp;
+   disk_storage storage(tmp.dir().native());
+   tile_protocol tile(cmdRender, 1024, 1024, 12, 0, "osm", fmtPNG, 0, 0);
+   fake_tile meta(tile.x, tile.y, tile.z, tile.format);
+   string data(meta.ptr, meta.total_size), data2;
+
+   if (storage.probe(tile)->exists()) 
+   {
+      throw runtime_error("Tile shouldn't exist before it's saved!");
+   }
+
+   if (!storage.put_meta(tile, data)) 
+   {
+      throw runtime_error("Can't save meta tile!");
+   }
+
+   tile.x = 1027;
+   tile.y = 1029;
+   shared_ptr<tile_storage::handle> probe = storage.probe(tile);
+   std::time_t get_last_modified = storage.get(tile)->last_modified();
+   if (!probe->exists()) 
+   {
+      throw runtime_error("Probed tile should exist!");
+   }
+   if (probe->expired())
+   {
+      throw runtime_error("Probed tile should not be expired already!");
+   }
+   if (probe->last_modified() != get_last_modified)
+   {
+      throw runtime_error("Probe and get disagree on last modified time!");
+   }
+   if (probe->data(data2) || !data2.empty())
+   {
+      throw runtime_error("Probe should not return any data!");
+   }
+
+   tile.format = fmtJPEG;
+   if (storage.probe(tile)->exists()) 
+   {
+      throw runtime_error("JPEG tile shouldn't exist in a PNG-only metatile!");
+   }
+
+   tile.format = fmtPNG;
+   if (!storage.expire(tile))
+   {
+      throw runtime_error("Can't expire meta tile!");
+   }
+   if (!storage.probe(tile)->expired())
+   {
+      throw runtime_error("Probed tile should be expired!");
+   }
+
+   // a status query is answered from a probe, which has no data, and
+   // an expired tile has no modification time, so the only thing which
+   // tells it apart from a missing tile is being marked dirty.
+   tile_protocol status(tile);
+   status.status = rendermq::cmdStatus;
+   rendermq::tile_from_handle(status, *storage.probe(status));
+   if ((status.status != rendermq::cmdStatus) || !status.dirty)
+   {
+      throw runtime_error("Status of an expired tile should say it's dirty!");
+   }
+   status.x = 0;
+   rendermq::tile_from_handle(status, *storage.probe(status));
+   if (status.dirty || (status.last_modified != 0))
+   {
+      throw runtime_error("Status of a missing tile shouldn't say it's dirty!");
+   }
+}
+
+/* test that a batch gets the same tiles as getting them one at a
+ * time, in the order they were asked for, including when the batch is
+ * big enough to be split between threads.
+ */
+void test_disk_get_multi() 
+{
+   tmp_dir tmp;
+   disk_storage storage(tmp.dir().native());
+   tile_protocol tile(cmdRender, 1024, 1024, 12, 0, "osm", fmtPNG, 0, 0);
+   {
+      fake_tile meta(tile.x, tile.y, tile.z, tile.format);
+      if (!storage.put_meta(tile, string(meta.ptr, meta.total_size))) 
+      {
+         throw runtime_error("Can't save meta tile!");
+      }
+   }
+   tile.x = 2048;
+   {
+      fake_tile meta(tile.x, tile.y, tile.z, tile.format);
+      if (!storage.put_meta(tile, string(meta.ptr, meta.total_size))) 
+      {
+         throw runtime_error("Can't save meta tile!");
+      }
+   }
+
+   // interleave the tiles from both metatiles, with some from a
+   // metatile which doesn't exist and some in the wrong format.
+   std::vector<tile_protocol> tiles;
+   for (int i = 0; i < 3; ++i) {
+      for (int dx = 0; dx < 8; ++dx) {
+         for (int dy = 0; dy < 8; ++dy) {
+            tiles.push_back(tile_protocol(cmdRender, 2048 + dx, 1024 + dy, 12, 0, "osm", fmtPNG, 0, 0));
+            tiles.push_back(tile_protocol(cmdRender, 1024 + dx, 1024 + dy, 12, 0, "osm", fmtPNG, 0, 0));
+         }
+      }
+   }
+   tiles.push_back(tile_protocol(cmdRender, 512, 512, 12, 0, "osm", fmtPNG, 0, 0));
+   tiles.push_back(tile_protocol(cmdRender, 1024, 1024, 12, 0, "osm", fmtJPEG, 0, 0));
+
+   std::vector<shared_ptr<tile_storage::handle> > handles, probes;
+   storage.get_multi(tiles, handles);
+   storage.probe_multi(tiles, probes);
+   if (handles.size() != tiles.size() || probes.size() != tiles.size())
+   {
+      throw runtime_error("Batch should give a handle for each tile!");
+   }
+
+   for (size_t i = 0; i < tiles.size(); ++i) {
+      shared_ptr<tile_storage::handle> single = storage.get(tiles[i]);
+      if (handles[i]->exists() != single->exists() || probes[i]->exists() != single->exists())
+      {
+         throw runtime_error((boost::format("Batch and single get disagree on whether %1% exists.") % tiles[i]).str());
+      }
+      if (!single->exists())
+      {
+         continue;
+      }
+
+      string batch_data, single_data;
+      if (!handles[i]->data(batch_data) || !single->data(single_data) || batch_data != single_data)
+      {
+         throw runtime_error((boost::format("Batch and single get disagree on the data for %1%.") % tiles[i]).str());
+      }
+      if (handles[i]->last_modified() != single->last_modified() ||
+          probes[i]->last_modified() != single->last_modified())
+      {
+         throw runtime_error((boost::format("Batch and single get disagree on last modified for %1%.") % tiles[i]).str());
+      }
+   }
+   if (handles[tiles.size() - 2]->exists() || handles[tiles.size() - 1]->exists())
+   {
+      throw runtime_error("Tiles which weren't saved shouldn't exist!");
+   }
+
+   // expiring the batch expires each metatile.
+   std::vector<tile_protocol> expiries;
+   expiries.push_back(tiles[0]);
+   expiries.push_back(tiles[1]);
+   expiries.push_back(tiles[2]);
+   expiries.push_back(tiles[tiles.size() - 2]);
+   std::vector<bool> results;
+   storage.expire_multi(expiries, results);
+   if (results.size() != 4 || !results[0] || !results[1] || !results[2] || results[3])
+   {
+      throw runtime_error("Expiring the batch should expire only the metatiles which exist!");
+   }
+   storage.probe_multi(tiles, probes);
+   if (!probes[0]->expired() || !probes[1]->expired())
+   {
+      throw runtime_error("Probed tiles should be expired!");
+   }
+}
+
+/* test that metatiles kept open between reads notice being replaced
+ * or expired by another storage, and that limiting how many are kept
+ * open doesn't change what is read.
+ */
+void test_disk_open_files() 
+{
+   tmp_dir tmp;
+   disk_storage reader(tmp.dir().native(), 2, 0);
+   disk_storage writer(tmp.dir().native());
+   tile_protocol tile(cmdRender, 1024, 1024, 12, 0, "osm", fmtPNG, 0, 0);
+
+   put_fake(writer, tile, 1024, 1024);
+   if (get_data(reader, tile) != fake_data(1024, 1024, 12))
+   {
+      throw runtime_error("Wrong data for tile.");
+   }
+
+   put_fake(writer, tile, 2048, 1024);
+   if (get_data(reader, tile) != fake_data(2048, 1024, 12))
+   {
+      throw runtime_error("Replaced metatile should be read after it's replaced.");
+   }
+
+   if (!writer.expire(tile) || !reader.probe(tile)->expired())
+   {
+      throw runtime_error("Metatile expired by another storage should be expired.");
+   }
+
+   // more metatiles than are kept open, read twice round.
+   for (int i = 0; i < 5; ++i)
+   {
+      tile.x = 8 * i;
+      put_fake(writer, tile, tile.x, tile.y);
+   }
+   for (int n = 0; n < 2; ++n)
+   {
+      for (int i = 0; i < 5; ++i)
+      {
+         tile.x = 8 * i + 3;
+         if (get_data(reader, tile) != fake_data(tile.x, tile.y, 12))
+         {
+            throw runtime_error((boost::format("Wrong data for %1%.") % tile).str());
+         }
+      }
+   }
+
+   // and the storage's own changes are seen even when it never checks.
+   disk_storage trusting(tmp.dir().native(), 2, -1);
+   tile.x = 0;
+   if (trusting.probe(tile)->expired() || !trusting.expire(tile) || !trusting.probe(tile)->expired())
+   {
+      throw runtime_error("Storage should see its own expiry.");
+   }
+   put_fake(trusting, tile, 2048, 1024);
+   if (get_data(trusting, tile) != fake_data(2048, 1024, 12))
+   {
+      throw runtime_error("Storage should see its own metatile being replaced.");
+   }
+}
+
+/* test that tiles can be taken from the mapped metatiles without a
+ * copy, that several handles can be used at once, and that the views
+ * stay valid after the metatile has been replaced or closed.
+ */
+void test_disk_mmap()
+{
+   tmp_dir tmp;
+   for (int n = 0; n < 2; ++n)
+   {
+      const bool use_mmap = (n == 0);
+      disk_storage storage(tmp.dir().native(), 1, 0, "none", 1, 1, use_mmap);
+      tile_protocol tile(cmdRender, 1024, 1024, 12, 0, "osm", fmtPNG, 0, 0);
+      put_fake(storage, tile, 1024, 1024);
+
+      shared_ptr<tile_storage::handle> a = storage.get(tile);
+      tile.x = 1025;
+      shared_ptr<tile_storage::handle> b = storage.get(tile);
+
+      rendermq::tile_data va, vb;
+      string data;
+      if (!a->payload(va) || !b->payload(vb) || (va.str() != fake_data(1024, 1024, 12)) ||
+          (vb.str() != fake_data(1025, 1024, 12)) || !b->data(data) || (data != vb.str()))
+      {
+         throw runtime_error("Wrong data for tiles read at the same time.");
+      }
+
+      // tiles from the same mapping share it, read tiles each have
+      // their own buffer.
+      if ((va.owner() == vb.owner()) != use_mmap)
+      {
+         throw runtime_error((boost::format("Expected tiles %1% share a buffer.")
+                              % (use_mmap ? "to" : "not to")).str());
+      }
+
+      // replace the metatile and close it by reading another one, then
+      // the old views are still there.
+      tile.x = 1024;
+      put_fake(storage, tile, 2048, 1024);
+      tile.x = 0;
+      put_fake(storage, tile, 0, 1024);
+      get_data(storage, tile);
+      a.reset();
+      b.reset();
+      if (va.str() != fake_data(1024, 1024, 12))
+      {
+         throw runtime_error("View of a replaced metatile should still be valid.");
+      }
+      tile.x = 1025;
+      if (get_data(storage, tile) != fake_data(2049, 1024, 12))
+      {
+         throw runtime_error("Replaced metatile should be read after it's replaced.");
+      }
+
+      // and the whole metatile is the same either way.
+      fake_tile meta(2048, 1024, 12, fmtPNG);
+      if (!storage.get_meta(tile, data) || (data != string(meta.ptr, meta.total_size)))
+      {
+         throw runtime_error("Wrong data for whole metatile.");
+      }
+   }
+}
+
+/* test that metatiles put through the background writer can be read
+ * straight away, from the queue or from disk, that expiring and
+ * replacing them while they're queued works, and that they're all on
+ * disk once the storage has gone.
+ */
+void test_disk_write_behind()
+{
+   const char *modes[] = { "none", "fsync", "syncfs" };
+   for (int n = 0; n < 3; ++n)
+   {
+      tmp_dir tmp;
+      {
+         disk_storage storage(tmp.dir().native(), 4, 0, "none", 1, 1, true,
+                              shared_ptr<rendermq::meta_writer>(new rendermq::meta_writer(2, 4, modes[n], 2)));
+         tile_protocol tile(cmdRender, 0, 0, 12, 0, "osm", fmtPNG, 0, 0);
+         for (int i = 0; i < 16; ++i)
+         {
+            tile.x = 8 * i;
+            put_fake(storage, tile, tile.x, tile.y);
+            if (get_data(storage, tile) != fake_data(tile.x, tile.y, 12))
+            {
+               throw runtime_error((boost::format("Wrong data for %1% just after putting it with sync %2%.")
+                                    % tile % modes[n]).str());
+            }
+         }
+
+         // replaced and expired straight after being put.
+         tile.x = 0;
+         put_fake(storage, tile, 2048, 1024);
+         tile.x = 8;
+         put_fake(storage, tile, 8, 0);
+         if (!storage.expire(tile) || !storage.probe(tile)->expired())
+         {
+            throw runtime_error("Expected metatile expired while queued to be expired.");
+         }
+         tile.x = 0;
+         if (get_data(storage, tile) != fake_data(2048, 1024, 12))
+         {
+            throw runtime_error("Expected replaced metatile while queued to be replaced.");
+         }
+
+         std::vector<tile_protocol> tiles;
+         std::vector<shared_ptr<tile_storage::handle> > handles;
+         for (int i = 0; i < 16; ++i)
+         {
+            tiles.push_back(tile_protocol(cmdRender, 8 * i + 1, 1, 12, 0, "osm", fmtPNG, 0, 0));
+         }
+         storage.get_multi(tiles, handles);
+         for (int i = 1; i < 16; ++i)
+         {
+            string data;
+            if (!handles[i]->data(data) || (data != fake_data(8 * i + 1, 1, 12)))
+            {
+               throw runtime_error((boost::format("Wrong data for %1% in a batch.") % tiles[i]).str());
+            }
+         }
+      }
+
+      // the storage writes everything before it goes.
+      disk_storage reader(tmp.dir().native());
+      tile_protocol tile(cmdRender, 0, 0, 12, 0, "osm", fmtPNG, 0, 0);
+      for (int i = 2; i < 16; ++i)
+      {
+         tile.x = 8 * i;
+         if (get_data(reader, tile) != fake_data(tile.x, tile.y, 12) || reader.probe(tile)->expired())
+         {
+            throw runtime_error((boost::format("Wrong data for %1% after writing.") % tile).str());
+         }
+      }
+      tile.x = 0;
+      if (get_data(reader, tile) != fake_data(2048, 1024, 12))
+      {
+         throw runtime_error("Expected replaced metatile to be written.");
+      }
+      tile.x = 8;
+      if (!reader.probe(tile)->expired())
+      {
+         throw runtime_error("Expected expired metatile to be written expired.");
+      }
+
+      // and nothing else is left in the directory.
+      size_t files = 0;
+      for (fs::recursive_directory_iterator itr(tmp.dir()), end; itr != end; ++itr)
+      {
+         if (fs::is_regular_file(itr->path()))
+         {
+            ++files;
+            if (itr->path().extension() != ".meta")
+            {
+               throw runtime_error((boost::format("Unexpected file %1% left behind.") % itr->path()).str());
+            }
+         }
+      }
+      if (files != 16)
+      {
+         throw runtime_error((boost::format("Expected 16 metatiles, got %1%.") % files).str());
+      }
+   }
+
+   // a metatile replaced while it's being written is only written by
+   // one thread at a time, so the last one put is the one on disk.
+   {
+      tmp_dir tmp;
+      const string path = (tmp.dir() / "osm" / "0.meta").native();
+      rendermq::meta_writer writer(4, 4, "none", 1);
+      for (int i = 0; i < 200; ++i)
+      {
+         writer.put(path, (boost::format("metatile %1%") % i).str());
+      }
+      writer.flush();
+      fs::ifstream in(path);
+      string data;
+      std::getline(in, data);
+      if (data != "metatile 199")
+      {
+         throw runtime_error((boost::format("Expected the last metatile put to be written, got \"%1%\".") % data).str());
+      }
+   }
+
+   bool thrown = false;
+   try { rendermq::meta_writer writer(1, 1, "sometimes", 1); } catch (const runtime_error &) { thrown = true; }
+   if (!thrown)
+   {
+      throw runtime_error("Expected unknown sync mode to be refused.");
+   }
+}
+
+/* test that a tile directory used as a cache is kept within its budget,
+ * that metatiles which were read recently survive the eviction, and
+ * that metatiles which were already there are found by the scan.
+ */
+void test_disk_cache()
+{
+   tmp_dir tmp;
+   tile_protocol tile(cmdRender, 0, 0, 12, 0, "osm", fmtPNG, 0, 0);
+   {
+      disk_storage storage(tmp.dir().native());
+      for (int i = 0; i < 4; ++i)
+      {
+         tile.x = 8 * i;
+         put_fake(storage, tile, tile.x, tile.y);
+      }
+   }
+
+   // room for 10 metatiles, and down to 9 when over.
+   const uint64_t meta_size = fake_tile(0, 0, 12, fmtPNG).total_size;
+   shared_ptr<rendermq::meta_cache_index> cache(
+      new rendermq::meta_cache_index(tmp.dir().native(), 10 * meta_size + 100, 0));
+   disk_storage storage(tmp.dir().native(), 4, 0, "none", 1, 1, true, NULL, cache);
+   cache->flush();
+   if (storage.get_cache_stats().metatiles[12] != 4)
+   {
+      throw runtime_error((boost::format("Expected the scan to find 4 metatiles, got %1%.")
+                           % storage.get_cache_stats().metatiles[12]).str());
+   }
+
+   // the first two found by the scan are read, so are kept when the
+   // other two are evicted to make room.
+   for (int i = 0; i < 2; ++i)
+   {
+      tile.x = 8 * i;
+      get_data(storage, tile);
+   }
+   for (int i = 4; i < 12; ++i)
+   {
+      tile.x = 8 * i;
+      put_fake(storage, tile, tile.x, tile.y);
+      cache->flush();
+   }
+
+   for (int i = 0; i < 12; ++i)
+   {
+      tile.x = 8 * i;
+      const bool evicted = (i == 2) || (i == 3);
+      if (fs::exists(rendermq::xyz_to_meta(tmp.dir().native(), tile.x, tile.y, tile.z, tile.style).first) == evicted)
+      {
+         throw runtime_error((boost::format("Expected %1% to be %2%.")
+                             % tile % (evicted ? "evicted" : "kept")).str());
+      }
+   }
+   tile.x = 16;
+   if (storage.get(tile)->exists())
+   {
+      throw runtime_error("Expected an evicted tile to be missing.");
+   }
+
+   const rendermq::meta_cache_index::stats stats = storage.get_cache_stats();
+   if ((cache->size() != 10 * meta_size) || (stats.metatiles[12] != 10) ||
+       (stats.bytes[12] != 10 * meta_size) || (stats.evicted != 2))
+   {
+      throw runtime_error((boost::format("Expected 10 metatiles in %1% bytes after evicting 2, got %2% in %3% "
+                                         "after evicting %4%.") % (10 * meta_size) % stats.metatiles[12]
+                           % stats.bytes[12] % stats.evicted).str());
+   }
+   if ((stats.hits[12] != 2) || (stats.misses[12] != 1))
+   {
+      throw runtime_error((boost::format("Expected 2 hits and 1 miss, got %1% and %2%.")
+                           % stats.hits[12] % stats.misses[12]).str());
+   }
+
+   // metatiles written behind are only in the index once they're on
+   // disk, and aren't removed while they're being written, so however
+   // the writes and evictions go the index ends up matching the disk.
+   tmp_dir behind;
+   shared_ptr<rendermq::meta_cache_index> behind_cache(
+      new rendermq::meta_cache_index(behind.dir().native(), 10 * meta_size + 100, 0, false));
+   {
+      disk_storage behind_storage(behind.dir().native(), 4, 0, "none", 1, 1, true,
+                                  shared_ptr<rendermq::meta_writer>(new rendermq::meta_writer(4, 8, "none", 1)),
+                                  behind_cache);
+      for (int i = 0; i < 40; ++i)
+      {
+         tile.x = 8 * i;
+         put_fake(behind_storage, tile, tile.x, tile.y);
+         tile.x = 0;
+         put_fake(behind_storage, tile, tile.x, tile.y);
+      }
+   }
+   behind_cache->flush();
+   uint64_t on_disk = 0;
+   for (fs::recursive_directory_iterator itr(behind.dir()), end; itr != end; ++itr)
+   {
+      if (fs::is_regular_file(itr->status()))
+      {
+         on_disk += fs::file_size(itr->path());
+      }
+   }
+   if (on_disk != behind_cache->size())
+   {
+      throw runtime_error((boost::format("Expected the index to have the %1% bytes on disk, but it has %2%.")
+                           % on_disk % behind_cache->size()).str());
+   }
+}
+
+/* test that the asynchronous calls, which go through the I/O engine,
+ * give the same answers as the blocking ones, with all the reads
+ * outstanding at once.
+ */
+void test_disk_async_engine(const string &engine) 
+{
+   tmp_dir tmp;
+   disk_storage storage(tmp.dir().native(), 4, 0, engine, 16, 4);
+   tile_protocol tile(cmdRender, 1024, 1024, 12, 0, "osm", fmtPNG, 0, 0);
+   put_fake(storage, tile, 1024, 1024);
+   tile.x = 2048;
+   put_fake(storage, tile, 2048, 1024);
+
+   // both metatiles, one which doesn't exist and one in the wrong format.
+   std::vector<tile_protocol> tiles;
+   for (int i = 0; i < 64; ++i)
+   {
+      tiles.push_back(tile_protocol(cmdRender, 1024 + i % 8, 1024 + i / 8, 12, 0, "osm", fmtPNG, 0, 0));
+      tiles.push_back(tile_protocol(cmdRender, 2048 + i % 8, 1024 + i / 8, 12, 0, "osm", fmtPNG, 0, 0));
+   }
+   tiles.push_back(tile_protocol(cmdRender, 512, 512, 12, 0, "osm", fmtPNG, 0, 0));
+   tiles.push_back(tile_protocol(cmdRender, 1024, 1024, 12, 0, "osm", fmtJPEG, 0, 0));
+
+   // twice, the first time opening the metatiles and then with them open.
+   for (int n = 0; n < 2; ++n)
+   {
+      std::vector<shared_ptr<tile_storage::handle> > handles(tiles.size()), probes(tiles.size());
+      for (size_t i = 0; i < tiles.size(); ++i)
+      {
+         storage.get_async(tiles[i], boost::bind(&store_handle, &handles[i], _1));
+         storage.probe_async(tiles[i], boost::bind(&store_handle, &probes[i], _1));
+      }
+      handles_done all_handles = { handles }, all_probes = { probes };
+      wait_for(storage, all_handles);
+      wait_for(storage, all_probes);
+
+      for (size_t i = 0; i < tiles.size(); ++i)
+      {
+         const bool exists = (i < 128);
+         if (handles[i]->exists() != exists || probes[i]->exists() != exists)
+         {
+            throw runtime_error((boost::format("Wrong existence for %1% with %2%.") % tiles[i] % engine).str());
+         }
+         string data;
+         if (exists && (!handles[i]->data(data) || data != fake_data(tiles[i].x, tiles[i].y, 12)))
+         {
+            throw runtime_error((boost::format("Wrong data for %1% with %2%.") % tiles[i] % engine).str());
+         }
+      }
+   }
+
+   string meta, expected;
+   int result = -1;
+   storage.get_meta_async(tiles[0], boost::bind(&store_meta, &result, &meta, _1, _2));
+   meta_done got_meta = { result };
+   wait_for(storage, got_meta);
+   if (result != 1 || !storage.get_meta(tiles[0], expected) || meta != expected)
+   {
+      throw runtime_error((boost::format("Wrong metatile with %1%.") % engine).str());
+   }
+
+   std::vector<shared_ptr<tile_storage::handle> > handles;
+   storage.get_multi(tiles, handles);
+   if (handles.size() != tiles.size() || !handles[0]->exists() || handles[tiles.size() - 1]->exists())
+   {
+      throw runtime_error((boost::format("Wrong batch with %1%.") % engine).str());
+   }
+}
+
+void test_disk_async_io_uring()
+{
+   test_disk_async_engine("io_uring");
+}
+
+void test_disk_async_threads()
+{
+   test_disk_async_engine("threads");
+}
+
 int main() 
 {
    int tests_failed = 0;
@@ -203,6 +889,14 @@ int main()
    tests_failed += test::run("test_disk_round_trip_empty", &test_disk_round_trip_empty);
    tests_failed += test::run("test_disk_round_trip", &test_disk_round_trip);
    tests_failed += test::run("test_disk_round_trip_multiformat", &test_disk_round_trip_multiformat);
+   tests_failed += test::run("test_disk_probe", &test_disk_probe);
+   tests_failed += test::run("test_disk_get_multi", &test_disk_get_multi);
+   tests_failed += test::run("test_disk_open_files", &test_disk_open_files);
+   tests_failed += test::run("test_disk_mmap", &test_disk_mmap);
+   tests_failed += test::run("test_disk_write_behind", &test_disk_write_behind);
+   tests_failed += test::run("test_disk_cache", &test_disk_cache);
+   tests_failed += test::run("test_disk_async_io_uring", &test_disk_async_io_uring);
+   tests_failed += test::run("test_disk_async_threads", &test_disk_async_threads);
    //tests_failed += test::run("test_", &test_);
 
    cout << " >> Tests failed: " << tests_failed << endl << endl;
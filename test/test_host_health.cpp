@@ -0,0 +1,141 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+
+#include "storage/host_health.hpp"
+#include "test/common.hpp"
+#include <stdexcept>
+#include <iostream>
+#include <boost/thread/thread.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+using rendermq::host_health;
+using std::runtime_error;
+using std::cout;
+using std::endl;
+
+namespace {
+
+void sleep_ms(long ms) {
+  boost::this_thread::sleep(boost::posix_time::milliseconds(ms));
+}
+
+}
+
+/* test that a host is only taken out of use after enough failures in a
+ * row, and that a success in between starts the count again.
+ */
+void test_failure_threshold() {
+  host_health health(3, 60000, 0);
+  host_health::host *h = health.add("localhost", 5050);
+
+  health.failed(h);
+  health.failed(h);
+  health.succeeded(h);
+  health.failed(h);
+  health.failed(h);
+  if (health.current(h) != host_health::state_closed || !health.allow(h)) {
+    throw runtime_error("Expected the host to stay in use below the threshold.");
+  }
+
+  health.failed(h);
+  if (health.current(h) != host_health::state_open) {
+    throw runtime_error("Expected the host to be taken out of use at the threshold.");
+  }
+  if (health.allow(h)) {
+    throw runtime_error("Expected no requests to be allowed to a down host.");
+  }
+}
+
+/* test that hosts are shared, so that anything looking up the same host
+ * sees it go down.
+ */
+void test_shared_hosts() {
+  host_health health(1, 60000, 0);
+  host_health::host *a = health.add("localhost", 5050);
+  host_health::host *b = health.add("localhost", 5050);
+  host_health::host *other = health.add("localhost", 5051);
+
+  if (a != b || a == other) {
+    throw runtime_error("Expected one entry for each host and port.");
+  }
+  health.failed(a);
+  if (health.allow(b)) {
+    throw runtime_error("Expected the host to be down for everyone.");
+  }
+  if (!health.allow(other)) {
+    throw runtime_error("Expected other hosts to be unaffected.");
+  }
+}
+
+/* test that once the open time is up, a single trial request is let
+ * through, and that its result decides whether the host comes back.
+ */
+void test_half_open() {
+  host_health health(1, 50, 0);
+  host_health::host *h = health.add("localhost", 5050);
+
+  health.failed(h);
+  sleep_ms(100);
+  if (!health.allow(h)) {
+    throw runtime_error("Expected a trial request after the open time.");
+  }
+  if (health.current(h) != host_health::state_half_open) {
+    throw runtime_error("Expected the host to be half-open during the trial.");
+  }
+  if (health.allow(h)) {
+    throw runtime_error("Expected only one trial request at a time.");
+  }
+
+  // a failed trial takes it out of use again.
+  health.failed(h);
+  if (health.current(h) != host_health::state_open || health.allow(h)) {
+    throw runtime_error("Expected a failed trial to take the host out of use again.");
+  }
+
+  // and a successful one brings it back for everyone.
+  sleep_ms(100);
+  if (!health.allow(h)) {
+    throw runtime_error("Expected another trial request after the open time.");
+  }
+  health.succeeded(h);
+  if (health.current(h) != host_health::state_closed || !health.allow(h) || !health.allow(h)) {
+    throw runtime_error("Expected a successful trial to bring the host back.");
+  }
+}
+
+int main() {
+  int tests_failed = 0;
+
+  cout << "== Testing Host Health ==" << endl << endl;
+
+  tests_failed += test::run("test_failure_threshold", &test_failure_threshold);
+  tests_failed += test::run("test_shared_hosts", &test_shared_hosts);
+  tests_failed += test::run("test_half_open", &test_half_open);
+
+  cout << " >> Tests failed: " << tests_failed << endl << endl;
+
+  return 0;
+}
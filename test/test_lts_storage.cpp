@@ -24,18 +24,24 @@
  *-----------------------------------------------------------------------------*/
 
 #include "test/common.hpp"
+#include "test/lts_stub_node.hpp"
 #include "storage/meta_tile.hpp"
 #include "tile_utils.hpp"
 #include "storage/tile_storage.hpp"
 #include "storage/lts_storage.hpp"
+#include "storage/host_health.hpp"
 #include <stdexcept>
 #include <iostream>
 #include <sstream>
 #include <cstdio>
 #include <boost/function.hpp>
 #include <boost/format.hpp>
+#include <boost/foreach.hpp>
 #define BOOST_FILESYSTEM_VERSION 3
 #include <boost/scoped_ptr.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/thread/thread.hpp>
 
 using boost::function;
 using boost::optional;
@@ -58,6 +64,7 @@ using rendermq::fmtJPEG;
 using rendermq::fmtJSON;
 using rendermq::fmtAll;
 using rendermq::lts_storage;
+using rendermq::host_health;
 using rendermq::tile_protocol;
 using rendermq::tile_storage;
 using rendermq::meta_layout;
@@ -368,6 +375,11 @@ namespace rendermq
          {
             return this->form_url(tile.x,tile.y,tile.z,tile.style,tile.format);
          }
+         //and the hedging delay for a host
+         long getHedgeDelay(const std::pair<string, int>& host)const
+         {
+            return this->hedge_delay(host);
+         }
    };
 }
 
@@ -433,6 +445,275 @@ void test_lts_mime_type()
    }
 }
 
+namespace
+{
+   // a storage talking to the given local stub nodes.
+   rendermq::vecHostInfo stub_hosts(const boost::ptr_vector<test::lts_stub_node> &nodes)
+   {
+      rendermq::vecHostInfo vecHosts;
+      for(boost::ptr_vector<test::lts_stub_node>::const_iterator node = nodes.begin(); node != nodes.end(); ++node)
+         vecHosts.push_back(std::make_pair("127.0.0.1", node->port()));
+      return vecHosts;
+   }
+
+   size_t total_requests(const boost::ptr_vector<test::lts_stub_node> &nodes, bool bundles_only)
+   {
+      size_t total = 0;
+      for(boost::ptr_vector<test::lts_stub_node>::const_iterator node = nodes.begin(); node != nodes.end(); ++node)
+         total += bundles_only ? node->bundle_requests() : node->requests();
+      return total;
+   }
+
+   void reset_counts(boost::ptr_vector<test::lts_stub_node> &nodes)
+   {
+      for(boost::ptr_vector<test::lts_stub_node>::iterator node = nodes.begin(); node != nodes.end(); ++node)
+         node->reset_counts();
+   }
+}
+
+/* test that a metatile goes to and comes back from nodes which support
+ * bundles in one request per host and replica.
+ */
+void test_lts_bundle_round_trip()
+{
+   boost::ptr_vector<test::lts_stub_node> nodes;
+   for(int i = 0; i < 3; ++i)
+      nodes.push_back(new test::lts_stub_node(true));
+
+   lts_storage storage(stub_hosts(nodes), LTS_TEST_CONFIG, "mq", "0", 16);
+   tile_protocol tile(cmdRender, 64, 128, 10, 0, "test_bundle", (rendermq::protoFmt)(fmtPNG | fmtJPEG), 0, 0);
+   fake_tile meta(tile.x, tile.y, tile.z, tile.format);
+   string data = meta.GetData(), data2;
+
+   if(!storage.put_meta(tile, data))
+      throw runtime_error("Can't save meta tile!");
+   if(total_requests(nodes, false) > 2 * nodes.size())
+      throw runtime_error((boost::format("Expected at most one put per host and replica, got %1%.") % total_requests(nodes, false)).str());
+   if(total_requests(nodes, true) != total_requests(nodes, false))
+      throw runtime_error("Expected only bundle requests for the put.");
+
+   reset_counts(nodes);
+   if(!storage.get_meta(tile, data2))
+      throw runtime_error("Can't load meta tile!");
+   if(data != data2)
+      throw runtime_error("Loaded data is different from saved data!");
+   if(total_requests(nodes, false) > nodes.size())
+      throw runtime_error((boost::format("Expected at most one get per host, got %1%.") % total_requests(nodes, false)).str());
+
+   //the individual tiles are all there too
+   tile.format = fmtPNG;
+   shared_ptr<tile_storage::handle> handle = storage.get(tile);
+   if(!handle->exists() || handle->expired())
+      throw runtime_error("Tile put in a bundle should exist!");
+
+   //an expired tile makes the bundle look expired
+   tile.format = (rendermq::protoFmt)(fmtPNG | fmtJPEG);
+   if(!storage.expire(tile))
+      throw runtime_error("Can't expire meta tile!");
+   if(storage.get_meta(tile, data2))
+      throw runtime_error("Shouldn't be able to get an expired meta tile!");
+}
+
+/* test that nodes which don't support bundles get per-tile requests, and
+ * aren't asked for bundles again straight away.
+ */
+void test_lts_bundle_fallback()
+{
+   boost::ptr_vector<test::lts_stub_node> nodes;
+   nodes.push_back(new test::lts_stub_node(true));
+   nodes.push_back(new test::lts_stub_node(false));
+   nodes.push_back(new test::lts_stub_node(false));
+
+   lts_storage storage(stub_hosts(nodes), LTS_TEST_CONFIG, "mq", "0", 16);
+   tile_protocol tile(cmdRender, 64, 128, 10, 0, "test_fallback", (rendermq::protoFmt)(fmtPNG | fmtJPEG), 0, 0);
+   fake_tile meta(tile.x, tile.y, tile.z, tile.format);
+   string data = meta.GetData(), data2;
+
+   if(!storage.put_meta(tile, data))
+      throw runtime_error("Can't save meta tile!");
+   //two formats and two replicas of every tile
+   if(nodes[0].tiles() + nodes[1].tiles() + nodes[2].tiles() != 2 * 2 * METATILE * METATILE)
+      throw runtime_error("Expected all the tiles to be stored.");
+
+   reset_counts(nodes);
+   if(!storage.get_meta(tile, data2))
+      throw runtime_error("Can't load meta tile!");
+   if(data != data2)
+      throw runtime_error("Loaded data is different from saved data!");
+   if(nodes[1].bundle_requests() != 0 || nodes[2].bundle_requests() != 0)
+      throw runtime_error("Nodes without bundles shouldn't be asked for them again.");
+   if(nodes[0].bundle_requests() == 0 || nodes[0].requests() != nodes[0].bundle_requests())
+      throw runtime_error("Nodes with bundles should still be asked for them.");
+}
+
+/* test that reads from a slow primary are hedged by the replica, and
+ * that expiries don't wait for the slow copy.
+ */
+void test_lts_hedged_reads()
+{
+   boost::ptr_vector<test::lts_stub_node> nodes;
+   nodes.push_back(new test::lts_stub_node(true));
+   nodes.push_back(new test::lts_stub_node(true));
+
+   //hedge after a fixed 20ms
+   lts_storage storage(stub_hosts(nodes), LTS_TEST_CONFIG, "mq", "0", 16, 300, true, true, 20);
+   tile_protocol tile(cmdRender, 64, 128, 10, 0, "test_hedge", fmtPNG, 0, 0);
+   fake_tile meta(tile.x, tile.y, tile.z, tile.format);
+   if(!storage.put_meta(tile, meta.GetData()))
+      throw runtime_error("Can't save meta tile!");
+
+   nodes[0].set_delay(1000);
+   const lts_storage::hedge_stats before = storage.get_hedge_stats();
+   for(int i = 0; i < METATILE * METATILE; ++i)
+   {
+      tile.x = 64 + i % METATILE;
+      tile.y = 128 + i / METATILE;
+      boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+      shared_ptr<tile_storage::handle> handle = (i % 2) ? storage.probe(tile) : storage.get(tile);
+      long taken = (boost::posix_time::microsec_clock::universal_time() - start).total_milliseconds();
+      if(!handle->exists())
+         throw runtime_error("Tile should exist!");
+      if(taken > 500)
+         throw runtime_error((boost::format("Read of %1% took %2%ms, it should have been hedged.") % tile % taken).str());
+   }
+
+   const lts_storage::hedge_stats after = storage.get_hedge_stats();
+   if(after.reads - before.reads != METATILE * METATILE)
+      throw runtime_error("Expected every read to be counted.");
+   if(after.hedged == before.hedged || after.replica_won - before.replica_won != after.hedged - before.hedged)
+      throw runtime_error((boost::format("Expected the replica to win every hedged read, but %1% were hedged and %2% won.")
+                           % (after.hedged - before.hedged) % (after.replica_won - before.replica_won)).str());
+
+   //one copy of each tile is enough for the expiry to finish
+   boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+   if(!storage.expire(tile))
+      throw runtime_error("Can't expire meta tile!");
+   long taken = (boost::posix_time::microsec_clock::universal_time() - start).total_milliseconds();
+   if(taken > 500)
+      throw runtime_error((boost::format("Expiry took %1%ms, it shouldn't wait for the slow copy.") % taken).str());
+}
+
+/* test that the hedging delay follows the latency of each host.
+ */
+void test_lts_adaptive_hedge()
+{
+   boost::ptr_vector<test::lts_stub_node> nodes;
+   nodes.push_back(new test::lts_stub_node(true));
+   nodes.push_back(new test::lts_stub_node(true));
+   const rendermq::vecHostInfo hosts = stub_hosts(nodes);
+
+   rendermq::lts_storage_tester storage(hosts, LTS_TEST_CONFIG, "mq", "0", 16);
+   long initial = storage.getHedgeDelay(hosts[0]);
+   if(initial <= 0)
+      throw runtime_error("Expected a default hedging delay before there are any measurements.");
+
+   //lots of quick misses
+   tile_protocol tile(cmdRender, 0, 0, 18, 0, "test_adaptive", fmtPNG, 0, 0);
+   for(tile.x = 0; tile.x < 256; ++tile.x)
+      storage.get(tile);
+
+   BOOST_FOREACH(const rendermq::vecHostInfo::value_type &host, hosts)
+   {
+      long delay = storage.getHedgeDelay(host);
+      if(delay <= 0 || delay >= initial)
+         throw runtime_error((boost::format("Expected the hedging delay for a quick host to come down, but it's %1%ms.") % delay).str());
+   }
+}
+
+namespace
+{
+   //read every tile of the metatile, which all have to be there.
+   void read_all(const lts_storage &storage, tile_protocol tile)
+   {
+      for(int i = 0; i < METATILE * METATILE; ++i)
+      {
+         tile.x = 64 + i % METATILE;
+         tile.y = 128 + i / METATILE;
+         if(!storage.get(tile)->exists())
+            throw runtime_error((boost::format("Tile %1% should have come from the replica.") % tile).str());
+      }
+   }
+
+   host_health::state health_of(const test::lts_stub_node &node)
+   {
+      host_health &health = host_health::instance();
+      return health.current(health.add("127.0.0.1", node.port()));
+   }
+}
+
+/* test that once one storage has found a node is down, other storage in
+ * the same process goes straight to the replica without trying it.
+ */
+void test_lts_host_down_shared()
+{
+   boost::ptr_vector<test::lts_stub_node> nodes;
+   nodes.push_back(new test::lts_stub_node(true));
+   nodes.push_back(new test::lts_stub_node(true));
+
+   //no probes, and a long time before trying the node again
+   host_health::instance().configure(1, 60000, 0);
+   lts_storage first(stub_hosts(nodes), LTS_TEST_CONFIG, "mq", "0", 16);
+   lts_storage second(stub_hosts(nodes), LTS_TEST_CONFIG, "mq", "0", 16);
+   tile_protocol tile(cmdRender, 64, 128, 10, 0, "test_down", fmtPNG, 0, 0);
+   fake_tile meta(tile.x, tile.y, tile.z, tile.format);
+   if(!first.put_meta(tile, meta.GetData()))
+      throw runtime_error("Can't save meta tile!");
+
+   nodes[0].stop();
+   read_all(first, tile);
+   if(health_of(nodes[0]) != host_health::state_open)
+      throw runtime_error("Expected the stopped node to be marked down.");
+   if(health_of(nodes[1]) != host_health::state_closed)
+      throw runtime_error("Expected the running node to still be up.");
+
+   //it's back, but nothing has found out yet, so it shouldn't be asked.
+   nodes[0].start();
+   reset_counts(nodes);
+   read_all(second, tile);
+   if(!second.expire(tile))
+      throw runtime_error("Expected the expiry to succeed on the replicas.");
+   if(nodes[0].requests() != 0)
+      throw runtime_error((boost::format("Expected no requests to the down node, but it got %1%.") % nodes[0].requests()).str());
+}
+
+/* test that a down node is probed in the background, and comes back into
+ * use once it answers.
+ */
+void test_lts_host_probe()
+{
+   boost::ptr_vector<test::lts_stub_node> nodes;
+   nodes.push_back(new test::lts_stub_node(true));
+   nodes.push_back(new test::lts_stub_node(true));
+
+   host_health::instance().configure(1, 60000, 50);
+   lts_storage storage(stub_hosts(nodes), LTS_TEST_CONFIG, "mq", "0", 16);
+   tile_protocol tile(cmdRender, 64, 128, 10, 0, "test_probe", fmtPNG, 0, 0);
+   fake_tile meta(tile.x, tile.y, tile.z, tile.format);
+   if(!storage.put_meta(tile, meta.GetData()))
+      throw runtime_error("Can't save meta tile!");
+
+   nodes[0].stop();
+   read_all(storage, tile);
+   boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+   if(health_of(nodes[0]) != host_health::state_open)
+      throw runtime_error("Expected the stopped node to stay down while the probes fail.");
+
+   nodes[0].start();
+   for(int i = 0; i < 100 && health_of(nodes[0]) == host_health::state_open; ++i)
+      boost::this_thread::sleep(boost::posix_time::milliseconds(20));
+   if(health_of(nodes[0]) != host_health::state_half_open)
+      throw runtime_error("Expected a probe to find the node is back.");
+
+   reset_counts(nodes);
+   read_all(storage, tile);
+   if(health_of(nodes[0]) != host_health::state_closed)
+      throw runtime_error("Expected the node to be back in use after a good request.");
+   if(nodes[0].requests() == 0)
+      throw runtime_error("Expected the node to be asked for tiles again.");
+
+   host_health::instance().configure(DEFAULT_FAILURE_THRESHOLD, DEFAULT_OPEN_TIME, DEFAULT_PROBE_INTERVAL);
+}
+
 int main()
 {
    int tests_failed = 0;
@@ -443,6 +724,12 @@ int main()
    tests_failed += test::run("test_lts_round_trip_multiformat", &test_lts_round_trip_multiformat);
    tests_failed += test::run("test_lts_expire_meta", &test_lts_expire_meta);
    tests_failed += test::run("test_lts_mime_type", &test_lts_mime_type);
+   tests_failed += test::run("test_lts_bundle_round_trip", &test_lts_bundle_round_trip);
+   tests_failed += test::run("test_lts_bundle_fallback", &test_lts_bundle_fallback);
+   tests_failed += test::run("test_lts_hedged_reads", &test_lts_hedged_reads);
+   tests_failed += test::run("test_lts_adaptive_hedge", &test_lts_adaptive_hedge);
+   tests_failed += test::run("test_lts_host_down_shared", &test_lts_host_down_shared);
+   tests_failed += test::run("test_lts_host_probe", &test_lts_host_probe);
 
    cout << " >> Tests failed: " << tests_failed << endl << endl;
 
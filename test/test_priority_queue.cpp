@@ -34,6 +34,7 @@
 #include <boost/function.hpp>
 #include <boost/format.hpp>
 #include <boost/foreach.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
 
 using rendermq::task_queue;
 using rendermq::tile_protocol;
@@ -54,6 +55,7 @@ using std::list;
 using rendermq::cmdIgnore;
 using rendermq::cmdDone;
 using rendermq::cmdRender;
+using rendermq::cmdRenderPrio;
 using rendermq::fmtPNG;
 
 namespace {
@@ -322,6 +324,112 @@ void test_front_processing()
       throw std::runtime_error((boost::format("Difference between number generated (%1%) and number processed (%2%) - error in queue logic!") % count_gen % count_proc).str());
    }
 }
+
+void test_expired_subscribers()
+{
+   task_queue q;
+   const std::time_t now = std::time(0);
+
+   // two clients who've given up, and one still waiting.
+   tile_protocol a(cmdRender, 0, 0, 10, 1, "map", fmtPNG), b(a), c(a);
+   a.deadline = now - 10;
+   b.deadline = now - 5;
+   c.deadline = now + 60;
+   q.push(a, "A", 100);
+   q.push(b, "B", 100);
+
+   if (q.get(a)->deadline != b.deadline) {
+      throw runtime_error("Task deadline should be the latest of its subscribers' deadlines.");
+   }
+   if (!q.prune_expired(a, now)) {
+      throw runtime_error("All subscribers expired, but prune didn't say so.");
+   }
+
+   q.push(c, "C", 100);
+   if (q.prune_expired(a, now)) {
+      throw runtime_error("Prune says all subscribers expired, but one is still waiting.");
+   }
+   pair<task::iterator, task::iterator> subs = q.get(a)->subscribers();
+   if ((distance(subs.first, subs.second) != 1) || (subs.first->second != "C")) {
+      throw runtime_error("Expected only the subscriber still waiting to be left.");
+   }
+
+   // a subscriber without a deadline means the task is wanted forever.
+   tile_protocol d(cmdRender, 0, 0, 10, 2, "map", fmtPNG);
+   q.push(d, "D", 0);
+   if (q.get(a)->deadline != 0) {
+      throw runtime_error("Task with a subscriber without a deadline shouldn't have one.");
+   }
+
+   q.demote(a);
+   if (q.get(a)->priority() != 0) {
+      throw runtime_error("Demoted task should have bulk priority.");
+   }
+
+   // once a high priority subscriber has given up, the task goes back
+   // to the priority and deadline of the ones which are left.
+   tile_protocol e(cmdRenderPrio, 8, 0, 10, 3, "map", fmtPNG), f(cmdRender, 8, 0, 10, 4, "map", fmtPNG);
+   e.deadline = now - 5;
+   f.deadline = now + 30;
+   q.push(f, "F", 100);
+   q.push(e, "E", 150);
+   if (q.prune_expired(e, now)) {
+      throw runtime_error("Prune says all subscribers expired, but one is still waiting.");
+   }
+   if ((q.get(e)->priority() != 100) || (q.get(e)->deadline != f.deadline)) {
+      throw runtime_error((boost::format("Expected priority 100 and deadline %1% after pruning, got %2% and %3%.")
+                           % f.deadline % q.get(e)->priority() % q.get(e)->deadline).str());
+   }
+}
+
+/* benchmark of the queue operations which the broker calls on every
+ * request or heartbeat, with a million tasks in the queue of which half
+ * are out being processed. these used to walk the whole queue, so the
+ * time per call grew with the number of tasks.
+ */
+void test_million_tasks()
+{
+   namespace pt = boost::posix_time;
+   const int num_tasks = 1000000, num_calls = 100000;
+   const string addr = "";
+   task_queue q;
+
+   pt::ptime start = pt::microsec_clock::universal_time();
+   for (int i = 0; i < num_tasks; ++i) {
+      // metatile-aligned and spread over a 1024x1024 grid of metatiles.
+      tile_protocol t(cmdRender, (i % 1024) * 8, (i / 1024) * 8, 18, 0, "map", fmtPNG, 0, 0);
+      q.push(t, addr, i % 100);
+   }
+   pt::ptime pushed = pt::microsec_clock::universal_time();
+
+   for (int i = 0; i < num_tasks / 2; ++i) {
+      boost::optional<const task &> t = q.front();
+      if (!t) { throw runtime_error("Queue ran out of unprocessed tasks."); }
+      q.set_processed(static_cast<tile_protocol>(*t));
+   }
+   pt::ptime processed = pt::microsec_clock::universal_time();
+
+   size_t total = 0;
+   for (int i = 0; i < num_calls; ++i) {
+      total += q.count_unprocessed();
+      if (!q.front()) { throw runtime_error("No unprocessed task at front of queue."); }
+      // nothing is old enough to be resubmitted, so this should only 
+      // look at the range boundary.
+      q.resubmit_older_than(3600);
+   }
+   pt::ptime queried = pt::microsec_clock::universal_time();
+
+   if (total != size_t(num_calls) * (num_tasks - num_tasks / 2)) {
+      throw runtime_error((boost::format("Expected %1% unprocessed tasks, but count was %2%.") 
+                           % (num_tasks - num_tasks / 2) % (total / num_calls)).str());
+   }
+
+   LOG_INFO(boost::format("%1% pushes took %2%ms, front + set_processed x %3% took %4%ms, "
+                          "count_unprocessed + front + resubmit_older_than x %5% took %6%ms.")
+            % num_tasks % (pushed - start).total_milliseconds() 
+            % (num_tasks / 2) % (processed - pushed).total_milliseconds()
+            % num_calls % (queried - processed).total_milliseconds());
+}
       
    
 int main() {
@@ -336,6 +444,8 @@ int main() {
   tests_failed += test::run("test_resubmit", &test_resubmit);
   tests_failed += test::run("test_collision", &test_collision);
   tests_failed += test::run("test_front_processing", &test_front_processing);
+  tests_failed += test::run("test_expired_subscribers", &test_expired_subscribers);
+  tests_failed += test::run("test_million_tasks", &test_million_tasks);
 
   cout << " >> Tests failed: " << tests_failed << endl << endl;
 
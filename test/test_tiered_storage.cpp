@@ -0,0 +1,523 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "storage/tiered_storage.hpp"
+#include "storage/meta_tile.hpp"
+#include "storage/null_handle.hpp"
+#include "storage/data_handle.hpp"
+#include "storage/disk_storage.hpp"
+#include "storage/meta_writer.hpp"
+#include "test/common.hpp"
+
+#include <stdexcept>
+#include <iostream>
+#include <map>
+#include <boost/format.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/bind.hpp>
+#define BOOST_FILESYSTEM_VERSION 3
+#include <boost/filesystem.hpp>
+
+using boost::shared_ptr;
+using std::runtime_error;
+using std::cout;
+using std::endl;
+using std::string;
+using std::map;
+
+namespace fs = boost::filesystem;
+
+using rendermq::tiered_storage;
+using rendermq::disk_storage;
+using rendermq::meta_writer;
+using rendermq::tile_storage;
+using rendermq::tile_protocol;
+using rendermq::cmdRender;
+using rendermq::fmtPNG;
+
+namespace 
+{
+
+// metatiles, shared between the instances of a tier.
+struct metatiles
+{
+   metatiles() : reads(0), hold(false), held(0) {}
+   boost::mutex mutex;
+   // reads by all the instances.
+   size_t reads;
+   // whether whole metatile reads by gated instances wait once they've
+   // read it, until it's let go of, and how many are waiting.
+   bool hold;
+   size_t held;
+   boost::condition_variable cond;
+   // data of each metatile, and whether it has expired.
+   map<string, std::pair<string, bool> > data;
+};
+
+/* storage which keeps metatiles in memory, and counts how often it's
+ * read from. the data of each tile is the whole metatile.
+ */
+class memory_storage
+   : public tile_storage
+{
+public:
+   memory_storage(shared_ptr<metatiles> m)
+      : m_meta(m), fail_puts(false), gated(false)
+   {
+   }
+
+   shared_ptr<tile_storage::handle> get(const tile_protocol &tile) const
+   {
+      boost::mutex::scoped_lock lock(m_meta->mutex);
+      ++m_meta->reads;
+      map<string, std::pair<string, bool> >::const_iterator itr = m_meta->data.find(key(tile));
+      if (itr == m_meta->data.end())
+      {
+         return shared_ptr<tile_storage::handle>(new rendermq::null_handle());
+      }
+      string data = itr->second.first;
+      return shared_ptr<tile_storage::handle>(new rendermq::data_handle(1, itr->second.second, data));
+   }
+
+   bool get_meta(const tile_protocol &tile, string &data) const
+   {
+      boost::mutex::scoped_lock lock(m_meta->mutex);
+      ++m_meta->reads;
+      map<string, std::pair<string, bool> >::const_iterator itr = m_meta->data.find(key(tile));
+      if (itr == m_meta->data.end() || itr->second.second)
+      {
+         return false;
+      }
+      data = itr->second.first;
+      if (gated)
+      {
+         ++m_meta->held;
+         m_meta->cond.notify_all();
+         while (m_meta->hold)
+         {
+            m_meta->cond.wait(lock);
+         }
+         --m_meta->held;
+      }
+      return true;
+   }
+
+   bool put_meta(const tile_protocol &tile, const string &buf) const
+   {
+      if (fail_puts)
+      {
+         return false;
+      }
+      boost::mutex::scoped_lock lock(m_meta->mutex);
+      m_meta->data[key(tile)] = std::make_pair(buf, false);
+      return true;
+   }
+
+   bool expire(const tile_protocol &tile) const
+   {
+      boost::mutex::scoped_lock lock(m_meta->mutex);
+      map<string, std::pair<string, bool> >::iterator itr = m_meta->data.find(key(tile));
+      if (itr == m_meta->data.end())
+      {
+         return false;
+      }
+      itr->second.second = true;
+      return true;
+   }
+
+   bool has(const tile_protocol &tile) const
+   {
+      boost::mutex::scoped_lock lock(m_meta->mutex);
+      return m_meta->data.count(key(tile)) > 0;
+   }
+
+   bool expired(const tile_protocol &tile) const
+   {
+      boost::mutex::scoped_lock lock(m_meta->mutex);
+      return m_meta->data[key(tile)].second;
+   }
+
+private:
+   static string key(const tile_protocol &tile)
+   {
+      return (boost::format("%1%/%2%/%3%/%4%") % tile.style % tile.z
+              % (tile.x & ~(METATILE - 1)) % (tile.y & ~(METATILE - 1))).str();
+   }
+
+   shared_ptr<metatiles> m_meta;
+
+public:
+   bool fail_puts, gated;
+};
+
+// a fast and a slow tier, each with one instance for reads and one for
+// copying between them.
+struct two_tiers
+{
+   two_tiers()
+      : fast_meta(new metatiles), slow_meta(new metatiles),
+        fast(new memory_storage(fast_meta)), slow(new memory_storage(slow_meta)),
+        promote_slow(new memory_storage(slow_meta))
+   {
+      tiers.push_back(fast);
+      tiers.push_back(slow);
+      promote_tiers.push_back(shared_ptr<tile_storage>(new memory_storage(fast_meta)));
+      promote_tiers.push_back(promote_slow);
+   }
+
+   shared_ptr<metatiles> fast_meta, slow_meta;
+   shared_ptr<memory_storage> fast, slow, promote_slow;
+   tiered_storage::tiers_t tiers, promote_tiers;
+};
+
+// a temporary directory, removed with everything in it.
+class tmp_dir
+{
+public:
+   tmp_dir()
+   {
+      m_dir = fs::path("/tmp") / fs::unique_path();
+      if (!fs::create_directories(m_dir))
+      {
+         throw runtime_error("Cannot create temporary directory for tiered tests.");
+      }
+   }
+
+   ~tmp_dir()
+   {
+      fs::remove_all(m_dir);
+   }
+
+   string dir() const
+   {
+      return m_dir.native();
+   }
+
+private:
+   fs::path m_dir;
+};
+
+tile_protocol make_tile(int x, int y)
+{
+   return tile_protocol(cmdRender, x, y, 12, 0, "osm", fmtPNG, 0, 0);
+}
+
+void store_handle(shared_ptr<tile_storage::handle> *result, shared_ptr<tile_storage::handle> handle)
+{
+   *result = handle;
+}
+
+} // anonymous namespace
+
+/* test that a tile which is only in the slow tier is read from there,
+ * copied into the fast tier, and read from the fast tier after that.
+ */
+void test_read_through()
+{
+   two_tiers t;
+   tiered_storage storage(t.tiers, t.promote_tiers, 1);
+   const tile_protocol tile = make_tile(9, 10);
+   t.slow->put_meta(tile, "metatile");
+
+   string data;
+   if (!storage.get(tile)->data(data) || (data != "metatile"))
+   {
+      throw runtime_error("Expected the tile from the slow tier.");
+   }
+   storage.flush();
+   if (!t.fast->has(tile))
+   {
+      throw runtime_error("Expected the metatile to be copied to the fast tier.");
+   }
+
+   const size_t slow_reads = t.slow_meta->reads;
+   if (!storage.get(make_tile(15, 15))->exists() || (t.slow_meta->reads != slow_reads))
+   {
+      throw runtime_error("Expected the copied metatile to be read from the fast tier.");
+   }
+   if (storage.get(make_tile(16, 8))->exists())
+   {
+      throw runtime_error("Expected a tile in neither tier to be missing.");
+   }
+}
+
+/* test that metatiles are only copied once they've been read enough
+ * times, and that the hits are forgotten after a couple of generations.
+ */
+void test_admission()
+{
+   two_tiers t;
+   tiered_storage storage(t.tiers, t.promote_tiers, 2, 16, 2);
+   for (int i = 0; i < 6; ++i)
+   {
+      t.slow->put_meta(make_tile(8 * i, 0), "metatile");
+   }
+
+   storage.get(make_tile(0, 0));
+   storage.flush();
+   if (t.fast->has(make_tile(0, 0)))
+   {
+      throw runtime_error("Expected a metatile read once not to be copied.");
+   }
+   storage.get(make_tile(1, 1));
+   storage.flush();
+   if (!t.fast->has(make_tile(0, 0)))
+   {
+      throw runtime_error("Expected a metatile read twice to be copied.");
+   }
+
+   // the first hit has been pushed out by the time of the second.
+   storage.get(make_tile(8, 0));
+   for (int i = 0; i < 4; ++i)
+   {
+      t.slow->put_meta(make_tile(16, 8 * i), "metatile");
+      t.slow->put_meta(make_tile(24, 8 * i), "metatile");
+      storage.get(make_tile(16, 8 * i));
+      storage.get(make_tile(24, 8 * i));
+   }
+   storage.get(make_tile(8, 0));
+   storage.flush();
+   if (t.fast->has(make_tile(8, 0)))
+   {
+      throw runtime_error("Expected hits from old generations to be forgotten.");
+   }
+   if (t.fast->has(make_tile(16, 0)))
+   {
+      throw runtime_error("Expected a metatile read once not to be copied.");
+   }
+   storage.get(make_tile(40, 0));
+   storage.get(make_tile(41, 0));
+   storage.flush();
+   if (!t.fast->has(make_tile(40, 0)))
+   {
+      throw runtime_error("Expected a metatile read twice in a row to be copied.");
+   }
+
+   // a whole metatile which has already been read is copied as it is.
+   t.slow->put_meta(make_tile(32, 0), "whole");
+   string data;
+   storage.get_meta(make_tile(32, 0), data);
+   const size_t slow_reads = t.slow_meta->reads;
+   storage.get_meta(make_tile(32, 0), data);
+   storage.flush();
+   if (!t.fast->has(make_tile(32, 0)) || (t.slow_meta->reads != slow_reads + 1))
+   {
+      throw runtime_error("Expected a whole metatile to be copied without reading it again.");
+   }
+}
+
+/* test that puts and expiries go to all the tiers, and that a tier
+ * which can't take a new metatile has the old one expired.
+ */
+void test_put_and_expire()
+{
+   two_tiers t;
+   tiered_storage storage(t.tiers, t.promote_tiers, 1);
+   const tile_protocol tile = make_tile(0, 0);
+
+   if (!storage.put_meta(tile, "new") || !t.fast->has(tile) || !t.slow->has(tile))
+   {
+      throw runtime_error("Expected put to go to both tiers.");
+   }
+   if (!storage.expire(tile) || !t.fast->expired(tile) || !t.slow->expired(tile))
+   {
+      throw runtime_error("Expected expire to go to both tiers.");
+   }
+
+   // only the slow tier has to succeed.
+   const tile_protocol other = make_tile(8, 0);
+   t.slow->put_meta(other, "old");
+   if (!storage.expire(other) || !t.slow->expired(other))
+   {
+      throw runtime_error("Expected expire to succeed when only the slow tier has the metatile.");
+   }
+
+   t.fast->put_meta(tile, "old");
+   t.fast->fail_puts = true;
+   if (!storage.put_meta(tile, "newer") || !t.fast->expired(tile))
+   {
+      throw runtime_error("Expected a failed put to a fast tier to expire the old metatile.");
+   }
+   string data;
+   if (!storage.get_meta(tile, data) || (data != "newer"))
+   {
+      throw runtime_error("Expected the new metatile from the slow tier.");
+   }
+}
+
+/* test that a metatile which is put or expired while it's waiting to
+ * be copied, or being copied, doesn't have the old one copied over it.
+ */
+void test_change_while_copying()
+{
+   two_tiers t;
+   t.promote_slow->gated = true;
+   tiered_storage storage(t.tiers, t.promote_tiers, 1);
+   const tile_protocol copying = make_tile(0, 0), waiting = make_tile(8, 0), put = make_tile(16, 0);
+   t.slow->put_meta(copying, "old");
+   t.slow->put_meta(waiting, "old");
+   t.slow->put_meta(put, "old");
+
+   // the first copy is held once it has read the old metatile from the
+   // slow tier, with the others queued behind it with the old data.
+   {
+      boost::mutex::scoped_lock lock(t.slow_meta->mutex);
+      t.slow_meta->hold = true;
+   }
+   storage.get(copying);
+   {
+      boost::mutex::scoped_lock lock(t.slow_meta->mutex);
+      while (t.slow_meta->held == 0)
+      {
+         t.slow_meta->cond.wait(lock);
+      }
+   }
+   string data;
+   storage.get_meta(waiting, data);
+   storage.get_meta(put, data);
+
+   storage.expire(copying);
+   storage.expire(waiting);
+   storage.put_meta(put, "new");
+   {
+      boost::mutex::scoped_lock lock(t.slow_meta->mutex);
+      t.slow_meta->hold = false;
+      t.slow_meta->cond.notify_all();
+   }
+   storage.flush();
+
+   if (t.fast->has(copying) || t.fast->has(waiting))
+   {
+      throw runtime_error("Expected copies of expired metatiles to be dropped.");
+   }
+   if (!t.fast->get_meta(put, data) || (data != "new"))
+   {
+      throw runtime_error("Expected the new metatile in the fast tier, not a copy of the old one.");
+   }
+}
+
+/* test that a fast disk tier which writes behind shares its writer with
+ * the promoter's instance, so that a copy of the old metatile which is
+ * queued while a new one is put can't be renamed over it on disk.
+ */
+void test_write_behind_tier()
+{
+   tmp_dir tmp;
+   shared_ptr<meta_writer> writer = meta_writer::shared(tmp.dir(), 2, 4, "none", 1);
+   if ((meta_writer::shared(tmp.dir(), 1, 1, "none", 1) != writer) ||
+       (meta_writer::shared(tmp.dir() + "/other", 2, 4, "none", 1) == writer))
+   {
+      throw runtime_error("Expected one shared writer for each directory.");
+   }
+
+   shared_ptr<metatiles> slow_meta(new metatiles);
+   tiered_storage::tiers_t tiers, promote_tiers;
+   tiers.push_back(shared_ptr<tile_storage>(
+      new disk_storage(tmp.dir(), 4, 0, "none", 1, 1, true, writer)));
+   tiers.push_back(shared_ptr<tile_storage>(new memory_storage(slow_meta)));
+   promote_tiers.push_back(shared_ptr<tile_storage>(
+      new disk_storage(tmp.dir(), 4, 0, "none", 1, 1, true,
+                       meta_writer::shared(tmp.dir(), 2, 4, "none", 1))));
+   promote_tiers.push_back(shared_ptr<tile_storage>(new memory_storage(slow_meta)));
+
+   // each metatile is read, queueing a copy of the old one, and then
+   // put straight away, racing the copy.
+   const int count = 64;
+   {
+      tiered_storage storage(tiers, promote_tiers, 1);
+      for (int i = 0; i < count; ++i)
+      {
+         const tile_protocol tile = make_tile(8 * i, 0);
+         string data;
+         tiers[1]->put_meta(tile, "old");
+         storage.get_meta(tile, data);
+         if (!storage.put_meta(tile, "new"))
+         {
+            throw runtime_error("Expected the put to succeed.");
+         }
+      }
+      storage.flush();
+   }
+   writer->flush();
+
+   disk_storage disk(tmp.dir(), 4, 0);
+   for (int i = 0; i < count; ++i)
+   {
+      string data;
+      if (!disk.get_meta(make_tile(8 * i, 0), data) || (data != "new"))
+      {
+         throw runtime_error("Expected the new metatile on disk, not a copy of the old one.");
+      }
+   }
+}
+
+/* test that the asynchronous calls go through the tiers in turn in the
+ * same way.
+ */
+void test_async()
+{
+   two_tiers t;
+   tiered_storage storage(t.tiers, t.promote_tiers, 1);
+   const tile_protocol tile = make_tile(0, 0);
+   t.slow->put_meta(tile, "metatile");
+
+   shared_ptr<tile_storage::handle> handle;
+   storage.get_async(tile, boost::bind(&store_handle, &handle, _1));
+   string data;
+   if (!handle || !handle->data(data) || (data != "metatile"))
+   {
+      throw runtime_error("Expected the tile from the slow tier asynchronously.");
+   }
+   storage.flush();
+   if (!t.fast->has(tile))
+   {
+      throw runtime_error("Expected an asynchronous read to copy the metatile.");
+   }
+
+   storage.probe_async(make_tile(8, 0), boost::bind(&store_handle, &handle, _1));
+   if (!handle || handle->exists())
+   {
+      throw runtime_error("Expected a tile in neither tier to be missing asynchronously.");
+   }
+}
+
+int main() 
+{
+   int tests_failed = 0;
+
+   cout << "== Testing Tiered Storage ==" << endl << endl;
+
+   tests_failed += test::run("test_read_through", &test_read_through);
+   tests_failed += test::run("test_admission", &test_admission);
+   tests_failed += test::run("test_put_and_expire", &test_put_and_expire);
+   tests_failed += test::run("test_change_while_copying", &test_change_while_copying);
+   tests_failed += test::run("test_write_behind_tier", &test_write_behind_tier);
+   tests_failed += test::run("test_async", &test_async);
+
+   cout << " >> Tests failed: " << tests_failed << endl << endl;
+
+   return 0;
+}
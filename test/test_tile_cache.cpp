@@ -0,0 +1,195 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "tile_cache.hpp"
+#include "test/common.hpp"
+#include <stdexcept>
+#include <iostream>
+#include <string>
+
+using rendermq::tile_cache;
+using rendermq::tile_protocol;
+using std::runtime_error;
+using std::cout;
+using std::endl;
+using std::string;
+
+using rendermq::cmdDone;
+using rendermq::cmdIgnore;
+using rendermq::cmdNotDone;
+using rendermq::cmdRender;
+using rendermq::fmtPNG;
+using rendermq::fmtJPEG;
+
+namespace {
+
+tile_protocol result(rendermq::protoCmd status, int x, int y, int z,
+                     const string &data, rendermq::protoFmt fmt = fmtPNG) {
+  tile_protocol tile(status, x, y, z, 0, "osm", fmt, 1234);
+  tile.set_data(data);
+  return tile;
+}
+
+tile_protocol request(int x, int y, int z, rendermq::protoFmt fmt = fmtPNG) {
+  return tile_protocol(cmdRender, x, y, z, 0, "osm", fmt);
+}
+
+}
+
+/* test that a stored tile comes back with the same data, timestamp
+ * and status, and that other tiles don't.
+ */
+void test_hit_and_miss() {
+  tile_cache cache(1024 * 1024, 4, 60, 60);
+
+  cache.insert(result(cmdDone, 1, 2, 5, "fresh"));
+  cache.insert(result(cmdIgnore, 2, 2, 5, "stale"));
+
+  tile_protocol t = request(1, 2, 5);
+  if (!cache.lookup(t)) { throw runtime_error("Expected fresh tile to be a hit."); }
+  if (t.status != cmdDone) { throw runtime_error("Fresh tile should have status cmdDone."); }
+  if (t.data() != "fresh") { throw runtime_error("Fresh tile has wrong data."); }
+  if (t.last_modified != 1234) { throw runtime_error("Fresh tile has wrong last modified time."); }
+
+  t = request(2, 2, 5);
+  if (!cache.lookup(t)) { throw runtime_error("Expected stale tile to be a hit."); }
+  if (t.status != cmdIgnore) { throw runtime_error("Stale tile should have status cmdIgnore."); }
+
+  t = request(1, 2, 5, fmtJPEG);
+  if (cache.lookup(t)) { throw runtime_error("Different format should be a miss."); }
+
+  t = request(3, 2, 5);
+  if (cache.lookup(t)) { throw runtime_error("Different tile should be a miss."); }
+
+  if (cache.hits() != 2 || cache.misses() != 2) {
+    throw runtime_error("Hit and miss counts are wrong.");
+  }
+}
+
+/* test that negative entries are returned as not done, and that they
+ * go away once their TTL runs out.
+ */
+void test_negative_entries() {
+  tile_cache cache(1024 * 1024, 4, 60, -1);
+
+  cache.insert(result(cmdNotDone, 1, 2, 5, ""));
+
+  // with a negative TTL the entry is already out of date.
+  tile_protocol t = request(1, 2, 5);
+  if (cache.lookup(t)) { throw runtime_error("Negative entry should have timed out."); }
+
+  tile_cache cache2(1024 * 1024, 4, 60, 60);
+  cache2.insert(result(cmdNotDone, 1, 2, 5, ""));
+
+  t = request(1, 2, 5);
+  if (!cache2.lookup(t)) { throw runtime_error("Expected negative entry to be a hit."); }
+  if (t.status != cmdNotDone) { throw runtime_error("Negative entry should have status cmdNotDone."); }
+  if (!t.data().empty()) { throw runtime_error("Negative entry should have no data."); }
+}
+
+/* test that invalidating a tile removes every tile and format in the
+ * same metatile, but leaves other metatiles alone.
+ */
+void test_invalidate_metatile() {
+  tile_cache cache(1024 * 1024, 4, 60, 60);
+
+  cache.insert(result(cmdDone, 0, 0, 5, "a"));
+  cache.insert(result(cmdDone, 7, 7, 5, "b", fmtJPEG));
+  cache.insert(result(cmdNotDone, 3, 4, 5, ""));
+  cache.insert(result(cmdDone, 8, 0, 5, "c"));
+
+  cache.invalidate(request(2, 2, 5));
+
+  tile_protocol t = request(0, 0, 5);
+  if (cache.lookup(t)) { throw runtime_error("Tile (0,0) should have been invalidated."); }
+  t = request(7, 7, 5, fmtJPEG);
+  if (cache.lookup(t)) { throw runtime_error("Tile (7,7) should have been invalidated."); }
+  t = request(3, 4, 5);
+  if (cache.lookup(t)) { throw runtime_error("Negative tile (3,4) should have been invalidated."); }
+  t = request(8, 0, 5);
+  if (!cache.lookup(t)) { throw runtime_error("Tile (8,0) is in another metatile and should remain."); }
+}
+
+/* test that the cache stays within its byte budget by evicting the
+ * least recently used tiles.
+ */
+void test_byte_bound() {
+  // single shard, so the eviction order is predictable.
+  tile_cache cache(3000, 1, 60, 60);
+  const string data(800, 'x');
+
+  cache.insert(result(cmdDone, 0, 0, 5, data));
+  cache.insert(result(cmdDone, 8, 0, 5, data));
+
+  // touch the first tile, so that the second is least recently used.
+  tile_protocol t = request(0, 0, 5);
+  if (!cache.lookup(t)) { throw runtime_error("Expected first tile to be a hit."); }
+
+  cache.insert(result(cmdDone, 16, 0, 5, data));
+  cache.insert(result(cmdDone, 24, 0, 5, data));
+
+  if (cache.size_bytes() > 3000) {
+    throw runtime_error("Cache has grown beyond its byte budget.");
+  }
+
+  t = request(8, 0, 5);
+  if (cache.lookup(t)) { throw runtime_error("Least recently used tile should have been evicted."); }
+  t = request(24, 0, 5);
+  if (!cache.lookup(t)) { throw runtime_error("Most recently inserted tile should be present."); }
+
+  // too big to ever fit, so shouldn't be cached or evict anything.
+  cache.insert(result(cmdDone, 32, 0, 5, string(4000, 'x')));
+  t = request(32, 0, 5);
+  if (cache.lookup(t)) { throw runtime_error("Oversized tile should not have been cached."); }
+  t = request(24, 0, 5);
+  if (!cache.lookup(t)) { throw runtime_error("Oversized tile should not have evicted anything."); }
+}
+
+/* test that a zero-sized cache doesn't store anything.
+ */
+void test_disabled() {
+  tile_cache cache(0, 4, 60, 60);
+
+  cache.insert(result(cmdDone, 0, 0, 5, "a"));
+  tile_protocol t = request(0, 0, 5);
+  if (cache.lookup(t)) { throw runtime_error("Disabled cache should never hit."); }
+  if (cache.enabled()) { throw runtime_error("Zero-sized cache should be disabled."); }
+}
+
+int main() {
+  int tests_failed = 0;
+
+  cout << "== Testing Tile Cache ==" << endl << endl;
+
+  tests_failed += test::run("test_hit_and_miss", &test_hit_and_miss);
+  tests_failed += test::run("test_negative_entries", &test_negative_entries);
+  tests_failed += test::run("test_invalidate_metatile", &test_invalidate_metatile);
+  tests_failed += test::run("test_byte_bound", &test_byte_bound);
+  tests_failed += test::run("test_disabled", &test_disabled);
+
+  cout << " >> Tests failed: " << tests_failed << endl << endl;
+
+  return 0;
+}
@@ -31,12 +31,18 @@
 #include <iostream>
 #include <boost/noncopyable.hpp>
 #include <boost/function.hpp>
+#include <boost/bind.hpp>
 #include <boost/format.hpp>
 #include <boost/foreach.hpp>
 #include <boost/random/mersenne_twister.hpp>
 #include <boost/random/uniform_int.hpp>
 #include <boost/random/variate_generator.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <limits>
+#include <map>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <string.h>
 
 using boost::function;
 using boost::shared_ptr;
@@ -410,8 +416,264 @@ private:
    list<tile_protocol> tiles;
 };
 
+/* storage which answers asynchronously after a delay, to look like
+ * storage on the other end of a network. its tiles are the ones which
+ * the predicate says exist.
+ */
+class delayed_storage
+   : public tile_storage
+{
+public:
+   delayed_storage(long delay, boost::function<bool (const tile_protocol &)> pred)
+      : m_delay(delay), m_pred(pred), m_timer_fd(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK))
+   {
+   }
+
+   ~delayed_storage()
+   {
+      close(m_timer_fd);
+   }
+
+   shared_ptr<tile_storage::handle> get(const tile_protocol &tile) const
+   {
+      throw runtime_error("Blocking get shouldn't be used.");
+   }
+
+   bool get_meta(const tile_protocol &tile, string &str) const
+   {
+      throw runtime_error("Blocking get_meta shouldn't be used.");
+   }
+
+   bool put_meta(const tile_protocol &tile, const string &str) const
+   {
+      throw runtime_error("Blocking put_meta shouldn't be used.");
+   }
+
+   bool expire(const tile_protocol &tile) const
+   {
+      throw runtime_error("Blocking expire shouldn't be used.");
+   }
+
+   void get_async(const tile_protocol &tile, const get_callback &callback) const
+   {
+      shared_ptr<tile_storage::handle> handle;
+      if (m_pred(tile))
+      {
+         handle.reset(new exists_handle());
+      }
+      else
+      {
+         handle.reset(new null_handle());
+      }
+      later(boost::bind(callback, handle));
+   }
+
+   void put_meta_async(const tile_protocol &tile, const string &buf, const put_meta_callback &callback) const
+   {
+      later(boost::bind(callback, true));
+   }
+
+   void expire_async(const tile_protocol &tile, const expire_callback &callback) const
+   {
+      later(boost::bind(callback, true));
+   }
+
+   void async_fds(std::vector<int> &fds) const
+   {
+      fds.push_back(m_timer_fd);
+   }
+
+   void async_perform() const
+   {
+      uint64_t expirations;
+      if (read(m_timer_fd, &expirations, sizeof(expirations)) < 0) {}
+
+      const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+      while (!m_pending.empty() && m_pending.begin()->first <= now)
+      {
+         boost::function<void ()> callback = m_pending.begin()->second;
+         m_pending.erase(m_pending.begin());
+         callback();
+      }
+      arm();
+   }
+
+private:
+   void later(const boost::function<void ()> &callback) const
+   {
+      m_pending.insert(std::make_pair(boost::posix_time::microsec_clock::universal_time() + 
+                                      boost::posix_time::milliseconds(m_delay), callback));
+      arm();
+   }
+
+   void arm() const
+   {
+      struct itimerspec its;
+      memset(&its, 0, sizeof(its));
+      if (!m_pending.empty())
+      {
+         long ms = (m_pending.begin()->first - boost::posix_time::microsec_clock::universal_time()).total_milliseconds();
+         ms = std::max(ms, 1L);
+         its.it_value.tv_sec = ms / 1000;
+         its.it_value.tv_nsec = (ms % 1000) * 1000000;
+      }
+      timerfd_settime(m_timer_fd, 0, &its, NULL);
+   }
+
+   const long m_delay;
+   boost::function<bool (const tile_protocol &)> m_pred;
+   int m_timer_fd;
+   mutable std::multimap<boost::posix_time::ptime, boost::function<void ()> > m_pending;
+};
+
+bool all_tiles(const tile_protocol &) 
+{
+   return true;
+}
+
+bool no_tiles(const tile_protocol &) 
+{
+   return false;
+}
+
+// milliseconds taken by a function.
+long time_taken(boost::function<void ()> func)
+{
+   boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+   func();
+   return (boost::posix_time::microsec_clock::universal_time() - start).total_milliseconds();
+}
+
+void get_existing(const tile_storage &storage, const tile_protocol &tile)
+{
+   assert_exists_tile(tile, storage);
+}
+
+void get_missing(const tile_storage &storage, const tile_protocol &tile)
+{
+   assert_no_tile(tile, storage);
+}
+
+void put_ok(const tile_storage &storage, const tile_protocol &tile)
+{
+   if (!storage.put_meta(tile, ""))
+   {
+      throw runtime_error("Put to all the storages should have worked.");
+   }
+}
+
 } // anonymous namespace
 
+/* test that the storages are all asked at once, so a slow storage
+ * doesn't hold up the others.
+ */
+void test_fan_out_concurrent()
+{
+   const tile_protocol tile(rendermq::cmdRender, 0, 0, 10, 0, "style", rendermq::fmtPNG, 0, 0);
+
+   // the tile is only in the last storage, so all have to answer.
+   union_storage::list_of_storage_t storages;
+   storages.push_back(shared_ptr<tile_storage>(new delayed_storage(200, &no_tiles)));
+   storages.push_back(shared_ptr<tile_storage>(new delayed_storage(200, &no_tiles)));
+   storages.push_back(shared_ptr<tile_storage>(new delayed_storage(200, &all_tiles)));
+   union_storage storage(storages);
+
+   long taken = time_taken(boost::bind(&get_existing, boost::cref(storage), tile));
+   if (taken >= 400)
+   {
+      throw runtime_error((boost::format("Get took %1%ms, the storages should have been asked at once.") % taken).str());
+   }
+   taken = time_taken(boost::bind(&put_ok, boost::cref(storage), tile));
+   if (taken >= 400)
+   {
+      throw runtime_error((boost::format("Put took %1%ms, the storages should have been written at once.") % taken).str());
+   }
+
+   // the first to have the tile wins, without waiting for the rest.
+   union_storage::list_of_storage_t racing;
+   racing.push_back(shared_ptr<tile_storage>(new delayed_storage(1000, &all_tiles)));
+   racing.push_back(shared_ptr<tile_storage>(new delayed_storage(50, &all_tiles)));
+   union_storage race(racing);
+   taken = time_taken(boost::bind(&get_existing, boost::cref(race), tile));
+   if (taken >= 500)
+   {
+      throw runtime_error((boost::format("Get took %1%ms, the quickest storage should have won.") % taken).str());
+   }
+}
+
+/* test that storage which doesn't answer in time is treated as not
+ * having the tile.
+ */
+void test_fan_out_timeout()
+{
+   const tile_protocol tile(rendermq::cmdRender, 0, 0, 10, 0, "style", rendermq::fmtPNG, 0, 0);
+
+   union_storage::list_of_storage_t storages;
+   storages.push_back(shared_ptr<tile_storage>(new delayed_storage(2000, &all_tiles)));
+   storages.push_back(shared_ptr<tile_storage>(new delayed_storage(20, &no_tiles)));
+   std::vector<long> timeouts;
+   timeouts.push_back(100);
+   union_storage storage(storages, timeouts);
+
+   long taken = time_taken(boost::bind(&get_missing, boost::cref(storage), tile));
+   if (taken >= 1000)
+   {
+      throw runtime_error((boost::format("Get took %1%ms, the slow storage should have timed out.") % taken).str());
+   }
+   if (storage.put_meta(tile, ""))
+   {
+      throw runtime_error("Put to a storage which timed out shouldn't have worked.");
+   }
+}
+
+/* test that a batch only passes on the tiles which haven't been
+ * found yet to the storages further down the list.
+ */
+void test_get_multi_pass_thru()
+{
+   recording_storage *record = new recording_storage();
+   union_storage::list_of_storage_t storages;
+   storages.push_back(shared_ptr<tile_storage>(new predicate_tiles_exist(&is_even_tile)));
+   storages.push_back(shared_ptr<tile_storage>(record));
+   storages.push_back(shared_ptr<tile_storage>(new predicate_tiles_exist(&is_odd_tile)));
+   union_storage storage(storages);
+
+   std::vector<tile_protocol> tiles;
+   for (int x = 0; x < 16; ++x)
+   {
+      for (int y = 0; y < 16; ++y)
+      {
+         tiles.push_back(tile_protocol(rendermq::cmdRender, x, y, 10, 0, "style", rendermq::fmtPNG, 0, 0));
+      }
+   }
+
+   std::vector<shared_ptr<tile_storage::handle> > handles;
+   storage.get_multi(tiles, handles);
+   if (handles.size() != tiles.size())
+   {
+      throw runtime_error("Batch should give a handle for each tile.");
+   }
+   for (size_t i = 0; i < tiles.size(); ++i)
+   {
+      if (!handles[i]->exists())
+      {
+         throw runtime_error((boost::format("Storage should have tile %1%, but does not.") % tiles[i]).str());
+      }
+   }
+
+   if (record->gets.size() != tiles.size() / 2)
+   {
+      throw runtime_error("Only the odd tiles should have been passed on.");
+   }
+   BOOST_FOREACH(const tile_protocol &t, record->gets)
+   {
+      if (is_even_tile(t)) 
+      {
+         throw runtime_error((boost::format("Tile %1% is an even tile, and should not have been passed on.") % t).str());
+      }
+   }
+}
+
 int main() 
 {
    int tests_failed = 0;
@@ -442,6 +704,9 @@ int main()
       test_expire_expires_from_all test;
       tests_failed += test::run("test_expire_expires_from_all", boost::ref(test));
    }
+   tests_failed += test::run("test_get_multi_pass_thru", &test_get_multi_pass_thru);
+   tests_failed += test::run("test_fan_out_concurrent", &test_fan_out_concurrent);
+   tests_failed += test::run("test_fan_out_timeout", &test_fan_out_timeout);
    //tests_failed += test::run("test_", &test_);
    
    cout << " >> Tests failed: " << tests_failed << endl << endl;
@@ -33,6 +33,7 @@
 #include <stdexcept>
 #include <iostream>
 #include <boost/function.hpp>
+#include <boost/bind.hpp>
 #include <boost/foreach.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/array.hpp>
@@ -101,6 +102,10 @@ struct test_base {
 
   void setup_broker_configs(pt::ptree &config);
 
+  // override this to change the config before the brokers, handlers
+  // and workers are set up.
+  virtual void configure(pt::ptree &config) {}
+
   list<string> broker_names;
   unsigned int num_workers;
   unsigned int num_handlers;
@@ -165,6 +170,7 @@ test_base::operator()() {
   config.put("zmq.liveness_time", 3 * heartbeat_time);
   config.put("worker.poll_timeout", "1");
   setup_broker_configs(config);
+  configure(config);
 
   try {
     zmq::context_t ctx(1);
@@ -495,6 +501,132 @@ struct test_worker_failure
   }
 };
 
+/* checks that a worker which prefetches jobs holds several of them at
+ * once, and that if it never finishes them they're reclaimed and given
+ * to another worker.
+ */
+struct test_prefetch
+  : public test_base {
+  test_prefetch() {
+    broker_names.push_back("broker1");
+    num_workers = 2;
+    num_handlers = 1;
+  }
+  virtual ~test_prefetch() {}
+
+  void configure(pt::ptree &config) {
+    config.put("worker.prefetch", 4);
+  }
+
+  void do_test(list<shared_ptr<dqueue::zmq_backend_handler> > &handlers,
+               list<shared_ptr<dqueue::zmq_backend_worker> > &workers) {
+    dqueue::zmq_backend_worker &first_worker = **workers.begin();
+    dqueue::zmq_backend_worker &second_worker = **(++workers.begin());
+    dqueue::zmq_backend_handler &handler = **handlers.begin();
+
+    rendermq::tile_protocol jobs[4];
+    jobs[0] = rendermq::tile_protocol(cmdRender,      0,  0, 4, 101010, "foo", fmtPNG);
+    jobs[1] = rendermq::tile_protocol(cmdRender,      8,  8, 5, 101010, "foo", fmtPNG);
+    jobs[2] = rendermq::tile_protocol(cmdRenderPrio, 16, 16, 5, 202020, "bar", fmtPNG);
+    jobs[3] = rendermq::tile_protocol(cmdRender,      0,  0, 6, 101010, "foo", fmtPNG);
+    
+    // send several jobs
+    for (size_t i = 0; i < sizeof(jobs)/sizeof(rendermq::tile_protocol); ++i) {
+      handler.send(jobs[i]);
+    }
+    
+    // get a job at the first worker, which should then go on to lease
+    // all the others as well.
+    first_worker.get_job();
+
+    size_t num_prefetched = 0;
+    for (size_t i = 0; (i < 30) && (num_prefetched < 3); ++i) {
+      usleep(100000);
+      num_prefetched = first_worker.prefetched_jobs().size();
+    }
+    if (num_prefetched != 3) {
+      throw runtime_error((boost::format("expected first worker to have prefetched 3 jobs, "
+                                         "but it has %1%.") % num_prefetched).str());
+    }
+
+    // the first worker never finishes any of them, as if it had failed,
+    // so the second worker should get them all once they've been 
+    // reclaimed as zombies.
+    for (size_t i = 0; i < sizeof(jobs)/sizeof(rendermq::tile_protocol); ++i) {
+      rendermq::tile_protocol job_get = second_worker.get_job();
+    
+      job_get.status = cmdDone;
+      second_worker.notify(job_get);
+    }
+
+    // let worker events percolate a little
+    usleep(100000);
+
+    size_t count = 0;
+    for (size_t i = 0; i < 10; ++i) {
+      list<rendermq::tile_protocol> rv_job_list;
+      poll_handler(handler, rv_job_list);
+      count += rv_job_list.size();
+    }
+    if (count != 4) {
+      throw runtime_error("didn't get all tile responses from worker.");
+    }
+  }
+};
+
+/* checks that a worker which is already waiting when a job arrives gets
+ * it pushed straight to it.
+ */
+struct test_idle_push
+  : public test_base {
+  test_idle_push() {
+    broker_names.push_back("broker1");
+    broker_names.push_back("broker2");
+    num_workers = 1;
+    num_handlers = 1;
+  }
+  virtual ~test_idle_push() {}
+
+  static void get_job(dqueue::zmq_backend_worker &worker, rendermq::tile_protocol &job) {
+    job = worker.get_job();
+  }
+
+  void do_test(list<shared_ptr<dqueue::zmq_backend_handler> > &handlers,
+               list<shared_ptr<dqueue::zmq_backend_worker> > &workers) {
+    dqueue::zmq_backend_worker &worker = **workers.begin();
+    dqueue::zmq_backend_handler &handler = **handlers.begin();
+
+    // start waiting for a job before there are any, and give the worker
+    // time to hear from the brokers and tell them it's idle.
+    rendermq::tile_protocol job_get;
+    boost::thread waiting(boost::bind(&test_idle_push::get_job, boost::ref(worker), boost::ref(job_get)));
+    usleep(2500000);
+
+    rendermq::tile_protocol job_put(cmdRender, 8, 16, 5, 101010, "foo", fmtPNG);
+    handler.send(job_put);
+
+    if (!waiting.timed_join(boost::posix_time::seconds(5))) {
+      throw runtime_error("idle worker didn't get the job.");
+    }
+    if ((job_get.x != job_put.x) || (job_get.y != job_put.y) || (job_get.z != job_put.z)) {
+      throw runtime_error("idle worker got a different job from the one sent by the handler.");
+    }
+
+    job_get.status = cmdDone;
+    worker.notify(job_get);
+
+    size_t count = 0;
+    for (size_t i = 0; i < 10; ++i) {
+      list<rendermq::tile_protocol> rv_job_list;
+      poll_handler(handler, rv_job_list);
+      count += rv_job_list.size();
+    }
+    if (count != 1) {
+      throw runtime_error("didn't get the tile response from worker.");
+    }
+  }
+};
+
 /* checks that the number of jobs executed by the workers is correct - it
  * should be the number of distinct metatile requests issued by the handler,
  * which is less than or equal to the actual number of requests.
@@ -866,6 +998,8 @@ int main() {
   tests_failed += test::run("test_multi_handler", test_multi_handler());
   tests_failed += test::run("test_multi_handler_interleaved", test_multi_handler_interleaved());
   tests_failed += test::run("test_multi_handler_data", test_multi_handler_data());
+  tests_failed += test::run("test_prefetch", test_prefetch());
+  tests_failed += test::run("test_idle_push", test_idle_push());
   //tests_failed += test::run("test_", &test_);
 
   cout << " >> Tests failed: " << tests_failed << endl << endl;
@@ -24,6 +24,7 @@
  *-----------------------------------------------------------------------------*/
 
 #include "zstream.hpp"
+#include "zstream_pbuf.hpp"
 #include "test/common.hpp"
 
 #include <stdexcept>
@@ -93,6 +94,103 @@ struct test_uint32 : public test_base<uint32_t> {
 struct test_uint64 : public test_base<uint64_t> {
 };
 
+void
+test_tile_data_slice() {
+  rendermq::tile_data whole(string("0123456789"));
+  rendermq::tile_data part = whole.slice(3, 4);
+
+  if (part.str() != "3456") {
+    throw runtime_error("Slice of tile data has the wrong contents.");
+  }
+  if (part.owner() != whole.owner()) {
+    throw runtime_error("Slice of tile data should share its owner.");
+  }
+}
+
+void
+test_tile_round_trip() {
+  zmq::context_t context(1);
+  zstream::socket::pair socket_a(context), socket_b(context);
+  socket_a.bind("inproc://test_tile_round_trip");
+  socket_b.connect("inproc://test_tile_round_trip");
+
+  rendermq::tile_protocol x(rendermq::cmdRender, 1, 2, 3, 4, "osm", rendermq::fmtPNG), y;
+  x.set_data(string("some tile data\0with a nul in it", 31));
+  x.last_modified = 1234;
+  x.dirty = true;
+
+  socket_a << x;
+  socket_b >> y;
+
+  if (!(x == y)) {
+    throw runtime_error("Tile header changed when sent across pipe.");
+  }
+  if (y.data() != x.data()) {
+    throw runtime_error("Tile data changed when sent across pipe.");
+  }
+  if (y.last_modified != x.last_modified) {
+    throw runtime_error("Tile last modified time changed when sent across pipe.");
+  }
+  if (!y.dirty) {
+    throw runtime_error("Tile lost being dirty when sent across pipe.");
+  }
+
+  // tiles without data still go as two parts, so that a tile can be
+  // followed by other parts of the same message.
+  rendermq::tile_protocol empty(rendermq::cmdStatus, 0, 0, 0, 5, "osm", rendermq::fmtJPEG);
+  std::string trailer;
+  socket_a << zstream::manip::more << empty << string("trailer");
+  socket_b >> y >> trailer;
+
+  if (!(empty == y) || y.payload().size() != 0 || trailer != "trailer") {
+    throw runtime_error("Empty tile and trailer didn't survive the pipe.");
+  }
+}
+
+// the header as older versions sent it, with the data in it and
+// nothing following it.
+string
+old_format(const rendermq::tile_protocol &tile) {
+  rendermq::proto::tile t;
+  t.set_command(tile.status);
+  t.set_x(tile.x);
+  t.set_y(tile.y);
+  t.set_z(tile.z);
+  t.set_id(tile.id);
+  t.set_style(tile.style);
+  t.set_format(tile.format);
+  t.set_image(tile.data());
+  string buf;
+  t.SerializeToString(&buf);
+  return buf;
+}
+
+void
+test_tile_old_format() {
+  zmq::context_t context(1);
+  zstream::socket::pair socket_a(context), socket_b(context);
+  socket_a.bind("inproc://test_tile_old_format");
+  socket_b.connect("inproc://test_tile_old_format");
+
+  // several tiles in one message, as the broker sends jobs, with each
+  // one's data in its header rather than in a part of its own.
+  rendermq::tile_protocol x(rendermq::cmdDone, 0, 0, 3, 4, "osm", rendermq::fmtPNG);
+  rendermq::tile_protocol z(rendermq::cmdDone, 8, 0, 3, 5, "osm", rendermq::fmtPNG);
+  x.set_data(string("first"));
+  z.set_data(string("second"));
+  socket_a << zstream::manip::more << old_format(x) << old_format(z);
+
+  rendermq::tile_protocol y, w;
+  socket_b >> y;
+  if (!(x == y) || (y.data() != "first") || !socket_b.has_more()) {
+    throw runtime_error("First tile in the old format didn't survive the pipe.");
+  }
+  socket_b >> w;
+  if (!(z == w) || (w.data() != "second") || socket_b.has_more()) {
+    throw runtime_error("Second tile in the old format was taken for the first's data.");
+  }
+}
+
 } // anonymous namespace
 
 int main() {
@@ -108,6 +206,9 @@ int main() {
     test_uint64 test;
     tests_failed += test::run("test_uint64", boost::ref(test));
   }
+  tests_failed += test::run("test_tile_data_slice", &test_tile_data_slice);
+  tests_failed += test::run("test_tile_round_trip", &test_tile_round_trip);
+  tests_failed += test::run("test_tile_old_format", &test_tile_old_format);
   //tests_failed += test::run("test_", &test_);
 
   cout << " >> Tests failed: " << tests_failed << endl << endl;
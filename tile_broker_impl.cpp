@@ -42,6 +42,7 @@
 
 #include <map>
 #include <queue>
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include "storage/meta_tile.hpp"
@@ -61,6 +62,10 @@ namespace pt = boost::property_tree;
 // a different worker.
 #define DEFAULT_ZOMBIE_TIME (300)
 
+// the maximum number of jobs which will be leased to a worker in reply
+// to a single request, whatever the number of jobs it asks for.
+#define DEFAULT_MAX_PREFETCH (16)
+
 namespace {
 
 /* thread which runs to send messages to the main thread reminding it
@@ -130,15 +135,23 @@ void send_tile_to_listeners(rendermq::task_queue &queue,
                             const std::string &worker_address) {
   typedef rendermq::task::iterator task_iterator;
   typedef std::pair<task_iterator, task_iterator> task_range;
-  typedef std::pair<string::const_iterator, string::const_iterator> string_const_range;
 
   boost::optional<const rendermq::task &> t = queue.get(tile_from_worker);
 
   if (t) {
+    const std::time_t now = std::time(0);
+    // tell the handlers how busy this broker is with every tile, so
+    // they don't have to wait for the next heartbeat to find out.
+    const int64_t queue_length = queue.count_unprocessed();
     task_range range = (*t).subscribers();
     for (task_iterator itr = range.first; itr != range.second; ++itr) {
        LOG_FINER(boost::format("SUB %1% addr size: %2%") % itr->first % itr->second.size());
+       // the client has given up waiting, so don't bother the handler.
+       if (itr->first.expired(now)) {
+         continue;
+       }
        rendermq::tile_protocol tile_for_handler(itr->first);
+       tile_for_handler.queue_length = queue_length;
        LOG_FINER(boost::format("with tile = %1%") % tile_for_handler);
                 
       if ((tile_for_handler.status != rendermq::cmdDirty) &&
@@ -149,10 +162,13 @@ void send_tile_to_listeners(rendermq::task_queue &queue,
 
          if (tile_from_worker.status != rendermq::cmdNotDone) 
          {
-            rendermq::metatile_reader reader(tile_from_worker.data(), itr->first.format);
-            string_const_range range = reader.get(tile_for_handler.x, tile_for_handler.y);
+            // the tile for the handler is just a view onto the part of the
+            // metatile it's in, so nothing is copied.
+            const rendermq::tile_data &meta = tile_from_worker.payload();
+            rendermq::metatile_reader reader(meta.data(), meta.size(), itr->first.format);
+            std::pair<size_t, size_t> range = reader.get_range(tile_for_handler.x, tile_for_handler.y);
             // TODO: add error handling when range is zero?
-            tile_for_handler.set_data(string(range.first,range.second));
+            tile_for_handler.set_payload(meta.slice(range.first, range.second));
          }
          frontend_rep.to(itr->second) << tile_for_handler;
       }
@@ -177,11 +193,111 @@ struct broker_impl::pimpl {
       heartbeat_interval(config.get<unsigned int>("zmq.heartbeat_time")),
       resubmit_interval(config.get<unsigned int>("zmq.resubmit_interval", heartbeat_interval)),
       zombie_time(config.get<unsigned int>("zmq.zombie_time", DEFAULT_ZOMBIE_TIME)),
+      max_prefetch(config.get<unsigned int>("zmq.max_prefetch", DEFAULT_MAX_PREFETCH)),
+      demote_expired(config.get<bool>("zmq.demote_expired", false)),
       shutdown_requested(false),
       broker_name(name) {
   }
 
-  void publish_availability() {
+  /* takes up to the given number of the highest priority unprocessed
+   * jobs from the queue, marking each as processed so that it's 
+   * reclaimed as a zombie if the worker it's given to never returns it.
+   *
+   * jobs whose subscribers have all given up waiting are dropped or 
+   * demoted to bulk on the way, rather than rendered for no-one.
+   */
+  list<tile_protocol> lease_jobs(uint32_t credits) {
+    list<tile_protocol> jobs;
+    const std::time_t now = std::time(0);
+    for (boost::optional<const task &> t = queue.front(); 
+         t && (jobs.size() < credits); t = queue.front()) {
+      tile_protocol proto = static_cast<tile_protocol>(*t);
+
+      if (queue.prune_expired(proto, now)) {
+        if (demote_expired) {
+          LOG_FINER(boost::format("Demoting abandoned task: %1%") % proto);
+          queue.demote(proto);
+        } else {
+          LOG_FINER(boost::format("Dropping abandoned task: %1%") % proto);
+          queue.erase(proto);
+        }
+        continue;
+      }
+
+      jobs.push_back(proto);
+      queue.set_processed(proto);
+    }
+    return jobs;
+  }
+
+  // send leased jobs to a worker, all in one message.
+  void send_jobs(const list<string> &worker_addresses, const string &command,
+                 const list<tile_protocol> &jobs) {
+    zstream::socket::osocket &out = backend_rep.to(worker_addresses);
+    out << manip::more << command;
+    for (list<tile_protocol>::const_iterator itr = jobs.begin(); itr != jobs.end(); ++itr) {
+      if (boost::next(itr) != jobs.end()) {
+        out << manip::more;
+      }
+      out << *itr;
+    }
+  }
+
+  /* workers which asked for jobs when there weren't any are remembered
+   * here, longest-waiting first, so that new jobs can be pushed to 
+   * exactly one of them rather than announced to all of them.
+   */
+  struct idle_worker {
+    list<string> addresses;
+    uint32_t credits;
+  };
+  typedef std::list<idle_worker> idle_workers_t;
+
+  void add_idle_worker(const list<string> &addresses, uint32_t credits) {
+    remove_idle_worker(addresses.front());
+    idle_worker w;
+    w.addresses = addresses;
+    w.credits = credits;
+    idle_index[addresses.front()] = idle_workers.insert(idle_workers.end(), w);
+  }
+
+  void remove_idle_worker(const string &worker_id) {
+    map<string, idle_workers_t::iterator>::iterator itr = idle_index.find(worker_id);
+    if (itr != idle_index.end()) {
+      idle_workers.erase(itr->second);
+      idle_index.erase(itr);
+    }
+  }
+
+  /* push available jobs to idle workers until one or the other runs 
+   * out. a worker is forgotten once it's been sent jobs, as it'll ask
+   * again when it needs more.
+   */
+  void dispatch_to_idle_workers() {
+    while (!idle_workers.empty() && queue.front()) {
+      idle_worker w = idle_workers.front();
+      remove_idle_worker(w.addresses.front());
+
+      list<tile_protocol> jobs = lease_jobs(w.credits);
+      if (jobs.empty()) {
+        // everything left at the front had been abandoned, so the
+        // worker goes back to waiting where it was.
+        idle_index[w.addresses.front()] = idle_workers.insert(idle_workers.begin(), w);
+        break;
+      }
+      LOG_FINER(boost::format("Pushing %1% jobs to idle worker `%2%'.") 
+                % jobs.size() % w.addresses.front());
+      send_jobs(w.addresses, "PUSH", jobs);
+    }
+  }
+
+  /* publish the aggregate availability of jobs on this broker. this 
+   * lets workers with spare capacity choose which broker to ask next.
+   * when there aren't any jobs, this is only published if `always' is
+   * set, which lets workers find out which brokers there are so that
+   * they can tell them when they're idle.
+   */
+  void publish_availability(bool always = false) {
     boost::optional<const task &> t = queue.front();
 
     if (t) {
@@ -196,6 +312,12 @@ struct broker_impl::pimpl {
         << manip::more << backend_rep.identity() 
         << manip::more << "JOBS AVAILABLE"
         << manip::more << priority << unprocessed;
+
+    } else if (always) {
+      backend_pub 
+        << manip::more << backend_rep.identity() 
+        << manip::more << "NO JOBS AVAILABLE"
+        << manip::more << uint32_t(0) << uint64_t(0);
     }
   }
 
@@ -225,6 +347,13 @@ struct broker_impl::pimpl {
   // tasks assigned to it are considered zombies.
   unsigned int zombie_time;
 
+  // maximum number of jobs to send to a worker in one reply.
+  unsigned int max_prefetch;
+
+  // whether to demote tasks which nobody is waiting for any more to 
+  // bulk priority, rather than dropping them.
+  bool demote_expired;
+
   // flag to shut down the heartbeat thread cleanly.
   bool shutdown_requested;
 
@@ -233,6 +362,10 @@ struct broker_impl::pimpl {
 
   // name of the broker.
   string broker_name;
+
+  // workers waiting for jobs, and an index of them by worker ID.
+  idle_workers_t idle_workers;
+  map<string, idle_workers_t::iterator> idle_index;
 };
 
 broker_impl::broker_impl(const pt::ptree &config, 
@@ -312,16 +445,57 @@ broker_impl::operator()() {
         impl->backend_rep >> meta;
         send_tile_to_listeners(impl->queue, impl->frontend_rep, meta, worker_addresses.front());
       }
+
+      // jobs pushed to a worker which has since found enough work 
+      // elsewhere are handed back, and need to go to someone else.
+      if (command.compare("RETURN") == 0) {
+        while (impl->backend_rep.has_more()) {
+          tile_protocol job;
+          impl->backend_rep >> job;
+          impl->queue.set_unprocessed(job);
+        }
+        impl->dispatch_to_idle_workers();
+        impl->publish_availability();
+      }
       
+      // workers which are waiting for jobs, and have told all the 
+      // brokers, get the next jobs pushed to them.
+      if (command.compare("IDLE") == 0) {
+        uint32_t credits = 1;
+        if (impl->backend_rep.has_more()) {
+          impl->backend_rep >> credits;
+        }
+        credits = std::max(uint32_t(1), std::min(credits, uint32_t(impl->max_prefetch)));
+        impl->add_idle_worker(worker_addresses, credits);
+        impl->dispatch_to_idle_workers();
+      }
+
+      if (command.compare("BUSY") == 0) {
+        impl->remove_idle_worker(worker_addresses.front());
+      }
+
       if (command.compare("GET_JOB") == 0) {
-        boost::optional<const task &> t = impl->queue.front();
-        if (t) {
-          tile_protocol proto = static_cast<tile_protocol>(*t);
-          impl->backend_rep.to(worker_addresses) << manip::more << "JOB" << proto;
-          impl->queue.set_processed(proto);
-          
+        // workers which prefetch say how many jobs they have credit
+        // for, otherwise they want just the one.
+        uint32_t credits = 1;
+        if (impl->backend_rep.has_more()) {
+          impl->backend_rep >> credits;
+        }
+        credits = std::max(uint32_t(1), std::min(credits, uint32_t(impl->max_prefetch)));
+
+        // any earlier registration of this worker as idle is replaced
+        // by whatever happens with this request.
+        impl->remove_idle_worker(worker_addresses.front());
+
+        list<tile_protocol> jobs = impl->lease_jobs(credits);
+        if (!jobs.empty()) {
+          impl->send_jobs(worker_addresses, "JOB", jobs);
+
         } else {
+          // remember that this worker wants jobs, so that the next one
+          // to arrive can be pushed straight to it.
           impl->backend_rep.to(worker_addresses) << "NO JOBS";
+          impl->add_idle_worker(worker_addresses, credits);
         }
         // TODO: do we need the "optimisation" of sending back whether there are
         // any jobs when the worker gives us back a complete job?
@@ -347,10 +521,17 @@ broker_impl::operator()() {
       boost::optional<const task &> front_task = impl->queue.front();
       
       impl->queue.push(tile, client_addresses.front(), priority);
+      const bool priority_changed = (!front_task) || (front_task->priority() < priority);
+
+      // jobs go straight to workers which are waiting for them, if there 
+      // are any.
+      impl->dispatch_to_idle_workers();
       
-      // we send out a notification to all listening workers if the priority of the 
-      // highest priority item in the queue has changed.
-      if ((!front_task) || (front_task->priority() < priority)) {
+      // if that didn't use them all up, we send out a notification to all 
+      // listening workers if the priority of the highest priority item in 
+      // the queue has changed. this is only aggregate information, and lets
+      // busy workers and workers of other brokers choose where to go next.
+      if (priority_changed) {
         impl->publish_availability();
       }
     }
@@ -368,6 +549,12 @@ broker_impl::operator()() {
         impl->queue.resubmit_older_than(impl->zombie_time); // older then 30 sec
         impl->monitor << str;
 
+        // the reclaimed jobs go straight to any waiting workers, as new
+        // requests do, and everyone else hears about them now rather
+        // than at the next heartbeat.
+        impl->dispatch_to_idle_workers();
+        impl->publish_availability();
+
       } else if (str.compare("STATS") == 0) {
         size_t size = impl->queue.size();
         size_t unprocessed = impl->queue.count_unprocessed();
@@ -386,8 +573,9 @@ broker_impl::operator()() {
           << uint64_t(impl->queue.count_unprocessed());
 
         // publish availability information to the workers, so that they 
-        // can claim jobs if they want to.
-        impl->publish_availability();
+        // can claim jobs if they want to, and so that they know about 
+        // this broker even if it has none.
+        impl->publish_availability(true);
         impl->monitor << str;
         
       } else if (str.compare("SHUTDOWN") == 0) {
@@ -0,0 +1,307 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "tile_cache.hpp"
+#include "storage/meta_tile.hpp"
+
+#include <boost/foreach.hpp>
+
+#include <algorithm>
+
+using boost::shared_ptr;
+
+// rough estimate of the memory used by an entry on top of the
+// tile data itself; list and hash nodes, the key and so on.
+#define ENTRY_OVERHEAD (128)
+
+namespace rendermq {
+
+namespace {
+
+// all the single formats which a tile might be stored in, used
+// when invalidating every format of a metatile.
+const protoFmt all_formats[] = { fmtPNG, fmtJPEG, fmtJSON, fmtGIF };
+const size_t num_formats = sizeof(all_formats) / sizeof(protoFmt);
+
+} // anonymous namespace
+
+tile_cache::tile_cache(size_t max_bytes, size_t num_shards,
+                       std::time_t ttl, std::time_t negative_ttl)
+   : m_shard_max_bytes(max_bytes / (num_shards > 0 ? num_shards : 1)),
+     m_ttl(ttl),
+     m_negative_ttl(negative_ttl)
+{
+   if (num_shards == 0)
+   {
+      num_shards = 1;
+   }
+
+   m_shards.reserve(num_shards);
+   for (size_t i = 0; i < num_shards; ++i)
+   {
+      m_shards.push_back(shared_ptr<shard>(new shard()));
+   }
+}
+
+tile_cache::~tile_cache()
+{
+}
+
+bool
+tile_cache::lookup(tile_protocol &tile)
+{
+   if (!enabled())
+   {
+      return false;
+   }
+
+   shard &s = shard_for(tile);
+   const key k = key_for(tile, tile.x, tile.y, tile.format);
+   const std::time_t now = std::time(NULL);
+
+   boost::mutex::scoped_lock lock(s.mutex);
+
+   index_map::iterator itr = s.index.find(k);
+   if (itr == s.index.end())
+   {
+      ++s.misses;
+      return false;
+   }
+
+   const entry &e = *itr->second;
+   if (e.valid_until < now)
+   {
+      // entry has outlived its TTL, so it might not reflect what's
+      // in the storage any more.
+      erase(s, itr);
+      ++s.misses;
+      return false;
+   }
+
+   if (e.present)
+   {
+      tile.status = e.expired ? cmdIgnore : cmdDone;
+      tile.set_payload(e.data);
+      tile.last_modified = e.last_modified;
+   }
+   else
+   {
+      tile.status = cmdNotDone;
+      tile.set_payload(tile_data());
+      tile.last_modified = 0;
+   }
+
+   // move to the most recently used end of the list.
+   s.lru.splice(s.lru.begin(), s.lru, itr->second);
+   ++s.hits;
+
+   return true;
+}
+
+void
+tile_cache::insert(const tile_protocol &tile)
+{
+   if (!enabled())
+   {
+      return;
+   }
+
+   entry e;
+   e.k = key_for(tile, tile.x, tile.y, tile.format);
+   e.last_modified = tile.last_modified;
+
+   const std::time_t now = std::time(NULL);
+
+   if (((tile.status == cmdDone) || (tile.status == cmdIgnore)) &&
+       (tile.payload().size() > 0))
+   {
+      e.present = true;
+      e.expired = (tile.status == cmdIgnore);
+      e.valid_until = now + m_ttl;
+      e.data = tile.payload();
+   }
+   else if (tile.status == cmdNotDone)
+   {
+      e.present = false;
+      e.expired = false;
+      e.valid_until = now + m_negative_ttl;
+   }
+   else
+   {
+      return;
+   }
+
+   e.cost = e.data.size() + e.k.style.size() + ENTRY_OVERHEAD;
+   if (e.cost > m_shard_max_bytes)
+   {
+      // wouldn't fit, even in an empty shard.
+      return;
+   }
+
+   shard &s = shard_for(tile);
+   boost::mutex::scoped_lock lock(s.mutex);
+
+   index_map::iterator itr = s.index.find(e.k);
+   if (itr != s.index.end())
+   {
+      erase(s, itr);
+   }
+
+   // make room by evicting from the least recently used end.
+   while (!s.lru.empty() && (s.bytes + e.cost > m_shard_max_bytes))
+   {
+      erase(s, s.index.find(s.lru.back().k));
+   }
+
+   s.lru.push_front(entry());
+   s.lru.front().k = e.k;
+   s.lru.front().present = e.present;
+   s.lru.front().expired = e.expired;
+   s.lru.front().last_modified = e.last_modified;
+   s.lru.front().valid_until = e.valid_until;
+   s.lru.front().data = e.data;
+   s.lru.front().cost = e.cost;
+
+   s.index.insert(std::make_pair(e.k, s.lru.begin()));
+   s.bytes += e.cost;
+}
+
+void
+tile_cache::invalidate(const tile_protocol &tile)
+{
+   if (!enabled())
+   {
+      return;
+   }
+
+   const int mx = tile.x & ~(METATILE - 1);
+   const int my = tile.y & ~(METATILE - 1);
+   // metatiles at low zoom levels are smaller than METATILE.
+   const int size = std::min(METATILE, 1 << tile.z);
+
+   shard &s = shard_for(tile);
+   boost::mutex::scoped_lock lock(s.mutex);
+
+   if (s.index.empty())
+   {
+      return;
+   }
+
+   for (int dx = 0; dx < size; ++dx)
+   {
+      for (int dy = 0; dy < size; ++dy)
+      {
+         for (size_t f = 0; f < num_formats; ++f)
+         {
+            index_map::iterator itr = s.index.find(key_for(tile, mx + dx, my + dy, all_formats[f]));
+            if (itr != s.index.end())
+            {
+               erase(s, itr);
+            }
+         }
+      }
+   }
+}
+
+void
+tile_cache::clear()
+{
+   BOOST_FOREACH(shared_ptr<shard> s, m_shards)
+   {
+      boost::mutex::scoped_lock lock(s->mutex);
+      s->index.clear();
+      s->lru.clear();
+      s->bytes = 0;
+   }
+}
+
+bool
+tile_cache::enabled() const
+{
+   return m_shard_max_bytes > 0;
+}
+
+size_t
+tile_cache::size_bytes() const
+{
+   size_t total = 0;
+   BOOST_FOREACH(shared_ptr<shard> s, m_shards)
+   {
+      total += s->bytes;
+   }
+   return total;
+}
+
+size_t
+tile_cache::hits() const
+{
+   size_t total = 0;
+   BOOST_FOREACH(shared_ptr<shard> s, m_shards)
+   {
+      total += s->hits;
+   }
+   return total;
+}
+
+size_t
+tile_cache::misses() const
+{
+   size_t total = 0;
+   BOOST_FOREACH(shared_ptr<shard> s, m_shards)
+   {
+      total += s->misses;
+   }
+   return total;
+}
+
+tile_cache::shard &
+tile_cache::shard_for(const tile_protocol &tile)
+{
+   // hash_value for tiles uses only the style and metatile, so all
+   // the tiles in a metatile end up in the same shard.
+   return *m_shards[hash_value(tile) % m_shards.size()];
+}
+
+tile_cache::key
+tile_cache::key_for(const tile_protocol &tile, int x, int y, protoFmt fmt)
+{
+   key k;
+   k.style = tile.style;
+   k.z = tile.z;
+   k.x = x;
+   k.y = y;
+   k.format = fmt;
+   return k;
+}
+
+void
+tile_cache::erase(shard &s, index_map::iterator itr)
+{
+   s.bytes -= itr->second->cost;
+   s.lru.erase(itr->second);
+   s.index.erase(itr);
+}
+
+} // namespace rendermq
@@ -0,0 +1,172 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef TILE_CACHE_HPP
+#define TILE_CACHE_HPP
+
+#include "tile_protocol.hpp"
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
+
+#include <string>
+#include <vector>
+#include <list>
+#include <ctime>
+
+namespace rendermq {
+
+/* in-process cache of recently fetched tiles, sitting in front of the
+ * storage worker in the handler.
+ *
+ * most of the traffic the handler sees is for a relatively small set
+ * of popular, low-zoom tiles. sending each of these over inproc to
+ * the storage worker, serialising them and fetching them from disk or
+ * LTS again is wasteful, so the handler keeps the result of recent
+ * lookups here, keyed by (style, z, x, y, format).
+ *
+ * the cache is split into a number of shards, each with its own lock
+ * and LRU list, so that it can be shared between threads. tiles are
+ * assigned to shards by metatile, so that invalidating a whole
+ * metatile only touches one shard. each shard is bounded by its share
+ * of the total byte budget.
+ *
+ * positive entries remember the data, last modified time and expired
+ * flag of the tile. negative entries remember that the storage said
+ * the tile wasn't there (cmdNotDone), and have a much shorter time to
+ * live, as they'll be invalidated by the render result in most cases
+ * anyway.
+ */
+class tile_cache
+   : public boost::noncopyable
+{
+public:
+   /* construct a cache.
+    *
+    * @param max_bytes total size in bytes of the data that the cache
+    *          may hold, including an estimate of the overhead. zero
+    *          disables the cache.
+    * @param num_shards number of independently locked shards.
+    * @param ttl time, in seconds, that a positive entry is considered
+    *          valid for.
+    * @param negative_ttl time, in seconds, that a negative entry is
+    *          considered valid for.
+    */
+   tile_cache(size_t max_bytes, size_t num_shards,
+              std::time_t ttl, std::time_t negative_ttl);
+   ~tile_cache();
+
+   /* look up the tile in the cache. if there is a valid entry then
+    * the tile's status, data and last modified time are filled in as
+    * if the storage worker had responded and true is returned.
+    *
+    * the status will be cmdDone for fresh tiles, cmdIgnore for tiles
+    * which are marked as expired and cmdNotDone for negative entries.
+    */
+   bool lookup(tile_protocol &tile);
+
+   /* insert the result of a storage lookup into the cache. only
+    * results with a status of cmdDone, cmdIgnore or cmdNotDone are
+    * cached, anything else is ignored.
+    */
+   void insert(const tile_protocol &tile);
+
+   /* remove all entries, in all formats, for the metatile containing
+    * this tile in the given style.
+    */
+   void invalidate(const tile_protocol &tile);
+
+   // remove all entries from the cache.
+   void clear();
+
+   // whether the cache is enabled, i.e: has a non-zero size.
+   bool enabled() const;
+
+   // statistics, approximate as they're read without locking.
+   size_t size_bytes() const;
+   size_t hits() const;
+   size_t misses() const;
+
+private:
+   struct key
+   {
+      std::string style;
+      int z, x, y;
+      protoFmt format;
+   };
+
+   friend bool operator==(const key &a, const key &b)
+   {
+      return a.z == b.z && a.x == b.x && a.y == b.y &&
+         a.format == b.format && a.style == b.style;
+   }
+
+   friend size_t hash_value(const key &k)
+   {
+      size_t seed = 0;
+      boost::hash_combine(seed, k.style);
+      boost::hash_combine(seed, k.z);
+      boost::hash_combine(seed, k.x);
+      boost::hash_combine(seed, k.y);
+      boost::hash_combine(seed, int(k.format));
+      return seed;
+   }
+
+   struct entry
+   {
+      key k;
+      bool present, expired;
+      std::time_t last_modified, valid_until;
+      // shared with the tiles it was inserted from and looked up into.
+      tile_data data;
+      size_t cost;
+   };
+
+   typedef std::list<entry> lru_list;
+   typedef boost::unordered_map<key, lru_list::iterator> index_map;
+
+   struct shard
+   {
+      shard() : bytes(0), hits(0), misses(0) {}
+      boost::mutex mutex;
+      lru_list lru;
+      index_map index;
+      size_t bytes, hits, misses;
+   };
+
+   shard &shard_for(const tile_protocol &tile);
+   static key key_for(const tile_protocol &tile, int x, int y, protoFmt fmt);
+   static void erase(shard &s, index_map::iterator itr);
+
+   const size_t m_shard_max_bytes;
+   const std::time_t m_ttl, m_negative_ttl;
+   std::vector<boost::shared_ptr<shard> > m_shards;
+};
+
+} // namespace rendermq
+
+#endif /* TILE_CACHE_HPP */
@@ -65,6 +65,7 @@ using std::map;
 using std::vector;
 using std::list;
 using std::runtime_error;
+using boost::posix_time::microsec_clock;
 namespace pt = boost::property_tree;
 
 // unless otherwise specified, the maximum zoom for any tile
@@ -72,6 +73,18 @@ namespace pt = boost::property_tree;
 // config file.
 #define DEFAULT_MAX_ZOOM (18)
 
+// maximum number of rounds of messages handled from the ready sockets
+// before going back to wait in the poll.
+#define MAX_POLL_BATCH (64)
+
+// time, in seconds, after which a storage lookup which hasn't come back
+// is given up on, along with the requests waiting on it.
+#define LOOKUP_TIMEOUT (30)
+
+// time, in microseconds, to wait in the poll while there are lookups in
+// flight, so that ones which have timed out are noticed.
+#define LOOKUP_POLL_TIMEOUT (1000000)
+
 namespace {
 
 inline bool old_tile(rendermq::tile_protocol const& tile, std::time_t delta)
@@ -157,25 +170,28 @@ tile_handler::tile_handler(const string &handler_id,
                            const string &in_ep, 
                            const string &out_ep,
                            std::time_t max_age,
-                           size_t queue_threshold_stale,
-                           size_t queue_threshold_satisfy,
-                           size_t queue_threshold_max,
+                           std::time_t client_timeout,
+                           boost::shared_ptr<admission_control> admission,
                            bool stale_render_background,
                            size_t max_io_threads,
+                           bool async_io,
                            const string &dqueue_config,
                            const pt::ptree &storage_conf,
                            const style_rules &rules,
-                           const map<string, list<string> > &dirty_list)
+                           const map<string, list<string> > &dirty_list,
+                           shared_ptr<tile_cache> cache)
    : m_context(1), 
      m_socket_req(m_context, ZMQ_PULL), 
      m_socket_rep(m_context, ZMQ_PUB),
      m_str_handler_id(handler_id),
      m_max_age(max_age), 
-     m_queue_threshold_stale(queue_threshold_stale),
-     m_queue_threshold_satisfy(queue_threshold_satisfy),
-     m_queue_threshold_max(queue_threshold_max),
+     m_client_timeout(client_timeout),
+     m_admission(admission),
      m_stale_render_background(stale_render_background),
      m_style_rules(rules),
+     m_dirty_list(dirty_list),
+     m_cache(cache),
+     m_next_lookup_sweep(0),
      m_queue_runner(dqueue_config, m_context), 
      m_socket_storage_request(m_context),
      m_socket_storage_results(m_context)
@@ -191,7 +207,7 @@ tile_handler::tile_handler(const string &handler_id,
    // setup the queue runner
    m_queue_runner.default_handler(
       dqueue::runner::handler_function_t(
-         boost::bind(&tile_handler::reply_with_tile, this, _1)));
+         boost::bind(&tile_handler::handle_response_from_broker, this, _1)));
 
    // connect input socket to mongrel server
    m_socket_req.connect(in_ep.c_str());
@@ -201,8 +217,13 @@ tile_handler::tile_handler(const string &handler_id,
    m_socket_storage_results.bind("inproc://storage_results_" + m_str_handler_id);
    
    // start storage worker thread
-   m_ptr_storage_instance.reset(new storage_worker(m_context, storage_conf, m_str_handler_id, max_io_threads, dirty_list));
-   m_ptr_storage_thread.reset(new boost::thread(boost::ref(*m_ptr_storage_instance)));
+   if (async_io) {
+      m_ptr_async_storage_instance.reset(new async_storage_worker(m_context, storage_conf, m_str_handler_id, max_io_threads, dirty_list));
+      m_ptr_storage_thread.reset(new boost::thread(boost::ref(*m_ptr_async_storage_instance)));
+   } else {
+      m_ptr_storage_instance.reset(new storage_worker(m_context, storage_conf, m_str_handler_id, max_io_threads, dirty_list));
+      m_ptr_storage_thread.reset(new boost::thread(boost::ref(*m_ptr_storage_instance)));
+   }
 }
 
 void 
@@ -225,29 +246,44 @@ tile_handler::operator()() {
     
       // poll
       try {
-         zmq::poll(&items[0], 4, -1);
+         zmq::poll(&items[0], 4, m_lookups.empty() ? -1 : LOOKUP_POLL_TIMEOUT);
       } catch (const zmq::error_t &) {
          // ignore and loop...
          continue;
       }
-    
-      // handle request from mongrel
-      if (items[0].revents & ZMQ_POLLIN) {
-         // this will either send a request to the storage component, or 
-         // return an error to the user. either way, it shouldn't take long.
-         handle_request_from_mongrel();
-      }
+      expire_lookups(std::time(0));
+
+      // handle one message from each source which is ready in turn, so
+      // that a flood of requests from mongrel can't hold up the results
+      // coming back from storage and the broker. carry on like that,
+      // without blocking, until nothing is ready or the batch is done.
+      for (int round = 0; round < MAX_POLL_BATCH; ++round) {
+         // handle request from mongrel
+         if (items[0].revents & ZMQ_POLLIN) {
+            // this will either send a request to the storage component, or 
+            // return an error to the user. either way, it shouldn't take long.
+            handle_request_from_mongrel();
+         }
                 
-      // handle response from the storage component
-      else if (items[1].revents & ZMQ_POLLIN) {
-         // this either returns a response to the client, which might be an
-         // error, or forwards the request on to the broker.
-         handle_response_from_storage();
-      } 
+         // handle response from the storage component
+         if (items[1].revents & ZMQ_POLLIN) {
+            // this either returns a response to the client, which might be an
+            // error, or forwards the request on to the broker.
+            handle_response_from_storage();
+         } 
                 
-      // handle response from broker
-      else {
-         m_queue_runner.handle_pollitems(&items[2]);
+         // handle response from broker
+         if ((items[2].revents | items[3].revents) & ZMQ_POLLIN) {
+            m_queue_runner.handle_pollitems(&items[2]);
+         }
+
+         try {
+            if (zmq::poll(&items[0], 4, 0) == 0) {
+               break;
+            }
+         } catch (const zmq::error_t &) {
+            break;
+         }
       }
    }
 }
@@ -262,26 +298,30 @@ tile_handler::reply_with_tile(const tile_protocol &tile) {
       return;
    }
 
-   /* tile is done, has data & is OK */
+   /* tile is done and is OK. the storage worker doesn't fetch the
+      data for tiles which haven't been modified since the client's
+      copy, so it's only needed if the client's copy is out of date. */
+   const bool not_modified = (tile.request_last_modified != 0) && 
+      (tile.last_modified <= tile.request_last_modified);
+
    if ((tile.status == cmdDone || tile.status == cmdIgnore) &&
-       (tile.data().size() > 0)) {
+       (not_modified || (tile.payload().size() > 0))) {
       // always assume that the tile is good for another max_age seconds.
       std::time_t expire_time = current_time + m_max_age;
       // what's the expected mime type returned?
       const string &mime_type = mime_type_for(tile.format);
                 
-      /* tile modified data is younger than last modified header, 
-         or last modified header doesn't exist */
-      if ((tile.request_last_modified == 0) || 
-          (tile.last_modified < tile.request_last_modified)) {
-         send_tile(m_socket_rep, m_date_format, m_str_mongrel_id, send_id, 
-                   m_max_age, tile.last_modified, expire_time, tile.data(), 
-                   mime_type);
-                        
-      } else {
+      if (not_modified) {
          // not modified
          send_304(m_socket_rep, m_str_mongrel_id, send_id,
                   current_time, m_date_format, mime_type);
+                        
+      } else {
+         /* tile modified data is younger than last modified header, 
+            or last modified header doesn't exist */
+         send_tile(m_socket_rep, m_date_format, m_str_mongrel_id, send_id, 
+                   m_max_age, tile.last_modified, expire_time, 
+                   tile.payload().data(), tile.payload().size(), mime_type);
       }
    } else {
       // something bad happened, return a server error status
@@ -292,6 +332,15 @@ tile_handler::reply_with_tile(const tile_protocol &tile) {
    }
 }
 
+void
+tile_handler::handle_response_from_broker(const tile_protocol &tile) {
+   // a freshly rendered metatile has been written to storage, so
+   // anything cached for it (including negative entries) is stale.
+   invalidate_cache(tile);
+   m_admission->completed(tile, microsec_clock::universal_time());
+   reply_with_tile(tile);
+}
+
 void 
 tile_handler::handle_request_from_mongrel() {
    int64_t more;
@@ -319,6 +368,18 @@ tile_handler::handle_request_from_mongrel() {
          // to send it to.
          tile.id = boost::lexical_cast<int>(request.id());
 
+         // pass on the time of the client's copy, if it has one, so
+         // that the storage worker can avoid fetching the tile data
+         // when we'd only be sending a 304.
+         tile.request_last_modified = request.if_modified_since();
+
+         // the time after which mongrel or the client will have given up
+         // on this request, so it's pointless for the queue to render
+         // it on the client's behalf.
+         if (m_client_timeout > 0) {
+            tile.deadline = std::time(0) + m_client_timeout;
+         }
+
          // need to store the id of the mongrel server too? we really 
          // should, in case multiple mongrel servers are being used. but
          // for the moment, just assume it's true.
@@ -330,9 +391,21 @@ tile_handler::handle_request_from_mongrel() {
 #endif
          }
 
+         if (tile.status == cmdDirty) {
+            // the storage worker is about to expire the tile, so drop
+            // any copies we're holding on to.
+            invalidate_cache(tile);
+
+         } else if ((tile.status == cmdRender) && m_cache->lookup(tile)) {
+            // recently looked up, so there's no need to go to the
+            // storage worker for it.
+            handle_storage_result(tile);
+            return;
+         }
+
          // send request to storage, see if the tile has already been
          // cached.
-         m_socket_storage_request << tile;
+         lookup_in_storage(tile);
                         
       } else {
          send_404(m_socket_rep, request.uuid(), request.id());
@@ -344,7 +417,155 @@ void
 tile_handler::handle_response_from_storage() {
    tile_protocol tile;
    m_socket_storage_results >> tile;
-  
+
+   if (tile.status == cmdDirty) {
+      // invalidate again now the expiry has actually happened, in case
+      // a lookup filled the cache while it was in progress.
+      invalidate_cache(tile);
+   } else {
+      m_cache->insert(tile);
+   }
+
+   // the result is copied to the waiters before it gets changed by
+   // being handled.
+   release_waiters(tile);
+   handle_storage_result(tile);
+}
+
+tile_handler::lookup_key
+tile_handler::lookup_key_for(const tile_protocol &tile)
+{
+   lookup_key k;
+   k.style = tile.style;
+   k.z = tile.z;
+   k.x = tile.x;
+   k.y = tile.y;
+   k.format = tile.format;
+   return k;
+}
+
+void
+tile_handler::lookup_in_storage(const tile_protocol &tile)
+{
+   // only plain gets are shared. expiries have to happen, status
+   // queries don't carry the tile's data and conditional gets may not
+   // have fetched it, so none of them can answer other requests.
+   // conditional gets can still wait for a plain get, though.
+   if (tile.status != cmdRender)
+   {
+      m_socket_storage_request << tile;
+      return;
+   }
+
+   const lookup_key key = lookup_key_for(tile);
+   boost::unordered_map<lookup_key, lookup>::iterator itr = m_lookups.find(key);
+   if (itr != m_lookups.end())
+   {
+      LOG_FINER(boost::format("Waiting on storage lookup already in flight for %1%") % tile);
+      itr->second.waiters.push_back(tile);
+      return;
+   }
+
+   if (tile.request_last_modified == 0)
+   {
+      lookup &l = m_lookups[key];
+      l.id = tile.id;
+      l.deadline = std::time(0) + LOOKUP_TIMEOUT;
+   }
+   m_socket_storage_request << tile;
+}
+
+void
+tile_handler::release_waiters(const tile_protocol &result)
+{
+   boost::unordered_map<lookup_key, lookup>::iterator itr = m_lookups.find(lookup_key_for(result));
+   if ((itr == m_lookups.end()) || (itr->second.id != result.id))
+   {
+      // not the lookup that the others are waiting on.
+      return;
+   }
+
+   list<tile_protocol> waiters;
+   waiters.swap(itr->second.waiters);
+   m_lookups.erase(itr);
+
+   BOOST_FOREACH(tile_protocol &tile, waiters)
+   {
+      // the result is the answer. the rest of the request, e.g: the
+      // client ID, stays as it was.
+      tile.status = result.status;
+      tile.last_modified = result.last_modified;
+      tile.dirty = result.dirty;
+      tile.set_payload(result.payload());
+      handle_storage_result(tile);
+   }
+
+   if (result.status != cmdNotDone)
+   {
+      return;
+   }
+
+   // the metatile hasn't been rendered, so neither have the other tiles
+   // in it. the requests waiting on lookups of them go to the queue
+   // with this one, and the broker will collapse them into one render.
+   // the lookups themselves are still answered by the storage worker.
+   lookup_key key = lookup_key_for(result);
+   const int meta_x = result.x & ~(METATILE - 1), meta_y = result.y & ~(METATILE - 1);
+   for (key.x = meta_x; key.x < meta_x + METATILE; ++key.x)
+   {
+      for (key.y = meta_y; key.y < meta_y + METATILE; ++key.y)
+      {
+         itr = m_lookups.find(key);
+         if (itr == m_lookups.end())
+         {
+            continue;
+         }
+         waiters.clear();
+         waiters.swap(itr->second.waiters);
+         BOOST_FOREACH(tile_protocol &tile, waiters)
+         {
+            tile.status = cmdNotDone;
+            handle_storage_result(tile);
+         }
+      }
+   }
+}
+
+void
+tile_handler::expire_lookups(std::time_t now)
+{
+   if (m_lookups.empty() || (now < m_next_lookup_sweep))
+   {
+      return;
+   }
+   m_next_lookup_sweep = now + 1;
+
+   // the storage worker can drop a request without answering it, e.g:
+   // if it can't be read off the socket, and the requests waiting on it
+   // mustn't wait forever. a late answer is handled as if it had never
+   // been shared.
+   boost::unordered_map<lookup_key, lookup>::iterator itr = m_lookups.begin();
+   while (itr != m_lookups.end())
+   {
+      if (now < itr->second.deadline)
+      {
+         ++itr;
+         continue;
+      }
+
+      LOG_ERROR(boost::format("Storage lookup for %1%/%2%/%3%/%4% timed out, failing %5% waiting requests.")
+                % itr->first.style % itr->first.z % itr->first.x % itr->first.y
+                % itr->second.waiters.size());
+      BOOST_FOREACH(const tile_protocol &tile, itr->second.waiters)
+      {
+         send_500(m_socket_rep, m_str_mongrel_id, (boost::format("%d") % tile.id).str());
+      }
+      itr = m_lookups.erase(itr);
+   }
+}
+
+void 
+tile_handler::handle_storage_result(tile_protocol &tile) {
    if (tile.status == cmdStatus) {
       string send_id = (boost::format("%d") % tile.id).str(); 
       // request was for status, so the tile metadata will tell us what
@@ -357,7 +578,7 @@ tile_handler::handle_response_from_storage() {
          send_reply(m_socket_rep, m_str_mongrel_id, send_id, 200, txt.str());
          
       } 
-      else if (tile.data().size() > 0) 
+      else if (tile.dirty || (tile.payload().size() > 0))
       {
          // tile is present, but has been expired.
          send_reply(m_socket_rep, m_str_mongrel_id, send_id, 200, "Tile marked as dirty.");
@@ -372,7 +593,7 @@ tile_handler::handle_response_from_storage() {
    } else if (tile.status == cmdDirty) {
       string send_id = (boost::format("%d") % tile.id).str(); 
 
-      if (m_queue_runner.queue_length() >= m_queue_threshold_max)
+      if (load_level(tile) >= admission_control::load_shed)
       {
          // send a 503 - queue is too long to send anything to.
          send_503(m_socket_rep, m_str_mongrel_id, send_id);
@@ -390,14 +611,15 @@ tile_handler::handle_response_from_storage() {
    } else if (tile.status == cmdNotDone) {
       // tile isn't available - have to render it, if there are resources
       // available to do it.
-      if (m_queue_runner.queue_length() >= m_queue_threshold_max) 
+      const admission_control::load load = load_level(tile);
+      if (load >= admission_control::load_shed) 
       {
          // send 503 (service unavailable) to indicate overload.
          string send_id = (boost::format("%d") % tile.id).str(); 
          send_503(m_socket_rep, m_str_mongrel_id, send_id);
 
       } 
-      else if (m_queue_runner.queue_length() >= m_queue_threshold_satisfy)
+      else if (load >= admission_control::load_satisfy)
       {
          // render the tile in the background and tell the client that
          // it's not ready yet.
@@ -419,8 +641,10 @@ tile_handler::handle_response_from_storage() {
 
    } else {
       // check if tile is fresh
+      const admission_control::load load = 
+         (tile.status == cmdDone) ? admission_control::load_normal : load_level(tile);
       if ((tile.status == cmdDone) ||
-          (m_queue_runner.queue_length() >= m_queue_threshold_stale))
+          (load >= admission_control::load_stale))
       {
          reply_with_tile(tile);
       }
@@ -435,7 +659,7 @@ tile_handler::handle_response_from_storage() {
             // don't background render when the queue is very long. this
             // prevents queue overload when a very large area has been
             // expired.
-            if (m_queue_runner.queue_length() < m_queue_threshold_stale)
+            if (load < admission_control::load_stale)
             {
                tile.status = cmdRenderBulk;
                tile.set_data("");
@@ -564,6 +788,25 @@ style_rules::rewrite_and_check(tile_protocol &tile) const
    }
 }
 
+void
+tile_handler::invalidate_cache(const tile_protocol &tile)
+{
+   if (!m_cache->enabled()) {
+      return;
+   }
+
+   m_cache->invalidate(tile);
+
+   map<string, list<string> >::const_iterator itr = m_dirty_list.find(tile.style);
+   if (itr != m_dirty_list.end()) {
+      BOOST_FOREACH(const string &style, itr->second) {
+         tile_protocol dependent_tile(tile);
+         dependent_tile.style = style;
+         m_cache->invalidate(dependent_tile);
+      }
+   }
+}
+
 void
 tile_handler::send_to_queue(const rendermq::tile_protocol &tile)
 {
@@ -571,7 +814,20 @@ tile_handler::send_to_queue(const rendermq::tile_protocol &tile)
 
    try
    {
-      m_queue_runner.put_job(tile);
+      if (tile.status == cmdRenderBulk)
+      {
+         // background renders are still wanted once the client which
+         // triggered them has gone.
+         tile_protocol bulk(tile);
+         bulk.deadline = 0;
+         m_queue_runner.put_job(bulk);
+      }
+      else
+      {
+         m_queue_runner.put_job(tile);
+         m_admission->submitted(tile, m_queue_runner.queue_length(),
+                                microsec_clock::universal_time());
+      }
       error = false;
    }
    catch (const dqueue::broker_error &e)
@@ -596,6 +852,13 @@ tile_handler::send_to_queue(const rendermq::tile_protocol &tile)
    }
 }
 
+admission_control::load
+tile_handler::load_level(const tile_protocol &tile)
+{
+   return m_admission->level(tile, m_queue_runner.queue_length(),
+                             microsec_clock::universal_time());
+}
+
 } // namespace rendermq
 
 
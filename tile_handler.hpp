@@ -29,6 +29,8 @@
 #include "tile_protocol.hpp"
 #include "zstream.hpp"
 #include "storage_worker.hpp"
+#include "tile_cache.hpp"
+#include "admission_control.hpp"
 #include "dqueue/distributed_queue.hpp"
 #include "tile_path_parser.hpp"
 #include "mongrel_request_parser.hpp"
@@ -38,6 +40,7 @@
 #include <boost/thread/thread.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/property_tree/ptree.hpp>
+#include <boost/unordered_map.hpp>
 
 // stl
 #include <ctime>
@@ -113,15 +116,21 @@ public:
     * @param out_ep outgoing endpoing to mongrel2.
     * @param max_age age, in seconds, to put in the HTTP expiry
     *          headers.
-    * @param queue_threshold_stale queue length at which to return
-    *          stale tiles rather than render them. 
-    * @param queue_threshold_max queue length at which to return an
-    *          error rather than try to render tiles. 
+    * @param client_timeout time, in seconds, after which a client
+    *          waiting for a render is assumed to have given up, so
+    *          that the queue doesn't render it for no-one. zero
+    *          means clients are assumed to wait forever.
+    * @param admission decides, from the state of the queue, whether
+    *          to render tiles, return stale tiles or return errors
+    *          rather than try to render tiles.
     * @param stale_render_background if true, return stale tiles
     *          immediately, even if the queue length is low, and
     *          render the tile in the background.
     * @param max_io_threads maximum number of concurrent storage
     *          requests to run. others are queued.
+    * @param async_io if true, run all storage requests from a single
+    *          event-driven thread using the asynchronous storage
+    *          interface, rather than a thread per request.
     * @param dqueue_config file name of distributed queue config.
     * @param storage_conf storage configuration - already parsed as a
     *          property tree.
@@ -129,22 +138,30 @@ public:
     * @param dirty_list a map of styles into a list of dependent
     *          styles to expire in addition to any specified in a 
     *          dirty request.
+    * @param cache the in-process tile cache. this is thread-safe,
+    *          so may be shared between all the handlers in a process.
     */
    tile_handler(const std::string &handler_id, 
                 const std::string &in_ep, 
                 const std::string &out_ep,
                 std::time_t max_age,
-                size_t queue_threshold_stale, 
-                size_t queue_threshold_satisfy, 
-                size_t queue_threshold_max,
+                std::time_t client_timeout,
+                boost::shared_ptr<admission_control> admission,
                 bool stale_render_background,
                 size_t max_io_threads,
+                bool async_io,
                 const std::string &dqueue_config,
                 const boost::property_tree::ptree &storage_conf,
                 const style_rules &rules,
-                const std::map<std::string, std::list<std::string> > &dirty_list);
+                const std::map<std::string, std::list<std::string> > &dirty_list,
+                boost::shared_ptr<tile_cache> cache);
    
    /* run the event loop for the handler.
+    *
+    * each handler has its own 0MQ context, sockets, storage worker and
+    * queue runner, so several can be run in separate threads of the
+    * same process, each connected to the same mongrel2 endpoints. the
+    * mongrel2 requests are spread between them by 0MQ.
     */
    void operator()();
 
@@ -154,6 +171,12 @@ private:
     * rendering queue is detected.
     */
    void reply_with_tile(const rendermq::tile_protocol &tile);
+
+   /* called when a rendered tile comes back from the broker. any
+    * cached copy of the tile is now out of date, so it's dropped
+    * before replying.
+    */
+   void handle_response_from_broker(const rendermq::tile_protocol &tile);
    
    /* called when a message from mongrel is detected. reads and parses
     * the request message and routes it appropriately.
@@ -164,11 +187,42 @@ private:
     */
    void handle_response_from_storage();
 
+   /* decide what to do with the result of a storage lookup, whether
+    * it came from the storage worker or the tile cache.
+    */
+   void handle_storage_result(rendermq::tile_protocol &tile);
+
+   /* drop the metatile containing this tile from the tile cache, along
+    * with any styles which depend on it according to the dirty list.
+    */
+   void invalidate_cache(const rendermq::tile_protocol &tile);
+
    /* send a tile to the queue. if there's an error then print a 
     * message and, if there is a connection id associated with the
     * tile, send an error response back to the client.
     */
    void send_to_queue(const rendermq::tile_protocol &tile);
+
+   /* the admission control load level for a tile at the moment.
+    */
+   admission_control::load load_level(const rendermq::tile_protocol &tile);
+
+   /* send a lookup to the storage worker, unless there's already one
+    * in flight for the same tile and format, in which case the tile
+    * waits for that one to come back instead.
+    */
+   void lookup_in_storage(const rendermq::tile_protocol &tile);
+
+   /* answer the requests waiting on a storage lookup which has just
+    * come back. if the metatile isn't there then the requests waiting
+    * on lookups of other tiles in it are answered too.
+    */
+   void release_waiters(const rendermq::tile_protocol &result);
+
+   /* give up on storage lookups which haven't come back in time, and
+    * send errors to the requests waiting on them.
+    */
+   void expire_lookups(std::time_t now);
    
    // zeromq socket context used in the handler
    zmq::context_t m_context;
@@ -185,10 +239,11 @@ private:
    // the maximum age in seconds for the handler to send back in the
    // cache-related HTTP headers.
    std::time_t m_max_age;
+   std::time_t m_client_timeout;
 
-   // the queue length at which to return stale tiles and errors to the
-   // client, respectively.
-   size_t m_queue_threshold_stale, m_queue_threshold_satisfy, m_queue_threshold_max;
+   // decides when to return stale tiles and errors to the client
+   // rather than render them.
+   boost::shared_ptr<admission_control> m_admission;
 
    // if true, return tiles to the client even if they're stale (marked as
    // expired). this reduces the amount of time clients are waiting for
@@ -198,6 +253,58 @@ private:
    // the style re-write rules.
    const style_rules &m_style_rules;
 
+   // styles which are expired along with others, used to invalidate
+   // the tile cache in the same way as the storage.
+   const std::map<std::string, std::list<std::string> > m_dirty_list;
+
+   // recent results of storage lookups, to avoid going to the storage
+   // worker for popular tiles. shared with other handlers in the process.
+   boost::shared_ptr<tile_cache> m_cache;
+
+   // storage lookups in flight, keyed by tile and format, so that a
+   // burst of requests for the same tile only goes to the storage once.
+   // each lookup only fetches its own tile, so tiles in the same
+   // metatile only share a result when the metatile isn't there.
+   struct lookup_key
+   {
+      std::string style;
+      int z, x, y;
+      protoFmt format;
+   };
+
+   friend bool operator==(const lookup_key &a, const lookup_key &b)
+   {
+      return a.z == b.z && a.x == b.x && a.y == b.y &&
+         a.format == b.format && a.style == b.style;
+   }
+
+   friend size_t hash_value(const lookup_key &k)
+   {
+      size_t seed = 0;
+      boost::hash_combine(seed, k.style);
+      boost::hash_combine(seed, k.z);
+      boost::hash_combine(seed, k.x);
+      boost::hash_combine(seed, k.y);
+      boost::hash_combine(seed, int(k.format));
+      return seed;
+   }
+
+   static lookup_key lookup_key_for(const rendermq::tile_protocol &tile);
+
+   struct lookup
+   {
+      // the request which went to the storage worker.
+      int64_t id;
+      // time after which it's given up on.
+      std::time_t deadline;
+      // requests which arrived while it was in flight.
+      std::list<rendermq::tile_protocol> waiters;
+   };
+
+   boost::unordered_map<lookup_key, lookup> m_lookups;
+   // the earliest time at which to look for lookups which have timed out.
+   std::time_t m_next_lookup_sweep;
+
    // the queue of rendering jobs
    dqueue::runner m_queue_runner;
    
@@ -223,6 +330,7 @@ private:
    // handler so that it can run blocking file / HTTP operations without
    // affecting the main thread's ability to continue handling tiles.
    boost::shared_ptr<rendermq::storage_worker> m_ptr_storage_instance;
+   boost::shared_ptr<rendermq::async_storage_worker> m_ptr_async_storage_instance;
    boost::shared_ptr<boost::thread> m_ptr_storage_thread;
 };
 
@@ -32,6 +32,7 @@
 #include <stdexcept>
 #include <map>
 #include <list>
+#include <vector>
 
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/ini_parser.hpp>
@@ -39,14 +40,26 @@
 #include <boost/optional.hpp>
 #include <boost/foreach.hpp>
 #include <boost/algorithm/string.hpp>
+#include <boost/format.hpp>
+#include <boost/thread/thread.hpp>
 
 // for gethostname
 #include <unistd.h>
 
+#define DEFAULT_CLIENT_TIMEOUT (0)
 #define DEFAULT_QUEUE_THRESHOLD_STALE (100)
 #define DEFAULT_QUEUE_THRESHOLD_SATISFY (500)
 #define DEFAULT_QUEUE_THRESHOLD_MAX (1000)
+#define DEFAULT_LATENCY_TARGET (1000)
+#define DEFAULT_LATENCY_INTERVAL (10000)
+#define DEFAULT_LATENCY_SATISFY (10000)
+#define DEFAULT_LATENCY_MAX (30000)
 #define DEFAULT_IO_MAX_CONCURRENCY (64)
+#define DEFAULT_CACHE_SIZE (64 * 1024 * 1024)
+#define DEFAULT_CACHE_SHARDS (16)
+#define DEFAULT_CACHE_TTL (60)
+#define DEFAULT_CACHE_NEGATIVE_TTL (5)
+#define DEFAULT_REACTORS (1)
 
 namespace po = boost::program_options;
 namespace pt = boost::property_tree;
@@ -80,6 +93,34 @@ map<string, list<string> > dirty_list_from_conf(const pt::ptree &conf)
    return deps;
 }
 
+// create the admission control selected by the admission option, either
+// fixed queue length thresholds or measured render latency.
+boost::shared_ptr<rendermq::admission_control> admission_from_conf(const pt::ptree &conf)
+{
+   const string mode = conf.get<string>("mongrel2.admission", "queue");
+
+   if (mode == "queue")
+   {
+      return boost::shared_ptr<rendermq::admission_control>(
+         new rendermq::queue_length_admission(
+            conf.get<size_t>("mongrel2.queue_threshold_stale", DEFAULT_QUEUE_THRESHOLD_STALE),
+            conf.get<size_t>("mongrel2.queue_threshold_satisfy", DEFAULT_QUEUE_THRESHOLD_SATISFY),
+            conf.get<size_t>("mongrel2.queue_threshold_max", DEFAULT_QUEUE_THRESHOLD_MAX)));
+   }
+   else if (mode == "latency")
+   {
+      return boost::shared_ptr<rendermq::admission_control>(
+         new rendermq::latency_admission(
+            conf.get<long>("mongrel2.latency_target", DEFAULT_LATENCY_TARGET),
+            conf.get<long>("mongrel2.latency_interval", DEFAULT_LATENCY_INTERVAL),
+            conf.get<long>("mongrel2.latency_satisfy", DEFAULT_LATENCY_SATISFY),
+            conf.get<long>("mongrel2.latency_max", DEFAULT_LATENCY_MAX)));
+   }
+
+   std::cerr << "Unknown admission mode `" << mode << "', expected `queue' or `latency'.\n";
+   exit(EXIT_FAILURE);
+}
+
 // turn an instance command line option into a set of strings
 // to be tried as the section headers.
 list<string> host_sections(const string &instance)
@@ -264,19 +305,56 @@ int main( int argc, char** argv)
    // expiry-chaining.
    map<string, list<string> > dirty_deps = dirty_list_from_conf(conf);
 
-   rendermq::tile_handler handler(
-      uuid,
-      conf.get<string>("mongrel2.in_endpoint","ipc:///tmp/mongrel_send"),
-      conf.get<string>("mongrel2.out_endpoint","ipc:///tmp/mongrel_recv"),
-      conf.get<std::time_t>("mongrel2.max_age",60*60*24),
-      conf.get<size_t>("mongrel2.queue_threshold_stale", DEFAULT_QUEUE_THRESHOLD_STALE),
-      conf.get<size_t>("mongrel2.queue_threshold_satisfy", DEFAULT_QUEUE_THRESHOLD_SATISFY),
-      conf.get<size_t>("mongrel2.queue_threshold_max", DEFAULT_QUEUE_THRESHOLD_MAX),                    
-      conf.get<bool>("mongrel2.stale_render_background", false),
-      conf.get<size_t>("mongrel2.max_io_concurrency", DEFAULT_IO_MAX_CONCURRENCY),
-      dqueue_config, conf.get_child("tiles"), style_rules, dirty_deps);
-
-   handler();
+   // the cache is shared by all the handler threads.
+   boost::shared_ptr<rendermq::tile_cache> cache(
+      new rendermq::tile_cache(
+         conf.get<size_t>("mongrel2.cache_size", DEFAULT_CACHE_SIZE),
+         conf.get<size_t>("mongrel2.cache_shards", DEFAULT_CACHE_SHARDS),
+         conf.get<std::time_t>("mongrel2.cache_ttl", DEFAULT_CACHE_TTL),
+         conf.get<std::time_t>("mongrel2.cache_negative_ttl", DEFAULT_CACHE_NEGATIVE_TTL)));
+
+   // each handler thread has its own sockets, so needs its own identity
+   // when there's more than one of them.
+   const size_t num_reactors = conf.get<size_t>("mongrel2.reactors", DEFAULT_REACTORS);
+   if (num_reactors == 0)
+   {
+      std::cerr << "The number of reactors must be at least 1.\n";
+      return EXIT_FAILURE;
+   }
+
+   std::vector<boost::shared_ptr<rendermq::tile_handler> > handlers;
+   for (size_t i = 0; i < num_reactors; ++i)
+   {
+      const string handler_id = (num_reactors == 1) ? uuid : 
+         (boost::format("%1%_%2%") % uuid % i).str();
+
+      handlers.push_back(boost::shared_ptr<rendermq::tile_handler>(new rendermq::tile_handler(
+         handler_id,
+         conf.get<string>("mongrel2.in_endpoint","ipc:///tmp/mongrel_send"),
+         conf.get<string>("mongrel2.out_endpoint","ipc:///tmp/mongrel_recv"),
+         conf.get<std::time_t>("mongrel2.max_age",60*60*24),
+         conf.get<std::time_t>("mongrel2.client_timeout", DEFAULT_CLIENT_TIMEOUT),
+         admission_from_conf(conf),
+         conf.get<bool>("mongrel2.stale_render_background", false),
+         conf.get<size_t>("mongrel2.max_io_concurrency", DEFAULT_IO_MAX_CONCURRENCY),
+         conf.get<bool>("mongrel2.async_io", false),
+         dqueue_config, conf.get_child("tiles"), style_rules, dirty_deps,
+         cache)));
+   }
+
+   if (num_reactors == 1)
+   {
+      (*handlers.front())();
+   }
+   else
+   {
+      boost::thread_group threads;
+      BOOST_FOREACH(boost::shared_ptr<rendermq::tile_handler> handler, handlers)
+      {
+         threads.create_thread(boost::ref(*handler));
+      }
+      threads.join_all();
+   }
     
    return EXIT_SUCCESS;
 }
@@ -30,6 +30,7 @@
 #include <ostream>
 #include <zmq.hpp>
 #include <boost/unordered_map.hpp>
+#include <boost/shared_ptr.hpp>
 #include <cstring> // for memcpy
 #include <ctime> // for std::time_t
 #include "tile_utils.hpp"
@@ -53,14 +54,93 @@ enum protoCmd {
    cmdStatus      // request the status of a tile
 };
 
+/* read-only, reference counted view of a tile's data.
+ *
+ * tiles and metatiles are passed through several processes and
+ * threads, and copying the data at each step adds up. this holds a
+ * pointer into a buffer which is kept alive by the owner, so copies
+ * of it (and slices of it, e.g: a single tile within a metatile) can
+ * be shared between tiles and handed to 0MQ without copying the
+ * bytes. the owner can be anything - usually a string or a 0MQ
+ * message which the data was received in.
+ */
+class tile_data
+{
+public:
+   tile_data()
+      : m_string(NULL), m_ptr(NULL), m_size(0) {}
+
+   // copies the string into a new buffer.
+   explicit tile_data(const std::string &str)
+      : m_string(NULL), m_ptr(NULL), m_size(0)
+      {
+         if (!str.empty()) { set_string(boost::shared_ptr<const std::string>(new std::string(str))); }
+      }
+
+   // a view of size bytes at ptr, which must stay valid for as long
+   // as the owner is alive.
+   tile_data(boost::shared_ptr<const void> owner, const char *ptr, size_t size)
+      : m_owner(owner), m_string(NULL), m_ptr(ptr), m_size(size) {}
+
+   // takes the contents of the string without copying it, leaving
+   // the string empty.
+   static tile_data adopt(std::string &str)
+      {
+         tile_data d;
+         if (!str.empty()) 
+         {
+            boost::shared_ptr<std::string> s(new std::string());
+            s->swap(str);
+            d.set_string(s);
+         }
+         return d;
+      }
+
+   // a view of part of this data, sharing the same buffer. the
+   // range is clamped to the size of this view.
+   tile_data slice(size_t offset, size_t length) const
+      {
+         if (offset > m_size) { offset = m_size; }
+         if (length > m_size - offset) { length = m_size - offset; }
+         if (length == m_size) { return *this; }
+         return tile_data(m_owner, m_ptr + offset, length);
+      }
+
+   const char *data() const { return m_ptr; }
+   size_t size() const { return m_size; }
+   bool empty() const { return m_size == 0; }
+   const boost::shared_ptr<const void> &owner() const { return m_owner; }
+
+   // the buffer as a string, if this views the whole of a string,
+   // otherwise NULL.
+   const std::string *whole_string() const { return m_string; }
+
+   // copy of the data as a string.
+   std::string str() const { return std::string(m_ptr, m_size); }
+
+private:
+   void set_string(boost::shared_ptr<const std::string> s)
+      {
+         m_owner = s;
+         m_string = s.get();
+         m_ptr = s->data();
+         m_size = s->size();
+      }
+
+   boost::shared_ptr<const void> m_owner;
+   const std::string *m_string;
+   const char *m_ptr;
+   size_t m_size;
+};
+
 class tile_protocol
 {
 
 public:
    tile_protocol()
-      : status(cmdRenderPrio), x(0), y(0), z(0), id(0), style(""), format(fmtPNG), last_modified(0), request_last_modified(0) {}
+      : status(cmdRenderPrio), x(0), y(0), z(0), id(0), style(""), format(fmtPNG), last_modified(0), request_last_modified(0), deadline(0), queue_length(-1), dirty(false) {}
    tile_protocol(protoCmd status_,int x_,int y_, int z_, int64_t id_, const std::string & style_, protoFmt format_, std::time_t last_mod_=0, std::time_t req_last_mod_=0)
-      : status(status_), x(x_), y(y_), z(z_), id(id_), style(style_), format(format_), last_modified(last_mod_), request_last_modified(req_last_mod_) {}
+      : status(status_), x(x_), y(y_), z(z_), id(id_), style(style_), format(format_), last_modified(last_mod_), request_last_modified(req_last_mod_), deadline(0), queue_length(-1), dirty(false) {}
    tile_protocol(tile_protocol const& other)
       : status(other.status), 
         x(other.x), y(other.y), 
@@ -69,14 +149,40 @@ public:
         format(other.format),
         last_modified(other.last_modified),
         request_last_modified(other.request_last_modified),
+        deadline(other.deadline),
+        queue_length(other.queue_length),
+        dirty(other.dirty),
         data_(other.data_)
       {}
     
+   // the data as a string. if the data is a view onto some other
+   // buffer (e.g: a 0MQ message or part of a metatile) then it's
+   // copied into a string the first time this is called. use
+   // payload() to avoid the copy.
    std::string const& data() const
       {
-         return data_;
+         if (data_.whole_string() == NULL)
+         {
+            if (data_.empty()) 
+            {
+               static const std::string empty;
+               return empty;
+            }
+            data_ = tile_data(data_.str());
+         }
+         return *data_.whole_string();
       }
    void set_data(std::string const& data)
+      {
+         data_ = tile_data(data);
+      }
+
+   // the data, without copying it.
+   const tile_data &payload() const
+      {
+         return data_;
+      }
+   void set_payload(const tile_data &data)
       {
          data_ = data;
       }
@@ -90,9 +196,25 @@ public:
    protoFmt format;
    std::time_t last_modified;
    std::time_t request_last_modified;
+   // time after which nobody is waiting for this tile any more, or 
+   // zero if there's no limit.
+   std::time_t deadline;
+
+   // length of the sending broker's queue, or negative if not known.
+   int64_t queue_length;
+
+   // whether storage has the tile, but marked as dirty. only set on the
+   // results of storage lookups.
+   bool dirty;
+
+   // whether the deadline has passed.
+   bool expired(std::time_t now) const
+      {
+         return (deadline != 0) && (deadline < now);
+      }
 
 private:
-   std::string data_;
+   mutable tile_data data_;
 };
 
 inline std::ostream& operator<< (std::ostream& out, tile_protocol const& t)
@@ -124,7 +246,7 @@ inline std::ostream& operator<< (std::ostream& out, tile_protocol const& t)
    if (t.request_last_modified > 0) { out << " request_last_modified=" << t.request_last_modified; }
 
    out << " id=" << t.id << " style=" << t.style
-       << " data.size()=" << t.data().size() ;
+       << " data.size()=" << t.payload().size() ;
    return out;
 }
 
@@ -155,46 +277,96 @@ inline size_t hash_value(const tile_protocol &tp) {
    return seed;
 }
 
-inline bool serialise(const tile_protocol &tile, std::string &buf) {
+/* serialise the header fields of the tile, i.e: everything except the
+ * data. the data travels as a separate 0MQ frame after the header, so
+ * that it never needs to be copied into or out of the protocol buffer.
+ */
+inline bool serialise_header(const tile_protocol &tile, std::string &buf) {
    proto::tile t;
    t.set_command(tile.status);
    t.set_x(tile.x);
    t.set_y(tile.y);
    t.set_z(tile.z);
    t.set_id(tile.id);
-   t.set_image(tile.data());
    t.set_style(tile.style);
    t.set_format(tile.format);
    if (tile.last_modified != 0) { t.set_last_modified(tile.last_modified); }
    if (tile.request_last_modified != 0) { t.set_request_last_modified(tile.request_last_modified); }
+   if (tile.deadline != 0) { t.set_deadline(tile.deadline); }
+   if (tile.queue_length >= 0) { t.set_queue_length(tile.queue_length); }
+   if (tile.dirty) { t.set_dirty(true); }
+   t.set_payload_follows(true);
    return t.SerializeToString(&buf);
 }
 
-inline bool unserialise(const std::string &buf, tile_protocol &tile) {
+/* parse the header fields of the tile directly from a received buffer.
+ * the tile's data is cleared, unless the header has an image in it,
+ * which is the way older versions sent the data. payload_follows, if
+ * given, is set to whether the data is in the next frame, which older
+ * versions didn't send, so it mustn't be read unless it's set.
+ */
+inline bool unserialise_header(const void *buf, size_t size, tile_protocol &tile,
+                               bool *payload_follows = NULL) {
    proto::tile t;
-   bool result = t.ParseFromString(buf);
+   bool result = t.ParseFromArray(buf, int(size));
    if (result) {
       tile.status = static_cast<rendermq::protoCmd>(t.command());
       tile.x = t.x();
       tile.y = t.y();
       tile.z = t.z();
       tile.id = t.id();
-      tile.set_data(t.image());
+      tile.set_payload(t.has_image() ? tile_data(t.image()) : tile_data());
       tile.style = t.style();
       tile.format = static_cast<rendermq::protoFmt>(t.format());
       tile.last_modified = t.has_last_modified() ? t.last_modified() : 0;
       tile.request_last_modified = t.has_request_last_modified() ? t.request_last_modified() : 0;
+      tile.deadline = t.has_deadline() ? t.deadline() : 0;
+      tile.queue_length = t.has_queue_length() ? int64_t(t.queue_length()) : -1;
+      tile.dirty = t.dirty();
+      if (payload_follows != NULL) { *payload_follows = t.payload_follows(); }
    }
    return result;
 }
 
+namespace detail {
+// called by 0MQ when it's finished with a payload message, to drop
+// the reference to the buffer that the message was pointing at.
+inline void release_payload(void *, void *hint) {
+   delete static_cast<boost::shared_ptr<const void> *>(hint);
+}
+} // namespace detail
+
+/* make a 0MQ message which points at the tile data, rather than
+ * copying it. the buffer is kept alive until 0MQ has sent it.
+ */
+inline void payload_to_message(const tile_data &data, zmq::message_t &msg) {
+   if (data.empty()) {
+      msg.rebuild();
+   } else {
+      msg.rebuild(const_cast<char *>(data.data()), data.size(), 
+                  &detail::release_payload, 
+                  new boost::shared_ptr<const void>(data.owner()));
+   }
+}
+
+/* set the tile's data to point into a received 0MQ message, rather
+ * than copying it out.
+ */
+inline void payload_from_message(boost::shared_ptr<zmq::message_t> msg, tile_protocol &tile) {
+   tile.set_payload(tile_data(msg, static_cast<const char *>(msg->data()), msg->size()));
+}
+
 inline bool send(zmq::socket_t & socket, tile_protocol const& tile)
 {
    std::string buf;
-   if (serialise(tile, buf))
+   if (serialise_header(tile, buf))
    {
       zmq::message_t msg(buf.size()); 
       std::memcpy(msg.data(),buf.data(),buf.size());
+      if (!socket.send(msg, ZMQ_SNDMORE)) return false;
+
+      // then the data, as a separate frame
+      payload_to_message(tile.payload(), msg);
       return socket.send(msg);
    }
    return false;
@@ -202,7 +374,7 @@ inline bool send(zmq::socket_t & socket, tile_protocol const& tile)
 
 inline bool send_to(const std::string id, zmq::socket_t & socket, tile_protocol const& tile) {
    std::string buf;
-   if (serialise(tile, buf)) {
+   if (serialise_header(tile, buf)) {
       zmq::message_t msg(id.size()); 
       std::memcpy(msg.data(),id.data(),id.size());
 
@@ -214,8 +386,12 @@ inline bool send_to(const std::string id, zmq::socket_t & socket, tile_protocol
       if (!socket.send(msg, ZMQ_SNDMORE)) return false;
       msg.rebuild(buf.size());
     
-      // then send the message itself
+      // then send the header itself
       std::memcpy(msg.data(),buf.data(),buf.size());
+      if (!socket.send(msg, ZMQ_SNDMORE)) return false;
+
+      // and finally the data
+      payload_to_message(tile.payload(), msg);
       return socket.send(msg);
    }
    return false;  
@@ -225,8 +401,18 @@ inline bool recv (zmq::socket_t & socket, tile_protocol & tile)
 {
    zmq::message_t msg;
    socket.recv(&msg);
-   std::string buf(static_cast<char*>(msg.data()),msg.size());
-   return unserialise(buf, tile);
+   bool payload_follows = false;
+   if (!unserialise_header(msg.data(), msg.size(), tile, &payload_follows)) return false;
+
+   int64_t more = 0;
+   size_t more_size = sizeof (more);
+   socket.getsockopt(ZMQ_RCVMORE, &more, &more_size);
+   if (payload_follows && more) {
+      boost::shared_ptr<zmq::message_t> payload(new zmq::message_t());
+      socket.recv(payload.get());
+      payload_from_message(payload, tile);
+   }
+   return true;
 }
 
 }
@@ -213,6 +213,11 @@ osocket::operator<<(const manip::manip_more &) {
   return *this;
 }
 
+bool
+osocket::more_pending() const {
+  return more_;
+}
+
 isocket::isocket(zmq::context_t &ctx, int type) 
   : basic_socket(ctx, type), more_(false) {
 }
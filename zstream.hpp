@@ -126,6 +126,10 @@ public:
   // set a stream manipulation bit
   osocket &operator<<(const manip::manip_more &);
 
+  // true if the next message sent will be marked as having more
+  // parts to follow it.
+  bool more_pending() const;
+
 protected:
   osocket(zmq::context_t &, int);
 
@@ -30,27 +30,52 @@ using zstream::socket::osocket;
 using zstream::socket::isocket;
 using std::runtime_error;
 using std::string;
+using boost::shared_ptr;
+namespace manip = zstream::manip;
 
 namespace rendermq {
 
 osocket &
 operator<<(osocket &out, const tile_protocol &tile) {
   string buf;
-  if (serialise(tile, buf)) {
-    out << buf;
-  } else {
+  if (!serialise_header(tile, buf)) {
     throw runtime_error("Can't serialise tile to buffer!");
   }
+
+  // the tile goes as two parts, so remember whether the caller wanted
+  // more parts after it before sending the header.
+  const bool more = out.more_pending();
+  out << manip::more << buf;
+
+  zmq::message_t msg;
+  payload_to_message(tile.payload(), msg);
+  if (more) {
+    out << manip::more;
+  }
+  out << msg;
+
   return out;
 }
 
 isocket &
 operator>>(isocket &in, tile_protocol &tile) {
-  string buf;
-  in >> buf;
-  if (!unserialise(buf, tile)) {
+  // parse the header straight out of the message, without copying it
+  // into a string first.
+  zmq::message_t msg;
+  in >> msg;
+  bool payload_follows = false;
+  if (!unserialise_header(msg.data(), msg.size(), tile, &payload_follows)) {
     throw runtime_error("Can't deserialise tile from buffer!");
   }
+
+  // the data follows in its own part, which the tile keeps hold of
+  // rather than copying. older senders put it in the header instead,
+  // and whatever follows is something else, e.g: the next tile.
+  if (payload_follows && in.has_more()) {
+    shared_ptr<zmq::message_t> payload(new zmq::message_t());
+    in >> *payload;
+    payload_from_message(payload, tile);
+  }
   return in;
 }
 
@@ -32,12 +32,14 @@
 namespace rendermq {
 
 // output stream helper, knows how to serialise a tile_protocol using 
-// google protocol buffers.
+// google protocol buffers. the tile is sent as two parts; the header as
+// a protocol buffer and then the data, which isn't copied.
 zstream::socket::osocket &operator<<(zstream::socket::osocket &out,
                                      const tile_protocol &tile);
 
 // input stream helper, knows how to deserialise a tile_protocol using 
-// google protocol buffers.
+// google protocol buffers. the tile's data refers to the received
+// message, rather than being copied out of it.
 zstream::socket::isocket &operator>>(zstream::socket::isocket &in,
                                      tile_protocol &tile);
 